@@ -0,0 +1,442 @@
+// Offline symbolizer for the traces written by TraceWriter.
+//
+// Usage: symbolize <trace> <elf>...
+//
+// The ELF files are the unstripped binaries, e.g. obj/local/<abi>/*
+// left by ndk-build. Each one is mmap'ed, and a sorted index of its
+// .symtab (or .dynsym, if stripped) is built once. Modules of the trace
+// are matched by build id, or by file name if the module has none,
+// and every frame is resolved with a binary search.
+//
+// Unlike symbolization on the device, this finds static and hidden
+// functions too, so the app does not have to be linked with -rdynamic.
+//
+// Runs on a Linux host, for traces of any ABI.
+
+#include "demangle_cache.h"
+#include "trace_format.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+struct Symbol {
+    uint64_t    start;
+    uint64_t    end;
+    const char* name;
+};
+typedef struct Symbol Symbol;
+
+struct ElfFile {
+    const char*     path;
+    const char*     name;
+    const uint8_t*  data;
+    size_t          size;
+    bool            is_64;
+
+    uint8_t         build_id[32];
+    size_t          build_id_size;
+
+    // Relative address + bias = virtual address of the ELF file.
+    uint64_t        bias;
+
+    Symbol*         symbols;
+    size_t          symbol_count;
+};
+typedef struct ElfFile ElfFile;
+
+struct Symbolizer {
+    ElfFile*        files;
+    size_t          file_count;
+
+    // By trace module id.
+    const ElfFile*  module_files[trace_file_module_id_max];
+    char*           module_names[trace_file_module_id_max];
+
+    DemangleCache   demangle_cache;
+    uint64_t        frame_count;
+    uint64_t        resolved_frame_count;
+};
+typedef struct Symbolizer Symbolizer;
+
+
+// Same as BacktraceMethod_Name(), without linking backtrace.c.
+static const char* MethodName(uint32_t method) {
+    static const char* const names[] = {
+        "UNKNOWN_METHOD",
+        "LIBUNWIND_WITH_REGISTERS_METHOD",
+        "UNWIND_BACKTRACE_WITH_REGISTERS_METHOD",
+        "UNWIND_BACKTRACE_WITH_SKIPPING_METHOD",
+        "FRAME_POINTER_METHOD",
+    };
+    return method < sizeof(names) / sizeof(names[0]) ? names[method] : names[0];
+}
+
+static const char* BaseName(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+
+// 32-bit headers are widened to the 64-bit ones, so the rest of
+// the code is written once. Only little-endian files are supported.
+static bool GetShdr(const ElfFile* elf, size_t index, Elf64_Shdr* shdr) {
+    if (elf->is_64) {
+        const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)elf->data;
+        uint64_t offset = ehdr->e_shoff + index * sizeof(Elf64_Shdr);
+        if (offset + sizeof(Elf64_Shdr) > elf->size)
+            return false;
+        memcpy(shdr, elf->data + offset, sizeof(*shdr));
+        return true;
+    }
+
+    const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*)elf->data;
+    uint64_t offset = ehdr->e_shoff + index * sizeof(Elf32_Shdr);
+    if (offset + sizeof(Elf32_Shdr) > elf->size)
+        return false;
+    Elf32_Shdr shdr32;
+    memcpy(&shdr32, elf->data + offset, sizeof(shdr32));
+    shdr->sh_name = shdr32.sh_name;
+    shdr->sh_type = shdr32.sh_type;
+    shdr->sh_flags = shdr32.sh_flags;
+    shdr->sh_addr = shdr32.sh_addr;
+    shdr->sh_offset = shdr32.sh_offset;
+    shdr->sh_size = shdr32.sh_size;
+    shdr->sh_link = shdr32.sh_link;
+    shdr->sh_info = shdr32.sh_info;
+    shdr->sh_addralign = shdr32.sh_addralign;
+    shdr->sh_entsize = shdr32.sh_entsize;
+    return true;
+}
+
+static bool GetPhdr(const ElfFile* elf, size_t index, Elf64_Phdr* phdr) {
+    if (elf->is_64) {
+        const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)elf->data;
+        uint64_t offset = ehdr->e_phoff + index * sizeof(Elf64_Phdr);
+        if (offset + sizeof(Elf64_Phdr) > elf->size)
+            return false;
+        memcpy(phdr, elf->data + offset, sizeof(*phdr));
+        return true;
+    }
+
+    const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*)elf->data;
+    uint64_t offset = ehdr->e_phoff + index * sizeof(Elf32_Phdr);
+    if (offset + sizeof(Elf32_Phdr) > elf->size)
+        return false;
+    Elf32_Phdr phdr32;
+    memcpy(&phdr32, elf->data + offset, sizeof(phdr32));
+    phdr->p_type = phdr32.p_type;
+    phdr->p_flags = phdr32.p_flags;
+    phdr->p_offset = phdr32.p_offset;
+    phdr->p_vaddr = phdr32.p_vaddr;
+    phdr->p_paddr = phdr32.p_paddr;
+    phdr->p_filesz = phdr32.p_filesz;
+    phdr->p_memsz = phdr32.p_memsz;
+    phdr->p_align = phdr32.p_align;
+    return true;
+}
+
+static void GetSym(const ElfFile* elf, const uint8_t* entry, Elf64_Sym* sym) {
+    if (elf->is_64) {
+        memcpy(sym, entry, sizeof(*sym));
+        return;
+    }
+
+    Elf32_Sym sym32;
+    memcpy(&sym32, entry, sizeof(sym32));
+    sym->st_name = sym32.st_name;
+    sym->st_info = sym32.st_info;
+    sym->st_other = sym32.st_other;
+    sym->st_shndx = sym32.st_shndx;
+    sym->st_value = sym32.st_value;
+    sym->st_size = sym32.st_size;
+}
+
+static void ReadBuildId(ElfFile* elf, const Elf64_Shdr* shdr) {
+    const uint8_t* note = elf->data + shdr->sh_offset;
+    const uint8_t* notes_end = note + shdr->sh_size;
+    while (note + sizeof(Elf64_Nhdr) <= notes_end) {
+        // Nhdr is the same for both classes.
+        Elf64_Nhdr nhdr;
+        memcpy(&nhdr, note, sizeof(nhdr));
+        const uint8_t* name = note + sizeof(nhdr);
+        const uint8_t* desc = name + ((nhdr.n_namesz + 3) & ~3u);
+        const uint8_t* next = desc + ((nhdr.n_descsz + 3) & ~3u);
+        if (next > notes_end)
+            return;
+
+        if (nhdr.n_type == NT_GNU_BUILD_ID && nhdr.n_namesz == 4
+                && memcmp(name, "GNU", 4) == 0) {
+            size_t size = nhdr.n_descsz;
+            if (size > sizeof(elf->build_id))
+                size = sizeof(elf->build_id);
+            memcpy(elf->build_id, desc, size);
+            elf->build_id_size = size;
+            return;
+        }
+        note = next;
+    }
+}
+
+static int CompareSymbols(const void* a_voidp, const void* b_voidp) {
+    const Symbol* a = (const Symbol*)a_voidp;
+    const Symbol* b = (const Symbol*)b_voidp;
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    // Sized symbols first, they are kept when deduplicating.
+    if (a->end != b->end)
+        return a->end > b->end ? -1 : 1;
+    return 0;
+}
+
+static bool ReadSymbols(ElfFile* elf, const Elf64_Shdr* symtab, bool is_arm) {
+    Elf64_Shdr strtab;
+    size_t entry_size = elf->is_64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+    if (!GetShdr(elf, symtab->sh_link, &strtab)
+            || symtab->sh_offset + symtab->sh_size > elf->size
+            || strtab.sh_offset + strtab.sh_size > elf->size)
+        return false;
+
+    size_t entry_count = symtab->sh_size / entry_size;
+    Symbol* symbols = (Symbol*)malloc((entry_count + 1) * sizeof(Symbol));
+    if (!symbols)
+        return false;
+
+    size_t symbol_count = 0;
+    for (size_t i = 0; i < entry_count; ++i) {
+        Elf64_Sym sym;
+        GetSym(elf, elf->data + symtab->sh_offset + i * entry_size, &sym);
+        unsigned char type = ELF64_ST_TYPE(sym.st_info);
+        if ((type != STT_FUNC && type != STT_GNU_IFUNC)
+                || sym.st_shndx == SHN_UNDEF || sym.st_value == 0
+                || sym.st_name >= strtab.sh_size)
+            continue;
+
+        uint64_t start = sym.st_value;
+        // Thumb functions have the lowest bit set.
+        if (is_arm)
+            start &= ~(uint64_t)1;
+
+        Symbol* symbol = &symbols[symbol_count++];
+        symbol->start = start;
+        symbol->end = start + sym.st_size;
+        symbol->name = (const char*)elf->data + strtab.sh_offset + sym.st_name;
+    }
+
+    qsort(symbols, symbol_count, sizeof(Symbol), CompareSymbols);
+
+    // Aliases share the start address, keep one of them. Symbols without
+    // a size extend to the next one.
+    size_t unique_count = 0;
+    for (size_t i = 0; i < symbol_count; ++i) {
+        if (unique_count > 0 && symbols[unique_count - 1].start == symbols[i].start)
+            continue;
+        symbols[unique_count++] = symbols[i];
+    }
+    for (size_t i = 0; i < unique_count; ++i) {
+        if (symbols[i].end == symbols[i].start)
+            symbols[i].end = i + 1 < unique_count ? symbols[i + 1].start : UINT64_MAX;
+    }
+
+    elf->symbols = symbols;
+    elf->symbol_count = unique_count;
+    return true;
+}
+
+// Returns false for files which are not little-endian ELF.
+static bool LoadElfFile(const char* path, ElfFile* elf) {
+    memset(elf, 0, sizeof(*elf));
+    elf->path = path;
+    elf->name = BaseName(path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || (size_t)st.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+    elf->data = (const uint8_t*)mapping;
+    elf->size = (size_t)st.st_size;
+
+    const unsigned char* ident = elf->data;
+    if (memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_DATA] != ELFDATA2LSB
+            || (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64)) {
+        munmap(mapping, elf->size);
+        return false;
+    }
+    elf->is_64 = ident[EI_CLASS] == ELFCLASS64;
+
+    size_t phnum, shnum;
+    bool is_arm;
+    if (elf->is_64) {
+        const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*)elf->data;
+        phnum = ehdr->e_phnum;
+        shnum = ehdr->e_shnum;
+        is_arm = false;
+    } else {
+        const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*)elf->data;
+        phnum = ehdr->e_phnum;
+        shnum = ehdr->e_shnum;
+        is_arm = ehdr->e_machine == EM_ARM;
+    }
+
+    // The module base is the ELF header, see AddModuleCallback()
+    // in module_map.c.
+    for (size_t i = 0; i < phnum; ++i) {
+        Elf64_Phdr phdr;
+        if (GetPhdr(elf, i, &phdr) && phdr.p_type == PT_LOAD) {
+            elf->bias = phdr.p_vaddr - phdr.p_offset;
+            break;
+        }
+    }
+
+    Elf64_Shdr symtab = {};
+    Elf64_Shdr dynsym = {};
+    for (size_t i = 0; i < shnum; ++i) {
+        Elf64_Shdr shdr;
+        if (!GetShdr(elf, i, &shdr))
+            break;
+        if (shdr.sh_type == SHT_NOTE && !elf->build_id_size
+                && shdr.sh_offset + shdr.sh_size <= elf->size)
+            ReadBuildId(elf, &shdr);
+        else if (shdr.sh_type == SHT_SYMTAB)
+            symtab = shdr;
+        else if (shdr.sh_type == SHT_DYNSYM)
+            dynsym = shdr;
+    }
+
+    if (symtab.sh_type == SHT_SYMTAB)
+        ReadSymbols(elf, &symtab, is_arm);
+    else if (dynsym.sh_type == SHT_DYNSYM)
+        ReadSymbols(elf, &dynsym, is_arm);
+    return true;
+}
+
+static const Symbol* FindSymbol(const ElfFile* elf, uint64_t address) {
+    size_t low = 0;
+    size_t high = elf->symbol_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (elf->symbols[middle].start <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+        return NULL;
+
+    const Symbol* symbol = &elf->symbols[low - 1];
+    return address < symbol->end ? symbol : NULL;
+}
+
+
+static void MatchModule(const TraceFileModule* module, void* symbolizer_voidp) {
+    Symbolizer* symbolizer = (Symbolizer*)symbolizer_voidp;
+
+    free(symbolizer->module_names[module->id]);
+    char* path = strndup(module->path, module->path_length);
+    symbolizer->module_names[module->id] = path;
+
+    const ElfFile* match = NULL;
+    for (size_t i = 0; i < symbolizer->file_count && !match; ++i) {
+        const ElfFile* elf = &symbolizer->files[i];
+        if (module->build_id_size > 0) {
+            if (elf->build_id_size == module->build_id_size
+                    && memcmp(elf->build_id, module->build_id,
+                            module->build_id_size) == 0)
+                match = elf;
+        } else if (path && strcmp(elf->name, BaseName(path)) == 0) {
+            match = elf;
+        }
+    }
+    symbolizer->module_files[module->id] = match;
+}
+
+static void PrintStack(const TraceFileStack* stack, void* symbolizer_voidp) {
+    Symbolizer* symbolizer = (Symbolizer*)symbolizer_voidp;
+    printf("Backtrace captured using %s, count %u:\n",
+            MethodName(stack->method), stack->count);
+
+    for (size_t frame_index = 0; frame_index < stack->frame_count; ++frame_index) {
+        const TraceFileFrame* frame = &stack->frames[frame_index];
+        ++symbolizer->frame_count;
+
+        if (frame->module_id == trace_file_no_module) {
+            printf("  #%02zu:  0x%llx\n",
+                    frame_index, (unsigned long long)frame->address);
+            continue;
+        }
+
+        const char* module_name = symbolizer->module_names[frame->module_id];
+        module_name = module_name ? BaseName(module_name) : "";
+        const ElfFile* elf = symbolizer->module_files[frame->module_id];
+        const Symbol* symbol = elf
+                ? FindSymbol(elf, frame->address + elf->bias) : NULL;
+        if (!symbol) {
+            printf("  #%02zu:  0x%llx  (%s)\n", frame_index,
+                    (unsigned long long)frame->address, module_name);
+            continue;
+        }
+
+        ++symbolizer->resolved_frame_count;
+        printf("  #%02zu:  0x%llx  %s+0x%llx  (%s)\n", frame_index,
+                (unsigned long long)frame->address,
+                DemangleCache_Demangle(&symbolizer->demangle_cache, symbol->name),
+                (unsigned long long)(frame->address + elf->bias - symbol->start),
+                module_name);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <trace> <elf>...\n", argv[0]);
+        return 1;
+    }
+
+    Symbolizer* symbolizer = (Symbolizer*)calloc(1, sizeof(Symbolizer));
+    if (!symbolizer)
+        return 1;
+    symbolizer->files = (ElfFile*)calloc((size_t)argc, sizeof(ElfFile));
+    if (!symbolizer->files)
+        return 1;
+
+    // Anything which is not ELF (static libraries, object directories)
+    // is skipped, so a whole obj/local/<abi>/* can be passed.
+    for (int i = 2; i < argc; ++i) {
+        ElfFile* elf = &symbolizer->files[symbolizer->file_count];
+        if (LoadElfFile(argv[i], elf))
+            ++symbolizer->file_count;
+    }
+
+    DemangleCache_Init(&symbolizer->demangle_cache);
+
+    TraceFileCallbacks callbacks = {};
+    callbacks.module = MatchModule;
+    callbacks.stack = PrintStack;
+    bool ok = TraceFile_Read(argv[1], &callbacks, symbolizer);
+
+    fprintf(stderr, "Resolved %llu of %llu frames with %zu ELF files.\n",
+            (unsigned long long)symbolizer->resolved_frame_count,
+            (unsigned long long)symbolizer->frame_count,
+            symbolizer->file_count);
+    if (!ok)
+        fprintf(stderr, "Could not read %s.\n", argv[1]);
+
+    DemangleCache_Destroy(&symbolizer->demangle_cache);
+    return ok ? 0 : 1;
+}
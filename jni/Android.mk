@@ -2,14 +2,20 @@ LOCAL_PATH := $(call my-dir)
 
 
 # libunwind_ndk
-# $(TARGET_ARCH) is one of: arm, arm64, x86, or x86_64
-ifeq ($(TARGET_ARCH),arm)
+# $(TARGET_ARCH_ABI) is one of: armeabi, armeabi-v7a, arm64-v8a, x86, x86_64
+# NDK r16b only has it for armeabi and armeabi-v7a, newer NDKs for all ABIs.
+# It is not used on x86, see backtrace.h.
+LIBUNWIND_AVAILABLE :=
+LIBUNWIND_NDK_PATH := $(ANDROID_NDK_ROOT)/sources/cxx-stl/llvm-libc++/libs/$(TARGET_ARCH_ABI)/libunwind.a
+ifneq ($(TARGET_ARCH),x86)
+ifneq ($(wildcard $(LIBUNWIND_NDK_PATH)),)
+LIBUNWIND_AVAILABLE := 1
 include $(CLEAR_VARS)
 LOCAL_MODULE := libunwind_ndk
-# $(TARGET_ARCH_ABI) is one of: armeabi, armeabi-v7a, arm64-v8a, x86, x86_64
-LOCAL_SRC_FILES := $(ANDROID_NDK_ROOT)/sources/cxx-stl/llvm-libc++/libs/$(TARGET_ARCH_ABI)/libunwind.a
+LOCAL_SRC_FILES := $(LIBUNWIND_NDK_PATH)
 include $(PREBUILT_STATIC_LIBRARY)
 endif
+endif
 
 
 # C++ names demangling.
@@ -19,23 +25,138 @@ LOCAL_SRC_FILES  := $(ANDROID_NDK_ROOT)/sources/cxx-stl/llvm-libc++/libs/$(TARGE
 include $(PREBUILT_STATIC_LIBRARY)
 
 
+# Sources and flags shared by the modules below.
+# COMMON_SRC_FILES are libbacktrace_capture, see backtrace_capture.h.
+MAIN_MODULE             := $(shell pwd | xargs dirname | xargs basename)
+EXECUTABLE_SRC_FILES    := main.c benchmark.c stress.c
+# Defines malloc(), only linked into the LD_PRELOAD library below.
+HEAP_PROFILE_SRC_FILES  := heap_profiler_shim.c
+# The library the stress test loads in many copies.
+STRESS_MODULE_SRC_FILES := stress_module.c
+COMMON_SRC_FILES        := $(filter-out $(EXECUTABLE_SRC_FILES) $(HEAP_PROFILE_SRC_FILES) \
+                           $(STRESS_MODULE_SRC_FILES),$(wildcard *.c))
+
+COMMON_CFLAGS           := -std=c11
+COMMON_CFLAGS           += -Wall
+COMMON_CFLAGS           += -DHIDE_EXPORTS
+
+# Keeps the frame chain for FRAME_POINTER_METHOD.
+COMMON_CFLAGS           += -fno-omit-frame-pointer
+
+COMMON_LDFLAGS          :=
+
+# Exports all the symbols for symbolization on the device.
+# Not needed with the host symbolizer: make build RDYNAMIC=0
+ifneq ($(RDYNAMIC),0)
+COMMON_LDFLAGS          += -rdynamic
+endif
+
+# Link-time optimization across the library and its callers:
+# make build LTO=1
+# The static library then contains bitcode, its users need -flto too.
+ifeq ($(LTO),1)
+COMMON_CFLAGS           += -flto
+COMMON_LDFLAGS          += -flto -fuse-ld=gold
+endif
+
+COMMON_STATIC_LIBRARIES :=
+
+ifeq ($(LIBUNWIND_AVAILABLE),1)
+COMMON_CFLAGS           += -DLIBUNWIND_AVAILABLE=1
+COMMON_STATIC_LIBRARIES += libunwind_ndk
+endif
+
+COMMON_STATIC_LIBRARIES += libc++abi
+
+
+# libbacktrace_capture.a, linked into the executables below.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE            := backtrace_capture_static
+LOCAL_MODULE_FILENAME   := libbacktrace_capture
+LOCAL_SRC_FILES         := $(COMMON_SRC_FILES)
+LOCAL_CFLAGS            := $(COMMON_CFLAGS)
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_EXPORT_LDLIBS     := -ldl
+LOCAL_STATIC_LIBRARIES  := $(COMMON_STATIC_LIBRARIES)
+
+include $(BUILD_STATIC_LIBRARY)
+
+
+# libbacktrace_capture.so, only the API is exported.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE            := backtrace_capture
+LOCAL_SRC_FILES         := $(COMMON_SRC_FILES)
+LOCAL_CFLAGS            := $(COMMON_CFLAGS)
+LOCAL_LDFLAGS           := $(filter-out -rdynamic,$(COMMON_LDFLAGS)) \
+                           -Wl,--version-script,$(LOCAL_PATH)/backtrace_capture.map
+LOCAL_LDLIBS            := -ldl
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+LOCAL_STATIC_LIBRARIES  := $(COMMON_STATIC_LIBRARIES)
+
+include $(BUILD_SHARED_LIBRARY)
+
+
 # main
 include $(CLEAR_VARS)
 
-LOCAL_MODULE        := $(shell pwd | xargs dirname | xargs basename)
-LOCAL_SRC_FILES     := $(wildcard *.c)
+LOCAL_MODULE            := $(MAIN_MODULE)
+LOCAL_SRC_FILES         := main.c
+LOCAL_CFLAGS            := $(COMMON_CFLAGS)
+LOCAL_LDFLAGS           := $(COMMON_LDFLAGS)
+LOCAL_STATIC_LIBRARIES  := backtrace_capture_static
 
+include $(BUILD_EXECUTABLE)
 
-LOCAL_CFLAGS        += -std=c11
-LOCAL_CFLAGS        += -Wall
-LOCAL_CFLAGS        += -DHIDE_EXPORTS
 
-LOCAL_LDFLAGS       += -rdynamic
+# benchmark, see benchmark.c.
+# Also times the C++ front end, see backtrace_unwinder.hpp.
+include $(CLEAR_VARS)
 
-ifeq ($(TARGET_ARCH),arm)
-LOCAL_STATIC_LIBRARIES  += libunwind_ndk
-endif
+LOCAL_MODULE            := $(MAIN_MODULE)-benchmark
+LOCAL_SRC_FILES         := benchmark.c benchmark_unwinder.cpp
+LOCAL_CFLAGS            := $(filter-out -std=c11,$(COMMON_CFLAGS))
+LOCAL_CONLYFLAGS        := -std=c11
+LOCAL_CPPFLAGS          := -std=c++11 -fno-exceptions -fno-rtti
+LOCAL_LDFLAGS           := $(COMMON_LDFLAGS)
+LOCAL_STATIC_LIBRARIES  := backtrace_capture_static
+
+include $(BUILD_EXECUTABLE)
 
-LOCAL_STATIC_LIBRARIES  += libc++abi
+
+# stress test, see stress.c, and the library it loads: next to it,
+# lib<stress executable>-module.so.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE            := $(MAIN_MODULE)-stress
+LOCAL_SRC_FILES         := stress.c
+LOCAL_CFLAGS            := $(COMMON_CFLAGS)
+LOCAL_LDFLAGS           := $(COMMON_LDFLAGS)
+LOCAL_STATIC_LIBRARIES  := backtrace_capture_static
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE            := $(MAIN_MODULE)-stress-module
+LOCAL_SRC_FILES         := $(STRESS_MODULE_SRC_FILES)
+LOCAL_CFLAGS            := $(COMMON_CFLAGS)
+
+include $(BUILD_SHARED_LIBRARY)
+
+
+# Heap profiler for LD_PRELOAD, see heap_profiler_shim.c.
+# Only the profiler and what it uses: unwind_cache.c would interpose
+# the unwind index lookups of the whole process.
+include $(CLEAR_VARS)
+
+LOCAL_MODULE            := $(MAIN_MODULE)-heapprofile
+LOCAL_SRC_FILES         := $(HEAP_PROFILE_SRC_FILES) heap_profiler.c \
+                           backtrace.c capture_counters.c demangle_cache.c \
+                           jit_ranges.c module_map.c stack_table.c stack_trie.c
+LOCAL_CFLAGS            := $(COMMON_CFLAGS) -fvisibility=hidden
+LOCAL_LDLIBS            := -ldl
+LOCAL_STATIC_LIBRARIES  := $(COMMON_STATIC_LIBRARIES)
+
+include $(BUILD_SHARED_LIBRARY)
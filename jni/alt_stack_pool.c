@@ -0,0 +1,161 @@
+#include "alt_stack_pool.h"
+#include "backtrace.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// unw_context_t and unw_cursor_t alone take a few KiB on ARM,
+// and libunwind recurses during the first step.
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+static const size_t alt_stack_size_default = 64 * 1024;
+#else
+static const size_t alt_stack_size_default = 32 * 1024;
+#endif
+
+static uint8_t* alt_stack_mapping;
+static size_t alt_stack_mapping_size;
+static size_t alt_stack_count;
+// Stack size plus its guard page.
+static size_t alt_stack_stride;
+static size_t alt_stack_page_size;
+
+// Bit per stack, set while claimed.
+static _Atomic uint32_t* alt_stack_claimed;
+
+// The key only serves its destructor: returning the stack
+// of an exiting thread.
+static pthread_key_t alt_stack_key;
+
+// Index + 1 of the stack of the thread, 0 if none.
+static __thread size_t alt_stack_index_plus_one;
+
+
+size_t AltStackPool_DefaultStackSize() {
+    return alt_stack_size_default > (size_t)SIGSTKSZ
+            ? alt_stack_size_default : (size_t)SIGSTKSZ;
+}
+
+static void ReleaseStack(size_t index) {
+    atomic_fetch_and(&alt_stack_claimed[index / 32], ~(1u << (index % 32)));
+}
+
+// Signals are still delivered while the thread exits, so the stack
+// is only returned once it is no longer installed: another thread may
+// claim it right away. Fails, and the stack is kept, if a handler
+// is running on it.
+static bool DisableAndReleaseStack(size_t index) {
+    stack_t stack = {};
+    stack.ss_flags = SS_DISABLE;
+    if (sigaltstack(&stack, NULL) != 0)
+        return false;
+    ReleaseStack(index);
+    return true;
+}
+
+// Runs on the exiting thread.
+static void ThreadExitDestructor(void* index_plus_one_voidp) {
+    DisableAndReleaseStack((uintptr_t)index_plus_one_voidp - 1);
+    alt_stack_index_plus_one = 0;
+}
+
+bool AltStackPool_Init(size_t stack_count, size_t stack_size) {
+    assert(stack_count > 0);
+    assert(!alt_stack_mapping);
+
+    if (stack_size == 0)
+        stack_size = AltStackPool_DefaultStackSize();
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+
+    size_t stride = page_size + stack_size;
+    size_t mapping_size = stack_count * stride;
+    void* mapping = mmap(NULL, mapping_size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    // Stacks grow down, so each guard page is below its stack.
+    for (size_t i = 0; i < stack_count; ++i) {
+        if (mprotect((uint8_t*)mapping + i * stride + page_size, stack_size,
+                    PROT_READ | PROT_WRITE) != 0) {
+            munmap(mapping, mapping_size);
+            return false;
+        }
+    }
+
+    alt_stack_claimed = (_Atomic uint32_t*)calloc(
+            (stack_count + 31) / 32, sizeof(uint32_t));
+    if (!alt_stack_claimed
+            || pthread_key_create(&alt_stack_key, ThreadExitDestructor) != 0) {
+        free((void*)alt_stack_claimed);
+        alt_stack_claimed = NULL;
+        munmap(mapping, mapping_size);
+        return false;
+    }
+
+    alt_stack_page_size = page_size;
+    alt_stack_stride = stride;
+    alt_stack_count = stack_count;
+    alt_stack_mapping_size = mapping_size;
+    alt_stack_mapping = (uint8_t*)mapping;
+    return true;
+}
+
+// Returns the index of the claimed stack, or SIZE_MAX.
+static size_t ClaimStack() {
+    size_t word_count = (alt_stack_count + 31) / 32;
+    for (size_t word_index = 0; word_index < word_count; ++word_index) {
+        uint32_t word = atomic_load(&alt_stack_claimed[word_index]);
+        while (word != UINT32_MAX) {
+            unsigned int bit = (unsigned int)__builtin_ctz(~word);
+            size_t index = word_index * 32 + bit;
+            if (index >= alt_stack_count)
+                break;
+            if (atomic_compare_exchange_weak(&alt_stack_claimed[word_index],
+                        &word, word | (1u << bit)))
+                return index;
+        }
+    }
+    return SIZE_MAX;
+}
+
+bool AltStackPool_RegisterThread() {
+    if (!alt_stack_mapping)
+        return false;
+    if (alt_stack_index_plus_one != 0)
+        return true;
+
+    size_t index = ClaimStack();
+    if (index == SIZE_MAX)
+        return false;
+
+    stack_t stack = {};
+    stack.ss_sp = alt_stack_mapping + index * alt_stack_stride + alt_stack_page_size;
+    stack.ss_size = alt_stack_stride - alt_stack_page_size;
+    if (sigaltstack(&stack, NULL) != 0) {
+        ReleaseStack(index);
+        return false;
+    }
+
+    alt_stack_index_plus_one = index + 1;
+    pthread_setspecific(alt_stack_key, (void*)(uintptr_t)alt_stack_index_plus_one);
+    return true;
+}
+
+void AltStackPool_UnregisterThread() {
+    if (alt_stack_index_plus_one == 0)
+        return;
+
+    if (!DisableAndReleaseStack(alt_stack_index_plus_one - 1))
+        return;
+
+    pthread_setspecific(alt_stack_key, NULL);
+    alt_stack_index_plus_one = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef ALT_STACK_POOL_H
+#define ALT_STACK_POOL_H
+
+// Pool of alternate signal stacks, one per registered thread.
+//
+// A crash on stack overflow can only be handled on an alternate stack,
+// and sigaltstack() is per thread, so every thread needs its own.
+// SIGSTKSZ is too small for the libunwind cursor and context,
+// so the stacks are sized for the enabled unwinders.
+//
+// All the stacks are mmap'ed at once, each one below a PROT_NONE guard
+// page, so an overflow of the signal handler itself faults instead of
+// corrupting the neighbouring stack. Registering a thread only claims
+// a free stack with compare-and-swap and calls sigaltstack(),
+// no other syscall. The stack goes back to the pool when the thread exits.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+// Enough for the deepest unwinder enabled in backtrace.h.
+size_t AltStackPool_DefaultStackSize();
+
+// Maps "stack_count" stacks of "stack_size" bytes, rounded up to pages.
+// "stack_size" 0 means AltStackPool_DefaultStackSize().
+// Not async-signal-safe, call once at start-up.
+bool AltStackPool_Init(size_t stack_count, size_t stack_size);
+
+// Claims a stack for the calling thread and installs it with
+// sigaltstack(). Returns true, if the thread has one already.
+// Returns false, if the pool is empty or not initialized.
+bool AltStackPool_RegisterThread();
+
+// Disables the alternate stack of the calling thread and returns it
+// to the pool. Called automatically when a registered thread exits.
+// The stack is kept, if a signal handler is running on it.
+void AltStackPool_UnregisterThread();
+
+#endif // ALT_STACK_POOL_H
@@ -0,0 +1,917 @@
+#include "backtrace.h"
+#include "capture_counters.h"
+#include "demangle_cache.h"
+#include "jit_ranges.h"
+#include "module_map.h"
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+#include "libunwind.h"
+#endif
+
+#define HIDE_EXPORTS 1
+#include <unwind.h>
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// Frames of the signal handler, skipped by
+// UNWIND_BACKTRACE_WITH_SKIPPING_METHOD, until calibrated.
+static const size_t backtrace_skip_count = 3;
+
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+// Once calibrated, frames looked at for the trampoline at most.
+static const size_t backtrace_skip_search_max = 32;
+
+// Ignored by default, so a late delivery does no harm.
+static const int backtrace_calibration_signal = SIGURG;
+enum { backtrace_calibration_depth = 64 };
+
+static BacktraceSkipCalibration backtrace_skip_calibration;
+static _Atomic bool backtrace_skip_calibrated;
+#endif
+
+// Fewer frames than this mean that the walk broke
+// right at the beginning.
+static const size_t backtrace_frame_count_min = 3;
+
+
+// In a signal handler, once calibrated, the frames up to the trampoline
+// are skipped, however many there are. Otherwise, a fixed count.
+static size_t InitialSkipCount(const BacktraceState* state) {
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+    if (state->signal_ucontext
+            && atomic_load_explicit(&backtrace_skip_calibrated, memory_order_acquire))
+        return backtrace_skip_search_max;
+#endif
+    return backtrace_skip_count;
+}
+
+
+const char* BacktraceMethod_Name(BacktraceMethod method) {
+    switch (method) {
+    case BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS:
+        return "LIBUNWIND_WITH_REGISTERS_METHOD";
+    case BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_REGISTERS:
+        return "UNWIND_BACKTRACE_WITH_REGISTERS_METHOD";
+    case BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_SKIPPING:
+        return "UNWIND_BACKTRACE_WITH_SKIPPING_METHOD";
+    case BACKTRACE_METHOD_FRAME_POINTER:
+        return "FRAME_POINTER_METHOD";
+    }
+    return "UNKNOWN_METHOD";
+}
+
+
+void BacktraceState_Init(
+        BacktraceState* state, const ucontext_t* ucontext,
+        uintptr_t* addresses, size_t address_capacity) {
+    assert(state);
+    assert(addresses);
+    assert(address_capacity >= backtrace_depth_min);
+    assert(address_capacity <= backtrace_depth_max);
+    memset(state, 0, sizeof(BacktraceState));
+    state->addresses = addresses;
+    state->address_capacity = address_capacity;
+    state->signal_ucontext = ucontext;
+    state->address_skip_count = InitialSkipCount(state);
+}
+
+void BacktraceState_Reset(BacktraceState* state) {
+    assert(state);
+    state->address_count = 0;
+    state->stopped = false;
+    state->stack_pointer_decreased = false;
+    state->last_stack_pointer = 0;
+    state->address_skip_count = InitialSkipCount(state);
+    state->step_count = 0;
+}
+
+static void CountDroppedFrame(const BacktraceState* state, CaptureCounter counter) {
+    if (!state->uncounted)
+        CAPTURE_COUNTERS_ADD(counter, 1);
+}
+
+bool BacktraceState_AddAddress(BacktraceState* state, uintptr_t ip) {
+    return BacktraceState_AddFrame(state, ip, 0);
+}
+
+bool BacktraceState_AddFrame(BacktraceState* state, uintptr_t ip, uintptr_t sp) {
+    assert(state);
+    state->step_count++;
+
+    // No more space in the storage. Fail.
+    if (state->address_count >= state->address_capacity) {
+        CountDroppedFrame(state, CAPTURE_COUNTER_DROPPED_OVERFLOW_COUNT);
+        return false;
+    }
+
+#if __thumb__
+    // Reset the Thumb bit, if it is set.
+    const uintptr_t thumb_bit = 1;
+    ip &= ~thumb_bit;
+#endif
+
+    if (state->address_count > 0) {
+        // Ignore null addresses.
+        // They sometimes happen when using _Unwind_Backtrace()
+        // with the compiler optimizations,
+        // when the Link Register is overwritten by the inner
+        // stack frames, like PreCrash() functions in this example.
+        if (ip == 0) {
+            CountDroppedFrame(state, CAPTURE_COUNTER_DROPPED_NULL_COUNT);
+            return true;
+        }
+
+        // Ignore duplicate addresses.
+        // They sometimes happen when using _Unwind_Backtrace()
+        // with the compiler optimizations,
+        // because we both add the second address from the Link Register
+        // in ProcessRegisters() and receive the same address
+        // in UnwindBacktraceCallback().
+        if (ip == state->addresses[state->address_count - 1]) {
+            CountDroppedFrame(state, CAPTURE_COUNTER_DROPPED_DUPLICATE_COUNT);
+            return true;
+        }
+    }
+
+    if (sp != 0) {
+        if (sp < state->last_stack_pointer)
+            state->stack_pointer_decreased = true;
+        state->last_stack_pointer = sp;
+    }
+
+    // Finally add the address to the storage.
+    state->addresses[state->address_count++] = ip;
+
+    if (state->predicate
+            && !state->predicate(state, ip, state->predicate_context)) {
+        state->stopped = true;
+        return false;
+    }
+    return true;
+}
+
+void BacktraceState_SetPredicate(
+        BacktraceState* state, BacktracePredicate predicate, void* context) {
+    assert(state);
+    state->predicate = predicate;
+    state->predicate_context = context;
+}
+
+bool BacktracePredicate_FrameLimit(
+        const BacktraceState* state, uintptr_t address, void* frame_limit_voidp) {
+    assert(frame_limit_voidp);
+    return state->address_count < *(const size_t*)frame_limit_voidp;
+}
+
+bool BacktracePredicate_StopInRange(
+        const BacktraceState* state, uintptr_t address, void* range_voidp) {
+    assert(range_voidp);
+    const BacktraceAddressRange* range = (const BacktraceAddressRange*)range_voidp;
+    return address < range->start || address >= range->end;
+}
+
+
+// Reads the registers of the interrupted code.
+static void GetSignalRegisters(
+        const ucontext_t* signal_ucontext,
+        uintptr_t* pc, uintptr_t* sp, uintptr_t* fp) {
+#if __arm__
+    const struct sigcontext* signal_mcontext = &(signal_ucontext->uc_mcontext);
+    *pc = signal_mcontext->arm_pc;
+    *sp = signal_mcontext->arm_sp;
+#if __thumb__
+    // Thumb code keeps the frame pointer in R7.
+    *fp = signal_mcontext->arm_r7;
+#else
+    *fp = signal_mcontext->arm_fp;
+#endif
+#elif __aarch64__
+    *pc = signal_ucontext->uc_mcontext.pc;
+    *sp = signal_ucontext->uc_mcontext.sp;
+    *fp = signal_ucontext->uc_mcontext.regs[29];
+#elif __x86_64__
+    *pc = signal_ucontext->uc_mcontext.gregs[REG_RIP];
+    *sp = signal_ucontext->uc_mcontext.gregs[REG_RSP];
+    *fp = signal_ucontext->uc_mcontext.gregs[REG_RBP];
+#elif __i386__
+    *pc = signal_ucontext->uc_mcontext.gregs[REG_EIP];
+    *sp = signal_ucontext->uc_mcontext.gregs[REG_ESP];
+    *fp = signal_ucontext->uc_mcontext.gregs[REG_EBP];
+#else
+#error "Unsupported architecture."
+#endif
+}
+
+
+// Around each method: the counters are added once per capture,
+// not per frame.
+static uint64_t CaptureBegin(BacktraceState* state) {
+    state->step_count = 0;
+    return CAPTURE_COUNTERS_TICKS();
+}
+
+static void CaptureEnd(const BacktraceState* state, uint64_t start_ticks) {
+#if CAPTURE_COUNTERS_ENABLED
+    CaptureCounters_Add(CAPTURE_COUNTER_UNWIND_TIME,
+            CaptureCounters_Ticks() - start_ticks);
+    CaptureCounters_Add(CAPTURE_COUNTER_CAPTURE_COUNT, 1);
+    CaptureCounters_Add(CAPTURE_COUNTER_UNWIND_STEP_COUNT, state->step_count);
+    CaptureCounters_Add(CAPTURE_COUNTER_FRAME_COUNT, state->address_count);
+#endif
+}
+
+
+uintptr_t Backtrace_GetSignalPc(const ucontext_t* signal_ucontext) {
+    assert(signal_ucontext);
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    uintptr_t fp = 0;
+    GetSignalRegisters(signal_ucontext, &pc, &sp, &fp);
+#if __thumb__
+    pc &= ~(uintptr_t)1;
+#endif
+    return pc;
+}
+
+void Backtrace_GetSignalRegisters(
+        const ucontext_t* signal_ucontext, uintptr_t* pc, uintptr_t* sp) {
+    assert(signal_ucontext);
+    assert(pc);
+    assert(sp);
+    uintptr_t fp = 0;
+    GetSignalRegisters(signal_ucontext, pc, sp, &fp);
+}
+
+static BacktraceFrameClassifier backtrace_frame_classifier;
+static void* backtrace_frame_classifier_context;
+
+void Backtrace_SetFrameClassifier(
+        BacktraceFrameClassifier classifier, void* context) {
+    backtrace_frame_classifier_context = context;
+    backtrace_frame_classifier = classifier;
+}
+
+BacktraceFrameKind Backtrace_ClassifyFrame(uintptr_t pc) {
+    if (backtrace_frame_classifier)
+        return backtrace_frame_classifier(pc, backtrace_frame_classifier_context);
+
+    if (ModuleMap_FindModule(pc))
+        return BACKTRACE_FRAME_NATIVE;
+    JitRange range;
+    if (JitRanges_Count() > 0 && JitRanges_Find(pc, &range))
+        return BACKTRACE_FRAME_JIT;
+    return BACKTRACE_FRAME_UNKNOWN;
+}
+
+// For the walks which do not classify every frame otherwise:
+// without JIT ranges and another classifier, no frame is JIT.
+static bool IsJitFrame(uintptr_t pc) {
+    if (!backtrace_frame_classifier && JitRanges_Count() == 0)
+        return false;
+    return Backtrace_ClassifyFrame(pc) == BACKTRACE_FRAME_JIT;
+}
+
+bool BacktraceState_Validate(const BacktraceState* state) {
+    assert(state);
+    assert(state->signal_ucontext);
+
+    size_t count = state->address_count;
+    if (count == 0 || state->stack_pointer_decreased)
+        return false;
+    if (count < backtrace_frame_count_min
+            && !state->stopped && count < state->address_capacity)
+        return false;
+
+    uintptr_t pc = Backtrace_GetSignalPc(state->signal_ucontext);
+
+    // The methods seeded with the registers start right at the PC,
+    // the skipping one may leave a few signal handler frames before it.
+    bool pc_found = false;
+    for (size_t i = 0; i < count && i <= backtrace_skip_count + 1; ++i) {
+        if (state->addresses[i] == pc) {
+            pc_found = true;
+            break;
+        }
+    }
+    if (!pc_found)
+        return false;
+
+    // The outermost address of a walk which ran off the end
+    // of the stack is often garbage, the PC may be unknown code.
+    for (size_t i = 1; i + 1 < count; ++i) {
+        if (Backtrace_ClassifyFrame(state->addresses[i]) == BACKTRACE_FRAME_UNKNOWN)
+            return false;
+    }
+    return true;
+}
+
+
+#if FRAME_POINTER_METHOD
+
+// Stack of the calling thread, [low, high).
+static __thread uintptr_t frame_pointer_stack_low;
+static __thread uintptr_t frame_pointer_stack_high;
+
+
+bool FramePointer_RegisterThread() {
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0)
+        return false;
+
+    void* stack_address = NULL;
+    size_t stack_size = 0;
+    int result = pthread_attr_getstack(&attr, &stack_address, &stack_size);
+    pthread_attr_destroy(&attr);
+    if (result != 0)
+        return false;
+
+    frame_pointer_stack_low = (uintptr_t)stack_address;
+    frame_pointer_stack_high = (uintptr_t)stack_address + stack_size;
+    return true;
+}
+
+bool FramePointer_GetThreadStack(uintptr_t* low, uintptr_t* high) {
+    assert(low);
+    assert(high);
+    if (frame_pointer_stack_high == 0)
+        return false;
+    *low = frame_pointer_stack_low;
+    *high = frame_pointer_stack_high;
+    return true;
+}
+
+static bool WalkFramePointers(BacktraceState* state) {
+    const ucontext_t* signal_ucontext = state->signal_ucontext;
+    assert(signal_ucontext);
+
+    uintptr_t stack_high = frame_pointer_stack_high;
+    if (stack_high == 0)
+        return false;
+
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    uintptr_t fp = 0;
+    GetSignalRegisters(signal_ucontext, &pc, &sp, &fp);
+
+    BacktraceFrameKind kind = Backtrace_ClassifyFrame(pc);
+    if (kind == BACKTRACE_FRAME_UNKNOWN)
+        return false;
+    if (!BacktraceState_AddFrame(state, pc, sp))
+        return state->stopped;
+
+    // With -fno-omit-frame-pointer every frame starts with a record of
+    // the caller's frame pointer and the return address, on all of
+    // the supported architectures (for ARM32 with clang):
+    //   fp[0] - frame pointer of the caller,
+    //   fp[1] - return address into the caller.
+    // Frame records are always above the interrupted stack pointer
+    // and each next one is above the previous.
+    // JIT frames are stepped over by their range, see jit_ranges.h.
+    uintptr_t low = sp > frame_pointer_stack_low ? sp : frame_pointer_stack_low;
+    const uintptr_t record_size = 2 * sizeof(uintptr_t);
+    for (;;) {
+        uintptr_t return_address = 0;
+        uintptr_t next_sp = 0;
+        uintptr_t next_fp = 0;
+        if (kind == BACKTRACE_FRAME_JIT) {
+            JitFrameRegisters registers = {pc, sp, fp};
+            if (!JitRanges_Step(&registers))
+                break;
+            return_address = registers.pc;
+            next_sp = registers.sp;
+            next_fp = registers.fp;
+        } else {
+            if (fp < low || fp > stack_high - record_size
+                    || fp % sizeof(uintptr_t) != 0)
+                break;
+            const uintptr_t* record = (const uintptr_t*)fp;
+            next_fp = record[0];
+            return_address = record[1];
+            next_sp = fp + record_size;
+        }
+
+        if (return_address == 0)
+            break;
+        kind = Backtrace_ClassifyFrame(return_address);
+        if (kind == BACKTRACE_FRAME_UNKNOWN)
+            break;
+
+        bool ok = BacktraceState_AddFrame(state, return_address, next_sp);
+        if (!ok)
+            break;
+
+        if (next_sp <= sp)
+            break;
+        pc = return_address;
+        sp = next_sp;
+        fp = next_fp;
+    }
+
+    return state->address_count >= backtrace_frame_count_min
+            || state->stopped;
+}
+
+bool FramePointerWithRegisters(BacktraceState* state) {
+    assert(state);
+    uint64_t start_ticks = CaptureBegin(state);
+    bool valid = WalkFramePointers(state);
+    CaptureEnd(state, start_ticks);
+    return valid;
+}
+
+#endif // #if FRAME_POINTER_METHOD
+
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+
+// Seeds the cursor with the registers of the interrupted code,
+// so that the walk starts right at the crashed frame,
+// not at the signal handler frames.
+// Returns the address of the instruction which caused the crash.
+static uintptr_t SetLibunwindRegisters(
+        unw_cursor_t* unw_cursor, const ucontext_t* signal_ucontext) {
+#if __arm__
+    const struct sigcontext* signal_mcontext = &(signal_ucontext->uc_mcontext);
+    assert(signal_mcontext);
+
+    unw_set_reg(unw_cursor, UNW_ARM_R0,  signal_mcontext->arm_r0);
+    unw_set_reg(unw_cursor, UNW_ARM_R1,  signal_mcontext->arm_r1);
+    unw_set_reg(unw_cursor, UNW_ARM_R2,  signal_mcontext->arm_r2);
+    unw_set_reg(unw_cursor, UNW_ARM_R3,  signal_mcontext->arm_r3);
+    unw_set_reg(unw_cursor, UNW_ARM_R4,  signal_mcontext->arm_r4);
+    unw_set_reg(unw_cursor, UNW_ARM_R5,  signal_mcontext->arm_r5);
+    unw_set_reg(unw_cursor, UNW_ARM_R6,  signal_mcontext->arm_r6);
+    unw_set_reg(unw_cursor, UNW_ARM_R7,  signal_mcontext->arm_r7);
+    unw_set_reg(unw_cursor, UNW_ARM_R8,  signal_mcontext->arm_r8);
+    unw_set_reg(unw_cursor, UNW_ARM_R9,  signal_mcontext->arm_r9);
+    unw_set_reg(unw_cursor, UNW_ARM_R10, signal_mcontext->arm_r10);
+    unw_set_reg(unw_cursor, UNW_ARM_R11, signal_mcontext->arm_fp);
+    unw_set_reg(unw_cursor, UNW_ARM_R12, signal_mcontext->arm_ip);
+    unw_set_reg(unw_cursor, UNW_ARM_R13, signal_mcontext->arm_sp);
+    unw_set_reg(unw_cursor, UNW_ARM_R14, signal_mcontext->arm_lr);
+    unw_set_reg(unw_cursor, UNW_ARM_R15, signal_mcontext->arm_pc);
+
+    unw_set_reg(unw_cursor, UNW_REG_IP,  signal_mcontext->arm_pc);
+    unw_set_reg(unw_cursor, UNW_REG_SP,  signal_mcontext->arm_sp);
+
+    return signal_mcontext->arm_pc;
+#elif __aarch64__
+    const mcontext_t* signal_mcontext = &(signal_ucontext->uc_mcontext);
+    assert(signal_mcontext);
+
+    // X0-X28, X29 (FP) and X30 (LR) are numbered the same way
+    // in libunwind and in sigcontext.
+    for (int reg = UNW_ARM64_X0; reg <= UNW_ARM64_X30; ++reg)
+        unw_set_reg(unw_cursor, reg, signal_mcontext->regs[reg]);
+
+    // IP is set last: libunwind looks up the unwind info for it.
+    unw_set_reg(unw_cursor, UNW_REG_SP,  signal_mcontext->sp);
+    unw_set_reg(unw_cursor, UNW_REG_IP,  signal_mcontext->pc);
+
+    return signal_mcontext->pc;
+#elif __x86_64__
+    const mcontext_t* signal_mcontext = &(signal_ucontext->uc_mcontext);
+    assert(signal_mcontext);
+    const greg_t* gregs = signal_mcontext->gregs;
+
+    unw_set_reg(unw_cursor, UNW_X86_64_RAX, gregs[REG_RAX]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RDX, gregs[REG_RDX]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RCX, gregs[REG_RCX]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RBX, gregs[REG_RBX]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RSI, gregs[REG_RSI]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RDI, gregs[REG_RDI]);
+    unw_set_reg(unw_cursor, UNW_X86_64_RBP, gregs[REG_RBP]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R8,  gregs[REG_R8]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R9,  gregs[REG_R9]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R10, gregs[REG_R10]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R11, gregs[REG_R11]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R12, gregs[REG_R12]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R13, gregs[REG_R13]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R14, gregs[REG_R14]);
+    unw_set_reg(unw_cursor, UNW_X86_64_R15, gregs[REG_R15]);
+
+    // IP is set last: libunwind looks up the unwind info for it.
+    unw_set_reg(unw_cursor, UNW_REG_SP,  gregs[REG_RSP]);
+    unw_set_reg(unw_cursor, UNW_REG_IP,  gregs[REG_RIP]);
+
+    return gregs[REG_RIP];
+#endif
+}
+
+#if __arm__
+static const int libunwind_fp_register = UNW_ARM_R11;
+#elif __aarch64__
+static const int libunwind_fp_register = UNW_ARM64_X29;
+#elif __x86_64__
+static const int libunwind_fp_register = UNW_X86_64_RBP;
+#endif
+
+// libunwind has no unwind info for JIT code: the range steps over
+// the frame, and the cursor continues from the caller.
+static bool StepLibunwindOverJit(unw_cursor_t* unw_cursor, uintptr_t pc) {
+    unw_word_t sp = 0;
+    unw_word_t fp = 0;
+    unw_get_reg(unw_cursor, UNW_REG_SP, &sp);
+    unw_get_reg(unw_cursor, libunwind_fp_register, &fp);
+
+    JitFrameRegisters registers = {pc, sp, fp};
+    if (!JitRanges_Step(&registers))
+        return false;
+
+    unw_set_reg(unw_cursor, libunwind_fp_register, registers.fp);
+    // IP is set last: libunwind looks up the unwind info for it.
+    unw_set_reg(unw_cursor, UNW_REG_SP, registers.sp);
+    unw_set_reg(unw_cursor, UNW_REG_IP, registers.pc);
+    return true;
+}
+
+static void WalkLibunwind(BacktraceState* state) {
+    // Initialize unw_context and unw_cursor.
+    unw_context_t unw_context = {};
+    unw_getcontext(&unw_context);
+    unw_cursor_t  unw_cursor = {};
+    unw_init_local(&unw_cursor, &unw_context);
+
+    // Get more contexts.
+    const ucontext_t* signal_ucontext = state->signal_ucontext;
+    assert(signal_ucontext);
+
+    // Set registers.
+    uintptr_t pc = SetLibunwindRegisters(&unw_cursor, signal_ucontext);
+    unw_word_t sp = 0;
+    unw_get_reg(&unw_cursor, UNW_REG_SP, &sp);
+
+    // unw_step() does not return the first IP,
+    // the address of the instruction which caused the crash.
+    // Thus let's add this address manually.
+    if (!BacktraceState_AddFrame(state, pc, sp))
+        return;
+
+    //printf("unw_is_signal_frame(): %i\n", unw_is_signal_frame(&unw_cursor));
+
+    // Unwind frames one by one, going up the frame stack.
+    unw_word_t ip = pc;
+    for (;;) {
+        if (IsJitFrame(ip)) {
+            if (!StepLibunwindOverJit(&unw_cursor, ip))
+                break;
+        } else if (unw_step(&unw_cursor) <= 0) {
+            break;
+        }
+        unw_get_reg(&unw_cursor, UNW_REG_IP, &ip);
+        unw_get_reg(&unw_cursor, UNW_REG_SP, &sp);
+
+        bool ok = BacktraceState_AddFrame(state, ip, sp);
+        if (!ok)
+            break;
+
+        //printf("unw_is_signal_frame(): %i\n", unw_is_signal_frame(&unw_cursor));
+    }
+}
+
+void LibunwindWithRegisters(BacktraceState* state) {
+    assert(state);
+    uint64_t start_ticks = CaptureBegin(state);
+    WalkLibunwind(state);
+    CaptureEnd(state, start_ticks);
+}
+
+#endif // #if LIBUNWIND_WITH_REGISTERS_METHOD
+
+
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+
+static void ProcessRegisters(
+        struct _Unwind_Context* unwind_context, BacktraceState* state) {
+    assert(unwind_context);
+    assert(state);
+
+    const ucontext_t* signal_ucontext = state->signal_ucontext;
+    assert(signal_ucontext);
+
+    const struct sigcontext* signal_mcontext = &(signal_ucontext->uc_mcontext);
+    assert(signal_mcontext);
+
+    _Unwind_SetGR(unwind_context, REG_R0,  signal_mcontext->arm_r0);
+    _Unwind_SetGR(unwind_context, REG_R1,  signal_mcontext->arm_r1);
+    _Unwind_SetGR(unwind_context, REG_R2,  signal_mcontext->arm_r2);
+    _Unwind_SetGR(unwind_context, REG_R3,  signal_mcontext->arm_r3);
+    _Unwind_SetGR(unwind_context, REG_R4,  signal_mcontext->arm_r4);
+    _Unwind_SetGR(unwind_context, REG_R5,  signal_mcontext->arm_r5);
+    _Unwind_SetGR(unwind_context, REG_R6,  signal_mcontext->arm_r6);
+    _Unwind_SetGR(unwind_context, REG_R7,  signal_mcontext->arm_r7);
+    _Unwind_SetGR(unwind_context, REG_R8,  signal_mcontext->arm_r8);
+    _Unwind_SetGR(unwind_context, REG_R9,  signal_mcontext->arm_r9);
+    _Unwind_SetGR(unwind_context, REG_R10, signal_mcontext->arm_r10);
+    _Unwind_SetGR(unwind_context, REG_R11, signal_mcontext->arm_fp);
+    _Unwind_SetGR(unwind_context, REG_R12, signal_mcontext->arm_ip);
+    _Unwind_SetGR(unwind_context, REG_R13, signal_mcontext->arm_sp);
+    _Unwind_SetGR(unwind_context, REG_R14, signal_mcontext->arm_lr);
+    _Unwind_SetGR(unwind_context, REG_R15, signal_mcontext->arm_pc);
+
+    // Program Counter register aka Instruction Pointer will contain
+    // the address of the instruction where the crash happened.
+    // UnwindBacktraceCallback() will not supply us with it.
+    BacktraceState_AddFrame(
+            state, signal_mcontext->arm_pc, signal_mcontext->arm_sp);
+}
+
+static _Unwind_Reason_Code UnwindBacktraceWithRegistersCallback(
+        struct _Unwind_Context* unwind_context, void* state_voidp) {
+    assert(unwind_context);
+    assert(state_voidp);
+
+    BacktraceState* state = (BacktraceState*)state_voidp;
+    assert(state);
+
+    // On the first UnwindBacktraceCallback() call,
+    // set registers to _Unwind_Context and BacktraceState.
+    if (state->address_count == 0) {
+        ProcessRegisters(unwind_context, state);
+        return state->stopped ? _URC_END_OF_STACK : _URC_NO_REASON;
+    }
+
+    uintptr_t ip = _Unwind_GetIP(unwind_context);
+    uintptr_t sp = _Unwind_GetGR(unwind_context, REG_R13);
+    bool ok = BacktraceState_AddFrame(state, ip, sp);
+    if (!ok)
+        return _URC_END_OF_STACK;
+
+    // Cannot be stepped over from here, see jit_ranges.h.
+    if (IsJitFrame(ip))
+        return _URC_END_OF_STACK;
+
+    return _URC_NO_REASON;
+}
+
+void UnwindBacktraceWithRegisters(BacktraceState* state) {
+    assert(state);
+    uint64_t start_ticks = CaptureBegin(state);
+    _Unwind_Backtrace(UnwindBacktraceWithRegistersCallback, state);
+    CaptureEnd(state, start_ticks);
+}
+
+#endif // #if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+
+
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+
+static _Unwind_Reason_Code UnwindBacktraceWithSkippingCallback(
+        struct _Unwind_Context* unwind_context, void* state_voidp) {
+    assert(unwind_context);
+    assert(state_voidp);
+
+    BacktraceState* state = (BacktraceState*)state_voidp;
+    assert(state);
+
+    uintptr_t ip = _Unwind_GetIP(unwind_context);
+
+    // Skip some initial addresses, because they belong
+    // to the signal handler frame.
+    if (state->address_skip_count > 0) {
+        state->address_skip_count--;
+        state->step_count++;
+        if (state->signal_ucontext
+                && atomic_load_explicit(&backtrace_skip_calibrated, memory_order_acquire)) {
+            // Up to and including the trampoline. Not found within
+            // backtrace_skip_search_max frames, the walk has not
+            // reached the interrupted stack.
+            const BacktraceAddressRange* trampoline =
+                    &backtrace_skip_calibration.trampoline;
+            if (ip >= trampoline->start && ip < trampoline->end)
+                state->address_skip_count = 0;
+            else if (state->address_skip_count == 0)
+                return _URC_END_OF_STACK;
+        }
+        return _URC_NO_REASON;
+    }
+
+    bool ok = BacktraceState_AddAddress(state, ip);
+    if (!ok)
+        return _URC_END_OF_STACK;
+
+    if (IsJitFrame(ip))
+        return _URC_END_OF_STACK;
+
+    return _URC_NO_REASON;
+}
+
+void UnwindBacktraceWithSkipping(BacktraceState* state) {
+    assert(state);
+    uint64_t start_ticks = CaptureBegin(state);
+    _Unwind_Backtrace(UnwindBacktraceWithSkippingCallback, state);
+    CaptureEnd(state, start_ticks);
+}
+
+// Walks its own frames without skipping any. The interrupted PC
+// (in raise()) comes right after the trampoline the handler returns to.
+static void CalibrationHandler(int sig, siginfo_t* info, void* ucontext) {
+    uintptr_t addresses[backtrace_calibration_depth] = {};
+    BacktraceState state;
+    BacktraceState_Init(&state, NULL, addresses, backtrace_calibration_depth);
+    state.address_skip_count = 0;
+    // Not counted as a capture, nor its frames.
+    state.uncounted = true;
+    _Unwind_Backtrace(UnwindBacktraceWithSkippingCallback, &state);
+
+    uintptr_t pc = Backtrace_GetSignalPc((const ucontext_t*)ucontext);
+
+    for (size_t i = 1; i < state.address_count; ++i) {
+        if (addresses[i] != pc)
+            continue;
+        // The trampoline address is the handler's return address,
+        // it is reported as it is, not as a call site.
+        backtrace_skip_calibration.handler_frame_count = i - 1;
+        backtrace_skip_calibration.trampoline.start = addresses[i - 1];
+        backtrace_skip_calibration.trampoline.end = addresses[i - 1] + 1;
+        atomic_store_explicit(&backtrace_skip_calibrated, true, memory_order_release);
+        break;
+    }
+}
+
+bool UnwindBacktraceWithSkipping_Calibrate() {
+    if (atomic_load(&backtrace_skip_calibrated))
+        return true;
+
+    struct sigaction action = {};
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = CalibrationHandler;
+    action.sa_flags = SA_SIGINFO;
+
+    struct sigaction previous_action = {};
+    if (sigaction(backtrace_calibration_signal, &action, &previous_action) != 0)
+        return false;
+
+    // raise() delivers the signal before it returns, unless it is blocked.
+    sigset_t unblocked;
+    sigset_t previous_mask;
+    sigemptyset(&unblocked);
+    sigaddset(&unblocked, backtrace_calibration_signal);
+    pthread_sigmask(SIG_UNBLOCK, &unblocked, &previous_mask);
+    raise(backtrace_calibration_signal);
+    pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+    sigaction(backtrace_calibration_signal, &previous_action, NULL);
+    return atomic_load(&backtrace_skip_calibrated);
+}
+
+bool UnwindBacktraceWithSkipping_GetCalibration(
+        BacktraceSkipCalibration* calibration) {
+    assert(calibration);
+    if (!atomic_load(&backtrace_skip_calibrated))
+        return false;
+    *calibration = backtrace_skip_calibration;
+    return true;
+}
+
+#endif // #if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+
+
+#if FRAME_POINTER_METHOD
+// FramePointerWithRegisters() does its own validation,
+// BacktraceState_Validate() is stricter.
+static void FramePointerStep(BacktraceState* state) {
+    FramePointerWithRegisters(state);
+}
+#endif
+
+struct BacktraceCascadeStep {
+    BacktraceMethod method;
+    void            (*capture)(BacktraceState* state);
+};
+typedef struct BacktraceCascadeStep BacktraceCascadeStep;
+
+// Cheapest first.
+static const BacktraceCascadeStep backtrace_cascade[] = {
+#if FRAME_POINTER_METHOD
+    {BACKTRACE_METHOD_FRAME_POINTER, FramePointerStep},
+#endif
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+    {BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_REGISTERS, UnwindBacktraceWithRegisters},
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+    {BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS, LibunwindWithRegisters},
+#endif
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+    {BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_SKIPPING, UnwindBacktraceWithSkipping},
+#endif
+};
+enum {
+    backtrace_cascade_length =
+            sizeof(backtrace_cascade) / sizeof(backtrace_cascade[0])
+};
+
+BacktraceMethod BacktraceWithFallback(BacktraceState* state) {
+    assert(state);
+
+    size_t best_step = 0;
+    size_t best_count = 0;
+    for (size_t i = 0; i < backtrace_cascade_length; ++i) {
+        BacktraceState_Reset(state);
+        backtrace_cascade[i].capture(state);
+        if (BacktraceState_Validate(state))
+            return backtrace_cascade[i].method;
+
+        if (state->address_count > best_count) {
+            best_count = state->address_count;
+            best_step = i;
+        }
+    }
+
+    // Nothing looked right. Redo the longest one, unless it is in
+    // the storage already.
+    if (best_step != backtrace_cascade_length - 1) {
+        BacktraceState_Reset(state);
+        backtrace_cascade[best_step].capture(state);
+    }
+    return backtrace_cascade[best_step].method;
+}
+
+
+#if ENABLE_DEMANGLING
+// Symbols are printed from one thread at a time.
+static DemangleCache print_demangle_cache;
+#endif
+
+void PrintFrame(
+        size_t frame_index,
+        unsigned long relative_address,
+        const char* symbol_name) {
+    assert(symbol_name);
+
+#if ENABLE_DEMANGLING
+    symbol_name = DemangleCache_Demangle(&print_demangle_cache, symbol_name);
+#endif
+
+    assert(symbol_name);
+    uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+    int size = printf("  #%02zu:  0x%lx  %s\n", frame_index, relative_address, symbol_name);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_TIME,
+            CAPTURE_COUNTERS_TICKS() - start_ticks);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_COUNT, 1);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_BYTE_COUNT, size > 0 ? (uint64_t)size : 0);
+}
+
+void PrintBacktrace(BacktraceState* state) {
+    assert(state);
+    PrintAddresses(state->addresses, state->address_count);
+}
+
+void PrintAddresses(const uintptr_t* addresses, size_t address_count) {
+    assert(addresses || address_count == 0);
+
+    bool refreshed = false;
+
+    size_t frame_count = address_count;
+    for (size_t frame_index = 0; frame_index < frame_count; ++frame_index) {
+
+        uintptr_t address = addresses[frame_index];
+        assert(address);
+
+        // Libraries may have been dlopen'ed since the last refresh.
+        const Module* module = ModuleMap_FindModule(address);
+        if (!module && !refreshed) {
+            ModuleMap_Refresh();
+            refreshed = true;
+            module = ModuleMap_FindModule(address);
+        }
+
+        const char* symbol_name = NULL;
+        unsigned long relative_address = address;
+        JitRange range;
+
+        if (module) {
+            // Relative address matches the address which "nm" and "objdump"
+            // utilities give you, if you compiled position-independent code
+            // (-fPIC, -pie).
+            // Android requires position-independent code since Android 5.0.
+            relative_address = address - module->base;
+            symbol_name = Module_FindSymbol(module, address);
+        } else if (JitRanges_Find(address, &range)) {
+            relative_address = address - range.start;
+            symbol_name = range.name;
+        } else {
+            // Not a module known to dl_iterate_phdr(), let dladdr() try.
+            Dl_info info = {};
+            uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+            int found = dladdr((void*)address, &info);
+            CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DLADDR_TIME,
+                    CAPTURE_COUNTERS_TICKS() - start_ticks);
+            CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DLADDR_COUNT, 1);
+            if (found) {
+                relative_address = (char*)address - (char*)info.dli_fbase;
+                symbol_name = info.dli_sname;
+            }
+        }
+
+        PrintFrame(frame_index, relative_address, symbol_name ? symbol_name : "");
+    }
+}
@@ -0,0 +1,286 @@
+#ifndef BACKTRACE_H
+#define BACKTRACE_H
+
+// 4 methods of backtracing are supported:
+// - FRAME_POINTER_METHOD
+// - LIBUNWIND_WITH_REGISTERS_METHOD
+// - UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+// - UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+// LIBUNWIND_WITH_REGISTERS_METHOD works more reliably on 32-bit ARM,
+// but it is more difficult to build.
+
+// FRAME_POINTER_METHOD can be used on any platform, but only gives
+// a full backtrace for code compiled with -fno-omit-frame-pointer.
+// It does not look up any unwind tables, so it is much cheaper per frame
+// than the other methods. The walk is bounds-checked against the stack
+// of the thread, registered with FramePointer_RegisterThread().
+// Its result is validated, so that the other methods can be tried
+// when the frame chain does not look right.
+#define FRAME_POINTER_METHOD 1
+
+// LIBUNWIND_WITH_REGISTERS_METHOD can be used on 32-bit ARM,
+// 64-bit ARM and x86_64, wherever "libunwind.a" is available.
+// Android NDK r16b contains "libunwind.a"
+// for "armeabi" and "armeabi-v7a" ABIs only,
+// newer NDKs contain it for all ABIs.
+// Android.mk defines LIBUNWIND_AVAILABLE, if it finds the library.
+// We can use this library, but we need matching headers,
+// namely "libunwind.h" and "__libunwind_config.h".
+// For NDK r16b, the headers can be fetched here:
+// https://android.googlesource.com/platform/external/libunwind_llvm/+/ndk-r16/include/
+#if LIBUNWIND_AVAILABLE && (__arm__ || __aarch64__ || __x86_64__)
+#define LIBUNWIND_WITH_REGISTERS_METHOD 1
+#endif
+
+// UNWIND_BACKTRACE_WITH_REGISTERS_METHOD can only be used on 32-bit ARM.
+#if __arm__
+#define UNWIND_BACKTRACE_WITH_REGISTERS_METHOD 1
+#endif
+
+// UNWIND_BACKTRACE_WITH_SKIPPING_METHOD be used on any platform.
+// It usually does not work on devices with 32-bit ARM CPUs.
+// Usually works on devices with 64-bit ARM CPUs in 32-bit mode though.
+#define UNWIND_BACKTRACE_WITH_SKIPPING_METHOD 1
+
+#define ENABLE_DEMANGLING 1
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+// Identifies the method a backtrace was captured with,
+// so that it can be recorded together with the raw addresses.
+enum BacktraceMethod {
+    BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS         = 1,
+    BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_REGISTERS  = 2,
+    BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_SKIPPING   = 3,
+    BACKTRACE_METHOD_FRAME_POINTER                    = 4,
+};
+typedef enum BacktraceMethod BacktraceMethod;
+
+const char* BacktraceMethod_Name(BacktraceMethod method);
+
+
+// The depth of a backtrace is chosen when BacktraceState is initialized,
+// within these limits.
+static const size_t backtrace_depth_min = 8;
+static const size_t backtrace_depth_max = 512;
+static const size_t backtrace_depth_default = 30;
+
+struct BacktraceState;
+
+// Called by every method for each address it stores, right after storing.
+// Returning false stops the walk there, the address is kept.
+// Lets the callers which only look at a few frames (the top N,
+// or up to a frame of interest) pay only for those frames.
+// Runs in the same context as the method, usually a signal handler.
+typedef bool (*BacktracePredicate)(
+        const struct BacktraceState* state, uintptr_t address, void* context);
+
+struct BacktraceState {
+    // These fields are touched for every frame.
+    // The struct is aligned, so that they share one cache line.
+
+    // Caller-owned storage, see BacktraceState_Init().
+    uintptr_t*          addresses;
+    size_t              address_count;
+    size_t              address_capacity;
+
+    // Optional, see BacktraceState_SetPredicate().
+    BacktracePredicate  predicate;
+    void*               predicate_context;
+    // Set when the predicate has stopped the walk.
+    bool                stopped;
+    // Set for walks which are not captures, such as the calibration
+    // of UnwindBacktraceWithSkipping(): their drops are not counted.
+    bool                uncounted;
+
+    // Checked by BacktraceState_Validate(): stack pointers of the frames
+    // must not go down while walking up the stack.
+    bool                stack_pointer_decreased;
+    uintptr_t           last_stack_pointer;
+
+    // On non-ARM32 architectures signal handler stack
+    // seems to be "connected" to the before-crash stack,
+    // so we only need to skip several initial addresses.
+    // Once UnwindBacktraceWithSkipping_Calibrate() has found the signal
+    // trampoline, the frames up to it, searching as many as this.
+    size_t              address_skip_count;
+
+    // On ARM32 architecture this context is needed
+    // for getting backtrace of the before-crash stack,
+    // not of the signal handler stack.
+    const ucontext_t*   signal_ucontext;
+
+    // Frames visited by the last method, stored, dropped or skipped,
+    // added to the capture counters once it is done.
+    size_t              step_count;
+
+} __attribute__((aligned(64)));
+typedef struct BacktraceState BacktraceState;
+
+
+// The addresses are stored into the caller-owned "addresses" array,
+// "address_capacity" is the depth of the backtrace and must be within
+// [backtrace_depth_min, backtrace_depth_max].
+// Does not allocate, so it can be used from a signal handler
+// with a preallocated array.
+// "ucontext" may be NULL outside of a signal handler, for
+// UnwindBacktraceWithSkipping() only, with "address_skip_count" set
+// to the frames of the caller to skip.
+void BacktraceState_Init(
+        BacktraceState* state, const ucontext_t* ucontext,
+        uintptr_t* addresses, size_t address_capacity);
+bool BacktraceState_AddAddress(BacktraceState* state, uintptr_t ip);
+// Same, with the stack pointer (or CFA, or frame pointer) of the frame,
+// for BacktraceState_Validate(). 0 means unknown.
+bool BacktraceState_AddFrame(BacktraceState* state, uintptr_t ip, uintptr_t sp);
+
+// Forgets the captured frames, for another method to start over
+// in the same storage. Keeps the predicate.
+void BacktraceState_Reset(BacktraceState* state);
+
+// Heuristic check of a captured backtrace:
+// - it starts at the interrupted PC,
+// - all the addresses but the outermost are inside known modules
+//   (see ModuleMap),
+// - stack pointers are monotonic,
+// - it is not truncated early: at least a few frames, unless
+//   the storage is full or the predicate stopped the walk.
+// Async-signal-safe.
+bool BacktraceState_Validate(const BacktraceState* state);
+
+// The interrupted PC, as the methods store it (without the Thumb bit).
+// Async-signal-safe.
+uintptr_t Backtrace_GetSignalPc(const ucontext_t* signal_ucontext);
+// The PC and the stack pointer as the registers hold them,
+// with the Thumb bit. Async-signal-safe.
+void Backtrace_GetSignalRegisters(
+        const ucontext_t* signal_ucontext, uintptr_t* pc, uintptr_t* sp);
+
+// Call after BacktraceState_Init(), which clears the predicate.
+void BacktraceState_SetPredicate(
+        BacktraceState* state, BacktracePredicate predicate, void* context);
+
+// Stops after the number of frames "frame_limit_voidp" points to (size_t).
+// Unlike a small "address_capacity", any limit down to 1 frame works.
+bool BacktracePredicate_FrameLimit(
+        const BacktraceState* state, uintptr_t address, void* frame_limit_voidp);
+
+// What a frame's address points into. Frames of unknown code end
+// the walks, JIT frames are stepped over by jit_ranges.h.
+enum BacktraceFrameKind {
+    BACKTRACE_FRAME_UNKNOWN = 0,
+    // A module known to the ModuleMap.
+    BACKTRACE_FRAME_NATIVE  = 1,
+    // Code generated at run time, see jit_ranges.h.
+    BACKTRACE_FRAME_JIT     = 2,
+};
+typedef enum BacktraceFrameKind BacktraceFrameKind;
+
+// Must be async-signal-safe and cheap: called for every frame.
+typedef BacktraceFrameKind (*BacktraceFrameClassifier)(uintptr_t pc, void* context);
+
+// The default classifier looks the address up in the ModuleMap, then
+// in the registered JIT ranges. Another one may know more, for example
+// that code of a module has no unwind tables and is to be stepped over
+// like JIT code. NULL restores the default.
+// Not async-signal-safe, call before installing the signal handlers.
+void Backtrace_SetFrameClassifier(
+        BacktraceFrameClassifier classifier, void* context);
+
+// Async-signal-safe.
+BacktraceFrameKind Backtrace_ClassifyFrame(uintptr_t pc);
+
+// [start, end) of code to look for, for example a function.
+struct BacktraceAddressRange {
+    uintptr_t   start;
+    uintptr_t   end;
+};
+typedef struct BacktraceAddressRange BacktraceAddressRange;
+
+// Stops at the first address inside the BacktraceAddressRange
+// "range_voidp" points to. It is the last captured one then,
+// "stopped" tells whether it was found.
+bool BacktracePredicate_StopInRange(
+        const BacktraceState* state, uintptr_t address, void* range_voidp);
+
+#if FRAME_POINTER_METHOD
+// Remembers the stack range of the calling thread, the frame pointer walk
+// never reads outside of it. Not async-signal-safe.
+bool FramePointer_RegisterThread();
+
+// The stack range registered by the calling thread, [low, high).
+// Returns false, if it has not registered. Async-signal-safe.
+bool FramePointer_GetThreadStack(uintptr_t* low, uintptr_t* high);
+
+// Returns false, if the thread is not registered or the frame chain
+// does not look valid: too few frames, or return addresses outside
+// of the known modules (see ModuleMap). Frames cut off by the predicate
+// are not "too few". Async-signal-safe.
+bool FramePointerWithRegisters(BacktraceState* state);
+#endif
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+void LibunwindWithRegisters(BacktraceState* state);
+#endif
+
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+void UnwindBacktraceWithRegisters(BacktraceState* state);
+#endif
+
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+void UnwindBacktraceWithSkipping(BacktraceState* state);
+
+struct BacktraceSkipCalibration {
+    // Frames above the trampoline in the calibration handler,
+    // UnwindBacktraceWithSkipping() included.
+    size_t                  handler_frame_count;
+    // The signal return trampoline (sa_restorer or the vDSO one),
+    // which all the handlers return to.
+    BacktraceAddressRange   trampoline;
+};
+typedef struct BacktraceSkipCalibration BacktraceSkipCalibration;
+
+// How many frames the handler has depends on the compiler,
+// the optimization level and the libc, so instead of skipping
+// "address_skip_count" frames in a signal handler,
+// UnwindBacktraceWithSkipping() can skip the frames up to the signal
+// return trampoline, compared by address. The trampoline is found once,
+// here: a signal is raised and its handler looks for the frame right
+// before the interrupted PC. Returns false, if it was not found
+// (on 32-bit ARM the walk does not usually leave the handler stack),
+// then the count is used.
+// Call before installing the signal handlers. Not async-signal-safe.
+bool UnwindBacktraceWithSkipping_Calibrate();
+
+// Returns false, if not calibrated.
+bool UnwindBacktraceWithSkipping_GetCalibration(
+        BacktraceSkipCalibration* calibration);
+#endif
+
+// Runs the enabled methods one at a time, cheapest first:
+// FRAME_POINTER_METHOD, UNWIND_BACKTRACE_WITH_REGISTERS_METHOD,
+// LIBUNWIND_WITH_REGISTERS_METHOD, UNWIND_BACKTRACE_WITH_SKIPPING_METHOD.
+// Escalates to the next one only if BacktraceState_Validate() fails,
+// so a single unwind is done in the common case. If none passes,
+// the longest backtrace is kept. Returns the method of the result.
+// Async-signal-safe, as the methods are.
+BacktraceMethod BacktraceWithFallback(BacktraceState* state);
+
+// Prints one symbolized frame. Demangles the symbol name through
+// a DemangleCache, if ENABLE_DEMANGLING is set.
+// Not thread-safe, not async-signal-safe.
+void PrintFrame(
+        size_t frame_index,
+        unsigned long relative_address,
+        const char* symbol_name);
+
+// Symbolizes the frames with the module index and prints them.
+// Not async-signal-safe, must not be called from a signal handler.
+void PrintBacktrace(BacktraceState* state);
+void PrintAddresses(const uintptr_t* addresses, size_t address_count);
+
+#endif // BACKTRACE_H
@@ -0,0 +1,43 @@
+#ifndef BACKTRACE_CAPTURE_H
+#define BACKTRACE_CAPTURE_H
+
+// Public API of libbacktrace_capture, everything but the demo
+// executables: capture (backtrace.h), symbolization (module_map.h,
+// symbolizer_pool.h), serialization (crash_dump.h, trace_file.h),
+// crash handling and profiling.
+//
+// Two flavours are built by Android.mk:
+// - libbacktrace_capture.a, to link the capture path into the hot paths
+//   of a service, with LTO and inlining across it (make build LTO=1),
+// - libbacktrace_capture.so, which exports only the functions declared
+//   in these headers, see backtrace_capture.map. The libunwind and
+//   libc++abi linked into it are not exported and do not clash with
+//   the application's.
+//
+// The unwind index cache (unwind_cache.h) only speeds up the unwinders
+// linked into the same module: the executable with the static library,
+// the shared library itself otherwise.
+
+#include "alt_stack_pool.h"
+#include "backtrace.h"
+#include "backtrace_pool.h"
+#include "capture_counters.h"
+#include "crash_dump.h"
+#include "crash_signature.h"
+#include "crash_snapshot.h"
+#include "demangle_cache.h"
+#include "fatal_signal.h"
+#include "heap_profiler.h"
+#include "jit_ranges.h"
+#include "module_map.h"
+#include "sampling_profiler.h"
+#include "stack_ring.h"
+#include "stack_table.h"
+#include "stack_trie.h"
+#include "symbolizer_pool.h"
+#include "thread_dump.h"
+#include "thread_snapshot.h"
+#include "trace_file.h"
+#include "unwind_cache.h"
+
+#endif // BACKTRACE_CAPTURE_H
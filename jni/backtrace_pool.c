@@ -0,0 +1,75 @@
+#include "backtrace_pool.h"
+
+#include <assert.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+// Set by BacktracePool_RegisterThread(), before any signal handler
+// reads it, so the (possibly emulated) TLS slot is already allocated
+// when the handler accesses it.
+static __thread BacktracePool* this_thread_pool;
+static __thread BacktracePool this_thread_pool_storage;
+
+
+bool BacktracePool_Init(BacktracePool* pool, size_t depth, size_t slot_count) {
+    assert(pool);
+    assert(depth >= backtrace_depth_min);
+    assert(depth <= backtrace_depth_max);
+    assert(slot_count > 0);
+    memset(pool, 0, sizeof(BacktracePool));
+
+    size_t size = depth * slot_count * sizeof(uintptr_t);
+    void* addresses = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addresses == MAP_FAILED)
+        return false;
+
+    pool->depth = depth;
+    pool->slot_count = slot_count;
+    pool->addresses = (uintptr_t*)addresses;
+    pool->mapping_size = size;
+    return true;
+}
+
+void BacktracePool_Destroy(BacktracePool* pool) {
+    assert(pool);
+    if (pool->addresses)
+        munmap(pool->addresses, pool->mapping_size);
+    memset(pool, 0, sizeof(BacktracePool));
+}
+
+uintptr_t* BacktracePool_Slot(const BacktracePool* pool, size_t slot_index) {
+    assert(pool);
+    assert(slot_index < pool->slot_count);
+    return pool->addresses + slot_index * pool->depth;
+}
+
+void BacktracePool_InitState(
+        const BacktracePool* pool, size_t slot_index,
+        BacktraceState* state, const ucontext_t* ucontext) {
+    assert(pool);
+    BacktraceState_Init(state, ucontext,
+            BacktracePool_Slot(pool, slot_index), pool->depth);
+}
+
+bool BacktracePool_RegisterThread(size_t depth, size_t slot_count) {
+    if (this_thread_pool)
+        return true;
+
+    if (!BacktracePool_Init(&this_thread_pool_storage, depth, slot_count))
+        return false;
+    this_thread_pool = &this_thread_pool_storage;
+    return true;
+}
+
+void BacktracePool_UnregisterThread() {
+    if (!this_thread_pool)
+        return;
+    this_thread_pool = NULL;
+    BacktracePool_Destroy(&this_thread_pool_storage);
+}
+
+BacktracePool* BacktracePool_ForThisThread() {
+    return this_thread_pool;
+}
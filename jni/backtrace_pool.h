@@ -0,0 +1,52 @@
+#ifndef BACKTRACE_POOL_H
+#define BACKTRACE_POOL_H
+
+// Preallocated per-thread storage for captured backtraces.
+//
+// The sampling path captures many backtraces per second on every thread,
+// so the frame storage is mmap'ed once, when the thread is registered,
+// and then handed out slot by slot without allocating or locking.
+// The depth of the slots is chosen at registration time.
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct BacktracePool {
+    size_t      depth;
+    size_t      slot_count;
+
+    // slot_count * depth addresses.
+    uintptr_t*  addresses;
+    size_t      mapping_size;
+};
+typedef struct BacktracePool BacktracePool;
+
+
+// Not async-signal-safe.
+bool BacktracePool_Init(BacktracePool* pool, size_t depth, size_t slot_count);
+void BacktracePool_Destroy(BacktracePool* pool);
+
+// Async-signal-safe.
+uintptr_t* BacktracePool_Slot(const BacktracePool* pool, size_t slot_index);
+
+// Initializes "state" to store addresses into the given slot.
+// Async-signal-safe.
+void BacktracePool_InitState(
+        const BacktracePool* pool, size_t slot_index,
+        BacktraceState* state, const ucontext_t* ucontext);
+
+// Creates the pool of the calling thread.
+// Must be called by the thread itself, before any signal that
+// uses the pool can be delivered to it. Not async-signal-safe.
+bool BacktracePool_RegisterThread(size_t depth, size_t slot_count);
+void BacktracePool_UnregisterThread();
+
+// Returns the pool of the calling thread, or NULL if the thread
+// is not registered. Async-signal-safe once the thread is registered.
+BacktracePool* BacktracePool_ForThisThread();
+
+#endif // BACKTRACE_POOL_H
@@ -0,0 +1,434 @@
+#ifndef BACKTRACE_UNWINDER_HPP
+#define BACKTRACE_UNWINDER_HPP
+
+// Optional C++ front end of the capture path, header-only.
+//
+// The C methods of backtrace.h are generic: the depth is chosen at run
+// time, every frame goes through BacktraceState_AddFrame() with its
+// predicate and asserts, and _Unwind_Backtrace() calls back through
+// a void* state. Here the storage, the depth and the filtering of
+// the frames (backtrace::DefaultFilter) are template parameters,
+// so each unwinder loop is compiled for them, with Add() inlined into
+// it and the filters that are off compiled out.
+//
+// The registers of the interrupted code are loaded in bulk: libunwind's
+// context is filled with a copy of the signal context, instead of through
+// unw_getcontext() and a unw_set_reg() per register, and on 32-bit ARM
+// the _Unwind_Context is seeded in a loop over the sigcontext array.
+//
+// The C path stays the reference: the crash handler, the profilers
+// and the capture counters (capture_counters.h) use it, not this.
+// Everything here is async-signal-safe. Needs C++11, no STL, no
+// exceptions or RTTI.
+
+extern "C" {
+#include "backtrace.h"
+#include "module_map.h"
+}
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+#include "libunwind.h"
+#endif
+
+#define HIDE_EXPORTS 1
+#include <unwind.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+namespace backtrace {
+
+// What Add() keeps, see BacktraceState_AddFrame().
+struct DefaultFilter {
+#if __thumb__
+    static const bool strip_thumb_bit = true;
+#else
+    static const bool strip_thumb_bit = false;
+#endif
+    static const bool drop_null = true;
+    static const bool drop_duplicates = true;
+};
+
+// Every address as the unwinder reported it.
+struct RawFilter {
+    static const bool strip_thumb_bit = false;
+    static const bool drop_null = false;
+    static const bool drop_duplicates = false;
+};
+
+// Fewer frames than this mean that the walk broke
+// right at the beginning, as in backtrace.c.
+static const size_t frame_count_min = 3;
+
+// Frames of the signal handler skipped without calibration,
+// and at most looked at for the trampoline with it.
+static const size_t skip_count = 3;
+static const size_t skip_search_max = 32;
+
+
+template <size_t Depth, typename Filter = DefaultFilter>
+class Backtrace {
+public:
+    static_assert(Depth >= 1, "Depth must be at least 1.");
+    static const size_t depth = Depth;
+
+    Backtrace() : count_(0) {}
+
+    size_t Count() const { return count_; }
+    bool IsFull() const { return count_ == Depth; }
+    const uintptr_t* Addresses() const { return addresses_; }
+    uintptr_t operator[](size_t index) const { return addresses_[index]; }
+    void Clear() { count_ = 0; }
+
+    // Returns false, once full: the address did not fit.
+    __attribute__((always_inline)) bool Add(uintptr_t ip) {
+        if (count_ == Depth)
+            return false;
+        if (Filter::strip_thumb_bit)
+            ip &= ~(uintptr_t)1;
+        if (count_ > 0) {
+            if (Filter::drop_null && ip == 0)
+                return true;
+            if (Filter::drop_duplicates && ip == addresses_[count_ - 1])
+                return true;
+        }
+        addresses_[count_++] = ip;
+        return true;
+    }
+
+    // For the C consumers: crash dump, trace file, symbolization.
+    // The addresses which do not fit into "state" are cut off.
+    void CopyTo(BacktraceState* state) const {
+        size_t count = count_ < state->address_capacity
+                ? count_ : state->address_capacity;
+        memcpy(state->addresses, addresses_, count * sizeof(uintptr_t));
+        state->address_count = count;
+    }
+
+private:
+    uintptr_t   addresses_[Depth];
+    size_t      count_;
+};
+
+
+namespace detail {
+
+inline void GetSignalRegisters(
+        const ucontext_t* signal_ucontext,
+        uintptr_t* pc, uintptr_t* sp, uintptr_t* fp) {
+#if __arm__
+    const struct sigcontext* signal_mcontext = &signal_ucontext->uc_mcontext;
+    *pc = signal_mcontext->arm_pc;
+    *sp = signal_mcontext->arm_sp;
+#if __thumb__
+    *fp = signal_mcontext->arm_r7;
+#else
+    *fp = signal_mcontext->arm_fp;
+#endif
+#elif __aarch64__
+    *pc = signal_ucontext->uc_mcontext.pc;
+    *sp = signal_ucontext->uc_mcontext.sp;
+    *fp = signal_ucontext->uc_mcontext.regs[29];
+#elif __x86_64__
+    *pc = signal_ucontext->uc_mcontext.gregs[REG_RIP];
+    *sp = signal_ucontext->uc_mcontext.gregs[REG_RSP];
+    *fp = signal_ucontext->uc_mcontext.gregs[REG_RBP];
+#elif __i386__
+    *pc = signal_ucontext->uc_mcontext.gregs[REG_EIP];
+    *sp = signal_ucontext->uc_mcontext.gregs[REG_ESP];
+    *fp = signal_ucontext->uc_mcontext.gregs[REG_EBP];
+#else
+#error "Unsupported architecture."
+#endif
+}
+
+template <size_t Depth, typename Filter>
+struct UnwindWalk {
+    Backtrace<Depth, Filter>*   backtrace;
+    const ucontext_t*           signal_ucontext;
+    size_t                      skip_count;
+    bool                        skip_to_trampoline;
+    BacktraceAddressRange       trampoline;
+
+    static _Unwind_Reason_Code Callback(
+            struct _Unwind_Context* unwind_context, void* walk_voidp) {
+        UnwindWalk* walk = static_cast<UnwindWalk*>(walk_voidp);
+
+#if __arm__
+        // The first call: seeds the context with the registers of the
+        // interrupted code, R0-R15 are consecutive in the sigcontext.
+        if (walk->signal_ucontext) {
+            const struct sigcontext* signal_mcontext =
+                    &walk->signal_ucontext->uc_mcontext;
+            const unsigned long* registers = &signal_mcontext->arm_r0;
+            for (int reg = 0; reg < 16; ++reg)
+                _Unwind_SetGR(unwind_context, reg, registers[reg]);
+            walk->signal_ucontext = NULL;
+            return walk->backtrace->Add(signal_mcontext->arm_pc)
+                    ? _URC_NO_REASON : _URC_END_OF_STACK;
+        }
+#endif
+
+        uintptr_t ip = _Unwind_GetIP(unwind_context);
+        if (walk->skip_count > 0) {
+            walk->skip_count--;
+            if (walk->skip_to_trampoline) {
+                if (ip >= walk->trampoline.start && ip < walk->trampoline.end)
+                    walk->skip_count = 0;
+                else if (walk->skip_count == 0)
+                    return _URC_END_OF_STACK;
+            }
+            return _URC_NO_REASON;
+        }
+
+        return walk->backtrace->Add(ip) ? _URC_NO_REASON : _URC_END_OF_STACK;
+    }
+};
+
+#if __arm__
+static_assert(offsetof(struct sigcontext, arm_pc)
+        - offsetof(struct sigcontext, arm_r0) == 15 * sizeof(unsigned long),
+        "R0-R15 must be consecutive in struct sigcontext.");
+#endif
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+// The layout unw_getcontext() stores the general purpose registers in,
+// in the LLVM libunwind of the NDK (UnwindRegistersSave.S):
+// - ARM: R0-R12, SP, LR, PC, the same order as in the sigcontext,
+// - ARM64: X0-X28, FP, LR, SP, PC,
+// - x86_64: RAX, RBX, RCX, RDX, RDI, RSI, RBP, RSP, R8-R15, RIP.
+// The floating point registers are left zero, the walk does not need them.
+inline void LoadLibunwindContext(
+        unw_context_t* unw_context, const ucontext_t* signal_ucontext) {
+    memset(unw_context, 0, sizeof(unw_context_t));
+#if __arm__
+    static_assert(sizeof(unw_context_t) >= 16 * sizeof(uint32_t),
+            "unw_context_t is too small.");
+    memcpy(unw_context, &signal_ucontext->uc_mcontext.arm_r0,
+            16 * sizeof(uint32_t));
+#elif __aarch64__
+    static_assert(sizeof(unw_context_t) >= 33 * sizeof(uint64_t),
+            "unw_context_t is too small.");
+    uint64_t* registers = reinterpret_cast<uint64_t*>(unw_context);
+    memcpy(registers, signal_ucontext->uc_mcontext.regs, 31 * sizeof(uint64_t));
+    registers[31] = signal_ucontext->uc_mcontext.sp;
+    registers[32] = signal_ucontext->uc_mcontext.pc;
+#elif __x86_64__
+    static_assert(sizeof(unw_context_t) >= 17 * sizeof(uint64_t),
+            "unw_context_t is too small.");
+    uint64_t* registers = reinterpret_cast<uint64_t*>(unw_context);
+    const greg_t* gregs = signal_ucontext->uc_mcontext.gregs;
+    static const int order[17] = {
+        REG_RAX, REG_RBX, REG_RCX, REG_RDX, REG_RDI, REG_RSI, REG_RBP, REG_RSP,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15,
+        REG_RIP,
+    };
+    for (int i = 0; i < 17; ++i)
+        registers[i] = (uint64_t)gregs[order[i]];
+#endif
+}
+#endif
+
+} // namespace detail
+
+
+#if FRAME_POINTER_METHOD
+// As FramePointerWithRegisters(): the thread must be registered with
+// FramePointer_RegisterThread(). Returns false, if the frame chain
+// does not look valid.
+template <size_t Depth, typename Filter>
+bool WalkFramePointers(
+        const ucontext_t* signal_ucontext, Backtrace<Depth, Filter>* backtrace) {
+    uintptr_t low = 0;
+    uintptr_t high = 0;
+    if (!FramePointer_GetThreadStack(&low, &high))
+        return false;
+
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    uintptr_t fp = 0;
+    detail::GetSignalRegisters(signal_ucontext, &pc, &sp, &fp);
+    if (!ModuleMap_FindModule(pc) || !backtrace->Add(pc))
+        return false;
+
+    if (sp > low)
+        low = sp;
+    const uintptr_t record_size = 2 * sizeof(uintptr_t);
+    while (fp >= low && fp <= high - record_size && fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t* record = reinterpret_cast<const uintptr_t*>(fp);
+        uintptr_t next_fp = record[0];
+        uintptr_t return_address = record[1];
+
+        if (return_address == 0 || !ModuleMap_FindModule(return_address))
+            break;
+        if (!backtrace->Add(return_address))
+            break;
+        if (next_fp <= fp)
+            break;
+        fp = next_fp;
+    }
+
+    return backtrace->Count() >= frame_count_min || backtrace->IsFull();
+}
+#endif
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+// As LibunwindWithRegisters().
+template <size_t Depth, typename Filter>
+void WalkLibunwind(
+        const ucontext_t* signal_ucontext, Backtrace<Depth, Filter>* backtrace) {
+    unw_context_t unw_context;
+    detail::LoadLibunwindContext(&unw_context, signal_ucontext);
+    unw_cursor_t unw_cursor;
+    if (unw_init_local(&unw_cursor, &unw_context) != UNW_ESUCCESS)
+        return;
+
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    uintptr_t fp = 0;
+    detail::GetSignalRegisters(signal_ucontext, &pc, &sp, &fp);
+    if (!backtrace->Add(pc))
+        return;
+
+    while (unw_step(&unw_cursor) > 0) {
+        unw_word_t ip = 0;
+        unw_get_reg(&unw_cursor, UNW_REG_IP, &ip);
+        if (!backtrace->Add(ip))
+            break;
+    }
+}
+#endif
+
+// As UnwindBacktraceWithRegisters() on 32-bit ARM, and as
+// UnwindBacktraceWithSkipping() elsewhere: the frames up to the signal
+// trampoline are skipped, once UnwindBacktraceWithSkipping_Calibrate()
+// has found it, otherwise a fixed count.
+template <size_t Depth, typename Filter>
+void WalkUnwindBacktrace(
+        const ucontext_t* signal_ucontext, Backtrace<Depth, Filter>* backtrace) {
+    detail::UnwindWalk<Depth, Filter> walk;
+    walk.backtrace = backtrace;
+    walk.signal_ucontext = NULL;
+    walk.skip_count = skip_count;
+    walk.skip_to_trampoline = false;
+    walk.trampoline.start = 0;
+    walk.trampoline.end = 0;
+
+#if __arm__
+    walk.signal_ucontext = signal_ucontext;
+    walk.skip_count = 0;
+#else
+    BacktraceSkipCalibration calibration;
+    if (UnwindBacktraceWithSkipping_GetCalibration(&calibration)) {
+        walk.skip_count = skip_search_max;
+        walk.skip_to_trampoline = true;
+        walk.trampoline = calibration.trampoline;
+    }
+#endif
+
+    _Unwind_Backtrace(detail::UnwindWalk<Depth, Filter>::Callback, &walk);
+}
+
+// As BacktraceState_Validate(), but for the stack pointers,
+// which are not recorded here.
+template <size_t Depth, typename Filter>
+bool Validate(
+        const ucontext_t* signal_ucontext, const Backtrace<Depth, Filter>& backtrace) {
+    size_t count = backtrace.Count();
+    if (count == 0 || (count < frame_count_min && !backtrace.IsFull()))
+        return false;
+
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    uintptr_t fp = 0;
+    detail::GetSignalRegisters(signal_ucontext, &pc, &sp, &fp);
+#if __thumb__
+    pc &= ~(uintptr_t)1;
+#endif
+
+    bool pc_found = false;
+    for (size_t i = 0; i < count && i <= skip_count + 1; ++i) {
+        if (backtrace[i] == pc) {
+            pc_found = true;
+            break;
+        }
+    }
+    if (!pc_found)
+        return false;
+
+    for (size_t i = 1; i + 1 < count; ++i) {
+        if (!ModuleMap_FindModule(backtrace[i]))
+            return false;
+    }
+    return true;
+}
+
+// Cheapest first, as in backtrace.c.
+static const BacktraceMethod cascade[] = {
+#if FRAME_POINTER_METHOD
+    BACKTRACE_METHOD_FRAME_POINTER,
+#endif
+#if __arm__
+    BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_REGISTERS,
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+    BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS,
+#endif
+#if !__arm__
+    BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_SKIPPING,
+#endif
+};
+static const size_t cascade_length = sizeof(cascade) / sizeof(cascade[0]);
+
+// Starts over with one of the methods of the cascade.
+template <size_t Depth, typename Filter>
+void Walk(
+        BacktraceMethod method,
+        const ucontext_t* signal_ucontext, Backtrace<Depth, Filter>* backtrace) {
+    backtrace->Clear();
+    switch (method) {
+#if FRAME_POINTER_METHOD
+    case BACKTRACE_METHOD_FRAME_POINTER:
+        WalkFramePointers(signal_ucontext, backtrace);
+        break;
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+    case BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS:
+        WalkLibunwind(signal_ucontext, backtrace);
+        break;
+#endif
+    default:
+        WalkUnwindBacktrace(signal_ucontext, backtrace);
+        break;
+    }
+}
+
+// As BacktraceWithFallback(): the next method only if the result
+// of the previous one does not validate, the longest result
+// if none does. Returns the method of the result.
+template <size_t Depth, typename Filter>
+BacktraceMethod CaptureWithFallback(
+        const ucontext_t* signal_ucontext, Backtrace<Depth, Filter>* backtrace) {
+    size_t best_step = 0;
+    size_t best_count = 0;
+    for (size_t i = 0; i < cascade_length; ++i) {
+        Walk(cascade[i], signal_ucontext, backtrace);
+        if (Validate(signal_ucontext, *backtrace))
+            return cascade[i];
+
+        if (backtrace->Count() > best_count) {
+            best_count = backtrace->Count();
+            best_step = i;
+        }
+    }
+
+    if (best_step != cascade_length - 1)
+        Walk(cascade[best_step], signal_ucontext, backtrace);
+    return cascade[best_step];
+}
+
+} // namespace backtrace
+
+#endif // BACKTRACE_UNWINDER_HPP
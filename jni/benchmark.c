@@ -0,0 +1,582 @@
+// Benchmark of the backtrace methods.
+//
+// A synthetic call chain of the requested depth raises a signal,
+// and the handler captures the interrupted stack with one of the methods,
+// the same way a crash handler does. Only the capture itself is timed,
+// signal delivery is not. Symbolization of the captured stacks
+// is timed separately, outside of the handler, and so is
+// the symbolization of a batch of stacks by a SymbolizerPool
+// with more and more threads. Last, snapshots of a busy thread
+// (thread_snapshot.h) are timed from the request to the answer.
+// Each method is also run with a frame limit predicate, which stops
+// the walk after the top frames, as crash bucketing needs, and through
+// the C++ front end (backtrace_unwinder.hpp), compiled for the depth
+// and the frame filtering. Frame classification (Backtrace_ClassifyFrame())
+// of the captured stacks is timed without and with JIT ranges.
+// The capture counters (capture_counters.h) of the whole run are
+// printed at the end.
+//
+// Usage: <benchmark> [iterations] [depth]...
+
+#include "backtrace.h"
+#include "capture_counters.h"
+#include "demangle_cache.h"
+#include "jit_ranges.h"
+#include "module_map.h"
+#include "symbolizer_pool.h"
+#include "thread_snapshot.h"
+#include "unwind_cache.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+
+enum { benchmark_depth_count_max = 16 };
+
+static const size_t benchmark_iterations_default = 1000;
+static const size_t benchmark_depths_default[] = {8, 32, 128};
+
+// Frames of the benchmark itself and of the signal delivery
+// on top of the synthetic chain.
+static const size_t benchmark_depth_reserve = 32;
+
+// Frames captured by the limited runs.
+static const size_t benchmark_frame_limit = 4;
+
+// The batch: stacks drawn from a set of unique addresses in libc,
+// which has plenty of symbols. Each is resolved once per batch.
+static const size_t benchmark_batch_stack_count = 4096;
+static const size_t benchmark_batch_depth = 32;
+static const size_t benchmark_batch_unique_count = 16384;
+static const size_t benchmark_batch_repeat_count = 4;
+
+// Depth (times 3) of the busy thread's chain and the snapshot timeout.
+static const size_t benchmark_snapshot_depth = 16;
+static const unsigned int benchmark_snapshot_timeout_us = 100 * 1000;
+
+typedef void (*BenchmarkMethod)(BacktraceState* state);
+
+struct BenchmarkRun {
+    BenchmarkMethod     method;
+    // 0 for the whole stack.
+    size_t              frame_limit;
+    size_t              iteration;
+    uint64_t*           latencies_ns;
+    size_t*             frame_counts;
+};
+typedef struct BenchmarkRun BenchmarkRun;
+
+// Only touched by the handler, which runs on this thread.
+static BenchmarkRun benchmark_run;
+static uintptr_t* benchmark_addresses;
+static size_t benchmark_address_count;
+
+
+static uint64_t NowNs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#if FRAME_POINTER_METHOD
+// FramePointerWithRegisters() returns whether the chain looked valid,
+// the benchmark only counts the frames.
+static void FramePointerMethod(BacktraceState* state) {
+    FramePointerWithRegisters(state);
+}
+#endif
+
+// benchmark_unwinder.cpp: the same walks with the C++ front end
+// (backtrace_unwinder.hpp).
+#if FRAME_POINTER_METHOD
+void BenchmarkUnwinder_FramePointer(BacktraceState* state);
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+void BenchmarkUnwinder_Libunwind(BacktraceState* state);
+#endif
+void BenchmarkUnwinder_UnwindBacktrace(BacktraceState* state);
+
+static void CaptureHandler(int sig, siginfo_t* info, void* ucontext) {
+    BacktraceState state;
+    BacktraceState_Init(&state, (const ucontext_t*)ucontext,
+            benchmark_addresses, backtrace_depth_max);
+    if (benchmark_run.frame_limit > 0) {
+        BacktraceState_SetPredicate(&state, BacktracePredicate_FrameLimit,
+                &benchmark_run.frame_limit);
+    }
+
+    uint64_t start = NowNs();
+    benchmark_run.method(&state);
+    uint64_t end = NowNs();
+
+    benchmark_run.latencies_ns[benchmark_run.iteration] = end - start;
+    benchmark_run.frame_counts[benchmark_run.iteration] = state.address_count;
+    benchmark_address_count = state.address_count;
+}
+
+
+// Extends the Func3() -> Func2() -> Func1() -> Crash() chain of main.c
+// to any depth. Three functions call each other in turn: with plain
+// recursion, every return address would be the same, and consecutive
+// duplicates are dropped by BacktraceState_AddAddress().
+// Not optimized, so that every level keeps its frame.
+#if __clang__
+#define BENCHMARK_NOINLINE __attribute__((optnone, noinline))
+#elif __GNUC__
+#define BENCHMARK_NOINLINE __attribute__((optimize("O0"), noinline))
+#endif
+
+void ChainFunc1(size_t depth) BENCHMARK_NOINLINE;
+void ChainFunc2(size_t depth) BENCHMARK_NOINLINE;
+void ChainFunc3(size_t depth) BENCHMARK_NOINLINE;
+
+void ChainFunc1(size_t depth) {
+    if (depth == 0)
+        raise(SIGUSR2);
+    else
+        ChainFunc2(depth - 1);
+}
+
+void ChainFunc2(size_t depth) {
+    if (depth == 0)
+        raise(SIGUSR2);
+    else
+        ChainFunc3(depth - 1);
+}
+
+void ChainFunc3(size_t depth) {
+    if (depth == 0)
+        raise(SIGUSR2);
+    else
+        ChainFunc1(depth - 1);
+}
+
+
+static int CompareLatencies(const void* a_voidp, const void* b_voidp) {
+    uint64_t a = *(const uint64_t*)a_voidp;
+    uint64_t b = *(const uint64_t*)b_voidp;
+    return (a > b) - (a < b);
+}
+
+static void RunMethod(
+        const char* name, BenchmarkMethod method_function,
+        size_t depth, size_t frame_limit, size_t iterations) {
+    benchmark_run.method = method_function;
+    benchmark_run.frame_limit = frame_limit;
+    for (size_t i = 0; i < iterations; ++i) {
+        benchmark_run.iteration = i;
+        ChainFunc1(depth);
+    }
+
+    size_t min_frames = SIZE_MAX;
+    size_t max_frames = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        size_t frames = benchmark_run.frame_counts[i];
+        if (frames < min_frames)
+            min_frames = frames;
+        if (frames > max_frames)
+            max_frames = frames;
+    }
+
+    qsort(benchmark_run.latencies_ns, iterations, sizeof(uint64_t),
+            CompareLatencies);
+    uint64_t p50 = benchmark_run.latencies_ns[iterations / 2];
+    uint64_t p99 = benchmark_run.latencies_ns[iterations * 99 / 100];
+
+    char limit[24] = "-";
+    if (frame_limit > 0)
+        snprintf(limit, sizeof(limit), "%zu", frame_limit);
+
+    printf("%-46s %6zu %6s %5zu-%-5zu %9llu %9llu %9.1f\n",
+            name, depth, limit, min_frames, max_frames,
+            (unsigned long long)p50, (unsigned long long)p99,
+            max_frames ? (double)p50 / (double)max_frames : 0.0);
+}
+
+// Symbolizes the last captured stack, with the module index
+// and with dladdr() for comparison.
+static void RunSymbolization(size_t iterations) {
+    if (benchmark_address_count == 0)
+        return;
+
+    DemangleCache demangle_cache;
+    DemangleCache_Init(&demangle_cache);
+
+    size_t resolved_count = 0;
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < iterations; ++i) {
+        for (size_t j = 0; j < benchmark_address_count; ++j) {
+            const Module* module = ModuleMap_FindModule(benchmark_addresses[j]);
+            const char* name = module
+                    ? Module_FindSymbol(module, benchmark_addresses[j]) : NULL;
+            if (name && DemangleCache_Demangle(&demangle_cache, name))
+                ++resolved_count;
+        }
+    }
+    uint64_t module_map_ns = NowNs() - start;
+
+    start = NowNs();
+    for (size_t i = 0; i < iterations; ++i) {
+        for (size_t j = 0; j < benchmark_address_count; ++j) {
+            Dl_info info = {};
+            dladdr((const void*)benchmark_addresses[j], &info);
+        }
+    }
+    uint64_t dladdr_ns = NowNs() - start;
+
+    double frame_count = (double)(iterations * benchmark_address_count);
+    printf("  symbolization of %zu frames: module map %.1f ns/frame"
+            " (%zu resolved), dladdr %.1f ns/frame\n",
+            benchmark_address_count,
+            (double)module_map_ns / frame_count, resolved_count / iterations,
+            (double)dladdr_ns / frame_count);
+
+    DemangleCache_Destroy(&demangle_cache);
+}
+
+static uint64_t ClassifyFrames(size_t iterations) {
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < iterations; ++i) {
+        for (size_t j = 0; j < benchmark_address_count; ++j)
+            (void)Backtrace_ClassifyFrame(benchmark_addresses[j]);
+    }
+    return NowNs() - start;
+}
+
+// Classifies the last captured stack, then again with jit_range_capacity
+// ranges registered in reserved address space, which none of the frames
+// is in: the registry lookup of every frame outside of the modules.
+static void RunFrameClassification(size_t iterations) {
+    if (benchmark_address_count == 0)
+        return;
+
+    uint64_t without_ranges_ns = ClassifyFrames(iterations);
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t reserved_size = jit_range_capacity * page_size;
+    void* reserved = mmap(NULL, reserved_size, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED)
+        return;
+
+    static uint32_t ids[jit_range_capacity];
+    size_t range_count = 0;
+    for (size_t i = 0; i < jit_range_capacity; ++i) {
+        uintptr_t start = (uintptr_t)reserved + i * page_size;
+        ids[range_count] = JitRanges_Register(start, start + page_size, "benchmark", NULL, NULL);
+        if (ids[range_count] != 0)
+            ++range_count;
+    }
+
+    uint64_t with_ranges_ns = ClassifyFrames(iterations);
+
+    for (size_t i = 0; i < range_count; ++i)
+        JitRanges_Unregister(ids[i]);
+    munmap(reserved, reserved_size);
+
+    double frame_count = (double)(iterations * benchmark_address_count);
+    printf("  classification of %zu frames: %.1f ns/frame, %.1f ns/frame"
+            " with %zu JIT ranges\n",
+            benchmark_address_count, (double)without_ranges_ns / frame_count,
+            (double)with_ranges_ns / frame_count, range_count);
+}
+
+static _Atomic bool benchmark_spinning;
+static _Atomic pid_t benchmark_spinning_tid;
+
+// Same as ChainFunc1() and co., spinning at the end of the chain.
+void SpinFunc1(size_t depth) BENCHMARK_NOINLINE;
+void SpinFunc2(size_t depth) BENCHMARK_NOINLINE;
+void SpinFunc3(size_t depth) BENCHMARK_NOINLINE;
+
+void SpinFunc1(size_t depth) {
+    if (depth == 0) {
+        while (atomic_load_explicit(&benchmark_spinning, memory_order_relaxed)) {
+        }
+    } else {
+        SpinFunc2(depth - 1);
+    }
+}
+
+void SpinFunc2(size_t depth) {
+    SpinFunc3(depth);
+}
+
+void SpinFunc3(size_t depth) {
+    SpinFunc1(depth);
+}
+
+static void* SpinThread(void* arg) {
+#if FRAME_POINTER_METHOD
+    FramePointer_RegisterThread();
+#endif
+    atomic_store(&benchmark_spinning_tid, gettid());
+    SpinFunc1(benchmark_snapshot_depth);
+    return NULL;
+}
+
+// Snapshots of a thread which is busy in a call chain,
+// as a watchdog would take them.
+static void RunThreadSnapshot(size_t iterations) {
+    atomic_store(&benchmark_spinning, true);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, SpinThread, NULL) != 0)
+        return;
+    while (atomic_load(&benchmark_spinning_tid) == 0)
+        sched_yield();
+    pid_t tid = atomic_load(&benchmark_spinning_tid);
+
+    size_t captured_count = 0;
+    size_t frame_count = 0;
+    BacktraceMethod method = BACKTRACE_METHOD_FRAME_POINTER;
+    for (size_t i = 0; i < iterations; ++i) {
+        BacktraceState state;
+        BacktraceState_Init(&state, NULL, benchmark_addresses, backtrace_depth_max);
+
+        uint64_t start = NowNs();
+        bool captured = ThreadSnapshot_Capture(
+                tid, &state, benchmark_snapshot_timeout_us, &method);
+        benchmark_run.latencies_ns[captured_count] = NowNs() - start;
+        if (captured) {
+            ++captured_count;
+            frame_count = state.address_count;
+        }
+    }
+
+    atomic_store(&benchmark_spinning, false);
+    pthread_join(thread, NULL);
+    if (captured_count == 0) {
+        printf("Thread snapshot: no answer.\n");
+        return;
+    }
+
+    qsort(benchmark_run.latencies_ns, captured_count, sizeof(uint64_t),
+            CompareLatencies);
+    printf("Thread snapshot of a busy thread, %zu of %zu captured"
+            " (%zu frames, %s): p50 %llu ns, p99 %llu ns\n",
+            captured_count, iterations, frame_count, BacktraceMethod_Name(method),
+            (unsigned long long)benchmark_run.latencies_ns[captured_count / 2],
+            (unsigned long long)benchmark_run.latencies_ns[captured_count * 99 / 100]);
+}
+
+static uint64_t NextRandom(uint64_t* state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+static uint64_t SymbolizeBatch(
+        size_t thread_count, const SymbolizerStack* stacks, char** texts) {
+    SymbolizerPool* pool = SymbolizerPool_Create(thread_count);
+    if (!pool)
+        return 0;
+
+    uint64_t best_ns = UINT64_MAX;
+    SymbolizerPoolStats stats = {};
+    for (size_t i = 0; i < benchmark_batch_repeat_count; ++i) {
+        uint64_t start = NowNs();
+        bool symbolized = SymbolizerPool_Symbolize(
+                pool, stacks, benchmark_batch_stack_count, texts);
+        uint64_t elapsed_ns = NowNs() - start;
+        if (!symbolized)
+            break;
+        if (elapsed_ns < best_ns)
+            best_ns = elapsed_ns;
+        SymbolizerPool_GetStats(pool, &stats);
+        for (size_t j = 0; j < benchmark_batch_stack_count; ++j)
+            free(texts[j]);
+    }
+    printf("  %2zu threads: %6.2f ms, %zu unique of %zu frames, %zu steals\n",
+            SymbolizerPool_ThreadCount(pool), (double)best_ns / 1e6,
+            stats.unique_address_count, stats.address_count, stats.steal_count);
+
+    // The first batch also builds the symbol index and warms up
+    // the demangle caches, the best one is the steady state.
+    SymbolizerPool_Destroy(pool);
+    return best_ns;
+}
+
+// Symbolizes the same batch with 1, 2, 4... threads, up to the CPU count.
+static void RunBatchSymbolization() {
+    const Module* module = ModuleMap_FindModule((uintptr_t)&snprintf);
+    if (!module)
+        return;
+
+    uintptr_t* unique = (uintptr_t*)malloc(
+            benchmark_batch_unique_count * sizeof(uintptr_t));
+    uintptr_t* addresses = (uintptr_t*)malloc(
+            benchmark_batch_stack_count * benchmark_batch_depth * sizeof(uintptr_t));
+    SymbolizerStack* stacks = (SymbolizerStack*)malloc(
+            benchmark_batch_stack_count * sizeof(SymbolizerStack));
+    char** texts = (char**)malloc(benchmark_batch_stack_count * sizeof(char*));
+    assert(unique && addresses && stacks && texts);
+
+    uint64_t random_state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < benchmark_batch_unique_count; ++i) {
+        unique[i] = module->base
+                + NextRandom(&random_state) % (module->end - module->base);
+    }
+    for (size_t i = 0; i < benchmark_batch_stack_count; ++i) {
+        stacks[i].addresses = addresses + i * benchmark_batch_depth;
+        stacks[i].address_count = benchmark_batch_depth;
+        for (size_t j = 0; j < benchmark_batch_depth; ++j) {
+            addresses[i * benchmark_batch_depth + j] =
+                    unique[NextRandom(&random_state) % benchmark_batch_unique_count];
+        }
+    }
+
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("Batch symbolization of %zu stacks of %zu frames:\n",
+            benchmark_batch_stack_count, benchmark_batch_depth);
+    uint64_t single_ns = 0;
+    for (size_t thread_count = 1; ; thread_count *= 2) {
+        if (thread_count > (size_t)cpu_count)
+            thread_count = (size_t)cpu_count;
+        uint64_t elapsed_ns = SymbolizeBatch(thread_count, stacks, texts);
+        if (thread_count == 1)
+            single_ns = elapsed_ns;
+        else if (elapsed_ns > 0)
+            printf("             %.2fx of 1 thread\n",
+                    (double)single_ns / (double)elapsed_ns);
+        if (thread_count >= (size_t)cpu_count)
+            break;
+    }
+
+    free(texts);
+    free(stacks);
+    free(addresses);
+    free(unique);
+}
+
+
+int main(int argc, char* argv[]) {
+    size_t iterations = benchmark_iterations_default;
+    if (argc > 1)
+        iterations = strtoul(argv[1], NULL, 10);
+    if (iterations == 0) {
+        printf("Usage: %s [iterations] [depth]...\n", argv[0]);
+        return 1;
+    }
+
+    size_t depths[benchmark_depth_count_max] = {};
+    size_t depth_count = 0;
+    for (int i = 2; i < argc && depth_count < benchmark_depth_count_max; ++i)
+        depths[depth_count++] = strtoul(argv[i], NULL, 10);
+    if (depth_count == 0) {
+        depth_count = sizeof(benchmark_depths_default) / sizeof(size_t);
+        memcpy(depths, benchmark_depths_default, sizeof(benchmark_depths_default));
+    }
+    for (size_t i = 0; i < depth_count; ++i) {
+        if (depths[i] + benchmark_depth_reserve > backtrace_depth_max) {
+            printf("Depth must be at most %zu.\n",
+                    backtrace_depth_max - benchmark_depth_reserve);
+            return 1;
+        }
+    }
+
+    benchmark_run.latencies_ns = (uint64_t*)calloc(iterations, sizeof(uint64_t));
+    benchmark_run.frame_counts = (size_t*)calloc(iterations, sizeof(size_t));
+    benchmark_addresses = (uintptr_t*)calloc(
+            backtrace_depth_max, sizeof(uintptr_t));
+    assert(benchmark_run.latencies_ns && benchmark_run.frame_counts
+            && benchmark_addresses);
+
+    ModuleMap_Init();
+#if UNWIND_CACHE_ENABLED
+    UnwindCache_Init();
+#endif
+#if FRAME_POINTER_METHOD
+    FramePointer_RegisterThread();
+#endif
+    UnwindBacktraceWithSkipping_Calibrate();
+
+    struct sigaction action = {};
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = CaptureHandler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigaction(SIGUSR2, &action, NULL);
+
+    printf("%zu iterations per method, latencies in ns.\n", iterations);
+    printf("%-46s %6s %6s %11s %9s %9s %9s\n",
+            "Method", "Depth", "Limit", "Frames", "p50", "p99", "p50/frame");
+
+    const size_t frame_limits[] = {0, benchmark_frame_limit};
+    for (size_t i = 0; i < depth_count; ++i) {
+        for (size_t j = 0; j < sizeof(frame_limits) / sizeof(size_t); ++j) {
+#if FRAME_POINTER_METHOD
+            RunMethod(BacktraceMethod_Name(BACKTRACE_METHOD_FRAME_POINTER),
+                    FramePointerMethod, depths[i], frame_limits[j], iterations);
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+            RunMethod(BacktraceMethod_Name(BACKTRACE_METHOD_LIBUNWIND_WITH_REGISTERS),
+                    LibunwindWithRegisters, depths[i], frame_limits[j], iterations);
+#endif
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+            RunMethod(BacktraceMethod_Name(BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_REGISTERS),
+                    UnwindBacktraceWithRegisters, depths[i], frame_limits[j],
+                    iterations);
+#endif
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+            RunMethod(BacktraceMethod_Name(BACKTRACE_METHOD_UNWIND_BACKTRACE_WITH_SKIPPING),
+                    UnwindBacktraceWithSkipping, depths[i], frame_limits[j],
+                    iterations);
+#endif
+            if (frame_limits[j] == 0) {
+                // The C++ front end has no predicate.
+#if FRAME_POINTER_METHOD
+                RunMethod("FRAME_POINTER_METHOD (C++)",
+                        BenchmarkUnwinder_FramePointer, depths[i], 0, iterations);
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+                RunMethod("LIBUNWIND_WITH_REGISTERS_METHOD (C++)",
+                        BenchmarkUnwinder_Libunwind, depths[i], 0, iterations);
+#endif
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+                RunMethod("UNWIND_BACKTRACE_WITH_REGISTERS_METHOD (C++)",
+                        BenchmarkUnwinder_UnwindBacktrace, depths[i], 0, iterations);
+#else
+                RunMethod("UNWIND_BACKTRACE_WITH_SKIPPING_METHOD (C++)",
+                        BenchmarkUnwinder_UnwindBacktrace, depths[i], 0, iterations);
+#endif
+                // Of the last whole stack.
+                RunSymbolization(iterations);
+                RunFrameClassification(iterations);
+            }
+        }
+    }
+
+    RunBatchSymbolization();
+    if (ThreadSnapshot_Init(SIGRTMIN + 3))
+        RunThreadSnapshot(iterations);
+
+#if UNWIND_CACHE_ENABLED
+    UnwindCacheStats cache_stats = {};
+    UnwindCache_GetStats(&cache_stats);
+    printf("Unwind cache: %u hits, %u misses, %u outside of known modules.\n",
+            cache_stats.hit_count, cache_stats.miss_count,
+            cache_stats.fallback_count);
+#endif
+
+    CaptureCountersSnapshot counters = {};
+    CaptureCounters_Snapshot(&counters);
+    CaptureCounters_Print(&counters);
+
+    free(benchmark_addresses);
+    free(benchmark_run.frame_counts);
+    free(benchmark_run.latencies_ns);
+    return 0;
+}
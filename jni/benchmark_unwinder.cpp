@@ -0,0 +1,36 @@
+// The C++ front end (backtrace_unwinder.hpp) as BenchmarkMethods,
+// for benchmark.c. The whole stack is captured, then copied into
+// the BacktraceState, which is timed too.
+
+#include "backtrace_unwinder.hpp"
+
+
+// Only touched by the benchmark's handler.
+static backtrace::Backtrace<backtrace_depth_max> benchmark_backtrace;
+
+
+extern "C" {
+
+#if FRAME_POINTER_METHOD
+void BenchmarkUnwinder_FramePointer(BacktraceState* state) {
+    benchmark_backtrace.Clear();
+    backtrace::WalkFramePointers(state->signal_ucontext, &benchmark_backtrace);
+    benchmark_backtrace.CopyTo(state);
+}
+#endif
+
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+void BenchmarkUnwinder_Libunwind(BacktraceState* state) {
+    benchmark_backtrace.Clear();
+    backtrace::WalkLibunwind(state->signal_ucontext, &benchmark_backtrace);
+    benchmark_backtrace.CopyTo(state);
+}
+#endif
+
+void BenchmarkUnwinder_UnwindBacktrace(BacktraceState* state) {
+    benchmark_backtrace.Clear();
+    backtrace::WalkUnwindBacktrace(state->signal_ucontext, &benchmark_backtrace);
+    benchmark_backtrace.CopyTo(state);
+}
+
+} // extern "C"
@@ -0,0 +1,249 @@
+#include "capture_counters.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// The handlers must not take the lock of a library implementation.
+#if CAPTURE_COUNTERS_ENABLED
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+        "capture counters need lock-free 64-bit atomics");
+#endif
+
+static const char* const capture_counter_names[CAPTURE_COUNTER_COUNT] = {
+    [CAPTURE_COUNTER_CAPTURE_COUNT]             = "capture_count",
+    [CAPTURE_COUNTER_UNWIND_STEP_COUNT]         = "unwind_step_count",
+    [CAPTURE_COUNTER_FRAME_COUNT]               = "frame_count",
+    [CAPTURE_COUNTER_UNWIND_TIME]               = "unwind_time",
+    [CAPTURE_COUNTER_DROPPED_NULL_COUNT]        = "dropped_null_count",
+    [CAPTURE_COUNTER_DROPPED_DUPLICATE_COUNT]   = "dropped_duplicate_count",
+    [CAPTURE_COUNTER_DROPPED_OVERFLOW_COUNT]    = "dropped_overflow_count",
+    [CAPTURE_COUNTER_SYMBOL_LOOKUP_COUNT]       = "symbol_lookup_count",
+    [CAPTURE_COUNTER_SYMBOL_LOOKUP_TIME]        = "symbol_lookup_time",
+    [CAPTURE_COUNTER_DLADDR_COUNT]              = "dladdr_count",
+    [CAPTURE_COUNTER_DLADDR_TIME]               = "dladdr_time",
+    [CAPTURE_COUNTER_DEMANGLE_COUNT]            = "demangle_count",
+    [CAPTURE_COUNTER_DEMANGLE_TIME]             = "demangle_time",
+    [CAPTURE_COUNTER_OUTPUT_COUNT]              = "output_count",
+    [CAPTURE_COUNTER_OUTPUT_BYTE_COUNT]         = "output_byte_count",
+    [CAPTURE_COUNTER_OUTPUT_TIME]               = "output_time",
+};
+
+// Each _TIME counter, and the count it is an average over.
+struct CaptureTimeCounter {
+    CaptureCounter  time;
+    CaptureCounter  count;
+};
+typedef struct CaptureTimeCounter CaptureTimeCounter;
+
+static const CaptureTimeCounter capture_time_counters[] = {
+    {CAPTURE_COUNTER_UNWIND_TIME,           CAPTURE_COUNTER_CAPTURE_COUNT},
+    {CAPTURE_COUNTER_SYMBOL_LOOKUP_TIME,    CAPTURE_COUNTER_SYMBOL_LOOKUP_COUNT},
+    {CAPTURE_COUNTER_DLADDR_TIME,           CAPTURE_COUNTER_DLADDR_COUNT},
+    {CAPTURE_COUNTER_DEMANGLE_TIME,         CAPTURE_COUNTER_DEMANGLE_COUNT},
+    {CAPTURE_COUNTER_OUTPUT_TIME,           CAPTURE_COUNTER_OUTPUT_COUNT},
+};
+static const size_t capture_time_counter_count =
+        sizeof(capture_time_counters) / sizeof(capture_time_counters[0]);
+
+static CaptureCountersPage capture_counters_static_page;
+static _Atomic(CaptureCountersPage*) capture_counters_page =
+        &capture_counters_static_page;
+static uint64_t capture_counters_ticks_per_second;
+
+
+void CaptureCounters_Add(CaptureCounter counter, uint64_t value) {
+    assert(counter < CAPTURE_COUNTER_COUNT);
+    CaptureCountersPage* page = atomic_load_explicit(
+            &capture_counters_page, memory_order_acquire);
+    atomic_fetch_add_explicit(&page->values[counter], value, memory_order_relaxed);
+}
+
+static uint64_t NowNs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+uint64_t CaptureCounters_Ticks() {
+#if __aarch64__
+    uint64_t ticks = 0;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+    return ticks;
+#elif __x86_64__ || __i386__
+    uint32_t low = 0;
+    uint32_t high = 0;
+    __asm__ __volatile__("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+#else
+    return NowNs();
+#endif
+}
+
+static uint64_t TicksPerSecond() {
+    if (capture_counters_ticks_per_second != 0)
+        return capture_counters_ticks_per_second;
+
+    uint64_t ticks_per_second = 1000000000;
+#if __aarch64__
+    __asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(ticks_per_second));
+#elif __x86_64__ || __i386__
+    // The TSC frequency is not exposed, it is measured.
+    uint64_t start_ns = NowNs();
+    uint64_t start_ticks = CaptureCounters_Ticks();
+    struct timespec interval = {0, 10 * 1000 * 1000};
+    nanosleep(&interval, NULL);
+    uint64_t elapsed_ticks = CaptureCounters_Ticks() - start_ticks;
+    uint64_t elapsed_ns = NowNs() - start_ns;
+    if (elapsed_ns > 0)
+        ticks_per_second = elapsed_ticks * 1000000000ull / elapsed_ns;
+#endif
+
+    capture_counters_ticks_per_second = ticks_per_second;
+    return ticks_per_second;
+}
+
+static bool IsTimeCounter(size_t counter) {
+    for (size_t i = 0; i < capture_time_counter_count; ++i) {
+        if (capture_time_counters[i].time == counter)
+            return true;
+    }
+    return false;
+}
+
+static uint64_t TicksToNs(uint64_t ticks, uint64_t ticks_per_second) {
+    if (ticks_per_second == 0)
+        return 0;
+    // Without the overflow of ticks * 1000000000.
+    return ticks / ticks_per_second * 1000000000ull
+            + ticks % ticks_per_second * 1000000000ull / ticks_per_second;
+}
+
+const char* CaptureCounter_Name(CaptureCounter counter) {
+    if ((size_t)counter >= CAPTURE_COUNTER_COUNT)
+        return NULL;
+    return capture_counter_names[counter];
+}
+
+void CaptureCounters_Snapshot(CaptureCountersSnapshot* snapshot) {
+    assert(snapshot);
+    const CaptureCountersPage* page = atomic_load(&capture_counters_page);
+    uint64_t ticks_per_second = TicksPerSecond();
+
+    for (size_t i = 0; i < CAPTURE_COUNTER_COUNT; ++i) {
+        uint64_t value = atomic_load_explicit(
+                &((CaptureCountersPage*)page)->values[i], memory_order_relaxed);
+        snapshot->values[i] = IsTimeCounter(i)
+                ? TicksToNs(value, ticks_per_second) : value;
+    }
+}
+
+void CaptureCounters_Reset() {
+    CaptureCountersPage* page = atomic_load(&capture_counters_page);
+    for (size_t i = 0; i < CAPTURE_COUNTER_COUNT; ++i)
+        atomic_store_explicit(&page->values[i], 0, memory_order_relaxed);
+}
+
+bool CaptureCounters_MapFile(const char* path) {
+    assert(path);
+    assert(atomic_load(&capture_counters_page) == &capture_counters_static_page);
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t file_size = (sizeof(CaptureCountersPage) + page_size - 1)
+            / page_size * page_size;
+
+    // Written rather than truncated to size, so that the blocks
+    // are allocated now, not on the first store into the mapping.
+    CaptureCountersPage* initial = (CaptureCountersPage*)calloc(1, file_size);
+    if (!initial)
+        return false;
+    initial->magic = capture_counters_magic;
+    initial->version = capture_counters_version;
+    initial->counter_count = CAPTURE_COUNTER_COUNT;
+    initial->ticks_per_second = TicksPerSecond();
+    for (size_t i = 0; i < CAPTURE_COUNTER_COUNT; ++i) {
+        atomic_init(&initial->values[i],
+                atomic_load(&capture_counters_static_page.values[i]));
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool written = fd >= 0
+            && pwrite(fd, initial, file_size, 0) == (ssize_t)file_size;
+    free(initial);
+    if (!written) {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    void* mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    // Never unmapped, the handlers may count at any time.
+    atomic_store_explicit(&capture_counters_page,
+            (CaptureCountersPage*)mapping, memory_order_release);
+    return true;
+}
+
+bool CaptureCounters_ReadFile(const char* path, CaptureCountersSnapshot* snapshot) {
+    assert(path);
+    assert(snapshot);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    CaptureCountersPage page;
+    ssize_t size = pread(fd, &page, sizeof(page), 0);
+    close(fd);
+
+    if (size < (ssize_t)offsetof(CaptureCountersPage, values)
+            || page.magic != capture_counters_magic
+            || page.version != capture_counters_version)
+        return false;
+
+    // A newer writer may have appended counters, an older one may lack some.
+    size_t counter_count = page.counter_count < CAPTURE_COUNTER_COUNT
+            ? page.counter_count : CAPTURE_COUNTER_COUNT;
+    size_t read_count = ((size_t)size - offsetof(CaptureCountersPage, values))
+            / sizeof(uint64_t);
+    if (read_count < counter_count)
+        counter_count = read_count;
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    for (size_t i = 0; i < counter_count; ++i) {
+        uint64_t value = atomic_load_explicit(&page.values[i], memory_order_relaxed);
+        snapshot->values[i] = IsTimeCounter(i)
+                ? TicksToNs(value, page.ticks_per_second) : value;
+    }
+    return true;
+}
+
+void CaptureCounters_Print(const CaptureCountersSnapshot* snapshot) {
+    assert(snapshot);
+
+    printf("Capture counters:\n");
+    for (size_t i = 0; i < CAPTURE_COUNTER_COUNT; ++i) {
+        printf("  %-24s %12llu%s\n", capture_counter_names[i],
+                (unsigned long long)snapshot->values[i],
+                IsTimeCounter(i) ? " ns" : "");
+    }
+    for (size_t i = 0; i < capture_time_counter_count; ++i) {
+        uint64_t count = snapshot->values[capture_time_counters[i].count];
+        if (count == 0)
+            continue;
+        printf("  %-24s %12.1f ns per %s\n",
+                capture_counter_names[capture_time_counters[i].time],
+                (double)snapshot->values[capture_time_counters[i].time] / (double)count,
+                capture_counter_names[capture_time_counters[i].count]);
+    }
+}
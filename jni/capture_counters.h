@@ -0,0 +1,126 @@
+#ifndef CAPTURE_COUNTERS_H
+#define CAPTURE_COUNTERS_H
+
+// Counters and timers of the capture pipeline: unwinding, dropped
+// frames, symbol lookups, dladdr(), demangling and output, to tune
+// against real numbers.
+//
+// Every counter is a 64-bit atomic, added to with a relaxed fetch-add:
+// lock-free and async-signal-safe, so the crash and sampling handlers
+// of any thread count too. Nothing is added per frame: the unwinders
+// count their steps in the BacktraceState and add them once per capture.
+// Where 64-bit atomics take a lock (armeabi, ARMv5), the counters
+// are compiled out.
+//
+// Times are in ticks of the cheapest clock there is: the virtual counter
+// on arm64, the TSC on x86 and x86_64. 32-bit ARM has no cycle counter
+// readable by user code, it uses CLOCK_MONOTONIC nanoseconds (vDSO).
+// CaptureCounters_Snapshot() converts them to nanoseconds.
+//
+// The counters live in a static block. CaptureCounters_MapFile() moves
+// them into a shared file mapping, which another process may read
+// at any time without stopping this one, and which outlives a crash.
+//
+// CAPTURE_COUNTERS_ENABLED 0 compiles the instrumentation out.
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef CAPTURE_COUNTERS_ENABLED
+#if ATOMIC_LLONG_LOCK_FREE == 2
+#define CAPTURE_COUNTERS_ENABLED 1
+#else
+#define CAPTURE_COUNTERS_ENABLED 0
+#endif
+#endif
+
+
+// The order is the layout of CaptureCountersPage::values,
+// new counters are only appended.
+enum CaptureCounter {
+    // Runs of an unwinding method, and their steps (frames visited,
+    // including dropped and skipped ones), frames kept and time.
+    CAPTURE_COUNTER_CAPTURE_COUNT = 0,
+    CAPTURE_COUNTER_UNWIND_STEP_COUNT,
+    CAPTURE_COUNTER_FRAME_COUNT,
+    CAPTURE_COUNTER_UNWIND_TIME,
+
+    // Frames BacktraceState_AddFrame() did not store: null and repeated
+    // addresses, and the first one which did not fit.
+    CAPTURE_COUNTER_DROPPED_NULL_COUNT,
+    CAPTURE_COUNTER_DROPPED_DUPLICATE_COUNT,
+    CAPTURE_COUNTER_DROPPED_OVERFLOW_COUNT,
+
+    // Module_FindSymbol(), dladdr() for addresses outside of the
+    // ModuleMap, and __cxa_demangle() on DemangleCache misses.
+    CAPTURE_COUNTER_SYMBOL_LOOKUP_COUNT,
+    CAPTURE_COUNTER_SYMBOL_LOOKUP_TIME,
+    CAPTURE_COUNTER_DLADDR_COUNT,
+    CAPTURE_COUNTER_DLADDR_TIME,
+    CAPTURE_COUNTER_DEMANGLE_COUNT,
+    CAPTURE_COUNTER_DEMANGLE_TIME,
+
+    // Crash dump records and printed frames.
+    CAPTURE_COUNTER_OUTPUT_COUNT,
+    CAPTURE_COUNTER_OUTPUT_BYTE_COUNT,
+    CAPTURE_COUNTER_OUTPUT_TIME,
+
+    CAPTURE_COUNTER_COUNT
+};
+typedef enum CaptureCounter CaptureCounter;
+
+static const uint32_t capture_counters_magic = 0x43435442; // "BTCC"
+static const uint32_t capture_counters_version = 1;
+
+// Layout of the file of CaptureCounters_MapFile().
+struct CaptureCountersPage {
+    uint32_t            magic;
+    uint32_t            version;
+    uint32_t            counter_count;
+    uint32_t            reserved;
+    // Of the _TIME counters.
+    uint64_t            ticks_per_second;
+    _Atomic uint64_t    values[CAPTURE_COUNTER_COUNT];
+};
+typedef struct CaptureCountersPage CaptureCountersPage;
+
+// _TIME counters in nanoseconds.
+struct CaptureCountersSnapshot {
+    uint64_t    values[CAPTURE_COUNTER_COUNT];
+};
+typedef struct CaptureCountersSnapshot CaptureCountersSnapshot;
+
+
+#if CAPTURE_COUNTERS_ENABLED
+#define CAPTURE_COUNTERS_ADD(counter, value) CaptureCounters_Add(counter, value)
+#define CAPTURE_COUNTERS_TICKS() CaptureCounters_Ticks()
+#else
+#define CAPTURE_COUNTERS_ADD(counter, value) ((void)sizeof(value))
+#define CAPTURE_COUNTERS_TICKS() ((uint64_t)0)
+#endif
+
+// Async-signal-safe.
+void CaptureCounters_Add(CaptureCounter counter, uint64_t value);
+uint64_t CaptureCounters_Ticks();
+
+// "capture_count" and so on. Returns NULL for an unknown counter.
+const char* CaptureCounter_Name(CaptureCounter counter);
+
+// The first call measures the TSC frequency on x86, for 10 ms.
+// Not async-signal-safe.
+void CaptureCounters_Snapshot(CaptureCountersSnapshot* snapshot);
+void CaptureCounters_Reset();
+
+// Creates the file, copies the counters so far into it and counts
+// there from then on. Call once, before the signal handlers are
+// installed: the increments of a capture running meanwhile may be lost.
+// Not async-signal-safe.
+bool CaptureCounters_MapFile(const char* path);
+
+// Reads a file of CaptureCounters_MapFile(), of this or another process.
+bool CaptureCounters_ReadFile(const char* path, CaptureCountersSnapshot* snapshot);
+
+void CaptureCounters_Print(const CaptureCountersSnapshot* snapshot);
+
+#endif // CAPTURE_COUNTERS_H
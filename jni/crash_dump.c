@@ -0,0 +1,383 @@
+#include "crash_dump.h"
+#include "capture_counters.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+static int crash_dump_fd = -1;
+
+// Used for copying /proc/self/maps from the signal handler,
+// the alternate signal stack is too small for it.
+static char crash_dump_maps_buffer[4096];
+
+
+bool CrashDump_Open(const char* path) {
+    assert(path);
+    crash_dump_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return crash_dump_fd >= 0;
+}
+
+static void WriteAll(const void* data, size_t size) {
+    const char* bytes = (const char*)data;
+    while (size > 0) {
+        ssize_t written = write(crash_dump_fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+}
+
+static void WriteRecord(
+        CrashDumpRecordType type, int32_t value,
+        const void* payload, size_t size) {
+    if (crash_dump_fd < 0)
+        return;
+
+    CrashDumpRecordHeader header = {};
+    header.magic = crash_dump_magic;
+    header.type = type;
+    header.size = (uint32_t)size;
+    header.value = value;
+
+    uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+    WriteAll(&header, sizeof(header));
+    if (size > 0)
+        WriteAll(payload, size);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_TIME,
+            CAPTURE_COUNTERS_TICKS() - start_ticks);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_COUNT, 1);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_OUTPUT_BYTE_COUNT, sizeof(header) + size);
+}
+
+void CrashDump_WriteSignal(int sig) {
+    if (crash_dump_fd < 0)
+        return;
+    // The records of the previous signal, if any, were of a fault
+    // the process recovered from. If they cannot be dropped,
+    // the new ones follow them.
+    if (ftruncate(crash_dump_fd, 0) == 0)
+        lseek(crash_dump_fd, 0, SEEK_SET);
+    WriteRecord(CRASH_DUMP_RECORD_SIGNAL, sig, NULL, 0);
+}
+
+void CrashDump_WriteThread(pid_t tid) {
+    WriteRecord(CRASH_DUMP_RECORD_THREAD, tid, NULL, 0);
+}
+
+void CrashDump_WriteSignature(uint64_t signature, size_t frame_count) {
+    WriteRecord(CRASH_DUMP_RECORD_SIGNATURE, (int32_t)frame_count,
+            &signature, sizeof(signature));
+}
+
+void CrashDump_WriteBacktrace(
+        const BacktraceState* state, BacktraceMethod method) {
+    assert(state);
+    CrashDump_WriteAddresses(state->addresses, state->address_count, method);
+}
+
+void CrashDump_WriteAddresses(
+        const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method) {
+    WriteRecord(CRASH_DUMP_RECORD_BACKTRACE, method,
+            addresses, address_count * sizeof(uintptr_t));
+}
+
+void CrashDump_WriteModuleMap() {
+    if (crash_dump_fd < 0)
+        return;
+
+    int maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps_fd < 0)
+        return;
+
+    for (;;) {
+        ssize_t size = read(
+                maps_fd, crash_dump_maps_buffer, sizeof(crash_dump_maps_buffer));
+        if (size < 0 && errno == EINTR)
+            continue;
+        if (size <= 0)
+            break;
+        WriteRecord(CRASH_DUMP_RECORD_MODULE_MAP, 0,
+                crash_dump_maps_buffer, (size_t)size);
+    }
+
+    close(maps_fd);
+}
+
+void CrashDump_Close() {
+    if (crash_dump_fd < 0)
+        return;
+    close(crash_dump_fd);
+    crash_dump_fd = -1;
+}
+
+
+CrashDumpMapping* CrashDump_ParseMaps(char* text, size_t* mapping_count) {
+    assert(text);
+    assert(mapping_count);
+
+    size_t capacity = 64;
+    size_t count = 0;
+    CrashDumpMapping* mappings = (CrashDumpMapping*)malloc(
+            capacity * sizeof(CrashDumpMapping));
+    if (!mappings) {
+        *mapping_count = 0;
+        return NULL;
+    }
+
+    const char* previous_path = "";
+    uintptr_t module_base = 0;
+
+    char* line = text;
+    while (line && *line) {
+        char* next_line = strchr(line, '\n');
+        if (next_line)
+            *next_line++ = '\0';
+
+        unsigned long start = 0;
+        unsigned long end = 0;
+        char permissions[5] = {};
+        unsigned long offset = 0;
+        int path_position = 0;
+        if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n",
+                    &start, &end, permissions, &offset, &path_position) >= 4
+                && path_position > 0 && line[path_position] == '/') {
+            const char* path = line + path_position;
+
+            // A new module starts either with the other file
+            // or with the file header mapped again.
+            if (offset == 0 || strcmp(path, previous_path) != 0)
+                module_base = start;
+            previous_path = path;
+
+            if (count == capacity) {
+                capacity *= 2;
+                CrashDumpMapping* grown = (CrashDumpMapping*)realloc(
+                        mappings, capacity * sizeof(CrashDumpMapping));
+                if (!grown)
+                    break;
+                mappings = grown;
+            }
+
+            CrashDumpMapping* mapping = &mappings[count++];
+            mapping->start = start;
+            mapping->end = end;
+            mapping->module_base = module_base;
+            mapping->path = path;
+            mapping->executable = permissions[2] == 'x';
+        }
+
+        line = next_line;
+    }
+
+    *mapping_count = count;
+    return mappings;
+}
+
+const CrashDumpMapping* CrashDump_FindMapping(
+        const CrashDumpMapping* mappings, size_t mapping_count,
+        uintptr_t address) {
+    for (size_t i = 0; i < mapping_count; ++i) {
+        if (address >= mappings[i].start && address < mappings[i].end)
+            return &mappings[i];
+    }
+    return NULL;
+}
+
+// Reads a whole file into a null-terminated malloc'ed buffer.
+static char* ReadFile(const char* path, size_t* size) {
+    FILE* file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    size_t capacity = 4096;
+    size_t length = 0;
+    char* data = (char*)malloc(capacity);
+    while (data) {
+        if (length + 1 >= capacity) {
+            capacity *= 2;
+            char* grown = (char*)realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            data = grown;
+        }
+        size_t read_size = fread(data + length, 1, capacity - length - 1, file);
+        if (read_size == 0)
+            break;
+        length += read_size;
+    }
+    fclose(file);
+
+    if (!data)
+        return NULL;
+    data[length] = '\0';
+    if (size)
+        *size = length;
+    return data;
+}
+
+static void PrintDumpedBacktrace(
+        const char* payload, size_t address_count,
+        const CrashDumpMapping* dumped_mappings, size_t dumped_mapping_count) {
+    for (size_t frame_index = 0; frame_index < address_count; ++frame_index) {
+        uintptr_t address = 0;
+        memcpy(&address, payload + frame_index * sizeof(uintptr_t),
+                sizeof(address));
+
+        const char* symbol_name = "";
+        unsigned long relative_address = address;
+
+        const CrashDumpMapping* dumped = CrashDump_FindMapping(
+                dumped_mappings, dumped_mapping_count, address);
+        if (dumped) {
+            relative_address = address - dumped->module_base;
+
+            // Same module in this process, most probably
+            // at a different address because of ASLR.
+            const Module* current = ModuleMap_FindModuleByPath(dumped->path);
+            if (current) {
+                const char* name = Module_FindSymbol(
+                        current, current->base + relative_address);
+                if (name)
+                    symbol_name = name;
+            }
+        }
+
+        PrintFrame(frame_index, relative_address, symbol_name);
+    }
+}
+
+bool CrashDump_Print(const char* path) {
+    assert(path);
+
+    size_t size = 0;
+    char* data = ReadFile(path, &size);
+    if (!data)
+        return false;
+
+    // First pass: concatenate module map chunks.
+    char* dumped_maps = (char*)malloc(size + 1);
+    size_t dumped_maps_length = 0;
+    for (size_t offset = 0;
+            dumped_maps && offset + sizeof(CrashDumpRecordHeader) <= size;) {
+        CrashDumpRecordHeader header = {};
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.magic != crash_dump_magic || header.size > size - offset)
+            break;
+
+        if (header.type == CRASH_DUMP_RECORD_MODULE_MAP) {
+            memcpy(dumped_maps + dumped_maps_length, data + offset, header.size);
+            dumped_maps_length += header.size;
+        }
+        offset += header.size;
+    }
+    if (!dumped_maps) {
+        free(data);
+        return false;
+    }
+    dumped_maps[dumped_maps_length] = '\0';
+
+    size_t dumped_mapping_count = 0;
+    CrashDumpMapping* dumped_mappings = CrashDump_ParseMaps(
+            dumped_maps, &dumped_mapping_count);
+
+    ModuleMap_Refresh();
+
+    // Second pass: print the backtraces.
+    size_t backtrace_count = 0;
+    size_t crashed_backtrace_count = 0;
+    size_t thread_count = 0;
+    bool has_signature = false;
+    for (size_t offset = 0; offset + sizeof(CrashDumpRecordHeader) <= size;) {
+        CrashDumpRecordHeader header = {};
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.magic != crash_dump_magic || header.size > size - offset)
+            break;
+
+        if (header.type == CRASH_DUMP_RECORD_SIGNAL) {
+            printf("Crashed with signal %i.\n", header.value);
+        } else if (header.type == CRASH_DUMP_RECORD_THREAD) {
+            printf("%s %i:\n", thread_count == 0 ? "Crashed thread" : "Thread",
+                    header.value);
+            ++thread_count;
+        } else if (header.type == CRASH_DUMP_RECORD_SIGNATURE
+                && header.size == sizeof(uint64_t)) {
+            uint64_t signature = 0;
+            memcpy(&signature, data + offset, sizeof(signature));
+            printf("Crash signature %016llx, of the top %i frames.\n",
+                    (unsigned long long)signature, header.value);
+            has_signature = true;
+        } else if (header.type == CRASH_DUMP_RECORD_BACKTRACE) {
+            printf("Backtrace captured using %s:\n",
+                    BacktraceMethod_Name((BacktraceMethod)header.value));
+            PrintDumpedBacktrace(
+                    data + offset, header.size / sizeof(uintptr_t),
+                    dumped_mappings, dumped_mapping_count);
+            ++backtrace_count;
+            if (thread_count <= 1)
+                ++crashed_backtrace_count;
+        }
+        offset += header.size;
+    }
+
+    if (has_signature && crashed_backtrace_count == 0)
+        printf("Known crash, only the signature of the crashed thread was written.\n");
+
+    free(dumped_mappings);
+    free(dumped_maps);
+    free(data);
+    return backtrace_count > 0 || has_signature;
+}
+
+bool CrashDump_ReadSignature(
+        const char* path, uint64_t* signature, bool* has_backtrace) {
+    assert(path);
+    assert(signature);
+    assert(has_backtrace);
+
+    size_t size = 0;
+    char* data = ReadFile(path, &size);
+    if (!data)
+        return false;
+
+    bool found = false;
+    *has_backtrace = false;
+    for (size_t offset = 0; offset + sizeof(CrashDumpRecordHeader) <= size;) {
+        CrashDumpRecordHeader header = {};
+        memcpy(&header, data + offset, sizeof(header));
+        offset += sizeof(header);
+        if (header.magic != crash_dump_magic || header.size > size - offset)
+            break;
+
+        if (header.type == CRASH_DUMP_RECORD_SIGNATURE && !found
+                && header.size == sizeof(uint64_t)) {
+            memcpy(signature, data + offset, sizeof(uint64_t));
+            found = true;
+        } else if (header.type == CRASH_DUMP_RECORD_BACKTRACE) {
+            *has_backtrace = true;
+        } else if (header.type == CRASH_DUMP_RECORD_THREAD && found) {
+            // The next thread's.
+            break;
+        }
+        offset += header.size;
+    }
+
+    free(data);
+    return found;
+}
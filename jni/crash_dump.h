@@ -0,0 +1,114 @@
+#ifndef CRASH_DUMP_H
+#define CRASH_DUMP_H
+
+// Deferred symbolization of crash backtraces.
+//
+// The signal handler only captures raw addresses and writes them,
+// together with the module map of the process, to a file descriptor
+// opened in advance. Only write(2), open(2), read(2) and close(2)
+// are used on that path, so it is async-signal-safe and does not touch
+// malloc, stdio or the dynamic linker.
+//
+// Symbolization and demangling happen later, in another process
+// (or on the next launch), by CrashDump_Print().
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+// Dump file layout: a sequence of records,
+// each one is a CrashDumpRecordHeader followed by "size" bytes of payload.
+static const uint32_t crash_dump_magic = 0x44435442; // "BTCD"
+
+enum CrashDumpRecordType {
+    // No payload, "value" is the signal number.
+    CRASH_DUMP_RECORD_SIGNAL      = 1,
+
+    // Payload is an array of uintptr_t absolute addresses,
+    // "value" is the BacktraceMethod used to capture them.
+    CRASH_DUMP_RECORD_BACKTRACE   = 2,
+
+    // Payload is a chunk of /proc/self/maps text.
+    // Chunks are concatenated in the order they appear.
+    CRASH_DUMP_RECORD_MODULE_MAP  = 3,
+
+    // No payload, "value" is the thread id. The backtraces following it,
+    // up to the next thread record, belong to that thread.
+    // The first thread is the crashing one.
+    CRASH_DUMP_RECORD_THREAD      = 4,
+
+    // Payload is the uint64_t signature of the crash (crash_signature.h),
+    // "value" is the number of frames it covers. Without backtraces
+    // after it, up to the next thread record, the crash was known and only
+    // the signature of the crashed thread was written.
+    CRASH_DUMP_RECORD_SIGNATURE   = 5,
+};
+typedef enum CrashDumpRecordType CrashDumpRecordType;
+
+struct CrashDumpRecordHeader {
+    uint32_t    magic;
+    uint32_t    type;
+    uint32_t    size;
+    int32_t     value;
+};
+typedef struct CrashDumpRecordHeader CrashDumpRecordHeader;
+
+
+// Opens (and truncates) the dump file. Must be called before
+// the signal handler is installed, not from the handler.
+bool CrashDump_Open(const char* path);
+
+// Functions below are async-signal-safe.
+// They do nothing, if CrashDump_Open() has not succeeded.
+// CrashDump_WriteSignal() starts the dump over, so the file can stay
+// open for a next crash, after one the process recovered from.
+void CrashDump_WriteSignal(int sig);
+void CrashDump_WriteThread(pid_t tid);
+void CrashDump_WriteSignature(uint64_t signature, size_t frame_count);
+void CrashDump_WriteBacktrace(
+        const BacktraceState* state, BacktraceMethod method);
+void CrashDump_WriteAddresses(
+        const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method);
+void CrashDump_WriteModuleMap();
+void CrashDump_Close();
+
+// One file-backed line of /proc/<pid>/maps.
+struct CrashDumpMapping {
+    uintptr_t   start;
+    uintptr_t   end;
+
+    // Address where the first mapping of the same file starts.
+    // Matches Dl_info::dli_fbase for the addresses in this mapping.
+    uintptr_t   module_base;
+
+    const char* path;
+    bool        executable;
+};
+typedef struct CrashDumpMapping CrashDumpMapping;
+
+// Parses /proc/<pid>/maps text. Modifies the text in place,
+// the returned mappings point into it. Free the result with free().
+// Not async-signal-safe.
+CrashDumpMapping* CrashDump_ParseMaps(char* text, size_t* mapping_count);
+
+const CrashDumpMapping* CrashDump_FindMapping(
+        const CrashDumpMapping* mappings, size_t mapping_count,
+        uintptr_t address);
+
+// Reads the dump file, symbolizes and prints the backtraces.
+// Modules are looked up by path in the current process,
+// so symbols are only resolved for modules which are loaded here too.
+// Returns false, if the file is missing or contains neither backtraces
+// nor a signature. Not async-signal-safe.
+bool CrashDump_Print(const char* path);
+
+// Reads the signature of the crashed thread. "has_backtrace" tells
+// whether the full backtrace was written too. Not async-signal-safe.
+bool CrashDump_ReadSignature(
+        const char* path, uint64_t* signature, bool* has_backtrace);
+
+#endif // CRASH_DUMP_H
@@ -0,0 +1,154 @@
+#include "crash_signature.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const uint64_t crash_signature_fnv_offset = 14695981039346656037ull;
+static const uint64_t crash_signature_fnv_prime = 1099511628211ull;
+
+// Stands for a frame outside of the known modules.
+static const uint64_t crash_signature_unknown_frame = 0x3f3f3f3f3f3f3f3full;
+
+// Sorted, written before the handlers are installed.
+static uint64_t crash_signature_known[crash_signature_known_capacity];
+static size_t crash_signature_known_count;
+
+
+static uint64_t MixBytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= crash_signature_fnv_prime;
+    }
+    return hash;
+}
+
+static uint64_t MixWord(uint64_t hash, uint64_t word) {
+    // Byte by byte, so that the signature does not depend on endianness.
+    for (int shift = 0; shift < 64; shift += 8) {
+        hash ^= (word >> shift) & 0xff;
+        hash *= crash_signature_fnv_prime;
+    }
+    return hash;
+}
+
+static void StartOver(CrashSignature* signature) {
+    signature->frame_count = 0;
+    signature->hash = crash_signature_fnv_offset;
+}
+
+
+void CrashSignature_Init(
+        CrashSignature* signature, const ucontext_t* signal_ucontext,
+        size_t frame_count_max) {
+    assert(signature);
+    assert(signal_ucontext);
+    assert(frame_count_max > 0);
+    signature->frame_count_max = frame_count_max < crash_signature_frame_count_max
+            ? frame_count_max : crash_signature_frame_count_max;
+    signature->pc = Backtrace_GetSignalPc(signal_ucontext);
+    signature->pc_found = false;
+    StartOver(signature);
+}
+
+bool CrashSignature_Predicate(
+        const BacktraceState* state, uintptr_t address, void* signature_voidp) {
+    assert(signature_voidp);
+    CrashSignature* signature = (CrashSignature*)signature_voidp;
+
+    // The first frame of another method, or the interrupted PC after
+    // the frames of the handler.
+    if (state->address_count == 1) {
+        signature->pc_found = false;
+        StartOver(signature);
+    }
+    if (!signature->pc_found && address == signature->pc) {
+        signature->pc_found = true;
+        StartOver(signature);
+    }
+
+    if (signature->frame_count >= signature->frame_count_max)
+        return true;
+
+    const Module* module = ModuleMap_FindModule(address);
+    uint64_t hash = signature->hash;
+    if (module) {
+        if (module->build_id_size > 0)
+            hash = MixBytes(hash, module->build_id, module->build_id_size);
+        else if (module->path)
+            hash = MixBytes(hash, module->path, strlen(module->path));
+        hash = MixWord(hash, address - module->base);
+    } else {
+        hash = MixWord(hash, crash_signature_unknown_frame);
+    }
+    signature->hash = hash;
+    signature->frame_count++;
+    return true;
+}
+
+uint64_t CrashSignature_Value(const CrashSignature* signature) {
+    assert(signature);
+    uint64_t hash = MixWord(signature->hash, signature->frame_count);
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+
+static int CompareSignatures(const void* a_voidp, const void* b_voidp) {
+    uint64_t a = *(const uint64_t*)a_voidp;
+    uint64_t b = *(const uint64_t*)b_voidp;
+    return (a > b) - (a < b);
+}
+
+bool CrashSignature_LoadKnown(const char* path) {
+    assert(path);
+    crash_signature_known_count = 0;
+
+    FILE* file = fopen(path, "r");
+    if (!file)
+        return true;
+
+    char line[64];
+    while (crash_signature_known_count < crash_signature_known_capacity
+            && fgets(line, sizeof(line), file)) {
+        char* end = NULL;
+        uint64_t signature = strtoull(line, &end, 16);
+        if (end != line)
+            crash_signature_known[crash_signature_known_count++] = signature;
+    }
+    bool read = !ferror(file);
+    fclose(file);
+
+    qsort(crash_signature_known, crash_signature_known_count,
+            sizeof(uint64_t), CompareSignatures);
+    return read;
+}
+
+bool CrashSignature_IsKnown(uint64_t signature) {
+    size_t low = 0;
+    size_t high = crash_signature_known_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (crash_signature_known[middle] < signature)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low < crash_signature_known_count
+            && crash_signature_known[low] == signature;
+}
+
+bool CrashSignature_SaveKnown(const char* path, uint64_t signature) {
+    assert(path);
+    FILE* file = fopen(path, "a");
+    if (!file)
+        return false;
+    bool written = fprintf(file, "%016llx\n", (unsigned long long)signature) > 0;
+    return fclose(file) == 0 && written;
+}
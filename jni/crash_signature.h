@@ -0,0 +1,79 @@
+#ifndef CRASH_SIGNATURE_H
+#define CRASH_SIGNATURE_H
+
+// Crash bucketing in the signal handler: a 64-bit signature of the top
+// frames, computed by a predicate (see BacktraceState_SetPredicate())
+// in the same walk which captures them.
+//
+// Each of the top frames, from the interrupted PC on, contributes
+// the build id of its module (the path, if it has none) and its address
+// relative to the module base, which do not change with ASLR: the same
+// binaries crashing at the same place give the same signature on any
+// device. Modules are looked up in the ModuleMap, no dladdr().
+// Addresses outside of the known modules (JIT code, garbage at the end
+// of a broken walk) only contribute a marker.
+//
+// The methods do not always see the same frames: the frame pointer walk
+// misses the callers of functions without a frame record, for example.
+// So a crash may have a signature per method, but BacktraceWithFallback()
+// settles on the same method for the same crash.
+//
+// The signatures of the crashes already reported in full are loaded
+// at start-up with CrashSignature_LoadKnown(). For those, the handler
+// can write the signature alone, without the backtrace of the crashed
+// thread, the rest of the dump is the same.
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum { crash_signature_frame_count_max = 32 };
+static const size_t crash_signature_frame_count_default = 8;
+
+// Signatures CrashSignature_LoadKnown() keeps at most.
+enum { crash_signature_known_capacity = 4096 };
+
+struct CrashSignature {
+    // Frames to hash, at most crash_signature_frame_count_max.
+    size_t      frame_count_max;
+    uintptr_t   pc;
+
+    // Of the walk so far.
+    bool        pc_found;
+    size_t      frame_count;
+    uint64_t    hash;
+};
+typedef struct CrashSignature CrashSignature;
+
+
+// Async-signal-safe.
+void CrashSignature_Init(
+        CrashSignature* signature, const ucontext_t* signal_ucontext,
+        size_t frame_count_max);
+
+// BacktracePredicate, "signature_voidp" is a CrashSignature.
+// Never stops the walk. Starts over when a method does, and at the
+// interrupted PC, if handler frames come before it.
+// Takes the place of any other predicate. Async-signal-safe.
+bool CrashSignature_Predicate(
+        const BacktraceState* state, uintptr_t address, void* signature_voidp);
+
+// Async-signal-safe.
+uint64_t CrashSignature_Value(const CrashSignature* signature);
+
+// Reads signatures, one hexadecimal number per line. A missing file
+// is an empty set. Not async-signal-safe, call before installing
+// the handlers.
+bool CrashSignature_LoadKnown(const char* path);
+
+// Binary search of the loaded signatures. Async-signal-safe.
+bool CrashSignature_IsKnown(uint64_t signature);
+
+// Appends a signature to a file for CrashSignature_LoadKnown().
+// Not async-signal-safe.
+bool CrashSignature_SaveKnown(const char* path, uint64_t signature);
+
+#endif // CRASH_SIGNATURE_H
@@ -0,0 +1,331 @@
+#include "crash_snapshot.h"
+#include "backtrace.h"
+#include "crash_dump.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+
+#if __arm__
+static const uint16_t crash_snapshot_machine = EM_ARM;
+#elif __aarch64__
+static const uint16_t crash_snapshot_machine = EM_AARCH64;
+#elif __x86_64__
+static const uint16_t crash_snapshot_machine = EM_X86_64;
+#elif __i386__
+static const uint16_t crash_snapshot_machine = EM_386;
+#else
+#error "Unsupported architecture."
+#endif
+
+// Leaf functions may keep data below the stack pointer on x86_64.
+#if __x86_64__
+static const size_t crash_snapshot_red_zone_size = 128;
+#else
+static const size_t crash_snapshot_red_zone_size = 0;
+#endif
+
+static int crash_snapshot_fd = -1;
+static uint8_t* crash_snapshot_mapping;
+static size_t crash_snapshot_mapping_size;
+static atomic_flag crash_snapshot_written = ATOMIC_FLAG_INIT;
+
+
+static size_t RoundUpToPage(size_t size, size_t page_size) {
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
+// Writes zeros over the whole file, so that its blocks are allocated.
+// A store into a sparse page of a full disk would raise SIGBUS
+// in the handler.
+static bool Preallocate(int fd, size_t size, size_t page_size) {
+    void* zeros = calloc(1, page_size);
+    if (!zeros)
+        return false;
+
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < size; offset += page_size)
+        ok = pwrite(fd, zeros, page_size, (off_t)offset) == (ssize_t)page_size;
+    free(zeros);
+    return ok;
+}
+
+bool CrashSnapshot_Open(const char* path, size_t stack_size, size_t maps_size) {
+    assert(path);
+    assert(!crash_snapshot_mapping);
+
+    if (stack_size == 0)
+        stack_size = crash_snapshot_stack_size_default;
+    if (maps_size == 0)
+        maps_size = crash_snapshot_maps_size_default;
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t registers_offset = RoundUpToPage(sizeof(CrashSnapshotHeader), page_size);
+    size_t registers_size = sizeof(((const ucontext_t*)NULL)->uc_mcontext);
+    size_t stack_offset = registers_offset + RoundUpToPage(registers_size, page_size);
+    size_t stack_capacity = RoundUpToPage(stack_size, page_size);
+    size_t maps_offset = stack_offset + stack_capacity;
+    size_t maps_capacity = RoundUpToPage(maps_size, page_size);
+    size_t file_size = maps_offset + maps_capacity;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    if (!Preallocate(fd, file_size, page_size)) {
+        close(fd);
+        return false;
+    }
+    void* mapping = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    // Everything known in advance is filled in now.
+    CrashSnapshotHeader* header = (CrashSnapshotHeader*)mapping;
+    header->magic = crash_snapshot_magic;
+    header->version = crash_snapshot_version;
+    header->machine = crash_snapshot_machine;
+    header->pointer_size = sizeof(uintptr_t);
+    header->registers_offset = registers_offset;
+    header->registers_size = registers_size;
+    header->stack_offset = stack_offset;
+    header->stack_capacity = stack_capacity;
+    header->maps_offset = maps_offset;
+    header->maps_capacity = maps_capacity;
+
+    crash_snapshot_fd = fd;
+    crash_snapshot_mapping_size = file_size;
+    crash_snapshot_mapping = (uint8_t*)mapping;
+    atomic_flag_clear(&crash_snapshot_written);
+    return true;
+}
+
+// Writes from "data" up to the first unreadable byte.
+// Returns the number of bytes written.
+static size_t WriteAt(const void* data, size_t size, size_t offset) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    size_t written_size = 0;
+    while (written_size < size) {
+        ssize_t written = pwrite(crash_snapshot_fd, bytes + written_size,
+                size - written_size, (off_t)(offset + written_size));
+        if (written < 0 && errno == EINTR)
+            continue;
+        // EFAULT at the end of the readable memory.
+        if (written <= 0)
+            break;
+        written_size += (size_t)written;
+    }
+    return written_size;
+}
+
+// Reads /proc/self/maps right into the mapped file.
+static size_t ReadMaps(uint8_t* destination, size_t capacity) {
+    int maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps_fd < 0)
+        return 0;
+
+    size_t size = 0;
+    while (size < capacity) {
+        ssize_t read_size = read(maps_fd, destination + size, capacity - size);
+        if (read_size < 0 && errno == EINTR)
+            continue;
+        if (read_size <= 0)
+            break;
+        size += (size_t)read_size;
+    }
+
+    close(maps_fd);
+    return size;
+}
+
+bool CrashSnapshot_Write(int sig, const siginfo_t* info, const void* ucontext) {
+    if (!crash_snapshot_mapping || !ucontext
+            || atomic_flag_test_and_set(&crash_snapshot_written))
+        return false;
+
+    int saved_errno = errno;
+    const ucontext_t* signal_ucontext = (const ucontext_t*)ucontext;
+    CrashSnapshotHeader* header = (CrashSnapshotHeader*)crash_snapshot_mapping;
+
+    // Until the sections are written again.
+    header->complete = 0;
+    atomic_thread_fence(memory_order_release);
+
+    uintptr_t pc = 0;
+    uintptr_t sp = 0;
+    Backtrace_GetSignalRegisters(signal_ucontext, &pc, &sp);
+
+    header->signal = sig;
+    header->code = info ? info->si_code : 0;
+    header->tid = gettid();
+    header->fault_address = info ? (uintptr_t)info->si_addr : 0;
+    header->pc = pc;
+    header->sp = sp;
+
+    WriteAt(&signal_ucontext->uc_mcontext, (size_t)header->registers_size,
+            (size_t)header->registers_offset);
+
+    uintptr_t stack_address = sp >= crash_snapshot_red_zone_size
+            ? sp - crash_snapshot_red_zone_size : sp;
+    header->stack_address = stack_address;
+    header->stack_size = WriteAt((const void*)stack_address,
+            (size_t)header->stack_capacity, (size_t)header->stack_offset);
+
+    header->maps_size = ReadMaps(
+            crash_snapshot_mapping + header->maps_offset,
+            (size_t)header->maps_capacity);
+
+    // The stores above and the writes go to the same page cache pages.
+    // A reader finding "complete" set finds the sections written, too.
+    atomic_thread_fence(memory_order_release);
+    header->complete = 1;
+
+    atomic_flag_clear(&crash_snapshot_written);
+    errno = saved_errno;
+    return true;
+}
+
+void CrashSnapshot_Close() {
+    if (crash_snapshot_mapping) {
+        munmap(crash_snapshot_mapping, crash_snapshot_mapping_size);
+        crash_snapshot_mapping = NULL;
+        crash_snapshot_mapping_size = 0;
+    }
+    if (crash_snapshot_fd >= 0) {
+        close(crash_snapshot_fd);
+        crash_snapshot_fd = -1;
+    }
+}
+
+
+static bool IsSectionValid(uint64_t offset, uint64_t size, size_t file_size) {
+    return offset <= file_size && size <= file_size - offset;
+}
+
+static void PrintScannedFrame(
+        size_t frame_index, uintptr_t address,
+        const CrashDumpMapping* mappings, size_t mapping_count) {
+    const char* symbol_name = "";
+    unsigned long relative_address = address;
+
+    const CrashDumpMapping* dumped = CrashDump_FindMapping(
+            mappings, mapping_count, address);
+    if (dumped) {
+        relative_address = address - dumped->module_base;
+        const Module* current = ModuleMap_FindModuleByPath(dumped->path);
+        if (current) {
+            const char* name = Module_FindSymbol(
+                    current, current->base + relative_address);
+            if (name)
+                symbol_name = name;
+        }
+    }
+
+    PrintFrame(frame_index, relative_address, symbol_name);
+}
+
+// Words of the saved stack pointing into executable mappings.
+// Like a stack scan of a minidump processor, without CFI it also finds
+// stale return addresses and function pointers, so the frames
+// are only candidates.
+static void PrintStackScan(
+        const CrashSnapshotHeader* header, const uint8_t* stack,
+        const CrashDumpMapping* mappings, size_t mapping_count) {
+    size_t frame_index = 0;
+    PrintScannedFrame(frame_index++, (uintptr_t)header->pc,
+            mappings, mapping_count);
+
+    for (size_t offset = 0;
+            offset + sizeof(uintptr_t) <= header->stack_size
+                && frame_index < backtrace_depth_max;
+            offset += sizeof(uintptr_t)) {
+        uintptr_t word = 0;
+        memcpy(&word, stack + offset, sizeof(word));
+
+        const CrashDumpMapping* mapping = CrashDump_FindMapping(
+                mappings, mapping_count, word);
+        if (mapping && mapping->executable)
+            PrintScannedFrame(frame_index++, word, mappings, mapping_count);
+    }
+}
+
+bool CrashSnapshot_Print(const char* path) {
+    assert(path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CrashSnapshotHeader)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    const uint8_t* data = (const uint8_t*)mapping;
+    CrashSnapshotHeader header = {};
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != crash_snapshot_magic
+            || header.version != crash_snapshot_version
+            || !header.complete
+            || !IsSectionValid(header.registers_offset, header.registers_size, size)
+            || !IsSectionValid(header.stack_offset, header.stack_size, size)
+            || !IsSectionValid(header.maps_offset, header.maps_size, size)) {
+        munmap(mapping, size);
+        return false;
+    }
+
+    printf("Snapshot of thread %i, signal %i (code %i), fault address 0x%llx.\n",
+            header.tid, header.signal, header.code,
+            (unsigned long long)header.fault_address);
+    printf("pc 0x%llx, sp 0x%llx, %llu bytes of registers, "
+            "%llu bytes of stack from 0x%llx.\n",
+            (unsigned long long)header.pc, (unsigned long long)header.sp,
+            (unsigned long long)header.registers_size,
+            (unsigned long long)header.stack_size,
+            (unsigned long long)header.stack_address);
+
+    // Addresses can only be interpreted for the same architecture.
+    if (header.machine != crash_snapshot_machine
+            || header.pointer_size != sizeof(uintptr_t)) {
+        munmap(mapping, size);
+        return true;
+    }
+
+    char* maps = (char*)malloc((size_t)header.maps_size + 1);
+    if (maps) {
+        memcpy(maps, data + header.maps_offset, (size_t)header.maps_size);
+        maps[header.maps_size] = '\0';
+
+        size_t mapping_count = 0;
+        CrashDumpMapping* mappings = CrashDump_ParseMaps(maps, &mapping_count);
+        ModuleMap_Refresh();
+
+        printf("Stack scan:\n");
+        PrintStackScan(&header, data + header.stack_offset,
+                mappings, mapping_count);
+
+        free(mappings);
+        free(maps);
+    }
+
+    munmap(mapping, size);
+    return true;
+}
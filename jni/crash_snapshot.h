@@ -0,0 +1,97 @@
+#ifndef CRASH_SNAPSHOT_H
+#define CRASH_SNAPSHOT_H
+
+// Minidump-style snapshot of the crashing thread: its registers,
+// a window of raw stack memory starting at the stack pointer,
+// and /proc/self/maps. Unlike the crash dump, nothing is unwound
+// in the handler, so it works even when the unwind tables or
+// the frame chain are broken. Unwinding (with DWARF CFI, or scanning
+// the stack for return addresses) happens off-device, from the file.
+//
+// The file is created, sized and mapped in advance. In the handler,
+// the header fields are stored straight into the mapped page,
+// the registers and the stack are written from where they are with
+// pwrite(2), and the maps are read(2) straight into the mapped file.
+// There is no intermediate buffer and no memcpy(). The kernel also does
+// the copy of the stack fault-safe: a window running past the end of
+// the stack is cut short with EFAULT, not with another SIGSEGV.
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+static const uint32_t crash_snapshot_magic = 0x53535442; // "BTSS"
+static const uint32_t crash_snapshot_version = 1;
+
+// Default size of the saved stack window.
+static const size_t crash_snapshot_stack_size_default = 32 * 1024;
+// Default capacity for /proc/self/maps. An app process with ART
+// has a couple thousand mappings.
+static const size_t crash_snapshot_maps_size_default = 256 * 1024;
+
+// At the file start. The sections follow at page-aligned offsets,
+// each one "capacity" bytes large, of which "size" are used.
+struct CrashSnapshotHeader {
+    uint32_t    magic;
+    uint32_t    version;
+
+    // ELF e_machine and pointer size of the crashed process,
+    // to interpret the registers.
+    uint16_t    machine;
+    uint16_t    pointer_size;
+
+    // Set last, after all the sections are written.
+    uint32_t    complete;
+
+    int32_t     signal;
+    int32_t     code;
+    int32_t     tid;
+    uint32_t    reserved;
+
+    uint64_t    fault_address;
+    uint64_t    pc;
+    uint64_t    sp;
+
+    // Raw uc_mcontext of the signal handler, in the layout
+    // of the platform headers for "machine".
+    uint64_t    registers_offset;
+    uint64_t    registers_size;
+
+    // Stack memory from "stack_address" up.
+    uint64_t    stack_address;
+    uint64_t    stack_offset;
+    uint64_t    stack_capacity;
+    uint64_t    stack_size;
+
+    // /proc/self/maps text, truncated to the capacity.
+    uint64_t    maps_offset;
+    uint64_t    maps_capacity;
+    uint64_t    maps_size;
+};
+typedef struct CrashSnapshotHeader CrashSnapshotHeader;
+
+
+// Creates the file and preallocates it for "stack_size" bytes of stack
+// (0 means crash_snapshot_stack_size_default) and "maps_size" bytes
+// of maps (0 means crash_snapshot_maps_size_default).
+// Must be called before the signal handler is installed,
+// not from the handler.
+bool CrashSnapshot_Open(const char* path, size_t stack_size, size_t maps_size);
+
+// Async-signal-safe. Writes over the snapshot of a previous crash,
+// which the process recovered from. Returns false while another call
+// is writing.
+bool CrashSnapshot_Write(int sig, const siginfo_t* info, const void* ucontext);
+
+void CrashSnapshot_Close();
+
+// Prints the header and the candidate return addresses found
+// by scanning the saved stack: words pointing into executable mappings.
+// Symbols are resolved for modules which are loaded here too.
+// Returns false, if the file is missing or incomplete.
+// Not async-signal-safe.
+bool CrashSnapshot_Print(const char* path);
+
+#endif // CRASH_SNAPSHOT_H
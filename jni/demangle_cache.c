@@ -0,0 +1,178 @@
+#include "demangle_cache.h"
+#include "capture_counters.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if __cplusplus
+extern "C"
+#endif
+char* __cxa_demangle(
+        const char* mangled_name,
+        char* output_buffer,
+        size_t* length,
+        int* status);
+
+
+static const size_t demangle_arena_chunk_size = 64 * 1024;
+static const size_t demangle_cache_initial_capacity = 1024;
+
+struct DemangleArenaChunk {
+    struct DemangleArenaChunk*  next;
+    size_t                      used;
+    size_t                      capacity;
+    char                        data[];
+};
+typedef struct DemangleArenaChunk DemangleArenaChunk;
+
+struct DemangleCacheEntry {
+    // NULL for an empty slot.
+    const char* symbol_name;
+    const char* demangled;
+    uint32_t    hash;
+};
+typedef struct DemangleCacheEntry DemangleCacheEntry;
+
+
+static char* Arena_CopyString(DemangleCache* cache, const char* string) {
+    size_t size = strlen(string) + 1;
+
+    DemangleArenaChunk* chunk = cache->arena;
+    if (!chunk || chunk->capacity - chunk->used < size) {
+        size_t capacity = demangle_arena_chunk_size;
+        if (capacity < size)
+            capacity = size;
+        chunk = (DemangleArenaChunk*)malloc(sizeof(DemangleArenaChunk) + capacity);
+        if (!chunk)
+            return NULL;
+        chunk->next = cache->arena;
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        cache->arena = chunk;
+    }
+
+    char* copy = chunk->data + chunk->used;
+    memcpy(copy, string, size);
+    chunk->used += size;
+    return copy;
+}
+
+// FNV-1a.
+static uint32_t HashString(const char* string) {
+    uint32_t hash = 2166136261u;
+    for (; *string; ++string) {
+        hash ^= (uint8_t)*string;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static DemangleCacheEntry* FindSlot(
+        DemangleCacheEntry* entries, size_t capacity,
+        const char* symbol_name, uint32_t hash) {
+    size_t mask = capacity - 1;
+    for (size_t index = hash & mask;; index = (index + 1) & mask) {
+        DemangleCacheEntry* entry = &entries[index];
+        if (!entry->symbol_name)
+            return entry;
+        if (entry->hash == hash && strcmp(entry->symbol_name, symbol_name) == 0)
+            return entry;
+    }
+}
+
+static bool Grow(DemangleCache* cache) {
+    size_t capacity = cache->entry_capacity
+            ? cache->entry_capacity * 2
+            : demangle_cache_initial_capacity;
+    DemangleCacheEntry* entries =
+            (DemangleCacheEntry*)calloc(capacity, sizeof(DemangleCacheEntry));
+    if (!entries)
+        return false;
+
+    for (size_t i = 0; i < cache->entry_capacity; ++i) {
+        const DemangleCacheEntry* entry = &cache->entries[i];
+        if (entry->symbol_name)
+            *FindSlot(entries, capacity, entry->symbol_name, entry->hash) = *entry;
+    }
+
+    free(cache->entries);
+    cache->entries = entries;
+    cache->entry_capacity = capacity;
+    return true;
+}
+
+
+void DemangleCache_Init(DemangleCache* cache) {
+    assert(cache);
+    memset(cache, 0, sizeof(DemangleCache));
+}
+
+void DemangleCache_Destroy(DemangleCache* cache) {
+    assert(cache);
+
+    DemangleArenaChunk* chunk = cache->arena;
+    while (chunk) {
+        DemangleArenaChunk* next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(cache->entries);
+    free(cache->scratch);
+    memset(cache, 0, sizeof(DemangleCache));
+}
+
+const char* DemangleCache_Demangle(DemangleCache* cache, const char* symbol_name) {
+    assert(cache);
+    assert(symbol_name);
+
+    // Only names starting with "_Z" can be mangled by the Itanium C++ ABI.
+    if (symbol_name[0] != '_' || symbol_name[1] != 'Z')
+        return symbol_name;
+
+    // Keep the load factor under 3/4.
+    if ((cache->entry_count + 1) * 4 > cache->entry_capacity * 3) {
+        if (!Grow(cache))
+            return symbol_name;
+    }
+
+    uint32_t hash = HashString(symbol_name);
+    DemangleCacheEntry* entry = FindSlot(
+            cache->entries, cache->entry_capacity, symbol_name, hash);
+    if (entry->symbol_name)
+        return entry->demangled ? entry->demangled : symbol_name;
+
+    int status = 0;
+    size_t length = cache->scratch_size;
+    uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+    char* demangled = __cxa_demangle(
+            symbol_name, cache->scratch, &length, &status);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DEMANGLE_TIME,
+            CAPTURE_COUNTERS_TICKS() - start_ticks);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DEMANGLE_COUNT, 1);
+    if (demangled) {
+        // __cxa_demangle() may have realloc'ed the buffer,
+        // "length" is its new size then.
+        if (demangled != cache->scratch || length > cache->scratch_size) {
+            cache->scratch = demangled;
+            cache->scratch_size = length;
+        }
+    }
+
+    const char* key = Arena_CopyString(cache, symbol_name);
+    if (!key)
+        return symbol_name;
+
+    entry->symbol_name = key;
+    entry->hash = hash;
+
+    // Failed demangling is cached too, as NULL.
+    entry->demangled = NULL;
+    if (demangled && status == 0)
+        entry->demangled = Arena_CopyString(cache, demangled);
+    ++cache->entry_count;
+
+    return entry->demangled ? entry->demangled : symbol_name;
+}
@@ -0,0 +1,48 @@
+#ifndef DEMANGLE_CACHE_H
+#define DEMANGLE_CACHE_H
+
+// Cache of demangled symbol names.
+//
+// The same symbols repeat in almost every backtrace,
+// so each name is demangled once. Both the raw and the demangled names
+// are copied into a bump arena, which is only freed as a whole.
+// __cxa_demangle() writes into a reusable scratch buffer,
+// so there is no malloc()/free() per frame once the cache is warm.
+//
+// Names which do not start with "_Z" are never mangled
+// (C symbols, for example) and are returned as they are,
+// without a lookup.
+//
+// Not thread-safe, use one cache per thread.
+// Not async-signal-safe.
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct DemangleCacheEntry;
+struct DemangleArenaChunk;
+
+struct DemangleCache {
+    struct DemangleCacheEntry*  entries;
+    size_t                      entry_capacity;
+    size_t                      entry_count;
+
+    struct DemangleArenaChunk*  arena;
+
+    // Output buffer for __cxa_demangle(), grown with realloc() by it.
+    char*                       scratch;
+    size_t                      scratch_size;
+};
+typedef struct DemangleCache DemangleCache;
+
+
+void DemangleCache_Init(DemangleCache* cache);
+void DemangleCache_Destroy(DemangleCache* cache);
+
+// Returns the demangled name, or the symbol name itself if it is not
+// a mangled C++ name. The returned string lives until
+// DemangleCache_Destroy().
+const char* DemangleCache_Demangle(DemangleCache* cache, const char* symbol_name);
+
+#endif // DEMANGLE_CACHE_H
@@ -0,0 +1,121 @@
+#include "fatal_signal.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+static const int fatal_signals[] = {
+    SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTRAP,
+};
+enum { fatal_signal_count = sizeof(fatal_signals) / sizeof(fatal_signals[0]) };
+
+// How long a second crashing thread waits for the first one's dump.
+static const unsigned int fatal_signal_wait_ms = 5000;
+
+static FatalSignalHandler fatal_signal_handler;
+static struct sigaction fatal_signal_previous_actions[fatal_signal_count];
+static bool fatal_signal_installed;
+static atomic_flag fatal_signal_handling = ATOMIC_FLAG_INIT;
+
+
+static const struct sigaction* FindPreviousAction(int sig) {
+    for (size_t i = 0; i < fatal_signal_count; ++i) {
+        if (fatal_signals[i] == sig)
+            return &fatal_signal_previous_actions[i];
+    }
+    return NULL;
+}
+
+// Signals sent with kill(), tgkill() or raise() (abort() among them)
+// are not re-triggered by returning from the handler, unlike faults.
+static bool IsSentSignal(const siginfo_t* info) {
+    return info == NULL || info->si_code <= 0;
+}
+
+static void ChainToPreviousAction(int sig, siginfo_t* info, void* ucontext) {
+    const struct sigaction* previous = FindPreviousAction(sig);
+    if (previous && (previous->sa_flags & SA_SIGINFO)) {
+        if (previous->sa_sigaction) {
+            previous->sa_sigaction(sig, info, ucontext);
+            return;
+        }
+    } else if (previous && previous->sa_handler == SIG_IGN) {
+        return;
+    } else if (previous && previous->sa_handler != SIG_DFL) {
+        previous->sa_handler(sig);
+        return;
+    }
+
+    // Default action: the process dies with the original signal
+    // once the handler returns, as if there was no handler at all.
+    struct sigaction action = {};
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = SIG_DFL;
+    sigaction(sig, &action, NULL);
+
+    // Blocked until the handler returns.
+    if (IsSentSignal(info))
+        syscall(SYS_tgkill, getpid(), gettid(), sig);
+}
+
+static void FatalSignalDispatcher(int sig, siginfo_t* info, void* ucontext) {
+    bool handling = !atomic_flag_test_and_set(&fatal_signal_handling);
+    if (handling) {
+        fatal_signal_handler(sig, info, ucontext);
+    } else {
+        // Another thread is capturing. If it does not terminate
+        // the process in time, carry on with the previous action.
+        struct timespec wait = {
+            fatal_signal_wait_ms / 1000, (fatal_signal_wait_ms % 1000) * 1000000L,
+        };
+        while (nanosleep(&wait, &wait) != 0) {
+        }
+    }
+
+    ChainToPreviousAction(sig, info, ucontext);
+
+    // The previous action may have recovered, as ART does for
+    // implicit null checks. The next crash is handled again.
+    if (handling)
+        atomic_flag_clear(&fatal_signal_handling);
+}
+
+
+bool FatalSignal_Install(FatalSignalHandler handler) {
+    assert(handler);
+    assert(!fatal_signal_installed);
+    fatal_signal_handler = handler;
+
+    struct sigaction action = {};
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < fatal_signal_count; ++i)
+        sigaddset(&action.sa_mask, fatal_signals[i]);
+    action.sa_sigaction = FatalSignalDispatcher;
+    action.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+
+    for (size_t i = 0; i < fatal_signal_count; ++i) {
+        if (sigaction(fatal_signals[i], &action,
+                    &fatal_signal_previous_actions[i]) != 0) {
+            while (i-- > 0)
+                sigaction(fatal_signals[i], &fatal_signal_previous_actions[i], NULL);
+            return false;
+        }
+    }
+
+    fatal_signal_installed = true;
+    return true;
+}
+
+void FatalSignal_Uninstall() {
+    if (!fatal_signal_installed)
+        return;
+
+    for (size_t i = 0; i < fatal_signal_count; ++i)
+        sigaction(fatal_signals[i], &fatal_signal_previous_actions[i], NULL);
+    fatal_signal_installed = false;
+}
@@ -0,0 +1,39 @@
+#ifndef FATAL_SIGNAL_H
+#define FATAL_SIGNAL_H
+
+// Crash handler installation for all the fatal signals:
+// SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT and SIGTRAP.
+//
+// The actions installed before (debuggerd, ART's fault handler,
+// the crash reporter of another library) are saved, and called after
+// the handler returns, with the same arguments. A previous default action
+// is restored and re-triggered, so the process still dies with
+// the original signal and debuggerd still writes its tombstone.
+//
+// On Android, ART's libsigchain intercepts sigaction() and calls its own
+// handler first, so implicit null checks and stack overflow checks are
+// resolved before this handler runs. On other setups, the handler is
+// called directly: nothing but one atomic flag is touched before it,
+// so a fault which only the previous action handles costs the capture.
+// If the previous action recovers, the handler is armed again and runs
+// for the next fatal signal too: whatever it writes to must stay open.
+//
+// Only one thread runs the handler. A second thread crashing meanwhile
+// waits, so that the first one can finish its dump before the process
+// is terminated.
+
+#include <signal.h>
+#include <stdbool.h>
+
+
+typedef void (*FatalSignalHandler)(int sig, siginfo_t* info, void* ucontext);
+
+// Installs the handler on the alternate signal stack, with
+// all the fatal signals blocked while it runs. Call once, at start-up,
+// before any thread may crash. Not async-signal-safe.
+bool FatalSignal_Install(FatalSignalHandler handler);
+
+// Puts the saved actions back.
+void FatalSignal_Uninstall();
+
+#endif // FATAL_SIGNAL_H
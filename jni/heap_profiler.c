@@ -0,0 +1,389 @@
+#include "heap_profiler.h"
+#include "backtrace.h"
+#include "stack_table.h"
+#include "stack_trie.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+// Frames of the hook itself, innermost first: UnwindBacktraceWithSkipping(),
+// SampleAllocation(), HeapProfiler_OnAllocation() and the allocator
+// wrapper, for example malloc() of the shim.
+static const size_t heap_profiler_skip_count = 4;
+
+// Never returned by an allocator, marks a removed live sample.
+static const uintptr_t heap_live_removed = 1;
+
+struct HeapLiveSlot {
+    _Atomic uintptr_t   pointer;
+    uint32_t            stack_id;
+    uint64_t            weight;
+};
+typedef struct HeapLiveSlot HeapLiveSlot;
+
+struct HeapProfilerThread {
+    int64_t     bytes_until_sample;
+    uint64_t    random_state;
+    // Allocations of the profiler itself and of the unwinder
+    // are not sampled.
+    bool        in_hook;
+    uintptr_t   addresses[];
+};
+typedef struct HeapProfilerThread HeapProfilerThread;
+
+static HeapProfilerConfig heap_config;
+static atomic_bool heap_sampling;
+static pthread_key_t heap_thread_key;
+
+static StackTable* heap_stack_table;
+static size_t heap_stack_capacity;
+
+// Sampled allocations which have not been freed yet.
+// Open addressing by pointer. Inserted under heap_mutex,
+// looked up by every free without it.
+static HeapLiveSlot* heap_live_slots;
+static size_t heap_live_capacity;
+static _Atomic uint32_t heap_live_count;
+
+// Guards everything below, only taken for the sampled allocations.
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+static size_t heap_live_used;
+static uint64_t* heap_live_bytes;
+static uint64_t* heap_allocated_bytes;
+static HeapProfilerStats heap_stats;
+
+
+static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+static size_t HashPointer(uintptr_t pointer) {
+    uint64_t hash = (uint64_t)pointer * 0x9e3779b97f4a7c15ull;
+    return (size_t)(hash >> 32);
+}
+
+static uint64_t NextRandom(HeapProfilerThread* thread) {
+    // xorshift64*
+    uint64_t x = thread->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    thread->random_state = x;
+    return x * 0x2545f4914f6cdd1dull;
+}
+
+// Uniform in [1, 2 * interval]: the right mean without log().
+static int64_t NextInterval(HeapProfilerThread* thread) {
+    uint64_t interval = heap_config.sample_interval_bytes;
+    return (int64_t)(1 + NextRandom(thread) % (2 * interval));
+}
+
+static void ThreadExitDestructor(void* thread_voidp) {
+    heap_config.deallocate(thread_voidp);
+}
+
+// The state is allocated with the allocator below the hooks.
+// pthread_setspecific() does not allocate on bionic,
+// nor on glibc for the first 32 keys.
+static HeapProfilerThread* GetThread() {
+    HeapProfilerThread* thread =
+            (HeapProfilerThread*)pthread_getspecific(heap_thread_key);
+    if (thread)
+        return thread;
+
+    thread = (HeapProfilerThread*)heap_config.allocate(
+            sizeof(HeapProfilerThread) + heap_config.depth * sizeof(uintptr_t));
+    if (!thread)
+        return NULL;
+    memset(thread, 0, sizeof(HeapProfilerThread));
+
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    thread->random_state = ((uint64_t)(uintptr_t)thread ^ (uint64_t)now.tv_nsec)
+            | 1;
+    thread->bytes_until_sample = NextInterval(thread);
+
+    if (pthread_setspecific(heap_thread_key, thread) != 0) {
+        heap_config.deallocate(thread);
+        return NULL;
+    }
+    return thread;
+}
+
+
+bool HeapProfiler_Start(const HeapProfilerConfig* config) {
+    assert(config);
+    assert(config->allocate && config->deallocate);
+    assert(!heap_stack_table);
+
+    heap_config = *config;
+    if (heap_config.sample_interval_bytes == 0)
+        heap_config.sample_interval_bytes = heap_profiler_sample_interval_default;
+    if (heap_config.depth == 0)
+        heap_config.depth = heap_profiler_depth_default;
+    if (heap_config.depth < backtrace_depth_min)
+        heap_config.depth = backtrace_depth_min;
+    if (heap_config.depth > backtrace_depth_max)
+        heap_config.depth = backtrace_depth_max;
+
+    size_t stack_capacity = RoundUpToPowerOfTwo(
+            config->stack_capacity ? config->stack_capacity : 4096);
+    size_t live_capacity = RoundUpToPowerOfTwo(
+            config->live_capacity ? config->live_capacity : 16384);
+
+    StackTable* table = StackTable_Create(
+            stack_capacity, stack_capacity * heap_config.depth);
+    if (!table)
+        return false;
+
+    size_t live_size = live_capacity * sizeof(HeapLiveSlot);
+    size_t bytes_size = stack_capacity * sizeof(uint64_t);
+    heap_live_slots = (HeapLiveSlot*)heap_config.allocate(live_size);
+    heap_live_bytes = (uint64_t*)heap_config.allocate(bytes_size);
+    heap_allocated_bytes = (uint64_t*)heap_config.allocate(bytes_size);
+    if (!heap_live_slots || !heap_live_bytes || !heap_allocated_bytes
+            || pthread_key_create(&heap_thread_key, ThreadExitDestructor) != 0) {
+        heap_config.deallocate(heap_allocated_bytes);
+        heap_config.deallocate(heap_live_bytes);
+        heap_config.deallocate(heap_live_slots);
+        StackTable_Destroy(table);
+        return false;
+    }
+    memset(heap_live_slots, 0, live_size);
+    memset(heap_live_bytes, 0, bytes_size);
+    memset(heap_allocated_bytes, 0, bytes_size);
+
+    heap_live_capacity = live_capacity;
+    heap_stack_capacity = stack_capacity;
+    heap_stack_table = table;
+    atomic_store(&heap_sampling, true);
+    return true;
+}
+
+void HeapProfiler_Stop() {
+    atomic_store(&heap_sampling, false);
+}
+
+// Called with heap_mutex held.
+static bool InsertLive(uintptr_t pointer, uint32_t stack_id, uint64_t weight) {
+    // At most 3/4 full, counting the removed slots, so that
+    // the probes of the frees stay short.
+    if (heap_live_used + 1 > heap_live_capacity / 4 * 3)
+        return false;
+
+    size_t mask = heap_live_capacity - 1;
+    for (size_t slot = HashPointer(pointer) & mask;; slot = (slot + 1) & mask) {
+        HeapLiveSlot* live = &heap_live_slots[slot];
+        uintptr_t current = atomic_load_explicit(
+                &live->pointer, memory_order_relaxed);
+        if (current != 0 && current != heap_live_removed)
+            continue;
+
+        live->stack_id = stack_id;
+        live->weight = weight;
+        atomic_store_explicit(&live->pointer, pointer, memory_order_release);
+        if (current == 0)
+            ++heap_live_used;
+        atomic_fetch_add_explicit(&heap_live_count, 1, memory_order_relaxed);
+        return true;
+    }
+}
+
+// Not inlined: heap_profiler_skip_count counts its frame.
+static void SampleAllocation(
+        HeapProfilerThread* thread, uintptr_t pointer, size_t size)
+        __attribute__((noinline));
+
+static void SampleAllocation(
+        HeapProfilerThread* thread, uintptr_t pointer, size_t size) {
+    BacktraceState state;
+    BacktraceState_Init(&state, NULL, thread->addresses, heap_config.depth);
+    state.address_skip_count = heap_profiler_skip_count;
+    UnwindBacktraceWithSkipping(&state);
+
+    uint64_t weight = size > heap_config.sample_interval_bytes
+            ? size : heap_config.sample_interval_bytes;
+
+    pthread_mutex_lock(&heap_mutex);
+    uint32_t stack_id = StackTable_Intern(
+            heap_stack_table, state.addresses, state.address_count);
+    if (stack_id == stack_table_invalid_id
+            || !InsertLive(pointer, stack_id, weight)) {
+        ++heap_stats.dropped_count;
+    } else {
+        ++heap_stats.sample_count;
+        ++heap_stats.live_sample_count;
+        heap_stats.live_bytes += weight;
+        heap_live_bytes[stack_id] += weight;
+        heap_allocated_bytes[stack_id] += weight;
+    }
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+void HeapProfiler_OnAllocation(void* pointer, size_t size) {
+    if (!pointer || size == 0
+            || !atomic_load_explicit(&heap_sampling, memory_order_relaxed))
+        return;
+
+    HeapProfilerThread* thread = GetThread();
+    if (!thread || thread->in_hook)
+        return;
+
+    // Allocations of the interval or more are all sampled, at their size,
+    // and leave the countdown alone. The overshoot of the others is carried
+    // over, otherwise the gaps between samples would be longer than
+    // the interval on average, and the samples would undercount.
+    bool large = size >= heap_config.sample_interval_bytes;
+    if (!large) {
+        thread->bytes_until_sample -= (int64_t)size;
+        if (thread->bytes_until_sample > 0)
+            return;
+    }
+
+    thread->in_hook = true;
+    SampleAllocation(thread, (uintptr_t)pointer, size);
+    if (!large)
+        thread->bytes_until_sample += NextInterval(thread);
+    thread->in_hook = false;
+}
+
+void HeapProfiler_OnFree(void* pointer) {
+    HeapProfilerSample sample;
+    HeapProfiler_TakeSample(pointer, &sample);
+}
+
+bool HeapProfiler_TakeSample(void* pointer, HeapProfilerSample* sample) {
+    assert(sample);
+    if (!pointer
+            || atomic_load_explicit(&heap_live_count, memory_order_relaxed) == 0)
+        return false;
+
+    // A free by the unwinder, while SampleAllocation() holds the lock.
+    HeapProfilerThread* thread =
+            (HeapProfilerThread*)pthread_getspecific(heap_thread_key);
+    if (thread && thread->in_hook)
+        return false;
+
+    size_t mask = heap_live_capacity - 1;
+    for (size_t slot = HashPointer((uintptr_t)pointer) & mask;;
+            slot = (slot + 1) & mask) {
+        HeapLiveSlot* live = &heap_live_slots[slot];
+        uintptr_t current = atomic_load_explicit(
+                &live->pointer, memory_order_acquire);
+        if (current == 0)
+            return false;
+        if (current != (uintptr_t)pointer)
+            continue;
+
+        // Read before the slot is released for reuse.
+        uint32_t stack_id = live->stack_id;
+        uint64_t weight = live->weight;
+        if (!atomic_compare_exchange_strong(
+                    &live->pointer, &current, heap_live_removed))
+            return false;
+        atomic_fetch_sub_explicit(&heap_live_count, 1, memory_order_relaxed);
+
+        pthread_mutex_lock(&heap_mutex);
+        heap_live_bytes[stack_id] -= weight;
+        --heap_stats.live_sample_count;
+        heap_stats.live_bytes -= weight;
+        pthread_mutex_unlock(&heap_mutex);
+
+        sample->stack_id = stack_id;
+        sample->weight = weight;
+        return true;
+    }
+}
+
+void HeapProfiler_RestoreSample(void* pointer, const HeapProfilerSample* sample) {
+    assert(pointer);
+    assert(sample);
+
+    pthread_mutex_lock(&heap_mutex);
+    if (InsertLive((uintptr_t)pointer, sample->stack_id, sample->weight)) {
+        heap_live_bytes[sample->stack_id] += sample->weight;
+        ++heap_stats.live_sample_count;
+        heap_stats.live_bytes += sample->weight;
+    } else {
+        ++heap_stats.dropped_count;
+    }
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+void HeapProfiler_GetStats(HeapProfilerStats* stats) {
+    assert(stats);
+    pthread_mutex_lock(&heap_mutex);
+    *stats = heap_stats;
+    pthread_mutex_unlock(&heap_mutex);
+}
+
+struct HeapStackVisit {
+    const uint64_t*         live_bytes;
+    const uint64_t*         allocated_bytes;
+    HeapProfilerCallback    callback;
+    void*                   context;
+};
+typedef struct HeapStackVisit HeapStackVisit;
+
+static void VisitStack(
+        uint32_t stack_id, const uintptr_t* addresses, size_t address_count,
+        uint32_t count, void* visit_voidp) {
+    const HeapStackVisit* visit = (const HeapStackVisit*)visit_voidp;
+    visit->callback(addresses, address_count, visit->live_bytes[stack_id],
+            visit->allocated_bytes[stack_id], visit->context);
+}
+
+void HeapProfiler_ForEachStack(HeapProfilerCallback callback, void* context) {
+    assert(callback);
+    if (!heap_stack_table)
+        return;
+
+    // The callback may allocate and free, so it runs on a copy,
+    // without the lock.
+    size_t bytes_size = heap_stack_capacity * sizeof(uint64_t);
+    uint64_t* live_bytes = (uint64_t*)heap_config.allocate(bytes_size);
+    uint64_t* allocated_bytes = (uint64_t*)heap_config.allocate(bytes_size);
+    if (live_bytes && allocated_bytes) {
+        pthread_mutex_lock(&heap_mutex);
+        memcpy(live_bytes, heap_live_bytes, bytes_size);
+        memcpy(allocated_bytes, heap_allocated_bytes, bytes_size);
+        pthread_mutex_unlock(&heap_mutex);
+
+        HeapStackVisit visit = {live_bytes, allocated_bytes, callback, context};
+        StackTable_ForEach(heap_stack_table, VisitStack, &visit);
+    }
+    heap_config.deallocate(allocated_bytes);
+    heap_config.deallocate(live_bytes);
+}
+
+static void AddLiveStack(
+        const uintptr_t* addresses, size_t address_count,
+        uint64_t live_bytes, uint64_t allocated_bytes, void* trie_voidp) {
+    if (live_bytes > 0)
+        StackTrie_Add((StackTrie*)trie_voidp, addresses, address_count, live_bytes);
+}
+
+bool HeapProfiler_WriteCollapsed(const char* path) {
+    assert(path);
+
+    StackTrie* trie = StackTrie_Create();
+    if (!trie)
+        return false;
+    HeapProfiler_ForEachStack(AddLiveStack, trie);
+
+    FILE* file = fopen(path, "w");
+    bool ok = file && StackTrie_WriteCollapsed(trie, file) >= 0;
+    if (file && fclose(file) != 0)
+        ok = false;
+
+    StackTrie_Destroy(trie);
+    return ok;
+}
@@ -0,0 +1,95 @@
+#ifndef HEAP_PROFILER_H
+#define HEAP_PROFILER_H
+
+// Sampling heap profiler: allocation sites of the live memory.
+//
+// Every thread counts down the bytes it allocates, and the allocation
+// which crosses zero is sampled: its stack is captured with
+// UNWIND_BACKTRACE_WITH_SKIPPING_METHOD, skipping the hook frames,
+// and interned in a StackTable. Then the countdown restarts from
+// a random interval, "sample_interval_bytes" on average, so that
+// periodic allocation patterns are not sampled in lockstep.
+// Allocations of the interval or more are always sampled.
+// A sample stands for max(size, interval) bytes.
+//
+// Unsampled allocations only cost the countdown. Frees cost one probe
+// of the table of sampled pointers, which is lock-free; only frees of
+// the sampled allocations take the lock.
+//
+// The hooks are called by the malloc shim (heap_profiler_shim.c,
+// built as a library for LD_PRELOAD), since bionic has no malloc hooks
+// before Android 9, but they can be called by any allocator wrapper.
+// Not async-signal-safe.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct HeapProfilerConfig {
+    size_t          sample_interval_bytes;
+    // Frames per stack, innermost first.
+    size_t          depth;
+    // Unique stacks, and sampled allocations live at the same time.
+    size_t          stack_capacity;
+    size_t          live_capacity;
+
+    // The allocator below the hooks, for the profiler's own memory.
+    void*           (*allocate)(size_t size);
+    void            (*deallocate)(void* pointer);
+};
+typedef struct HeapProfilerConfig HeapProfilerConfig;
+
+static const size_t heap_profiler_sample_interval_default = 128 * 1024;
+static const size_t heap_profiler_depth_default = 16;
+
+struct HeapProfilerStats {
+    uint64_t    sample_count;
+    // Samples lost to a full stack table or a full table of live samples.
+    uint64_t    dropped_count;
+    uint64_t    live_sample_count;
+    uint64_t    live_bytes;
+};
+typedef struct HeapProfilerStats HeapProfilerStats;
+
+// A sampled allocation, taken out of the live ones by HeapProfiler_TakeSample().
+struct HeapProfilerSample {
+    uint32_t    stack_id;
+    uint64_t    weight;
+};
+typedef struct HeapProfilerSample HeapProfilerSample;
+
+// Per unique stack: estimated live bytes and allocated bytes
+// (including the freed ones), the addresses innermost first.
+typedef void (*HeapProfilerCallback)(
+        const uintptr_t* addresses, size_t address_count,
+        uint64_t live_bytes, uint64_t allocated_bytes, void* context);
+
+
+// Call once, before the hooks may sample. ModuleMap_Init() is not
+// called here, but symbolizing the report needs it.
+bool HeapProfiler_Start(const HeapProfilerConfig* config);
+
+// Stops sampling, the samples so far stay until exit.
+void HeapProfiler_Stop();
+
+// Called after every allocation (size 0 and NULL are ignored)
+// and before every free.
+void HeapProfiler_OnAllocation(void* pointer, size_t size);
+void HeapProfiler_OnFree(void* pointer);
+
+// For realloc(), which may release the block: the sample is taken out
+// before, so that another thread getting the same address meanwhile
+// can sample it. Returns false, if the allocation was not sampled.
+// HeapProfiler_RestoreSample() puts it back, if the block stayed.
+bool HeapProfiler_TakeSample(void* pointer, HeapProfilerSample* sample);
+void HeapProfiler_RestoreSample(void* pointer, const HeapProfilerSample* sample);
+
+void HeapProfiler_GetStats(HeapProfilerStats* stats);
+void HeapProfiler_ForEachStack(HeapProfilerCallback callback, void* context);
+
+// Live bytes per call path, in the collapsed flame graph format,
+// see stack_trie.h. Best called after HeapProfiler_Stop().
+bool HeapProfiler_WriteCollapsed(const char* path);
+
+#endif // HEAP_PROFILER_H
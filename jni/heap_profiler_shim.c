@@ -0,0 +1,260 @@
+// malloc(), free() and the rest of them, for LD_PRELOAD:
+//
+//  adb shell LD_PRELOAD=/data/local/tmp/lib<app>-heapprofile.so <app> heap
+//
+// Forwards to the next definitions (libc's), found with dlsym(RTLD_NEXT),
+// and calls the HeapProfiler hooks. Configured with the environment:
+// - HEAP_PROFILE_INTERVAL: average bytes between samples,
+// - HEAP_PROFILE_OUTPUT: report path, "<executable>.heap" by default.
+// At exit, the live bytes per call path are written to the report
+// in the collapsed flame graph format.
+//
+// Built with hidden visibility: only the allocator functions are exported,
+// so that the profiler's own module map and unwinder are not interposed
+// by the exported symbols of the executable, nor the other way round.
+
+#include "heap_profiler.h"
+#include "module_map.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SHIM_EXPORT __attribute__((visibility("default")))
+
+
+typedef void* (*MallocFunction)(size_t size);
+typedef void  (*FreeFunction)(void* pointer);
+typedef void* (*CallocFunction)(size_t count, size_t size);
+typedef void* (*ReallocFunction)(void* pointer, size_t size);
+typedef void* (*MemalignFunction)(size_t alignment, size_t size);
+typedef int   (*PosixMemalignFunction)(void** pointer, size_t alignment, size_t size);
+typedef void* (*AlignedAllocFunction)(size_t alignment, size_t size);
+typedef void* (*VallocFunction)(size_t size);
+
+static MallocFunction        real_malloc;
+static FreeFunction          real_free;
+static CallocFunction        real_calloc;
+static ReallocFunction       real_realloc;
+static MemalignFunction      real_memalign;
+static PosixMemalignFunction real_posix_memalign;
+static AlignedAllocFunction  real_aligned_alloc;
+static VallocFunction        real_valloc;
+
+// dlsym() itself may allocate, before the real functions are known.
+// Those allocations come from here and are never freed.
+enum { shim_bootstrap_size = 16 * 1024 };
+static _Alignas(16) char shim_bootstrap_heap[shim_bootstrap_size];
+static _Atomic size_t shim_bootstrap_used;
+static atomic_flag shim_resolving = ATOMIC_FLAG_INIT;
+
+// Size header of a bootstrap allocation, keeps 16-byte alignment.
+struct BootstrapHeader {
+    size_t  size;
+    size_t  padding;
+};
+typedef struct BootstrapHeader BootstrapHeader;
+
+
+static bool IsBootstrapPointer(const void* pointer) {
+    return (const char*)pointer >= shim_bootstrap_heap
+            && (const char*)pointer < shim_bootstrap_heap + shim_bootstrap_size;
+}
+
+static void* BootstrapAllocate(size_t size) {
+    size_t total = sizeof(BootstrapHeader) + ((size + 15) & ~(size_t)15);
+    size_t offset = atomic_fetch_add(&shim_bootstrap_used, total);
+    if (offset + total > shim_bootstrap_size)
+        return NULL;
+
+    BootstrapHeader* header = (BootstrapHeader*)(shim_bootstrap_heap + offset);
+    header->size = size;
+    return header + 1;
+}
+
+static size_t BootstrapSize(const void* pointer) {
+    return ((const BootstrapHeader*)pointer - 1)->size;
+}
+
+static void ResolveRealFunctions() {
+    if (real_malloc || atomic_flag_test_and_set(&shim_resolving))
+        return;
+
+    real_free           = (FreeFunction)dlsym(RTLD_NEXT, "free");
+    real_calloc         = (CallocFunction)dlsym(RTLD_NEXT, "calloc");
+    real_realloc        = (ReallocFunction)dlsym(RTLD_NEXT, "realloc");
+    real_memalign       = (MemalignFunction)dlsym(RTLD_NEXT, "memalign");
+    real_posix_memalign = (PosixMemalignFunction)dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc  = (AlignedAllocFunction)dlsym(RTLD_NEXT, "aligned_alloc");
+    real_valloc         = (VallocFunction)dlsym(RTLD_NEXT, "valloc");
+    // Published last: the others are checked through it.
+    real_malloc         = (MallocFunction)dlsym(RTLD_NEXT, "malloc");
+}
+
+static bool IsResolved() {
+    ResolveRealFunctions();
+    return real_malloc != NULL;
+}
+
+
+SHIM_EXPORT void* malloc(size_t size) {
+    if (!IsResolved())
+        return BootstrapAllocate(size);
+
+    void* pointer = real_malloc(size);
+    HeapProfiler_OnAllocation(pointer, size);
+    return pointer;
+}
+
+SHIM_EXPORT void free(void* pointer) {
+    // Nothing but the bootstrap allocations exist before the real
+    // functions are resolved.
+    if (!pointer || IsBootstrapPointer(pointer) || !real_free)
+        return;
+
+    HeapProfiler_OnFree(pointer);
+    real_free(pointer);
+}
+
+SHIM_EXPORT void* calloc(size_t count, size_t size) {
+    if (!IsResolved()) {
+        if (size != 0 && count > SIZE_MAX / size)
+            return NULL;
+        // Static memory is zeroed already.
+        return BootstrapAllocate(count * size);
+    }
+
+    void* pointer = real_calloc(count, size);
+    HeapProfiler_OnAllocation(pointer, count * size);
+    return pointer;
+}
+
+SHIM_EXPORT void* realloc(void* pointer, size_t size) {
+    if (IsBootstrapPointer(pointer)) {
+        void* moved = malloc(size);
+        if (moved) {
+            size_t old_size = BootstrapSize(pointer);
+            memcpy(moved, pointer, old_size < size ? old_size : size);
+        }
+        return moved;
+    }
+    if (!IsResolved())
+        return pointer ? NULL : BootstrapAllocate(size);
+
+    // Unless the call fails, the old block is gone or moved:
+    // a resized sampled allocation is not a sample any more.
+    // Taken out before the call, which may hand the address
+    // to another thread. On failure it is still allocated, and put back.
+    HeapProfilerSample sample;
+    bool sampled = HeapProfiler_TakeSample(pointer, &sample);
+    void* resized = real_realloc(pointer, size);
+    if (sampled && !resized && size != 0)
+        HeapProfiler_RestoreSample(pointer, &sample);
+    HeapProfiler_OnAllocation(resized, size);
+    return resized;
+}
+
+SHIM_EXPORT void* memalign(size_t alignment, size_t size) {
+    if (!IsResolved() || !real_memalign)
+        return NULL;
+
+    void* pointer = real_memalign(alignment, size);
+    HeapProfiler_OnAllocation(pointer, size);
+    return pointer;
+}
+
+SHIM_EXPORT int posix_memalign(void** pointer, size_t alignment, size_t size) {
+    if (!IsResolved() || !real_posix_memalign)
+        return ENOMEM;
+
+    int result = real_posix_memalign(pointer, alignment, size);
+    if (result == 0)
+        HeapProfiler_OnAllocation(*pointer, size);
+    return result;
+}
+
+SHIM_EXPORT void* aligned_alloc(size_t alignment, size_t size) {
+    if (!IsResolved() || !real_aligned_alloc)
+        return NULL;
+
+    void* pointer = real_aligned_alloc(alignment, size);
+    HeapProfiler_OnAllocation(pointer, size);
+    return pointer;
+}
+
+// Only in 32-bit bionic, but still called by old code.
+SHIM_EXPORT void* valloc(size_t size) {
+    if (!IsResolved() || !real_valloc)
+        return NULL;
+
+    void* pointer = real_valloc(size);
+    HeapProfiler_OnAllocation(pointer, size);
+    return pointer;
+}
+
+
+static void* RealAllocate(size_t size) {
+    return real_malloc(size);
+}
+
+static void RealDeallocate(void* pointer) {
+    real_free(pointer);
+}
+
+static size_t GetEnvironmentSize(const char* name) {
+    const char* value = getenv(name);
+    return value ? strtoul(value, NULL, 10) : 0;
+}
+
+__attribute__((constructor))
+static void StartHeapProfile() {
+    if (!IsResolved())
+        return;
+
+    // Symbolized at exit, after the libraries loaded meanwhile
+    // are added by ModuleMap_Refresh().
+    ModuleMap_Init();
+
+    HeapProfilerConfig config = {};
+    config.sample_interval_bytes = GetEnvironmentSize("HEAP_PROFILE_INTERVAL");
+    config.allocate = RealAllocate;
+    config.deallocate = RealDeallocate;
+    if (!HeapProfiler_Start(&config))
+        fprintf(stderr, "Could not start the heap profiler.\n");
+}
+
+__attribute__((destructor))
+static void WriteHeapProfile() {
+    HeapProfiler_Stop();
+
+    char path[PATH_MAX + 8] = {};
+    const char* output = getenv("HEAP_PROFILE_OUTPUT");
+    if (output) {
+        snprintf(path, sizeof(path), "%s", output);
+    } else {
+        char executable[PATH_MAX] = {};
+        if (readlink("/proc/self/exe", executable, sizeof(executable) - 1) <= 0)
+            return;
+        snprintf(path, sizeof(path), "%s.heap", executable);
+    }
+
+    ModuleMap_Refresh();
+
+    HeapProfilerStats stats = {};
+    HeapProfiler_GetStats(&stats);
+    if (!HeapProfiler_WriteCollapsed(path)) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return;
+    }
+    fprintf(stderr, "Heap profile: %llu samples, %llu dropped, "
+            "%llu still live, about %llu bytes. Wrote %s.\n",
+            (unsigned long long)stats.sample_count,
+            (unsigned long long)stats.dropped_count,
+            (unsigned long long)stats.live_sample_count,
+            (unsigned long long)stats.live_bytes, path);
+}
@@ -0,0 +1,186 @@
+#include "jit_ranges.h"
+#include "backtrace.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+
+
+struct JitRangeTable {
+    // Lookups in progress.
+    _Atomic uint32_t    reader_count;
+    size_t              range_count;
+    // Sorted by start, not overlapping.
+    JitRange            ranges[jit_range_capacity];
+};
+typedef struct JitRangeTable JitRangeTable;
+
+// A lookup which keeps losing the race against the writers gives up.
+static const int jit_range_lookup_attempts = 8;
+
+static JitRangeTable jit_range_tables[2];
+static _Atomic(JitRangeTable*) jit_range_table = &jit_range_tables[0];
+static pthread_mutex_t jit_range_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t jit_range_next_id = 1;
+
+
+// Returns the index of the first range with start > pc.
+static size_t UpperBound(const JitRangeTable* table, uintptr_t pc) {
+    size_t low = 0;
+    size_t high = table->range_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (table->ranges[middle].start <= pc)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Under jit_range_mutex. Returns the table readers are not using,
+// once the last of them has left it, as a copy of the current one.
+static JitRangeTable* BeginChange() {
+    JitRangeTable* current = atomic_load(&jit_range_table);
+    JitRangeTable* next = current == &jit_range_tables[0]
+            ? &jit_range_tables[1] : &jit_range_tables[0];
+
+    // Readers which have loaded the pointer before the last swap.
+    // They check it again, so none can enter it from now on.
+    while (atomic_load(&next->reader_count) != 0)
+        sched_yield();
+
+    next->range_count = current->range_count;
+    memcpy(next->ranges, current->ranges, current->range_count * sizeof(JitRange));
+    return next;
+}
+
+static void CommitChange(JitRangeTable* next) {
+    atomic_store(&jit_range_table, next);
+}
+
+// Enters the current table, see BeginChange(). Returns NULL,
+// if the writers keep swapping it.
+static const JitRangeTable* BeginRead() {
+    for (int attempt = 0; attempt < jit_range_lookup_attempts; ++attempt) {
+        JitRangeTable* table = atomic_load(&jit_range_table);
+        atomic_fetch_add(&table->reader_count, 1);
+        if (atomic_load(&jit_range_table) == table)
+            return table;
+        atomic_fetch_sub(&table->reader_count, 1);
+    }
+    return NULL;
+}
+
+static void EndRead(const JitRangeTable* table) {
+    atomic_fetch_sub(&((JitRangeTable*)table)->reader_count, 1);
+}
+
+
+uint32_t JitRanges_Register(
+        uintptr_t start, uintptr_t end, const char* name,
+        JitFrameStep step, void* step_context) {
+    if (start >= end)
+        return 0;
+
+    pthread_mutex_lock(&jit_range_mutex);
+    uint32_t id = 0;
+    JitRangeTable* next = BeginChange();
+    size_t index = UpperBound(next, start);
+    bool overlaps = (index > 0 && next->ranges[index - 1].end > start)
+            || (index < next->range_count && next->ranges[index].start < end);
+    if (!overlaps && next->range_count < jit_range_capacity) {
+        memmove(&next->ranges[index + 1], &next->ranges[index],
+                (next->range_count - index) * sizeof(JitRange));
+        JitRange* range = &next->ranges[index];
+        memset(range, 0, sizeof(JitRange));
+        range->start = start;
+        range->end = end;
+        range->id = id = jit_range_next_id++;
+        if (name)
+            strncpy(range->name, name, jit_range_name_size - 1);
+        range->step = step;
+        range->step_context = step_context;
+        next->range_count++;
+        CommitChange(next);
+    }
+    pthread_mutex_unlock(&jit_range_mutex);
+    return id;
+}
+
+bool JitRanges_Unregister(uint32_t id) {
+    pthread_mutex_lock(&jit_range_mutex);
+    bool found = false;
+    JitRangeTable* next = BeginChange();
+    for (size_t i = 0; i < next->range_count; ++i) {
+        if (next->ranges[i].id != id)
+            continue;
+        memmove(&next->ranges[i], &next->ranges[i + 1],
+                (next->range_count - i - 1) * sizeof(JitRange));
+        next->range_count--;
+        found = true;
+        CommitChange(next);
+        break;
+    }
+    pthread_mutex_unlock(&jit_range_mutex);
+    return found;
+}
+
+size_t JitRanges_Count() {
+    return atomic_load_explicit(&jit_range_table, memory_order_relaxed)->range_count;
+}
+
+bool JitRanges_Find(uintptr_t pc, JitRange* range) {
+    assert(range);
+    const JitRangeTable* table = BeginRead();
+    if (!table)
+        return false;
+
+    bool found = false;
+    size_t index = UpperBound(table, pc);
+    if (index > 0 && pc < table->ranges[index - 1].end) {
+        *range = table->ranges[index - 1];
+        found = true;
+    }
+    EndRead(table);
+    return found;
+}
+
+bool JitRanges_Step(JitFrameRegisters* registers) {
+    assert(registers);
+    JitRange range;
+    if (JitRanges_Find(registers->pc, &range) && range.step)
+        return range.step(&range, registers, range.step_context);
+    return JitRanges_FrameRecordStep(NULL, registers, NULL);
+}
+
+bool JitRanges_FrameRecordStep(
+        const JitRange* range, JitFrameRegisters* registers, void* context) {
+    assert(registers);
+    uintptr_t low = 0;
+    uintptr_t high = 0;
+    if (!FramePointer_GetThreadStack(&low, &high))
+        return false;
+
+    uintptr_t fp = registers->fp;
+    const uintptr_t record_size = 2 * sizeof(uintptr_t);
+    if (registers->sp > low)
+        low = registers->sp;
+    if (fp < low || fp > high - record_size || fp % sizeof(uintptr_t) != 0)
+        return false;
+
+    const uintptr_t* record = (const uintptr_t*)fp;
+    uintptr_t next_fp = record[0];
+    uintptr_t return_address = record[1];
+    if (return_address == 0)
+        return false;
+
+    // The caller's sp is past this record, so the next step
+    // only accepts a record above it.
+    registers->pc = return_address;
+    registers->sp = fp + record_size;
+    registers->fp = next_fp;
+    return true;
+}
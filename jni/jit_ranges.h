@@ -0,0 +1,87 @@
+#ifndef JIT_RANGES_H
+#define JIT_RANGES_H
+
+// Registry of code generated at run time: ART's JIT code cache,
+// a JavaScript engine, our own JIT.
+//
+// Such code has no unwind tables and is not in any module, so
+// _Unwind_Backtrace() and libunwind either stop at it or continue with
+// garbage, after a failed unwind index lookup across all the libraries.
+// Frames in registered ranges are classified as BACKTRACE_FRAME_JIT
+// (see Backtrace_ClassifyFrame()) without that lookup, and the frame
+// pointer and libunwind walks step over them with the step function
+// of the range: by default, the frame record at the frame pointer,
+// which is what JIT compilers on ARM64 and x86_64 usually keep.
+// _Unwind_Backtrace() cannot be resumed like that, it stops there.
+//
+// The ranges are kept in two sorted tables: a change is made into the
+// one readers are not using and is published with a pointer swap, so
+// lookups take no locks and are async-signal-safe.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+enum { jit_range_capacity = 512 };
+enum { jit_range_name_size = 32 };
+
+// Registers of a frame, as the unwinders know them.
+// "sp" may be an estimate past the first frame.
+struct JitFrameRegisters {
+    uintptr_t   pc;
+    uintptr_t   sp;
+    uintptr_t   fp;
+};
+typedef struct JitFrameRegisters JitFrameRegisters;
+
+struct JitRange;
+
+// Steps from a frame of the range to its caller: "registers" are those
+// of the frame on input and of the caller on output. Returns false,
+// if the walk must stop. Called from signal handlers, so must be
+// async-signal-safe, and must not read outside of the stack.
+typedef bool (*JitFrameStep)(
+        const struct JitRange* range, JitFrameRegisters* registers, void* context);
+
+struct JitRange {
+    // [start, end).
+    uintptr_t       start;
+    uintptr_t       end;
+    uint32_t        id;
+    // Printed for its frames, truncated.
+    char            name[jit_range_name_size];
+    // NULL for JitRanges_FrameRecordStep().
+    JitFrameStep    step;
+    void*           step_context;
+};
+typedef struct JitRange JitRange;
+
+
+// Returns the id of the range, or 0, if it overlaps a registered one
+// or there are jit_range_capacity of them already.
+// Not async-signal-safe.
+uint32_t JitRanges_Register(
+        uintptr_t start, uintptr_t end, const char* name,
+        JitFrameStep step, void* step_context);
+
+// Call before the code is freed. Not async-signal-safe.
+bool JitRanges_Unregister(uint32_t id);
+
+// Functions below are async-signal-safe and lock-free.
+size_t JitRanges_Count();
+
+// Copies the range containing "pc", if any.
+bool JitRanges_Find(uintptr_t pc, JitRange* range);
+
+// Steps over a frame at registers->pc with the step function of its
+// range, a frame record walk for addresses outside of the ranges.
+bool JitRanges_Step(JitFrameRegisters* registers);
+
+// The default JitFrameStep: fp[0] is the caller's frame pointer, fp[1]
+// the return address, as FramePointerWithRegisters() reads them. Only
+// reads the stack registered with FramePointer_RegisterThread().
+bool JitRanges_FrameRecordStep(
+        const JitRange* range, JitFrameRegisters* registers, void* context);
+
+#endif // JIT_RANGES_H
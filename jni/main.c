@@ -1,379 +1,175 @@
-// 3 methods of backtracing are supported:
-// - LIBUNWIND_WITH_REGISTERS_METHOD
-// - UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
-// - UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
-// LIBUNWIND_WITH_REGISTERS_METHOD works more reliably on 32-bit ARM,
-// but it is more difficult to build.
-
-// LIBUNWIND_WITH_REGISTERS_METHOD can only be used on 32-bit ARM.
-// Android NDK r16b contains "libunwind.a"
-// for "armeabi" and "armeabi-v7a" ABIs.
-// We can use this library, but we need matching headers,
-// namely "libunwind.h" and "__libunwind_config.h".
-// For NDK r16b, the headers can be fetched here:
-// https://android.googlesource.com/platform/external/libunwind_llvm/+/ndk-r16/include/
-#if __arm__
-#define LIBUNWIND_WITH_REGISTERS_METHOD 1
-#include "libunwind.h"
-#endif
-
-// UNWIND_BACKTRACE_WITH_REGISTERS_METHOD can only be used on 32-bit ARM.
-#if __arm__
-#define UNWIND_BACKTRACE_WITH_REGISTERS_METHOD 1
-#endif
-
-// UNWIND_BACKTRACE_WITH_SKIPPING_METHOD be used on any platform.
-// It usually does not work on devices with 32-bit ARM CPUs.
-// Usually works on devices with 64-bit ARM CPUs in 32-bit mode though.
-#define UNWIND_BACKTRACE_WITH_SKIPPING_METHOD 1
-
-#define HIDE_EXPORTS 1
-#include <unwind.h>
-
-#define ENABLE_DEMANGLING 1
-#if __cplusplus
-extern "C"
-#endif
-char* __cxa_demangle(
-        const char* mangled_name,
-        char* output_buffer,
-        size_t* length,
-        int* status);
+#include "alt_stack_pool.h"
+#include "backtrace.h"
+#include "capture_counters.h"
+#include "crash_dump.h"
+#include "crash_signature.h"
+#include "crash_snapshot.h"
+#include "fatal_signal.h"
+#include "module_map.h"
+#include "sampling_profiler.h"
+#include "stack_ring.h"
+#include "stack_table.h"
+#include "stack_trie.h"
+#include "thread_dump.h"
+#include "trace_file.h"
+#include "unwind_cache.h"
 
 #include <assert.h>
-#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
-#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-
-static const size_t address_count_max = 30;
-
-struct BacktraceState {
-    // On ARM32 architecture this context is needed
-    // for getting backtrace of the before-crash stack,
-    // not of the signal handler stack.
-    const ucontext_t*   signal_ucontext;
-
-    // On non-ARM32 architectures signal handler stack
-    // seems to be "connected" to the before-crash stack,
-    // so we only need to skip several initial addresses.
-    size_t              address_skip_count;
-
-    size_t              address_count;
-    uintptr_t           addresses[address_count_max];
-
-};
-typedef struct BacktraceState BacktraceState;
-
-
-void BacktraceState_Init(BacktraceState* state, const ucontext_t* ucontext) {
-    assert(state);
-    assert(ucontext);
-    memset(state, 0, sizeof(BacktraceState));
-    state->signal_ucontext = ucontext;
-    state->address_skip_count = 3;
-}
-
-bool BacktraceState_AddAddress(BacktraceState* state, uintptr_t ip) {
-    assert(state);
-
-    // No more space in the storage. Fail.
-    if (state->address_count >= address_count_max)
-        return false;
-
-#if __thumb__
-    // Reset the Thumb bit, if it is set.
-    const uintptr_t thumb_bit = 1;
-    ip &= ~thumb_bit;
-#endif
-
-    if (state->address_count > 0) {
-        // Ignore null addresses.
-        // They sometimes happen when using _Unwind_Backtrace()
-        // with the compiler optimizations,
-        // when the Link Register is overwritten by the inner
-        // stack frames, like PreCrash() functions in this example.
-        if (ip == 0)
-            return true;
-
-        // Ignore duplicate addresses.
-        // They sometimes happen when using _Unwind_Backtrace()
-        // with the compiler optimizations,
-        // because we both add the second address from the Link Register
-        // in ProcessRegisters() and receive the same address
-        // in UnwindBacktraceCallback().
-        if (ip == state->addresses[state->address_count - 1])
-            return true;
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Slots needed in the ring of a thread: one backtrace per crash.
+static const size_t crash_ring_capacity = 1;
+
+// Not the ring registered for the thread (StackRing_RegisterThread()):
+// that one is the sampling profiler's, and may be full of its samples.
+// Created before any signal handler reads it, by SetUpSigActionHandler().
+static __thread StackRing* crash_ring;
+
+// Threads captured by the "threads" mode, and how long the crashing thread
+// waits for them.
+static const size_t thread_dump_capacity = 64;
+static const unsigned int thread_dump_timeout_ms = 1000;
+static const size_t worker_thread_count = 4;
+
+static void WriteCrashBatch(
+        const StackRingEntry* entries, size_t entry_count, void* context) {
+    for (size_t i = 0; i < entry_count; ++i) {
+        CrashDump_WriteAddresses(entries[i].addresses, entries[i].address_count,
+                (BacktraceMethod)entries[i].tag);
     }
-
-    // Finally add the address to the storage.
-    state->addresses[state->address_count++] = ip;
-    return true;
 }
 
-
-#if LIBUNWIND_WITH_REGISTERS_METHOD
-
-void LibunwindWithRegisters(BacktraceState* state) {
-    assert(state);
-
-    // Initialize unw_context and unw_cursor.
-    unw_context_t unw_context = {};
-    unw_getcontext(&unw_context);
-    unw_cursor_t  unw_cursor = {};
-    unw_init_local(&unw_cursor, &unw_context);
-
-    // Get more contexts.
-    const ucontext_t* signal_ucontext = state->signal_ucontext;
-    assert(signal_ucontext);
-    const struct sigcontext* signal_mcontext = &(signal_ucontext->uc_mcontext);
-    assert(signal_mcontext);
-
-    // Set registers.
-    unw_set_reg(&unw_cursor, UNW_ARM_R0,  signal_mcontext->arm_r0);
-    unw_set_reg(&unw_cursor, UNW_ARM_R1,  signal_mcontext->arm_r1);
-    unw_set_reg(&unw_cursor, UNW_ARM_R2,  signal_mcontext->arm_r2);
-    unw_set_reg(&unw_cursor, UNW_ARM_R3,  signal_mcontext->arm_r3);
-    unw_set_reg(&unw_cursor, UNW_ARM_R4,  signal_mcontext->arm_r4);
-    unw_set_reg(&unw_cursor, UNW_ARM_R5,  signal_mcontext->arm_r5);
-    unw_set_reg(&unw_cursor, UNW_ARM_R6,  signal_mcontext->arm_r6);
-    unw_set_reg(&unw_cursor, UNW_ARM_R7,  signal_mcontext->arm_r7);
-    unw_set_reg(&unw_cursor, UNW_ARM_R8,  signal_mcontext->arm_r8);
-    unw_set_reg(&unw_cursor, UNW_ARM_R9,  signal_mcontext->arm_r9);
-    unw_set_reg(&unw_cursor, UNW_ARM_R10, signal_mcontext->arm_r10);
-    unw_set_reg(&unw_cursor, UNW_ARM_R11, signal_mcontext->arm_fp);
-    unw_set_reg(&unw_cursor, UNW_ARM_R12, signal_mcontext->arm_ip);
-    unw_set_reg(&unw_cursor, UNW_ARM_R13, signal_mcontext->arm_sp);
-    unw_set_reg(&unw_cursor, UNW_ARM_R14, signal_mcontext->arm_lr);
-    unw_set_reg(&unw_cursor, UNW_ARM_R15, signal_mcontext->arm_pc);
-
-    unw_set_reg(&unw_cursor, UNW_REG_IP,  signal_mcontext->arm_pc);
-    unw_set_reg(&unw_cursor, UNW_REG_SP,  signal_mcontext->arm_sp);
-
-    // unw_step() does not return the first IP,
-    // the address of the instruction which caused the crash.
-    // Thus let's add this address manually.
-    BacktraceState_AddAddress(state, signal_mcontext->arm_pc);
-
-    //printf("unw_is_signal_frame(): %i\n", unw_is_signal_frame(&unw_cursor));
-
-    // Unwind frames one by one, going up the frame stack.
-    while (unw_step(&unw_cursor) > 0) {
-        unw_word_t ip = 0;
-        unw_get_reg(&unw_cursor, UNW_REG_IP, &ip);
-
-        bool ok = BacktraceState_AddAddress(state, ip);
-        if (!ok)
-            break;
-
-        //printf("unw_is_signal_frame(): %i\n", unw_is_signal_frame(&unw_cursor));
-    }
+static void DiscardCrashBatch(
+        const StackRingEntry* entries, size_t entry_count, void* context) {
 }
 
-#endif // #if LIBUNWIND_WITH_REGISTERS_METHOD
-
-
-#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
-
-void ProcessRegisters(
-        struct _Unwind_Context* unwind_context, BacktraceState* state) {
-    assert(unwind_context);
-    assert(state);
-
-    const ucontext_t* signal_ucontext = state->signal_ucontext;
-    assert(signal_ucontext);
-
-    const struct sigcontext* signal_mcontext = &(signal_ucontext->uc_mcontext);
-    assert(signal_mcontext);
-
-    _Unwind_SetGR(unwind_context, REG_R0,  signal_mcontext->arm_r0);
-    _Unwind_SetGR(unwind_context, REG_R1,  signal_mcontext->arm_r1);
-    _Unwind_SetGR(unwind_context, REG_R2,  signal_mcontext->arm_r2);
-    _Unwind_SetGR(unwind_context, REG_R3,  signal_mcontext->arm_r3);
-    _Unwind_SetGR(unwind_context, REG_R4,  signal_mcontext->arm_r4);
-    _Unwind_SetGR(unwind_context, REG_R5,  signal_mcontext->arm_r5);
-    _Unwind_SetGR(unwind_context, REG_R6,  signal_mcontext->arm_r6);
-    _Unwind_SetGR(unwind_context, REG_R7,  signal_mcontext->arm_r7);
-    _Unwind_SetGR(unwind_context, REG_R8,  signal_mcontext->arm_r8);
-    _Unwind_SetGR(unwind_context, REG_R9,  signal_mcontext->arm_r9);
-    _Unwind_SetGR(unwind_context, REG_R10, signal_mcontext->arm_r10);
-    _Unwind_SetGR(unwind_context, REG_R11, signal_mcontext->arm_fp);
-    _Unwind_SetGR(unwind_context, REG_R12, signal_mcontext->arm_ip);
-    _Unwind_SetGR(unwind_context, REG_R13, signal_mcontext->arm_sp);
-    _Unwind_SetGR(unwind_context, REG_R14, signal_mcontext->arm_lr);
-    _Unwind_SetGR(unwind_context, REG_R15, signal_mcontext->arm_pc);
-
-    // Program Counter register aka Instruction Pointer will contain
-    // the address of the instruction where the crash happened.
-    // UnwindBacktraceCallback() will not supply us with it.
-    BacktraceState_AddAddress(state, signal_mcontext->arm_pc);
-}
-
-_Unwind_Reason_Code UnwindBacktraceWithRegistersCallback(
-        struct _Unwind_Context* unwind_context, void* state_voidp) {
-    assert(unwind_context);
-    assert(state_voidp);
-
-    BacktraceState* state = (BacktraceState*)state_voidp;
-    assert(state);
-
-    // On the first UnwindBacktraceCallback() call,
-    // set registers to _Unwind_Context and BacktraceState.
-    if (state->address_count == 0) {
-        ProcessRegisters(unwind_context, state);
-        return _URC_NO_REASON;
-    }
-
-    uintptr_t ip = _Unwind_GetIP(unwind_context);
-    bool ok = BacktraceState_AddAddress(state, ip);
-    if (!ok)
-        return _URC_END_OF_STACK;
-
-    return _URC_NO_REASON;
+static void WriteThreadBacktrace(
+        pid_t tid, const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method, void* context) {
+    CrashDump_WriteThread(tid);
+    CrashDump_WriteAddresses(addresses, address_count, method);
 }
 
-void UnwindBacktraceWithRegisters(BacktraceState* state) {
-    assert(state);
-    _Unwind_Backtrace(UnwindBacktraceWithRegistersCallback, state);
+// Captures into the ring of the crashed thread with the cheapest method
+// whose backtrace looks valid, see BacktraceWithFallback(),
+// hashing the top frames into "signature" on the way.
+static void CaptureCrash(
+        StackRing* ring, const ucontext_t* signal_ucontext,
+        CrashSignature* signature) {
+    // On the alternate signal stack. Only the counters,
+    // the addresses are stored in the ring.
+    BacktraceState backtrace_state;
+    if (StackRing_BeginWrite(ring, &backtrace_state, signal_ucontext)) {
+        BacktraceState_SetPredicate(
+                &backtrace_state, CrashSignature_Predicate, signature);
+        BacktraceMethod method = BacktraceWithFallback(&backtrace_state);
+        StackRing_CommitWrite(ring, &backtrace_state, method);
+    }
 }
 
-#endif // #if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
-
-
-#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
-
-_Unwind_Reason_Code UnwindBacktraceWithSkippingCallback(
-        struct _Unwind_Context* unwind_context, void* state_voidp) {
-    assert(unwind_context);
-    assert(state_voidp);
+// Only async-signal-safe work is done here: capturing raw addresses
+// into the preallocated ring of the thread and writing them
+// to the pre-opened dump file.
+// Symbolization is deferred to CrashDump_Print().
+// Called for every fatal signal, see fatal_signal.h. The previous action
+// may recover (ART's fault handler does), and the handler is then called
+// again for the next one, so the snapshot and the dump stay open: each
+// signal writes over the files of the one before, until one is fatal.
+void SigActionHandler(int sig, siginfo_t* info, void* ucontext) {
+    const ucontext_t* signal_ucontext = (const ucontext_t*)ucontext;
+    assert(signal_ucontext);
 
-    BacktraceState* state = (BacktraceState*)state_voidp;
-    assert(state);
+    // First, before any unwinder can fault: the registers and the stack
+    // are enough to unwind off-device.
+    CrashSnapshot_Write(sig, info, ucontext);
+
+    CrashDump_WriteSignal(sig);
+    CrashDump_WriteThread(gettid());
+
+    // Threads which did not register have nowhere to capture to.
+    StackRing* ring = crash_ring;
+    if (ring) {
+        CrashSignature signature;
+        CrashSignature_Init(
+                &signature, signal_ucontext, crash_signature_frame_count_default);
+        CaptureCrash(ring, signal_ucontext, &signature);
+
+        bool known = false;
+        if (signature.frame_count > 0) {
+            uint64_t signature_value = CrashSignature_Value(&signature);
+            CrashDump_WriteSignature(signature_value, signature.frame_count);
+            known = CrashSignature_IsKnown(signature_value);
+        }
 
-    // Skip some initial addresses, because they belong
-    // to the signal handler frame.
-    if (state->address_skip_count > 0) {
-        state->address_skip_count--;
-        return _URC_NO_REASON;
+        // Reported in full before: the signature stands for this thread.
+        // Drained either way, for the next crash to have a free slot.
+        StackRing_Drain(ring, known ? DiscardCrashBatch : WriteCrashBatch,
+                NULL, NULL);
     }
 
-    uintptr_t ip = _Unwind_GetIP(unwind_context);
-    bool ok = BacktraceState_AddAddress(state, ip);
-    if (!ok)
-        return _URC_END_OF_STACK;
+    // Does nothing, unless ThreadDump_Init() was called.
+    ThreadDump_CaptureOtherThreads(WriteThreadBacktrace, NULL, NULL);
 
-    return _URC_NO_REASON;
-}
+    CrashDump_WriteModuleMap();
 
-void UnwindBacktraceWithSkipping(BacktraceState* state) {
-    assert(state);
-    _Unwind_Backtrace(UnwindBacktraceWithSkippingCallback, state);
+    // Returns to FatalSignal, which chains to the previous action.
 }
 
-#endif // #if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
-
-
-void PrintBacktrace(BacktraceState* state) {
-    assert(state);
-
-    size_t frame_count = state->address_count;
-    for (size_t frame_index = 0; frame_index < frame_count; ++frame_index) {
-
-        void* address = (void*)(state->addresses[frame_index]);
-        assert(address);
-
-        const char* symbol_name = "";
-
-        Dl_info info = {};
-        if (dladdr(address, &info) && info.dli_sname) {
-            symbol_name = info.dli_sname;
-        }
-
-        // Relative address matches the address which "nm" and "objdump"
-        // utilities give you, if you compiled position-independent code
-        // (-fPIC, -pie).
-        // Android requires position-independent code since Android 5.0.
-        unsigned long relative_address = (char*)address - (char*)info.dli_fbase;
-
-        char* demangled = NULL;
 
-#if ENABLE_DEMANGLING
-        int status = 0;
-        demangled = __cxa_demangle(symbol_name, NULL, NULL, &status);
-        if (demangled)
-            symbol_name = demangled;
-#endif
-
-        assert(symbol_name);
-        printf("  #%02zu:  0x%lx  %s\n", frame_index, relative_address, symbol_name);
+void SetUpAltStack() {
+    // One alternate signal stack per thread which may crash,
+    // sized for the enabled unwinders.
+    bool initialized = AltStackPool_Init(thread_dump_capacity, 0);
+    assert(initialized);
 
-        free(demangled);
-    }
+    bool registered = AltStackPool_RegisterThread();
+    assert(registered);
 }
 
-void SigActionHandler(int sig, siginfo_t* info, void* ucontext) {
-    const ucontext_t* signal_ucontext = (const ucontext_t*)ucontext;
-    assert(signal_ucontext);
+void SetUpSigActionHandler(size_t depth) {
+    // The ring of this thread is where the handler captures to.
+    crash_ring = StackRing_Create(depth, crash_ring_capacity);
+    assert(crash_ring);
 
-#if LIBUNWIND_WITH_REGISTERS_METHOD
-    {
-        printf("Backtrace captured using LIBUNWIND_WITH_REGISTERS_METHOD:\n");
-        BacktraceState backtrace_state;
-        BacktraceState_Init(&backtrace_state, signal_ucontext);
-        LibunwindWithRegisters(&backtrace_state);
-        PrintBacktrace(&backtrace_state);
-    }
+    // Build the module index while it is still safe to call
+    // dl_iterate_phdr(), the handler only does lookups in it.
+    ModuleMap_Init();
+#if UNWIND_CACHE_ENABLED
+    UnwindCache_Init();
 #endif
 
-#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
-    {
-        printf("Backtrace captured using UNWIND_BACKTRACE_WITH_REGISTERS_METHOD:\n");
-        BacktraceState backtrace_state;
-        BacktraceState_Init(&backtrace_state, signal_ucontext);
-        UnwindBacktraceWithRegisters(&backtrace_state);
-        PrintBacktrace(&backtrace_state);
-
-    }
+#if FRAME_POINTER_METHOD
+    FramePointer_RegisterThread();
 #endif
 
 #if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
-    {
-        printf("Backtrace captured using UNWIND_BACKTRACE_WITH_SKIPPING_METHOD:\n");
-        BacktraceState backtrace_state;
-        BacktraceState_Init(&backtrace_state, signal_ucontext);
-        UnwindBacktraceWithSkipping(&backtrace_state);
-        PrintBacktrace(&backtrace_state);
-
+    // Raises a signal of its own, so before the handlers are installed.
+    BacktraceSkipCalibration calibration = {};
+    if (UnwindBacktraceWithSkipping_Calibrate()
+            && UnwindBacktraceWithSkipping_GetCalibration(&calibration)) {
+        printf("Signal trampoline at %p, %zu handler frames above it.\n",
+                (void*)calibration.trampoline.start,
+                calibration.handler_frame_count);
+    } else {
+        printf("Signal trampoline not found, skipping a fixed frame count.\n");
     }
+    // This process is about to crash.
+    fflush(stdout);
 #endif
 
-    exit(0);
-}
-
-
-void SetUpAltStack() {
-    // Set up an alternate signal handler stack.
-    stack_t stack = {};
-    stack.ss_size = 0;
-    stack.ss_flags = 0;
-    stack.ss_size = SIGSTKSZ;
-    stack.ss_sp = malloc(stack.ss_size);
-    assert(stack.ss_sp);
-
-    sigaltstack(&stack, NULL);
-}
-
-void SetUpSigActionHandler() {
-    // Set up signal handler.
-    struct sigaction action = {};
-    memset(&action, 0, sizeof(action));
-    sigemptyset(&action.sa_mask);
-    action.sa_sigaction = SigActionHandler;
-    action.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
-
-    sigaction(SIGSEGV, &action, NULL);
+    bool installed = FatalSignal_Install(SigActionHandler);
+    assert(installed);
 }
 
 void PreCrash3() {
@@ -416,13 +212,333 @@ void Func3() {
     Func2();
 }
 
-int main() {
+// Busy loop for the sampling profiler demo.
+#if __clang__
+void Spin() __attribute__((optnone));
+#elif __GNUC__
+void Spin() __attribute__((optimize("O0")));
+#endif
+
+void Spin() {
+    for (volatile int i = 0; i < 1000; ++i) {
+    }
+}
+
+void SpinFunc1() {
+    Spin();
+}
+
+void SpinFunc2() {
+    SpinFunc1();
+}
+
+void SpinFunc3() {
+    SpinFunc2();
+}
+
+static atomic_size_t started_worker_count;
+
+void* WorkerThread(void* arg) {
+    AltStackPool_RegisterThread();
+#if FRAME_POINTER_METHOD
+    FramePointer_RegisterThread();
+#endif
+    atomic_fetch_add(&started_worker_count, 1);
+    for (;;)
+        SpinFunc3();
+    return NULL;
+}
+
+// Starts the workers and waits until they all run.
+void StartWorkerThreads(size_t depth) {
+    if (!ThreadDump_Init(depth, thread_dump_capacity,
+                SIGRTMIN + 2, thread_dump_timeout_ms)) {
+        printf("Could not set up the thread dump.\n");
+        return;
+    }
+
+    for (size_t i = 0; i < worker_thread_count; ++i) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, WorkerThread, NULL);
+    }
+    while (atomic_load(&started_worker_count) < worker_thread_count)
+        sched_yield();
+}
+
+void AddTrieStack(
+        uint32_t stack_id, const uintptr_t* addresses, size_t address_count,
+        uint32_t count, void* trie_voidp) {
+    StackTrie_Add((StackTrie*)trie_voidp, addresses, address_count, count);
+}
+
+// Allocation sites for the heap profiler demo: one keeps its blocks,
+// the other frees them right away.
+void* RetainedAllocation(size_t size) __attribute__((noinline));
+void* RetainedAllocation(size_t size) {
+    return malloc(size);
+}
 
-    SetUpAltStack();
-    SetUpSigActionHandler();
+void TransientAllocation(size_t size) __attribute__((noinline));
+void TransientAllocation(size_t size) {
+    char* volatile block = (char*)malloc(size);
+    free(block);
+}
 
-    Func3();
+void* HeapFunc1(size_t size) {
+    TransientAllocation(size);
+    return RetainedAllocation(size);
+}
+
+void* HeapFunc2(size_t size) {
+    return HeapFunc1(size);
+}
+
+void* HeapFunc3(size_t size) {
+    return HeapFunc2(size);
+}
+
+// Only allocates. The profile is captured by the malloc shim,
+// see heap_profiler_shim.c.
+int RunHeap() {
+    enum { block_count = 4096 };
+    static void* blocks[block_count];
+
+    size_t retained_size = 0;
+    for (size_t i = 0; i < block_count; ++i) {
+        size_t size = 256 + (i % 16) * 256;
+        blocks[i] = HeapFunc3(size);
+        retained_size += size;
+    }
+    printf("Allocated %zu KiB twice, freed one half.\n", retained_size / 1024);
+    printf("Run with LD_PRELOAD=lib<app>-heapprofile.so to profile.\n");
 
-    printf("Returned from the signal handler?\n");
+    // Still live at exit, when the shim writes the report.
+    return blocks[0] ? 0 : 1;
+}
+
+// Merges the unique stacks into a trie and writes it for flame graphs
+// and for pprof.
+void WriteAggregatedProfile(
+        const StackTable* stack_table, uint64_t sampling_period_ns,
+        const char* collapsed_path, const char* pprof_path) {
+    StackTrie* trie = StackTrie_Create();
+    if (!trie)
+        return;
+    StackTable_ForEach(stack_table, AddTrieStack, trie);
+
+    FILE* collapsed = fopen(collapsed_path, "w");
+    long line_count = collapsed ? StackTrie_WriteCollapsed(trie, collapsed) : -1;
+    if (collapsed && fclose(collapsed) != 0)
+        line_count = -1;
+
+    FILE* pprof = fopen(pprof_path, "wb");
+    bool pprof_written = pprof
+            && StackTrie_WritePprof(trie, pprof, sampling_period_ns);
+    if (pprof && fclose(pprof) != 0)
+        pprof_written = false;
+
+    printf("Merged %llu samples into %zu call path nodes.\n",
+            (unsigned long long)StackTrie_SampleCount(trie),
+            StackTrie_NodeCount(trie));
+    if (line_count >= 0)
+        printf("Wrote %ld collapsed stacks to %s.\n", line_count, collapsed_path);
+    else
+        printf("Could not write %s.\n", collapsed_path);
+    if (pprof_written)
+        printf("Wrote pprof profile to %s.\n", pprof_path);
+    else
+        printf("Could not write %s.\n", pprof_path);
+
+    StackTrie_Destroy(trie);
+}
+
+void WriteTraceStack(
+        uint32_t stack_id, const uintptr_t* addresses, size_t address_count,
+        uint32_t count, void* writer_voidp) {
+    TraceWriter_WriteStack((TraceWriter*)writer_voidp, addresses, address_count,
+            BACKTRACE_METHOD_FRAME_POINTER, count);
+}
+
+int RunProfile(
+        size_t depth, const char* trace_path,
+        const char* collapsed_path, const char* pprof_path) {
+    // Samples are interned in the handler, so each of them costs
+    // a counter increment, not a full copy of the stack.
+    StackTable* stack_table = StackTable_Create(4096, 4096 * depth);
+    assert(stack_table);
+
+    SamplingProfilerConfig config = {};
+    config.frequency_hz = 1000;
+    config.depth = depth;
+    config.ring_size = 4;
+    config.drain_interval_ms = 50;
+    config.stack_table = stack_table;
+
+    if (!SamplingProfiler_Start(&config) || !SamplingProfiler_RegisterThread()) {
+        printf("Could not start the sampling profiler.\n");
+        return 1;
+    }
+
+    struct timespec start = {};
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        SpinFunc3();
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000000000L
+            + (now.tv_nsec - start.tv_nsec) < 1000000000L);
+
+    SamplingProfiler_Stop();
+    SamplingProfiler_UnregisterThread();
+
+    SamplingProfilerStats stats = {};
+    SamplingProfiler_GetStats(&stats);
+    printf("Collected %llu samples of %zu unique stacks, dropped %llu.\n",
+            (unsigned long long)stats.sample_count,
+            StackTable_StackCount(stack_table),
+            (unsigned long long)stats.dropped_count);
+
+    // Only raw stacks are written here, symbolization is done
+    // from the trace afterwards, as it could be done on the host.
+    TraceWriter writer;
+    if (!TraceWriter_Open(&writer, trace_path, 1 << 20)) {
+        printf("Could not open %s.\n", trace_path);
+        StackTable_Destroy(stack_table);
+        return 1;
+    }
+    StackTable_ForEach(stack_table, WriteTraceStack, &writer);
+    uint64_t stack_count = writer.stack_count;
+    bool written = TraceWriter_Close(&writer);
+    printf("Wrote %llu stacks to %s.\n",
+            (unsigned long long)stack_count, trace_path);
+    if (!written || !TraceFile_Print(trace_path))
+        printf("Could not write or read %s.\n", trace_path);
+
+    WriteAggregatedProfile(stack_table, 1000000000ull / config.frequency_hz,
+            collapsed_path, pprof_path);
+
+    StackTable_Destroy(stack_table);
     return 0;
 }
+
+int RunCrash(
+        size_t depth, const char* dump_path, const char* snapshot_path,
+        const char* counters_path, const char* signatures_path,
+        bool all_threads) {
+    // The child crashes and only dumps raw addresses,
+    // the parent symbolizes the dump afterwards.
+    // The same would work on the next launch of the app.
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    if (child == 0) {
+        if (!CrashDump_Open(dump_path)) {
+            perror(dump_path);
+            _exit(1);
+        }
+        if (!CrashSnapshot_Open(snapshot_path, 0, 0)) {
+            perror(snapshot_path);
+            _exit(1);
+        }
+        if (!CaptureCounters_MapFile(counters_path)) {
+            perror(counters_path);
+            _exit(1);
+        }
+        if (!CrashSignature_LoadKnown(signatures_path)) {
+            perror(signatures_path);
+            _exit(1);
+        }
+
+        SetUpAltStack();
+        SetUpSigActionHandler(depth);
+        if (all_threads)
+            StartWorkerThreads(depth);
+
+        Func3();
+
+        printf("Returned from the signal handler?\n");
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (WIFSIGNALED(status))
+        printf("Child terminated by signal %i.\n", WTERMSIG(status));
+
+    if (!CrashSnapshot_Print(snapshot_path))
+        printf("No snapshot in %s.\n", snapshot_path);
+
+    // Of the child, up to the crash.
+    CaptureCountersSnapshot counters = {};
+    if (CaptureCounters_ReadFile(counters_path, &counters))
+        CaptureCounters_Print(&counters);
+    else
+        printf("No counters in %s.\n", counters_path);
+
+    if (!CrashDump_Print(dump_path)) {
+        printf("No backtraces in %s.\n", dump_path);
+        return 1;
+    }
+
+    // Reported in full now, so the next crash at the same place
+    // only writes its signature.
+    uint64_t signature = 0;
+    bool has_backtrace = false;
+    if (CrashDump_ReadSignature(dump_path, &signature, &has_backtrace)
+            && has_backtrace
+            && CrashSignature_SaveKnown(signatures_path, signature)) {
+        printf("Added crash signature %016llx to %s.\n",
+                (unsigned long long)signature, signatures_path);
+    }
+    return 0;
+}
+
+// Usage: <app> [profile | threads | heap] [depth]
+int main(int argc, char* argv[]) {
+    const char* app_path = argc > 0 ? argv[0] : "backtrace";
+    char dump_path[PATH_MAX] = {};
+    snprintf(dump_path, sizeof(dump_path), "%s.dump", app_path);
+    char trace_path[PATH_MAX] = {};
+    snprintf(trace_path, sizeof(trace_path), "%s.trace", app_path);
+    char collapsed_path[PATH_MAX] = {};
+    snprintf(collapsed_path, sizeof(collapsed_path), "%s.collapsed", app_path);
+    char pprof_path[PATH_MAX] = {};
+    snprintf(pprof_path, sizeof(pprof_path), "%s.pb", app_path);
+    char snapshot_path[PATH_MAX] = {};
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s.snapshot", app_path);
+    char counters_path[PATH_MAX] = {};
+    snprintf(counters_path, sizeof(counters_path), "%s.counters", app_path);
+    char signatures_path[PATH_MAX] = {};
+    snprintf(signatures_path, sizeof(signatures_path), "%s.signatures", app_path);
+
+    int arg_index = 1;
+    bool profile = false;
+    bool all_threads = false;
+    if (arg_index < argc && strcmp(argv[arg_index], "profile") == 0) {
+        profile = true;
+        ++arg_index;
+    } else if (arg_index < argc && strcmp(argv[arg_index], "threads") == 0) {
+        all_threads = true;
+        ++arg_index;
+    } else if (arg_index < argc && strcmp(argv[arg_index], "heap") == 0) {
+        return RunHeap();
+    }
+
+    // Optional backtrace depth.
+    size_t depth = backtrace_depth_default;
+    if (arg_index < argc)
+        depth = strtoul(argv[arg_index], NULL, 10);
+    if (depth < backtrace_depth_min || depth > backtrace_depth_max) {
+        printf("Depth must be within [%zu, %zu].\n",
+                backtrace_depth_min, backtrace_depth_max);
+        return 1;
+    }
+
+    if (profile)
+        return RunProfile(depth, trace_path, collapsed_path, pprof_path);
+    return RunCrash(depth, dump_path, snapshot_path, counters_path,
+            signatures_path, all_threads);
+}
@@ -0,0 +1,500 @@
+#include "module_map.h"
+#include "capture_counters.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <link.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct ModuleSymbol {
+    uintptr_t   start;
+    uintptr_t   end;
+    const char* name;
+};
+typedef struct ModuleSymbol ModuleSymbol;
+
+// Dynamic symbols of one module, sorted by start address.
+struct ModuleSymbols {
+    size_t          symbol_count;
+    ModuleSymbol    symbols[];
+};
+typedef struct ModuleSymbols ModuleSymbols;
+
+// Immutable snapshot of the loaded modules, sorted by base.
+// A refresh publishes a new table instead of modifying the current one,
+// so readers (including signal handlers) never see it half-updated.
+struct ModuleTable {
+    size_t      module_count;
+    Module*     modules[];
+};
+typedef struct ModuleTable ModuleTable;
+
+static _Atomic(ModuleTable*) module_table;
+static _Atomic uint32_t module_next_id;
+
+#if __GLIBC__
+// Loads and unloads counted by dl_iterate_phdr(), as of the last refresh.
+// bionic has no such counters before Android 11.
+struct ModuleLoadCounts {
+    bool                known;
+    unsigned long long  adds;
+    unsigned long long  subs;
+};
+typedef struct ModuleLoadCounts ModuleLoadCounts;
+
+static ModuleLoadCounts module_load_counts;
+#endif
+
+
+// Collects the modules reported by dl_iterate_phdr().
+struct ModuleList {
+    const ModuleTable*  previous;
+    size_t              callback_count;
+    // Not taken from the previous table.
+    size_t              new_module_count;
+    size_t              module_count;
+    size_t              capacity;
+    Module**            modules;
+};
+typedef struct ModuleList ModuleList;
+
+static Module* FindModuleInTable(const ModuleTable* table, uintptr_t address) {
+    if (!table)
+        return NULL;
+
+    // Find the last module with base <= address.
+    size_t low = 0;
+    size_t high = table->module_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (table->modules[middle]->base <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    if (low == 0)
+        return NULL;
+
+    Module* module = table->modules[low - 1];
+    if (address >= module->end)
+        return NULL;
+    return module;
+}
+
+// Copies NT_GNU_BUILD_ID from the PT_NOTE segments of a loaded module.
+static void ReadBuildId(const struct dl_phdr_info* info, Module* module) {
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_NOTE)
+            continue;
+
+        const char* note = (const char*)(info->dlpi_addr + phdr->p_vaddr);
+        const char* notes_end = note + phdr->p_memsz;
+        while (note + sizeof(ElfW(Nhdr)) <= notes_end) {
+            const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*)note;
+            const char* name = note + sizeof(ElfW(Nhdr));
+            const char* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+            const char* next = desc + ((nhdr->n_descsz + 3) & ~3u);
+            if (next > notes_end)
+                break;
+
+            if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4
+                    && memcmp(name, "GNU", 4) == 0) {
+                size_t size = nhdr->n_descsz;
+                if (size > module_build_id_size_max)
+                    size = module_build_id_size_max;
+                memcpy(module->build_id, desc, size);
+                module->build_id_size = size;
+                return;
+            }
+            note = next;
+        }
+    }
+}
+
+#if __arm__
+static void ReadExidx(const struct dl_phdr_info* info, Module* module) {
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_ARM_EXIDX) {
+            module->exidx_start = info->dlpi_addr + phdr->p_vaddr;
+            module->exidx_count = phdr->p_memsz / 8;
+            return;
+        }
+    }
+}
+#endif
+
+static int AddModuleCallback(
+        struct dl_phdr_info* info, size_t size, void* list_voidp) {
+    assert(info);
+    assert(list_voidp);
+    ModuleList* list = (ModuleList*)list_voidp;
+
+    uintptr_t base = 0;
+    uintptr_t end = 0;
+    bool found_header = false;
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD)
+            continue;
+
+        uintptr_t segment_start = info->dlpi_addr + phdr->p_vaddr;
+        uintptr_t segment_end = segment_start + phdr->p_memsz;
+        if (!found_header) {
+            base = segment_start - phdr->p_offset;
+            found_header = true;
+        }
+        if (segment_end > end)
+            end = segment_end;
+    }
+    if (!found_header)
+        return 0;
+
+    const char* loaded_name = info->dlpi_name ? info->dlpi_name : "";
+    bool is_first = list->callback_count++ == 0;
+
+    // Reuse the module from the previous table, if it is still loaded,
+    // together with its already built symbol index. The same range and
+    // name is the same module, nothing else is read for it.
+    Module* previous = FindModuleInTable(list->previous, base);
+    if (previous && (previous->base != base || previous->end != end
+                || previous->load_bias != info->dlpi_addr))
+        previous = NULL;
+    Module* module = previous
+            && strcmp(previous->loaded_name, loaded_name) == 0 ? previous : NULL;
+
+    if (!module) {
+        // The main executable is reported first,
+        // glibc gives it an empty name.
+        char executable_path[PATH_MAX] = {};
+        const char* path = loaded_name;
+        if (is_first && path[0] == '\0') {
+            ssize_t length = readlink(
+                    "/proc/self/exe", executable_path, sizeof(executable_path) - 1);
+            if (length > 0)
+                path = executable_path;
+        }
+
+        // Store the same path /proc/<pid>/maps shows,
+        // so that dumped mappings can be matched by path.
+        char* resolved_path = realpath(path, NULL);
+        if (!resolved_path)
+            resolved_path = strdup(path);
+        if (!resolved_path)
+            return 0;
+        Module loaded = {};
+        ReadBuildId(info, &loaded);
+
+        // The same range under another name: the same library through
+        // another path, or another one loaded at the range of an unloaded one.
+        if (previous && strcmp(previous->path, resolved_path) == 0
+                && previous->build_id_size == loaded.build_id_size
+                && memcmp(previous->build_id, loaded.build_id,
+                        loaded.build_id_size) == 0) {
+            free(resolved_path);
+            module = previous;
+        } else {
+            module = (Module*)calloc(1, sizeof(Module));
+            char* name_copy = strdup(loaded_name);
+            if (!module || !name_copy) {
+                free(module);
+                free(name_copy);
+                free(resolved_path);
+                return 0;
+            }
+            module->id = atomic_fetch_add(&module_next_id, 1);
+            module->base = base;
+            module->end = end;
+            module->load_bias = info->dlpi_addr;
+            module->path = resolved_path;
+            module->loaded_name = name_copy;
+            memcpy(module->build_id, loaded.build_id, loaded.build_id_size);
+            module->build_id_size = loaded.build_id_size;
+#if __arm__
+            ReadExidx(info, module);
+#endif
+            ++list->new_module_count;
+        }
+    }
+
+    if (list->module_count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        Module** grown = (Module**)realloc(
+                list->modules, capacity * sizeof(Module*));
+        if (!grown)
+            return 0;
+        list->modules = grown;
+        list->capacity = capacity;
+    }
+    list->modules[list->module_count++] = module;
+    return 0;
+}
+
+static int CompareModules(const void* left_voidp, const void* right_voidp) {
+    const Module* left = *(const Module* const*)left_voidp;
+    const Module* right = *(const Module* const*)right_voidp;
+    if (left->base < right->base)
+        return -1;
+    return left->base > right->base;
+}
+
+#if __GLIBC__
+// The counters are the same in every entry, the first one is enough.
+static int ReadLoadCountsCallback(
+        struct dl_phdr_info* info, size_t size, void* counts_voidp) {
+    ModuleLoadCounts* counts = (ModuleLoadCounts*)counts_voidp;
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        counts->known = true;
+        counts->adds = info->dlpi_adds;
+        counts->subs = info->dlpi_subs;
+    }
+    return 1;
+}
+#endif
+
+bool ModuleMap_Init() {
+    ModuleMap_Refresh();
+    return atomic_load(&module_table) != NULL;
+}
+
+void ModuleMap_Refresh() {
+    ModuleList list = {};
+    list.previous = atomic_load(&module_table);
+
+#if __GLIBC__
+    ModuleLoadCounts counts = {};
+    dl_iterate_phdr(ReadLoadCountsCallback, &counts);
+    if (list.previous && counts.known && module_load_counts.known
+            && counts.adds == module_load_counts.adds
+            && counts.subs == module_load_counts.subs)
+        return;
+    module_load_counts = counts;
+#endif
+
+    dl_iterate_phdr(AddModuleCallback, &list);
+
+    // Every table is kept forever, see below, so the same modules
+    // are not published again.
+    if (list.previous && list.new_module_count == 0
+            && list.module_count == list.previous->module_count) {
+        free(list.modules);
+        return;
+    }
+
+    qsort(list.modules, list.module_count, sizeof(Module*), CompareModules);
+
+    ModuleTable* table = (ModuleTable*)malloc(
+            sizeof(ModuleTable) + list.module_count * sizeof(Module*));
+    if (table) {
+        table->module_count = list.module_count;
+        memcpy(table->modules, list.modules, list.module_count * sizeof(Module*));
+
+        // The previous table and the modules which are not in the new one
+        // are never freed: a signal handler may still be reading them.
+        // They are small and dlclose() is rare.
+        atomic_store(&module_table, table);
+    }
+    free(list.modules);
+}
+
+const Module* ModuleMap_FindModule(uintptr_t address) {
+    return FindModuleInTable(atomic_load(&module_table), address);
+}
+
+const Module* ModuleMap_FindModuleByPath(const char* path) {
+    assert(path);
+    const ModuleTable* table = atomic_load(&module_table);
+    if (!table)
+        return NULL;
+
+    for (size_t i = 0; i < table->module_count; ++i) {
+        if (strcmp(table->modules[i]->path, path) == 0)
+            return table->modules[i];
+    }
+    return NULL;
+}
+
+const Module* ModuleMap_FindModuleByBuildId(
+        const uint8_t* build_id, size_t build_id_size) {
+    assert(build_id || build_id_size == 0);
+    const ModuleTable* table = atomic_load(&module_table);
+    if (!table || build_id_size == 0)
+        return NULL;
+
+    for (size_t i = 0; i < table->module_count; ++i) {
+        const Module* module = table->modules[i];
+        if (module->build_id_size == build_id_size
+                && memcmp(module->build_id, build_id, build_id_size) == 0)
+            return module;
+    }
+    return NULL;
+}
+
+void ModuleMap_ForEach(ModuleMapCallback callback, void* context) {
+    assert(callback);
+    const ModuleTable* table = atomic_load(&module_table);
+    if (!table)
+        return;
+
+    for (size_t i = 0; i < table->module_count; ++i)
+        callback(table->modules[i], context);
+}
+
+
+// Dynamic section addresses are relocated in place by some linkers
+// (glibc) and left as virtual addresses by others (bionic).
+static uintptr_t DynamicAddress(const Module* module, ElfW(Addr) address) {
+    if (address < module->load_bias)
+        return module->load_bias + address;
+    return address;
+}
+
+// DT_GNU_HASH does not store the symbol count,
+// it has to be derived from the hash chains.
+static size_t GnuHashSymbolCount(const uint32_t* gnu_hash) {
+    uint32_t bucket_count = gnu_hash[0];
+    uint32_t symbol_offset = gnu_hash[1];
+    uint32_t bloom_size = gnu_hash[2];
+    const ElfW(Addr)* bloom = (const ElfW(Addr)*)&gnu_hash[4];
+    const uint32_t* buckets = (const uint32_t*)&bloom[bloom_size];
+    const uint32_t* chains = &buckets[bucket_count];
+
+    uint32_t last_symbol = 0;
+    for (uint32_t i = 0; i < bucket_count; ++i) {
+        if (buckets[i] > last_symbol)
+            last_symbol = buckets[i];
+    }
+    if (last_symbol < symbol_offset)
+        return symbol_offset;
+
+    while ((chains[last_symbol - symbol_offset] & 1) == 0)
+        ++last_symbol;
+    return last_symbol + 1;
+}
+
+static int CompareSymbols(const void* left_voidp, const void* right_voidp) {
+    const ModuleSymbol* left = (const ModuleSymbol*)left_voidp;
+    const ModuleSymbol* right = (const ModuleSymbol*)right_voidp;
+    if (left->start < right->start)
+        return -1;
+    return left->start > right->start;
+}
+
+static ModuleSymbols* BuildModuleSymbols(const Module* module) {
+    // Find PT_DYNAMIC through the program headers mapped with the ELF header.
+    const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*)module->base;
+    const ElfW(Phdr)* phdrs = (const ElfW(Phdr)*)(module->base + ehdr->e_phoff);
+    const ElfW(Dyn)* dynamic = NULL;
+    for (size_t i = 0; i < ehdr->e_phnum; ++i) {
+        if (phdrs[i].p_type == PT_DYNAMIC)
+            dynamic = (const ElfW(Dyn)*)(module->load_bias + phdrs[i].p_vaddr);
+    }
+
+    const ElfW(Sym)* symtab = NULL;
+    const char* strtab = NULL;
+    size_t symbol_count = 0;
+    for (; dynamic && dynamic->d_tag != DT_NULL; ++dynamic) {
+        switch (dynamic->d_tag) {
+        case DT_SYMTAB:
+            symtab = (const ElfW(Sym)*)DynamicAddress(module, dynamic->d_un.d_ptr);
+            break;
+        case DT_STRTAB:
+            strtab = (const char*)DynamicAddress(module, dynamic->d_un.d_ptr);
+            break;
+        case DT_HASH:
+            // nchain is the symbol count.
+            symbol_count = ((const uint32_t*)DynamicAddress(
+                    module, dynamic->d_un.d_ptr))[1];
+            break;
+        case DT_GNU_HASH:
+            if (symbol_count == 0) {
+                symbol_count = GnuHashSymbolCount((const uint32_t*)DynamicAddress(
+                        module, dynamic->d_un.d_ptr));
+            }
+            break;
+        }
+    }
+    if (!symtab || !strtab)
+        symbol_count = 0;
+
+    ModuleSymbols* symbols = (ModuleSymbols*)malloc(
+            sizeof(ModuleSymbols) + symbol_count * sizeof(ModuleSymbol));
+    if (!symbols)
+        return NULL;
+
+    size_t defined_count = 0;
+    for (size_t i = 0; i < symbol_count; ++i) {
+        const ElfW(Sym)* sym = &symtab[i];
+        int type = sym->st_info & 0xf; // ELF32_ST_TYPE() and ELF64_ST_TYPE() are the same.
+        if (sym->st_shndx == SHN_UNDEF || sym->st_value == 0)
+            continue;
+        if (type != STT_FUNC && type != STT_OBJECT)
+            continue;
+
+        ModuleSymbol* symbol = &symbols->symbols[defined_count++];
+        symbol->start = module->load_bias + sym->st_value;
+        symbol->end = symbol->start + sym->st_size;
+        symbol->name = strtab + sym->st_name;
+    }
+    symbols->symbol_count = defined_count;
+
+    qsort(symbols->symbols, defined_count, sizeof(ModuleSymbol), CompareSymbols);
+    return symbols;
+}
+
+static const char* FindSymbol(const Module* module, uintptr_t address) {
+    // Built once per module. Concurrent callers may both build the index,
+    // only one of them gets published.
+    Module* mutable_module = (Module*)module;
+    ModuleSymbols* symbols =
+            __atomic_load_n(&mutable_module->symbols, __ATOMIC_ACQUIRE);
+    if (!symbols) {
+        ModuleSymbols* built = BuildModuleSymbols(module);
+        if (!built)
+            return NULL;
+        ModuleSymbols* expected = NULL;
+        if (__atomic_compare_exchange_n(&mutable_module->symbols,
+                    &expected, built, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            symbols = built;
+        } else {
+            free(built);
+            symbols = expected;
+        }
+    }
+
+    // Find the last symbol with start <= address.
+    size_t low = 0;
+    size_t high = symbols->symbol_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (symbols->symbols[middle].start <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    // Symbols may overlap (aliases), so check a few preceding ones too.
+    for (size_t i = low; i > 0 && low - i < 4; --i) {
+        const ModuleSymbol* symbol = &symbols->symbols[i - 1];
+        if (address < symbol->end)
+            return symbol->name;
+    }
+    return NULL;
+}
+
+const char* Module_FindSymbol(const Module* module, uintptr_t address) {
+    assert(module);
+    uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+    const char* name = FindSymbol(module, address);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_SYMBOL_LOOKUP_TIME,
+            CAPTURE_COUNTERS_TICKS() - start_ticks);
+    CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_SYMBOL_LOOKUP_COUNT, 1);
+    return name;
+}
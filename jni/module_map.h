@@ -0,0 +1,92 @@
+#ifndef MODULE_MAP_H
+#define MODULE_MAP_H
+
+// Index of the modules (executable and shared libraries) loaded
+// into the process, sorted by load base.
+//
+// Built once with dl_iterate_phdr() and refreshed incrementally
+// after dlopen(), so looking up the module of an address is a binary
+// search which takes no locks, unlike dladdr(), which takes the linker
+// lock and walks all the loaded libraries on every call.
+//
+// Symbols are looked up in a sorted index of the module's dynamic symbol
+// table, built lazily on the first lookup. It contains the same
+// symbols dladdr() is able to find.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct ModuleSymbols;
+
+// NT_GNU_BUILD_ID is 20 bytes (SHA-1) for both GNU ld and lld.
+enum { module_build_id_size_max = 32 };
+
+struct Module {
+    // Unique for the lifetime of the process, never reused,
+    // even if the same library is loaded again.
+    uint32_t                id;
+
+    // Address of the ELF header, matches Dl_info::dli_fbase.
+    uintptr_t               base;
+
+    // End of the last PT_LOAD segment.
+    uintptr_t               end;
+
+    // Load bias, matches dl_phdr_info::dlpi_addr.
+    uintptr_t               load_bias;
+
+    const char*             path;
+
+    // dl_phdr_info::dlpi_name, as the linker reported it. A refresh
+    // compares it before resolving the path and reading the build id.
+    const char*             loaded_name;
+
+    // NT_GNU_BUILD_ID note, if the module has one.
+    uint8_t                 build_id[module_build_id_size_max];
+    size_t                  build_id_size;
+
+#if __arm__
+    // PT_ARM_EXIDX, the EHABI unwind index of the module:
+    // 8-byte entries sorted by function address.
+    uintptr_t               exidx_start;
+    size_t                  exidx_count;
+#endif
+
+    // Built by Module_FindSymbol() on the first call.
+    struct ModuleSymbols*   symbols;
+};
+typedef struct Module Module;
+
+
+// Builds the index. Must be called before the signal handler is installed.
+// Not async-signal-safe.
+bool ModuleMap_Init();
+
+// Adds the modules loaded since the last refresh and drops the unloaded
+// ones. Module structs already in the index are kept as they are.
+// If nothing was loaded or unloaded, the index is not replaced,
+// so it is cheap to call on every unknown address.
+// Call after dlopen(). Not async-signal-safe.
+void ModuleMap_Refresh();
+
+// Async-signal-safe, lock-free.
+// Returns NULL, if the address does not belong to any known module.
+const Module* ModuleMap_FindModule(uintptr_t address);
+
+// Not async-signal-safe.
+const Module* ModuleMap_FindModuleByPath(const char* path);
+const Module* ModuleMap_FindModuleByBuildId(
+        const uint8_t* build_id, size_t build_id_size);
+
+// Calls the callback for every module of the current index, in the order
+// of load bases. Async-signal-safe, if the callback is.
+typedef void (*ModuleMapCallback)(const Module* module, void* context);
+void ModuleMap_ForEach(ModuleMapCallback callback, void* context);
+
+// Returns the name of the dynamic symbol containing the address,
+// or NULL. Not async-signal-safe.
+const char* Module_FindSymbol(const Module* module, uintptr_t address);
+
+#endif // MODULE_MAP_H
@@ -0,0 +1,296 @@
+#include "sampling_profiler.h"
+#include "backtrace.h"
+#include "module_map.h"
+#include "stack_ring.h"
+#include "stack_table.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if !FRAME_POINTER_METHOD
+#error "SamplingProfiler needs FRAME_POINTER_METHOD."
+#endif
+
+// Older C libraries only have the union member.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+
+enum { sampling_thread_count_max = 256 };
+
+enum SamplingThreadState {
+    SAMPLING_THREAD_FREE        = 0,
+    SAMPLING_THREAD_RESERVED    = 1,
+    SAMPLING_THREAD_ACTIVE      = 2,
+};
+
+// Samples go into the StackRing of the thread:
+// the SIGPROF handler on the thread is the producer,
+// the drain is the consumer.
+struct SamplingThread {
+    _Atomic int     state;
+    pid_t           tid;
+    timer_t         timer;
+    bool            timer_armed;
+    StackRing*      ring;
+};
+typedef struct SamplingThread SamplingThread;
+
+static SamplingThread sampling_threads[sampling_thread_count_max];
+static __thread SamplingThread* this_sampling_thread;
+
+static SamplingProfilerConfig sampling_config;
+static _Atomic bool sampling_running;
+static pthread_t sampling_drain_thread;
+static struct sigaction sampling_previous_action;
+
+// Serializes the drain thread, SamplingProfiler_Drain()
+// and unregistering threads.
+static pthread_mutex_t sampling_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Added to by the handler: 32-bit, 64-bit atomics take a lock on armeabi.
+static _Atomic uint32_t sampling_sample_count;
+static _Atomic uint32_t sampling_dropped_count;
+
+
+static void SigProfHandler(int sig, siginfo_t* info, void* ucontext) {
+    SamplingThread* thread = this_sampling_thread;
+    if (!thread || atomic_load_explicit(&thread->state, memory_order_acquire)
+            != SAMPLING_THREAD_ACTIVE)
+        return;
+
+    int saved_errno = errno;
+
+    BacktraceState state;
+    if (!StackRing_BeginWrite(thread->ring, &state,
+                (const ucontext_t*)ucontext)) {
+        atomic_fetch_add_explicit(
+                &sampling_dropped_count, 1, memory_order_relaxed);
+        errno = saved_errno;
+        return;
+    }
+
+    // A broken chain still leaves the frames before the break.
+    // The walk stores nothing for a PC in unknown code (JIT code,
+    // a library loaded since the last refresh), the sample is the PC.
+    FramePointerWithRegisters(&state);
+    if (state.address_count == 0)
+        BacktraceState_AddAddress(&state, Backtrace_GetSignalPc(state.signal_ucontext));
+
+    if (state.address_count > 0) {
+        if (sampling_config.stack_table) {
+            // The slot is only scratch space, the next sample reuses it.
+            uint32_t stack_id = StackTable_Intern(sampling_config.stack_table,
+                    state.addresses, state.address_count);
+            StackRing_AbortWrite(thread->ring);
+            if (stack_id == stack_table_invalid_id) {
+                atomic_fetch_add_explicit(
+                        &sampling_dropped_count, 1, memory_order_relaxed);
+                errno = saved_errno;
+                return;
+            }
+        } else {
+            StackRing_CommitWrite(thread->ring, &state,
+                    BACKTRACE_METHOD_FRAME_POINTER);
+        }
+        atomic_fetch_add_explicit(
+                &sampling_sample_count, 1, memory_order_relaxed);
+    } else {
+        StackRing_AbortWrite(thread->ring);
+        atomic_fetch_add_explicit(
+                &sampling_dropped_count, 1, memory_order_relaxed);
+    }
+
+    errno = saved_errno;
+}
+
+static void OnSampleBatch(
+        const StackRingEntry* entries, size_t entry_count, void* thread_voidp) {
+    const SamplingThread* thread = (const SamplingThread*)thread_voidp;
+    for (size_t i = 0; i < entry_count; ++i) {
+        sampling_config.callback(thread->tid,
+                entries[i].addresses, entries[i].address_count,
+                sampling_config.callback_context);
+    }
+}
+
+// Must be called with sampling_drain_mutex locked.
+static void DrainThread(SamplingThread* thread) {
+    // The only consumer: the crash handler captures into a ring of its own.
+    StackRing_Drain(thread->ring, OnSampleBatch, thread, NULL);
+}
+
+void SamplingProfiler_Drain() {
+    pthread_mutex_lock(&sampling_drain_mutex);
+    for (size_t i = 0; i < sampling_thread_count_max; ++i) {
+        SamplingThread* thread = &sampling_threads[i];
+        if (atomic_load(&thread->state) == SAMPLING_THREAD_ACTIVE)
+            DrainThread(thread);
+    }
+    pthread_mutex_unlock(&sampling_drain_mutex);
+}
+
+static void* DrainThreadMain(void* unused) {
+    struct timespec interval = {};
+    interval.tv_sec = sampling_config.drain_interval_ms / 1000;
+    interval.tv_nsec = (long)(sampling_config.drain_interval_ms % 1000) * 1000000;
+
+    while (atomic_load(&sampling_running)) {
+        nanosleep(&interval, NULL);
+        SamplingProfiler_Drain();
+    }
+    return NULL;
+}
+
+bool SamplingProfiler_Start(const SamplingProfilerConfig* config) {
+    assert(config);
+    assert(config->callback || config->stack_table);
+    assert(config->frequency_hz > 0);
+    assert(config->ring_size > 0);
+    assert(config->drain_interval_ms > 0);
+
+    if (atomic_load(&sampling_running))
+        return false;
+    sampling_config = *config;
+
+    // FramePointerWithRegisters() validates return addresses with it.
+    ModuleMap_Init();
+
+    struct sigaction action = {};
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = SigProfHandler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    if (sigaction(SIGPROF, &action, &sampling_previous_action) != 0)
+        return false;
+
+    atomic_store(&sampling_running, true);
+    if (pthread_create(&sampling_drain_thread, NULL, DrainThreadMain, NULL) != 0) {
+        atomic_store(&sampling_running, false);
+        sigaction(SIGPROF, &sampling_previous_action, NULL);
+        return false;
+    }
+    return true;
+}
+
+void SamplingProfiler_Stop() {
+    if (!atomic_exchange(&sampling_running, false))
+        return;
+
+    // Threads stay registered until they unregister themselves:
+    // a signal may already be pending on them.
+    pthread_mutex_lock(&sampling_drain_mutex);
+    for (size_t i = 0; i < sampling_thread_count_max; ++i) {
+        SamplingThread* thread = &sampling_threads[i];
+        if (atomic_load(&thread->state) == SAMPLING_THREAD_ACTIVE
+                && thread->timer_armed) {
+            timer_delete(thread->timer);
+            thread->timer_armed = false;
+        }
+    }
+    pthread_mutex_unlock(&sampling_drain_mutex);
+
+    pthread_join(sampling_drain_thread, NULL);
+    SamplingProfiler_Drain();
+
+    // The handler stays installed: restoring the default action
+    // would terminate the process on a still pending SIGPROF.
+}
+
+bool SamplingProfiler_RegisterThread() {
+    if (!atomic_load(&sampling_running) || this_sampling_thread)
+        return false;
+
+    SamplingThread* thread = NULL;
+    for (size_t i = 0; i < sampling_thread_count_max && !thread; ++i) {
+        int expected = SAMPLING_THREAD_FREE;
+        if (atomic_compare_exchange_strong(&sampling_threads[i].state,
+                    &expected, SAMPLING_THREAD_RESERVED))
+            thread = &sampling_threads[i];
+    }
+    if (!thread)
+        return false;
+
+    thread->ring = StackRing_RegisterThread(
+            sampling_config.depth, sampling_config.ring_size);
+    if (!FramePointer_RegisterThread() || !thread->ring) {
+        StackRing_UnregisterThread();
+        atomic_store(&thread->state, SAMPLING_THREAD_FREE);
+        return false;
+    }
+    thread->tid = gettid();
+    thread->timer_armed = false;
+
+    // Make the (possibly emulated) TLS slot exist before the first signal.
+    this_sampling_thread = thread;
+
+    struct sigevent event = {};
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = thread->tid;
+
+    // CPU time of this thread, so idle threads are not sampled.
+    long period_ns = 1000000000L / sampling_config.frequency_hz;
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec = period_ns / 1000000000L;
+    spec.it_interval.tv_nsec = period_ns % 1000000000L;
+    spec.it_value = spec.it_interval;
+
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &thread->timer) != 0) {
+        this_sampling_thread = NULL;
+        StackRing_UnregisterThread();
+        atomic_store(&thread->state, SAMPLING_THREAD_FREE);
+        return false;
+    }
+    thread->timer_armed = true;
+
+    atomic_store_explicit(&thread->state, SAMPLING_THREAD_ACTIVE,
+            memory_order_release);
+    timer_settime(thread->timer, 0, &spec, NULL);
+    return true;
+}
+
+void SamplingProfiler_UnregisterThread() {
+    SamplingThread* thread = this_sampling_thread;
+    if (!thread)
+        return;
+
+    // The handler of this thread must not run while it is unregistered.
+    sigset_t profiling_signals;
+    sigset_t previous_signals;
+    sigemptyset(&profiling_signals);
+    sigaddset(&profiling_signals, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &profiling_signals, &previous_signals);
+
+    pthread_mutex_lock(&sampling_drain_mutex);
+    if (thread->timer_armed) {
+        timer_delete(thread->timer);
+        thread->timer_armed = false;
+    }
+    DrainThread(thread);
+    atomic_store(&thread->state, SAMPLING_THREAD_RESERVED);
+    pthread_mutex_unlock(&sampling_drain_mutex);
+
+    // Not drained any more, nor written: SIGPROF is blocked.
+    this_sampling_thread = NULL;
+    thread->ring = NULL;
+    StackRing_UnregisterThread();
+    atomic_store(&thread->state, SAMPLING_THREAD_FREE);
+
+    pthread_sigmask(SIG_SETMASK, &previous_signals, NULL);
+}
+
+void SamplingProfiler_GetStats(SamplingProfilerStats* stats) {
+    assert(stats);
+    stats->sample_count = atomic_load(&sampling_sample_count);
+    stats->dropped_count = atomic_load(&sampling_dropped_count);
+}
@@ -0,0 +1,87 @@
+#ifndef SAMPLING_PROFILER_H
+#define SAMPLING_PROFILER_H
+
+// Low-overhead CPU sampling profiler.
+//
+// Every registered thread gets a per-thread CPU-time timer, which sends
+// SIGPROF to that thread. The handler captures the interrupted stack
+// into the StackRing of the thread with FRAME_POINTER_METHOD,
+// the only method which neither looks up unwind tables nor takes locks.
+// A background thread drains the rings and passes the samples
+// to a callback.
+//
+// Cost per sample is one signal delivery plus a frame pointer walk,
+// a few microseconds, which is well under the 2% CPU overhead target
+// at 1 kHz (1 ms between samples).
+// Full rings do not block the handler, samples are dropped and counted.
+//
+// Needs code built with -fno-omit-frame-pointer. The stack of a sample
+// is cut at the first frame which breaks the chain, but always contains
+// at least the interrupted instruction: a PC outside of the known modules
+// is a sample of that one frame.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+// Called on the drain thread for every captured sample.
+typedef void (*SamplingProfilerCallback)(
+        pid_t tid, const uintptr_t* addresses, size_t address_count,
+        void* context);
+
+struct SamplingProfilerConfig {
+    // Per thread, 1000 is 1 kHz.
+    unsigned int                frequency_hz;
+
+    // Backtrace depth, within [backtrace_depth_min, backtrace_depth_max].
+    size_t                      depth;
+
+    // Samples each thread can hold between two drains.
+    size_t                      ring_size;
+
+    // How often the background thread drains the rings.
+    unsigned int                drain_interval_ms;
+
+    // If set, the handler interns every sample there
+    // and only the count of the stack is incremented.
+    // The ring is then only used as scratch space,
+    // and the callback is not called.
+    struct StackTable*          stack_table;
+
+    SamplingProfilerCallback    callback;
+    void*                       callback_context;
+};
+typedef struct SamplingProfilerConfig SamplingProfilerConfig;
+
+struct SamplingProfilerStats {
+    uint64_t    sample_count;
+    uint64_t    dropped_count;
+};
+typedef struct SamplingProfilerStats SamplingProfilerStats;
+
+
+// Installs the SIGPROF handler and starts the drain thread.
+// Only one profiler can run at a time.
+bool SamplingProfiler_Start(const SamplingProfilerConfig* config);
+
+// Stops sampling of all threads, drains the rings one last time
+// and joins the drain thread.
+void SamplingProfiler_Stop();
+
+// Must be called by each thread to be sampled, after
+// SamplingProfiler_Start(). Allocates the ring and arms the timer.
+bool SamplingProfiler_RegisterThread();
+
+// Disarms the timer of the calling thread, drains its ring and releases it
+// (StackRing_UnregisterThread()). Must be called before the thread exits.
+void SamplingProfiler_UnregisterThread();
+
+// Drains all the rings on the calling thread.
+// Normally done by the drain thread.
+void SamplingProfiler_Drain();
+
+void SamplingProfiler_GetStats(SamplingProfilerStats* stats);
+
+#endif // SAMPLING_PROFILER_H
@@ -0,0 +1,197 @@
+#include "stack_ring.h"
+#include "backtrace_pool.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Entries passed to the consumer callback at once.
+enum { stack_ring_batch_size = 32 };
+
+struct StackRingSlotInfo {
+    size_t      address_count;
+    uint32_t    tag;
+};
+typedef struct StackRingSlotInfo StackRingSlotInfo;
+
+struct StackRing {
+    // Written by the producer only.
+    _Atomic size_t      head __attribute__((aligned(64)));
+    // 32-bit: 64-bit atomics take a lock on armeabi.
+    _Atomic uint32_t    dropped_count;
+    // Between StackRing_BeginWrite() and the end of the write.
+    _Atomic bool        writing;
+
+    // Written by the consumer only.
+    _Atomic size_t      tail __attribute__((aligned(64)));
+    _Atomic bool        consumer_busy;
+
+    // Read-only after creation.
+    size_t              capacity __attribute__((aligned(64)));
+    pid_t               tid;
+    size_t              mapping_size;
+    BacktracePool       pool;
+    StackRingSlotInfo   slot_infos[];
+};
+
+// Set before any signal handler reads it, by StackRing_RegisterThread().
+static __thread StackRing* this_thread_ring;
+
+
+static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+StackRing* StackRing_Create(size_t depth, size_t capacity) {
+    assert(capacity > 0);
+    capacity = RoundUpToPowerOfTwo(capacity);
+
+    size_t size = sizeof(StackRing) + capacity * sizeof(StackRingSlotInfo);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    // Anonymous mappings are zeroed.
+    StackRing* ring = (StackRing*)mapping;
+    ring->capacity = capacity;
+    ring->tid = gettid();
+    ring->mapping_size = size;
+    if (!BacktracePool_Init(&ring->pool, depth, capacity)) {
+        munmap(mapping, size);
+        return NULL;
+    }
+    return ring;
+}
+
+void StackRing_Destroy(StackRing* ring) {
+    if (!ring)
+        return;
+    BacktracePool_Destroy(&ring->pool);
+    munmap(ring, ring->mapping_size);
+}
+
+StackRing* StackRing_RegisterThread(size_t depth, size_t capacity) {
+    if (!this_thread_ring)
+        this_thread_ring = StackRing_Create(depth, capacity);
+    return this_thread_ring;
+}
+
+void StackRing_UnregisterThread() {
+    StackRing* ring = this_thread_ring;
+    if (!ring)
+        return;
+
+    // Wait for a consumer on another thread to finish.
+    bool expected = false;
+    while (!atomic_compare_exchange_weak(&ring->consumer_busy, &expected, true))
+        expected = false;
+
+    this_thread_ring = NULL;
+    StackRing_Destroy(ring);
+}
+
+StackRing* StackRing_ForThisThread() {
+    return this_thread_ring;
+}
+
+bool StackRing_BeginWrite(
+        StackRing* ring, BacktraceState* state, const ucontext_t* ucontext) {
+    assert(ring);
+    assert(state);
+
+    // A handler which interrupted another one's write, for example
+    // a crash in the middle of a sample, would capture into the same slot.
+    if (atomic_exchange_explicit(&ring->writing, true, memory_order_acquire)) {
+        atomic_fetch_add_explicit(&ring->dropped_count, 1, memory_order_relaxed);
+        return false;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= ring->capacity) {
+        atomic_fetch_add_explicit(&ring->dropped_count, 1, memory_order_relaxed);
+        atomic_store_explicit(&ring->writing, false, memory_order_release);
+        return false;
+    }
+
+    BacktracePool_InitState(&ring->pool, head & (ring->capacity - 1),
+            state, ucontext);
+    return true;
+}
+
+void StackRing_CommitWrite(
+        StackRing* ring, const BacktraceState* state, uint32_t tag) {
+    assert(ring);
+    assert(state);
+
+    if (state->address_count > 0) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        StackRingSlotInfo* info = &ring->slot_infos[head & (ring->capacity - 1)];
+        info->address_count = state->address_count;
+        info->tag = tag;
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+    atomic_store_explicit(&ring->writing, false, memory_order_release);
+}
+
+void StackRing_AbortWrite(StackRing* ring) {
+    assert(ring);
+    atomic_store_explicit(&ring->writing, false, memory_order_release);
+}
+
+bool StackRing_Drain(
+        StackRing* ring, StackRingBatchCallback callback, void* context,
+        size_t* drained_count) {
+    assert(ring);
+    assert(callback);
+
+    bool expected = false;
+    if (!atomic_compare_exchange_strong_explicit(&ring->consumer_busy,
+                &expected, true, memory_order_acquire, memory_order_relaxed))
+        return false;
+
+    size_t count = 0;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    while (tail != head) {
+        StackRingEntry entries[stack_ring_batch_size];
+        size_t entry_count = 0;
+        for (; tail + entry_count != head
+                && entry_count < stack_ring_batch_size; ++entry_count) {
+            size_t slot = (tail + entry_count) & (ring->capacity - 1);
+            entries[entry_count].addresses = BacktracePool_Slot(&ring->pool, slot);
+            entries[entry_count].address_count = ring->slot_infos[slot].address_count;
+            entries[entry_count].tag = ring->slot_infos[slot].tag;
+        }
+
+        callback(entries, entry_count, context);
+
+        // Hand the slots back to the producer after each batch.
+        tail += entry_count;
+        count += entry_count;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    atomic_store_explicit(&ring->consumer_busy, false, memory_order_release);
+    if (drained_count)
+        *drained_count = count;
+    return true;
+}
+
+pid_t StackRing_Tid(const StackRing* ring) {
+    assert(ring);
+    return ring->tid;
+}
+
+uint64_t StackRing_DroppedCount(const StackRing* ring) {
+    assert(ring);
+    return atomic_load_explicit(
+            &((StackRing*)ring)->dropped_count, memory_order_relaxed);
+}
@@ -0,0 +1,82 @@
+#ifndef STACK_RING_H
+#define STACK_RING_H
+
+// Lock-free single-producer/single-consumer ring of captured stacks.
+//
+// Every thread gets one ring, mmap'ed when the thread registers.
+// The producer is a signal handler running on that thread (crash or
+// sampling), it captures straight into the next free slot of the ring
+// and publishes it, without allocating or locking. When the ring is full,
+// the stack is dropped and counted, the producer never waits.
+// A producer which must not lose its stack to another one's full ring
+// creates its own with StackRing_Create(), as the crash handler does.
+//
+// The consumer drains published stacks in batches. Only one consumer
+// drains a ring at a time: StackRing_Drain() fails instead of blocking,
+// if another one is draining, so it can be retried from a signal handler.
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+struct StackRing;
+typedef struct StackRing StackRing;
+
+struct StackRingEntry {
+    const uintptr_t*    addresses;
+    size_t              address_count;
+
+    // Set by the producer, for example the BacktraceMethod.
+    uint32_t            tag;
+};
+typedef struct StackRingEntry StackRingEntry;
+
+// Entries are only valid during the call.
+typedef void (*StackRingBatchCallback)(
+        const StackRingEntry* entries, size_t entry_count, void* context);
+
+
+// "depth" is the backtrace depth of every slot,
+// "capacity" is rounded up to a power of two.
+// Not async-signal-safe.
+StackRing* StackRing_Create(size_t depth, size_t capacity);
+void StackRing_Destroy(StackRing* ring);
+
+// Creates the ring of the calling thread, or returns the existing one.
+// Must be called by the thread itself. Not async-signal-safe.
+StackRing* StackRing_RegisterThread(size_t depth, size_t capacity);
+void StackRing_UnregisterThread();
+
+// Returns NULL, if the calling thread is not registered.
+// Async-signal-safe.
+StackRing* StackRing_ForThisThread();
+
+// Producer side, async-signal-safe.
+// Initializes "state" to capture into the next free slot.
+// Returns false and counts a drop, if the ring is full.
+// Writes must not nest: a handler which interrupts another write
+// of the ring (a crash in the middle of a sample) fails the same way.
+// Every successful StackRing_BeginWrite() must be ended by
+// StackRing_CommitWrite(), which publishes the slot, unless the state
+// has no addresses, or by StackRing_AbortWrite(), which does not.
+bool StackRing_BeginWrite(
+        StackRing* ring, BacktraceState* state, const ucontext_t* ucontext);
+void StackRing_CommitWrite(
+        StackRing* ring, const BacktraceState* state, uint32_t tag);
+void StackRing_AbortWrite(StackRing* ring);
+
+// Consumer side, async-signal-safe as long as the callback is.
+// Passes all published entries to the callback, in batches.
+// Returns false without draining, if another consumer is draining.
+bool StackRing_Drain(
+        StackRing* ring, StackRingBatchCallback callback, void* context,
+        size_t* drained_count);
+
+pid_t StackRing_Tid(const StackRing* ring);
+uint64_t StackRing_DroppedCount(const StackRing* ring);
+
+#endif // STACK_RING_H
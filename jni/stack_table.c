@@ -0,0 +1,200 @@
+#include "stack_table.h"
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+
+
+enum StackTableSlotState {
+    STACK_TABLE_SLOT_EMPTY      = 0,
+    STACK_TABLE_SLOT_WRITING    = 1,
+    STACK_TABLE_SLOT_READY      = 2,
+    // Claimed, but the arena was full.
+    STACK_TABLE_SLOT_FAILED     = 3,
+};
+
+// 32-bit atomics only: 64-bit ones are not lock-free on all the ARM32 CPUs,
+// and locking ones are not async-signal-safe.
+struct StackTableSlot {
+    _Atomic uint32_t    state;
+    uint32_t            hash;
+    uint32_t            address_count;
+    _Atomic uint32_t    count;
+    size_t              address_offset;
+};
+typedef struct StackTableSlot StackTableSlot;
+
+struct StackTable {
+    size_t              capacity;
+    size_t              address_capacity;
+    size_t              mapping_size;
+
+    _Atomic size_t      stack_count;
+    _Atomic size_t      address_used;
+    _Atomic uint32_t    dropped_count;
+
+    StackTableSlot*     slots;
+    uintptr_t*          addresses;
+};
+
+
+static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+static uint32_t HashAddresses(const uintptr_t* addresses, size_t address_count) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < address_count; ++i) {
+        hash ^= (uint64_t)addresses[i];
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+
+StackTable* StackTable_Create(size_t stack_capacity, size_t address_capacity) {
+    assert(stack_capacity > 0);
+    assert(address_capacity > 0);
+    stack_capacity = RoundUpToPowerOfTwo(stack_capacity);
+
+    size_t header_size = (sizeof(StackTable) + 63) & ~(size_t)63;
+    size_t slots_size = stack_capacity * sizeof(StackTableSlot);
+    size_t size = header_size + slots_size + address_capacity * sizeof(uintptr_t);
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    // Anonymous mappings are zeroed, all slots are empty.
+    StackTable* table = (StackTable*)mapping;
+    table->capacity = stack_capacity;
+    table->address_capacity = address_capacity;
+    table->mapping_size = size;
+    table->slots = (StackTableSlot*)((char*)mapping + header_size);
+    table->addresses = (uintptr_t*)((char*)mapping + header_size + slots_size);
+    return table;
+}
+
+void StackTable_Destroy(StackTable* table) {
+    if (table)
+        munmap(table, table->mapping_size);
+}
+
+static bool SlotMatches(
+        const StackTable* table, const StackTableSlot* slot, uint32_t hash,
+        const uintptr_t* addresses, size_t address_count) {
+    return slot->hash == hash
+            && slot->address_count == address_count
+            && memcmp(&table->addresses[slot->address_offset], addresses,
+                    address_count * sizeof(uintptr_t)) == 0;
+}
+
+uint32_t StackTable_Intern(
+        StackTable* table, const uintptr_t* addresses, size_t address_count) {
+    assert(table);
+    assert(addresses || address_count == 0);
+
+    uint32_t hash = HashAddresses(addresses, address_count);
+    size_t mask = table->capacity - 1;
+
+    for (size_t probe = 0; probe < table->capacity; ++probe) {
+        size_t index = (hash + probe) & mask;
+        StackTableSlot* slot = &table->slots[index];
+
+        uint32_t state = atomic_load_explicit(&slot->state, memory_order_acquire);
+        if (state == STACK_TABLE_SLOT_EMPTY) {
+            uint32_t expected = STACK_TABLE_SLOT_EMPTY;
+            if (!atomic_compare_exchange_strong_explicit(&slot->state,
+                        &expected, STACK_TABLE_SLOT_WRITING,
+                        memory_order_acq_rel, memory_order_acquire)) {
+                // Somebody else claimed it, check what they wrote.
+                state = expected;
+            } else {
+                size_t offset = atomic_fetch_add_explicit(&table->address_used,
+                        address_count, memory_order_relaxed);
+                if (offset + address_count > table->address_capacity) {
+                    atomic_store_explicit(&slot->state,
+                            STACK_TABLE_SLOT_FAILED, memory_order_release);
+                    break;
+                }
+
+                memcpy(&table->addresses[offset], addresses,
+                        address_count * sizeof(uintptr_t));
+                slot->hash = hash;
+                slot->address_count = (uint32_t)address_count;
+                slot->address_offset = offset;
+                atomic_store_explicit(&slot->count, 1, memory_order_relaxed);
+                atomic_store_explicit(&slot->state,
+                        STACK_TABLE_SLOT_READY, memory_order_release);
+                atomic_fetch_add_explicit(
+                        &table->stack_count, 1, memory_order_relaxed);
+                return (uint32_t)index;
+            }
+        }
+
+        // A slot which is still being written is skipped, not waited for:
+        // its writer may be the very code this signal handler interrupted.
+        if (state == STACK_TABLE_SLOT_READY
+                && SlotMatches(table, slot, hash, addresses, address_count)) {
+            atomic_fetch_add_explicit(&slot->count, 1, memory_order_relaxed);
+            return (uint32_t)index;
+        }
+    }
+
+    atomic_fetch_add_explicit(&table->dropped_count, 1, memory_order_relaxed);
+    return stack_table_invalid_id;
+}
+
+bool StackTable_GetStack(
+        const StackTable* table, uint32_t stack_id,
+        const uintptr_t** addresses, size_t* address_count, uint32_t* count) {
+    assert(table);
+    if (stack_id >= table->capacity)
+        return false;
+
+    StackTableSlot* slot = &table->slots[stack_id];
+    if (atomic_load_explicit(&slot->state, memory_order_acquire)
+            != STACK_TABLE_SLOT_READY)
+        return false;
+
+    if (addresses)
+        *addresses = &table->addresses[slot->address_offset];
+    if (address_count)
+        *address_count = slot->address_count;
+    if (count)
+        *count = atomic_load_explicit(&slot->count, memory_order_relaxed);
+    return true;
+}
+
+void StackTable_ForEach(
+        const StackTable* table, StackTableCallback callback, void* context) {
+    assert(table);
+    assert(callback);
+
+    for (uint32_t id = 0; id < table->capacity; ++id) {
+        const uintptr_t* addresses = NULL;
+        size_t address_count = 0;
+        uint32_t count = 0;
+        if (StackTable_GetStack(table, id, &addresses, &address_count, &count))
+            callback(id, addresses, address_count, count, context);
+    }
+}
+
+size_t StackTable_StackCount(const StackTable* table) {
+    assert(table);
+    return atomic_load_explicit(
+            &((StackTable*)table)->stack_count, memory_order_relaxed);
+}
+
+uint64_t StackTable_DroppedCount(const StackTable* table) {
+    assert(table);
+    return atomic_load_explicit(
+            &((StackTable*)table)->dropped_count, memory_order_relaxed);
+}
@@ -0,0 +1,57 @@
+#ifndef STACK_TABLE_H
+#define STACK_TABLE_H
+
+// Table of unique stacks.
+//
+// Sampled or collected stacks repeat a lot, so each unique address
+// sequence is stored once and identified by a 32-bit stack id.
+// A sample then only needs the stack id (and a timestamp, if wanted),
+// and symbolization is done once per unique stack.
+//
+// The table is an open-addressing hash table in preallocated (mmap'ed)
+// memory. Inserting is lock-free and async-signal-safe:
+// a slot is claimed with compare-and-swap and the addresses are copied
+// into an arena reserved with an atomic add. Inserting never waits for
+// another inserter. If a matching stack is still being written by
+// an interrupted inserter, the stack gets a second slot instead.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct StackTable;
+typedef struct StackTable StackTable;
+
+static const uint32_t stack_table_invalid_id = UINT32_MAX;
+
+typedef void (*StackTableCallback)(
+        uint32_t stack_id, const uintptr_t* addresses, size_t address_count,
+        uint32_t count, void* context);
+
+
+// "stack_capacity" is rounded up to a power of two.
+// "address_capacity" is the total number of addresses of all the stacks.
+// Not async-signal-safe.
+StackTable* StackTable_Create(size_t stack_capacity, size_t address_capacity);
+void StackTable_Destroy(StackTable* table);
+
+// Returns the id of the stack and increments its count.
+// Returns stack_table_invalid_id and counts a drop, if the table
+// or the arena is full. Async-signal-safe, lock-free.
+uint32_t StackTable_Intern(
+        StackTable* table, const uintptr_t* addresses, size_t address_count);
+
+// Returns false for an unknown or not yet completely written stack.
+bool StackTable_GetStack(
+        const StackTable* table, uint32_t stack_id,
+        const uintptr_t** addresses, size_t* address_count, uint32_t* count);
+
+// Calls the callback for every completely written stack.
+void StackTable_ForEach(
+        const StackTable* table, StackTableCallback callback, void* context);
+
+size_t StackTable_StackCount(const StackTable* table);
+uint64_t StackTable_DroppedCount(const StackTable* table);
+
+#endif // STACK_TABLE_H
@@ -0,0 +1,539 @@
+#include "stack_trie.h"
+#include "backtrace.h"
+#include "demangle_cache.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+static const uint32_t stack_trie_no_node = UINT32_MAX;
+static const size_t stack_trie_initial_capacity = 256;
+
+struct StackTrieNode {
+    // NULL for addresses outside of the known modules.
+    const Module*   module;
+    // Module-relative, absolute if there is no module.
+    uintptr_t       address;
+
+    uint32_t        parent;
+    uint32_t        first_child;
+    uint32_t        next_sibling;
+    uint32_t        depth;
+
+    // Samples ending in this node.
+    uint64_t        self_count;
+
+    // Resolved on the first export.
+    const char*     name;
+    bool            name_owned;
+};
+typedef struct StackTrieNode StackTrieNode;
+
+struct StackTrie {
+    // Node 0 is the root, it has no frame.
+    StackTrieNode*  nodes;
+    size_t          node_count;
+    size_t          node_capacity;
+
+    // Open addressing, node indices of the children by
+    // (parent, module, address). 0 marks an empty slot,
+    // the root is nobody's child.
+    uint32_t*       child_index;
+    size_t          child_index_capacity;
+
+    uint64_t        sample_count;
+    uint32_t        depth_max;
+
+    DemangleCache   demangle_cache;
+};
+
+
+static uint32_t HashKey(uint32_t parent, const Module* module, uintptr_t address) {
+    uint64_t hash = (uint64_t)address * 0x9e3779b97f4a7c15ull;
+    hash ^= (uint64_t)(uintptr_t)module + ((uint64_t)parent << 32);
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ull;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+StackTrie* StackTrie_Create() {
+    StackTrie* trie = (StackTrie*)calloc(1, sizeof(StackTrie));
+    if (!trie)
+        return NULL;
+
+    trie->nodes = (StackTrieNode*)calloc(
+            stack_trie_initial_capacity, sizeof(StackTrieNode));
+    trie->child_index = (uint32_t*)calloc(
+            2 * stack_trie_initial_capacity, sizeof(uint32_t));
+    if (!trie->nodes || !trie->child_index) {
+        free(trie->child_index);
+        free(trie->nodes);
+        free(trie);
+        return NULL;
+    }
+    trie->node_capacity = stack_trie_initial_capacity;
+    trie->child_index_capacity = 2 * stack_trie_initial_capacity;
+
+    StackTrieNode* root = &trie->nodes[0];
+    root->parent = stack_trie_no_node;
+    root->first_child = stack_trie_no_node;
+    root->next_sibling = stack_trie_no_node;
+    trie->node_count = 1;
+
+    DemangleCache_Init(&trie->demangle_cache);
+    return trie;
+}
+
+void StackTrie_Destroy(StackTrie* trie) {
+    if (!trie)
+        return;
+    for (size_t i = 0; i < trie->node_count; ++i) {
+        if (trie->nodes[i].name_owned)
+            free((void*)trie->nodes[i].name);
+    }
+    DemangleCache_Destroy(&trie->demangle_cache);
+    free(trie->child_index);
+    free(trie->nodes);
+    free(trie);
+}
+
+static void InsertIntoIndex(
+        uint32_t* index, size_t capacity, const StackTrieNode* nodes,
+        uint32_t node_index) {
+    const StackTrieNode* node = &nodes[node_index];
+    size_t mask = capacity - 1;
+    size_t slot = HashKey(node->parent, node->module, node->address) & mask;
+    while (index[slot] != 0)
+        slot = (slot + 1) & mask;
+    index[slot] = node_index;
+}
+
+// Keeps the index at most half full.
+static bool GrowIndex(StackTrie* trie) {
+    size_t capacity = trie->child_index_capacity * 2;
+    uint32_t* index = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    if (!index)
+        return false;
+    for (size_t i = 1; i < trie->node_count; ++i)
+        InsertIntoIndex(index, capacity, trie->nodes, (uint32_t)i);
+
+    free(trie->child_index);
+    trie->child_index = index;
+    trie->child_index_capacity = capacity;
+    return true;
+}
+
+static uint32_t FindOrAddChild(
+        StackTrie* trie, uint32_t parent, const Module* module, uintptr_t address) {
+    size_t mask = trie->child_index_capacity - 1;
+    size_t slot = HashKey(parent, module, address) & mask;
+    for (; trie->child_index[slot] != 0; slot = (slot + 1) & mask) {
+        const StackTrieNode* node = &trie->nodes[trie->child_index[slot]];
+        if (node->parent == parent && node->module == module
+                && node->address == address)
+            return trie->child_index[slot];
+    }
+
+    if (trie->node_count == trie->node_capacity) {
+        size_t capacity = trie->node_capacity * 2;
+        StackTrieNode* nodes = (StackTrieNode*)realloc(
+                trie->nodes, capacity * sizeof(StackTrieNode));
+        if (!nodes)
+            return stack_trie_no_node;
+        trie->nodes = nodes;
+        trie->node_capacity = capacity;
+    }
+    if ((trie->node_count + 1) * 2 > trie->child_index_capacity
+            && !GrowIndex(trie))
+        return stack_trie_no_node;
+
+    uint32_t node_index = (uint32_t)trie->node_count++;
+    StackTrieNode* node = &trie->nodes[node_index];
+    memset(node, 0, sizeof(StackTrieNode));
+    node->module = module;
+    node->address = address;
+    node->parent = parent;
+    node->first_child = stack_trie_no_node;
+    node->depth = trie->nodes[parent].depth + 1;
+    node->next_sibling = trie->nodes[parent].first_child;
+    trie->nodes[parent].first_child = node_index;
+    if (node->depth > trie->depth_max)
+        trie->depth_max = node->depth;
+
+    InsertIntoIndex(trie->child_index, trie->child_index_capacity,
+            trie->nodes, node_index);
+    return node_index;
+}
+
+bool StackTrie_Add(
+        StackTrie* trie, const uintptr_t* addresses, size_t address_count,
+        uint64_t sample_count) {
+    assert(trie);
+    assert(addresses || address_count == 0);
+
+    uint32_t node_index = 0;
+    for (size_t i = address_count; i-- > 0;) {
+        uintptr_t address = addresses[i];
+        const Module* module = ModuleMap_FindModule(address);
+        if (module)
+            address -= module->base;
+
+        node_index = FindOrAddChild(trie, node_index, module, address);
+        if (node_index == stack_trie_no_node)
+            return false;
+    }
+
+    trie->nodes[node_index].self_count += sample_count;
+    trie->sample_count += sample_count;
+    return true;
+}
+
+size_t StackTrie_NodeCount(const StackTrie* trie) {
+    assert(trie);
+    return trie->node_count - 1;
+}
+
+uint64_t StackTrie_SampleCount(const StackTrie* trie) {
+    assert(trie);
+    return trie->sample_count;
+}
+
+
+static const char* PathBaseName(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static const char* NodeName(StackTrie* trie, StackTrieNode* node) {
+    if (node->name)
+        return node->name;
+
+    const char* symbol_name = node->module
+            ? Module_FindSymbol(node->module, node->module->base + node->address)
+            : NULL;
+    if (symbol_name) {
+        node->name = DemangleCache_Demangle(&trie->demangle_cache, symbol_name);
+        return node->name;
+    }
+
+    char buffer[256];
+    if (node->module) {
+        snprintf(buffer, sizeof(buffer), "%s+0x%lx",
+                PathBaseName(node->module->path), (unsigned long)node->address);
+    } else {
+        snprintf(buffer, sizeof(buffer), "0x%lx", (unsigned long)node->address);
+    }
+    node->name = strdup(buffer);
+    node->name_owned = node->name != NULL;
+    return node->name ? node->name : "";
+}
+
+// Depth-first, every child before its next sibling.
+// Returns stack_trie_no_node after the last node.
+static uint32_t NextNode(const StackTrie* trie, uint32_t node_index) {
+    const StackTrieNode* node = &trie->nodes[node_index];
+    if (node->first_child != stack_trie_no_node)
+        return node->first_child;
+    while (node_index != 0) {
+        node = &trie->nodes[node_index];
+        if (node->next_sibling != stack_trie_no_node)
+            return node->next_sibling;
+        node_index = node->parent;
+    }
+    return stack_trie_no_node;
+}
+
+long StackTrie_WriteCollapsed(StackTrie* trie, FILE* file) {
+    assert(trie);
+    assert(file);
+
+    uint32_t* path = (uint32_t*)malloc((trie->depth_max + 1) * sizeof(uint32_t));
+    if (!path)
+        return -1;
+
+    long line_count = 0;
+    for (uint32_t i = NextNode(trie, 0); i != stack_trie_no_node;
+            i = NextNode(trie, i)) {
+        StackTrieNode* node = &trie->nodes[i];
+        if (node->self_count == 0)
+            continue;
+
+        // Outermost first.
+        for (uint32_t j = i; j != 0; j = trie->nodes[j].parent)
+            path[trie->nodes[j].depth] = j;
+        for (uint32_t depth = 1; depth <= node->depth; ++depth) {
+            if (depth > 1)
+                fputc(';', file);
+            fputs(NodeName(trie, &trie->nodes[path[depth]]), file);
+        }
+        fprintf(file, " %llu\n", (unsigned long long)node->self_count);
+        ++line_count;
+    }
+
+    free(path);
+    return ferror(file) ? -1 : line_count;
+}
+
+
+// Protocol buffers encoding, just what profile.proto needs.
+struct ProtoBuffer {
+    uint8_t*    data;
+    size_t      size;
+    size_t      capacity;
+    bool        failed;
+};
+typedef struct ProtoBuffer ProtoBuffer;
+
+enum ProtoWireType {
+    PROTO_WIRE_VARINT   = 0,
+    PROTO_WIRE_BYTES    = 2,
+};
+
+// Field numbers of profile.proto.
+enum {
+    PPROF_PROFILE_SAMPLE_TYPE       = 1,
+    PPROF_PROFILE_SAMPLE            = 2,
+    PPROF_PROFILE_MAPPING           = 3,
+    PPROF_PROFILE_LOCATION          = 4,
+    PPROF_PROFILE_FUNCTION          = 5,
+    PPROF_PROFILE_STRING_TABLE      = 6,
+    PPROF_PROFILE_PERIOD_TYPE       = 11,
+    PPROF_PROFILE_PERIOD            = 12,
+
+    PPROF_VALUE_TYPE_TYPE           = 1,
+    PPROF_VALUE_TYPE_UNIT           = 2,
+
+    PPROF_SAMPLE_LOCATION_ID        = 1,
+    PPROF_SAMPLE_VALUE              = 2,
+
+    PPROF_MAPPING_ID                = 1,
+    PPROF_MAPPING_MEMORY_START      = 2,
+    PPROF_MAPPING_MEMORY_LIMIT      = 3,
+    PPROF_MAPPING_FILENAME          = 5,
+    PPROF_MAPPING_BUILD_ID          = 6,
+    PPROF_MAPPING_HAS_FUNCTIONS     = 7,
+
+    PPROF_LOCATION_ID               = 1,
+    PPROF_LOCATION_MAPPING_ID       = 2,
+    PPROF_LOCATION_ADDRESS          = 3,
+    PPROF_LOCATION_LINE             = 4,
+
+    PPROF_LINE_FUNCTION_ID          = 1,
+
+    PPROF_FUNCTION_ID               = 1,
+    PPROF_FUNCTION_NAME             = 2,
+    PPROF_FUNCTION_SYSTEM_NAME      = 3,
+};
+
+static void ProtoReserve(ProtoBuffer* buffer, size_t size) {
+    if (buffer->failed || buffer->size + size <= buffer->capacity)
+        return;
+    size_t capacity = buffer->capacity ? buffer->capacity : 256;
+    while (capacity < buffer->size + size)
+        capacity *= 2;
+    uint8_t* data = (uint8_t*)realloc(buffer->data, capacity);
+    if (!data) {
+        buffer->failed = true;
+        return;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+static void ProtoWriteVarint(ProtoBuffer* buffer, uint64_t value) {
+    ProtoReserve(buffer, 10);
+    if (buffer->failed)
+        return;
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        buffer->data[buffer->size++] = byte | (value ? 0x80 : 0);
+    } while (value);
+}
+
+static void ProtoWriteBytes(
+        ProtoBuffer* buffer, uint32_t field, const void* data, size_t size) {
+    ProtoWriteVarint(buffer, (field << 3) | PROTO_WIRE_BYTES);
+    ProtoWriteVarint(buffer, size);
+    ProtoReserve(buffer, size);
+    if (buffer->failed || size == 0)
+        return;
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+}
+
+static void ProtoWriteUint(ProtoBuffer* buffer, uint32_t field, uint64_t value) {
+    ProtoWriteVarint(buffer, (field << 3) | PROTO_WIRE_VARINT);
+    ProtoWriteVarint(buffer, value);
+}
+
+// Appends "message" as a field of "buffer" and clears it for reuse.
+static void ProtoWriteMessage(
+        ProtoBuffer* buffer, uint32_t field, ProtoBuffer* message) {
+    if (message->failed)
+        buffer->failed = true;
+    ProtoWriteBytes(buffer, field, message->data, message->size);
+    message->size = 0;
+}
+
+static void PprofWriteValueType(
+        ProtoBuffer* profile, ProtoBuffer* scratch, uint32_t field,
+        uint64_t type_string, uint64_t unit_string) {
+    ProtoWriteUint(scratch, PPROF_VALUE_TYPE_TYPE, type_string);
+    ProtoWriteUint(scratch, PPROF_VALUE_TYPE_UNIT, unit_string);
+    ProtoWriteMessage(profile, field, scratch);
+}
+
+// Fixed part of the string table.
+enum {
+    PPROF_STRING_EMPTY,
+    PPROF_STRING_SAMPLES,
+    PPROF_STRING_COUNT,
+    PPROF_STRING_CPU,
+    PPROF_STRING_NANOSECONDS,
+    PPROF_STRING_FIRST_FREE,
+};
+static const char* const pprof_fixed_strings[] = {
+    "", "samples", "count", "cpu", "nanoseconds",
+};
+
+struct PprofModules {
+    const Module**  modules;
+    size_t          count;
+};
+typedef struct PprofModules PprofModules;
+
+// Mapping ids are the indices + 1, so that 0 means "no mapping".
+static uint64_t FindOrAddModule(PprofModules* modules, const Module* module) {
+    if (!module)
+        return 0;
+    for (size_t i = 0; i < modules->count; ++i) {
+        if (modules->modules[i] == module)
+            return i + 1;
+    }
+    modules->modules[modules->count++] = module;
+    return modules->count;
+}
+
+bool StackTrie_WritePprof(
+        StackTrie* trie, FILE* file, uint64_t sampling_period_ns) {
+    assert(trie);
+    assert(file);
+
+    ProtoBuffer profile = {};
+    ProtoBuffer message = {};
+    ProtoBuffer line = {};
+    ProtoBuffer packed = {};
+
+    PprofModules modules = {};
+    modules.modules = (const Module**)malloc(trie->node_count * sizeof(Module*));
+    uint64_t* mapping_ids = (uint64_t*)calloc(trie->node_count, sizeof(uint64_t));
+    if (!modules.modules || !mapping_ids) {
+        free(mapping_ids);
+        free((void*)modules.modules);
+        return false;
+    }
+    for (size_t i = 1; i < trie->node_count; ++i)
+        mapping_ids[i] = FindOrAddModule(&modules, trie->nodes[i].module);
+
+    PprofWriteValueType(&profile, &message, PPROF_PROFILE_SAMPLE_TYPE,
+            PPROF_STRING_SAMPLES, PPROF_STRING_COUNT);
+    if (sampling_period_ns > 0) {
+        PprofWriteValueType(&profile, &message, PPROF_PROFILE_SAMPLE_TYPE,
+                PPROF_STRING_CPU, PPROF_STRING_NANOSECONDS);
+        PprofWriteValueType(&profile, &message, PPROF_PROFILE_PERIOD_TYPE,
+                PPROF_STRING_CPU, PPROF_STRING_NANOSECONDS);
+        ProtoWriteUint(&profile, PPROF_PROFILE_PERIOD, sampling_period_ns);
+    }
+
+    // Strings after the fixed ones: for each module its path
+    // and build id, then for each node its name.
+    uint64_t module_strings = PPROF_STRING_FIRST_FREE;
+    uint64_t node_strings = module_strings + 2 * modules.count - 1;
+
+    // A sample per node with samples ending in it, leaf first.
+    for (uint32_t i = NextNode(trie, 0); i != stack_trie_no_node;
+            i = NextNode(trie, i)) {
+        const StackTrieNode* node = &trie->nodes[i];
+        if (node->self_count == 0)
+            continue;
+
+        for (uint32_t j = i; j != 0; j = trie->nodes[j].parent)
+            ProtoWriteVarint(&packed, j);
+        ProtoWriteMessage(&message, PPROF_SAMPLE_LOCATION_ID, &packed);
+
+        ProtoWriteVarint(&packed, node->self_count);
+        if (sampling_period_ns > 0)
+            ProtoWriteVarint(&packed, node->self_count * sampling_period_ns);
+        ProtoWriteMessage(&message, PPROF_SAMPLE_VALUE, &packed);
+
+        ProtoWriteMessage(&profile, PPROF_PROFILE_SAMPLE, &message);
+    }
+
+    for (size_t i = 0; i < modules.count; ++i) {
+        const Module* module = modules.modules[i];
+        ProtoWriteUint(&message, PPROF_MAPPING_ID, i + 1);
+        ProtoWriteUint(&message, PPROF_MAPPING_MEMORY_START, module->base);
+        ProtoWriteUint(&message, PPROF_MAPPING_MEMORY_LIMIT, module->end);
+        ProtoWriteUint(&message, PPROF_MAPPING_FILENAME, module_strings + 2 * i);
+        ProtoWriteUint(&message, PPROF_MAPPING_BUILD_ID, module_strings + 2 * i + 1);
+        ProtoWriteUint(&message, PPROF_MAPPING_HAS_FUNCTIONS, 1);
+        ProtoWriteMessage(&profile, PPROF_PROFILE_MAPPING, &message);
+    }
+
+    // Location and function ids are the node indices.
+    for (size_t i = 1; i < trie->node_count; ++i) {
+        const StackTrieNode* node = &trie->nodes[i];
+        uintptr_t address = node->module
+                ? node->module->base + node->address : node->address;
+
+        ProtoWriteUint(&message, PPROF_LOCATION_ID, i);
+        if (mapping_ids[i])
+            ProtoWriteUint(&message, PPROF_LOCATION_MAPPING_ID, mapping_ids[i]);
+        ProtoWriteUint(&message, PPROF_LOCATION_ADDRESS, address);
+        ProtoWriteUint(&line, PPROF_LINE_FUNCTION_ID, i);
+        ProtoWriteMessage(&message, PPROF_LOCATION_LINE, &line);
+        ProtoWriteMessage(&profile, PPROF_PROFILE_LOCATION, &message);
+
+        ProtoWriteUint(&message, PPROF_FUNCTION_ID, i);
+        ProtoWriteUint(&message, PPROF_FUNCTION_NAME, node_strings + i);
+        ProtoWriteUint(&message, PPROF_FUNCTION_SYSTEM_NAME, node_strings + i);
+        ProtoWriteMessage(&profile, PPROF_PROFILE_FUNCTION, &message);
+    }
+
+    for (size_t i = 0; i < PPROF_STRING_FIRST_FREE; ++i) {
+        ProtoWriteBytes(&profile, PPROF_PROFILE_STRING_TABLE,
+                pprof_fixed_strings[i], strlen(pprof_fixed_strings[i]));
+    }
+    for (size_t i = 0; i < modules.count; ++i) {
+        const Module* module = modules.modules[i];
+        ProtoWriteBytes(&profile, PPROF_PROFILE_STRING_TABLE,
+                module->path, strlen(module->path));
+
+        char build_id[2 * module_build_id_size_max + 1] = {};
+        for (size_t j = 0; j < module->build_id_size; ++j) {
+            snprintf(build_id + 2 * j, sizeof(build_id) - 2 * j,
+                    "%02x", module->build_id[j]);
+        }
+        ProtoWriteBytes(&profile, PPROF_PROFILE_STRING_TABLE,
+                build_id, strlen(build_id));
+    }
+    for (size_t i = 1; i < trie->node_count; ++i) {
+        const char* name = NodeName(trie, &trie->nodes[i]);
+        ProtoWriteBytes(&profile, PPROF_PROFILE_STRING_TABLE, name, strlen(name));
+    }
+
+    bool ok = !profile.failed && !message.failed && !line.failed && !packed.failed
+            && fwrite(profile.data, 1, profile.size, file) == profile.size;
+
+    free(packed.data);
+    free(line.data);
+    free(message.data);
+    free(profile.data);
+    free(mapping_ids);
+    free((void*)modules.modules);
+    return ok;
+}
@@ -0,0 +1,53 @@
+#ifndef STACK_TRIE_H
+#define STACK_TRIE_H
+
+// Aggregation of sampled stacks into a prefix trie, for flame graphs.
+//
+// Stacks are merged from the outermost frame in: there is a node
+// per distinct call path, keyed by the module and the module-relative
+// address of its frame, with the number of samples ending there.
+// Thousands of samples of a few hot paths become a few dozen nodes,
+// and symbolization is done once per node, on export, not per sample.
+//
+// Two export formats:
+// - collapsed "outer;...;inner count" lines, as read by flamegraph.pl,
+//   inferno and speedscope. Different addresses in the same function
+//   give the same line more than once, the tools add them up.
+// - pprof (profile.proto, uncompressed, which pprof accepts as well).
+//
+// Not thread-safe, not async-signal-safe. Build it after sampling,
+// for example from a StackTable.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+struct StackTrie;
+typedef struct StackTrie StackTrie;
+
+
+StackTrie* StackTrie_Create();
+void StackTrie_Destroy(StackTrie* trie);
+
+// Adds "sample_count" samples of the stack. The addresses are absolute,
+// innermost first, as captured. Returns false, if out of memory.
+bool StackTrie_Add(
+        StackTrie* trie, const uintptr_t* addresses, size_t address_count,
+        uint64_t sample_count);
+
+// Nodes, without the root.
+size_t StackTrie_NodeCount(const StackTrie* trie);
+uint64_t StackTrie_SampleCount(const StackTrie* trie);
+
+// One line per call path with samples ending in it.
+// Returns the number of lines written, or -1 on a write error.
+long StackTrie_WriteCollapsed(StackTrie* trie, FILE* file);
+
+// A "samples/count" value per sample and, if "sampling_period_ns"
+// is not 0, a "cpu/nanoseconds" one. Returns false on a write error.
+bool StackTrie_WritePprof(
+        StackTrie* trie, FILE* file, uint64_t sampling_period_ns);
+
+#endif // STACK_TRIE_H
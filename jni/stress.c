@@ -0,0 +1,804 @@
+// Stress test of the capture under load.
+//
+// Every enabled method, and BacktraceWithFallback(), is run through
+// the scenarios below, each thread faulting with a real SIGSEGV:
+// the handler captures on the alternate stack of the thread, the way
+// a crash handler does, and jumps back for the next fault.
+// - concurrent: N threads fault at the same time, at the end
+//   of a call chain of stress_chain_depth frames,
+// - deep: the chain is stress_deep_depth frames, more than
+//   backtrace_depth_max, so every capture is cut at the capacity,
+// - modules: hundreds of copies of stress_module.c are dlopen'ed,
+//   and the faulting call goes through all of them.
+// For each method and scenario, the handler latencies (p50, p90, p99, max)
+// are printed, with how many captures passed BacktraceState_Validate()
+// and how many were complete: the faulting frame, then the whole chain
+// in order, or as much of it as fits.
+//
+// The module map and symbolization are timed across the loaded copies,
+// dladdr() for comparison. Last, the sampling profiler runs at
+// stress_sampling_hz on N busy threads, its samples are counted
+// against the CPU time of the threads and checked for their frames.
+// Kernels usually expire CPU-time timers on the scheduler tick,
+// which is what limits the rate then.
+//
+// The library is looked up next to the executable: lib<executable>-module.so.
+//
+// Usage: <stress> [threads] [modules] [iterations]
+
+#include "alt_stack_pool.h"
+#include "backtrace.h"
+#include "capture_counters.h"
+#include "module_map.h"
+#include "sampling_profiler.h"
+#include "stress_module.h"
+#include "unwind_cache.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+enum { stress_thread_count_max = 64 };
+enum { stress_module_count_max = 1024 };
+
+static const size_t stress_thread_count_default = 8;
+static const size_t stress_module_count_default = 200;
+// Faults per thread, method and scenario.
+static const size_t stress_iterations_default = 100;
+
+static const size_t stress_chain_depth = 32;
+static const size_t stress_deep_depth = 4096;
+// The deep chain at -O0, with room for the rest.
+static const size_t stress_thread_stack_size = 2 * 1024 * 1024;
+
+// Frames the skipping method may leave before the faulting one.
+static const size_t stress_fault_search_max = 8;
+
+static const unsigned int stress_sampling_hz = 10000;
+static const unsigned int stress_sampling_ms = 1000;
+static const size_t stress_sampling_depth = 64;
+static const size_t stress_sampling_spin_depth = 16;
+
+typedef void (*StressCapture)(BacktraceState* state);
+
+struct StressMethod {
+    const char*     name;
+    StressCapture   capture;
+};
+typedef struct StressMethod StressMethod;
+
+enum StressScenario {
+    STRESS_SCENARIO_CONCURRENT,
+    STRESS_SCENARIO_DEEP,
+    STRESS_SCENARIO_MODULES,
+};
+typedef enum StressScenario StressScenario;
+
+struct StressThread {
+    pthread_t       thread;
+    sigjmp_buf      fault_jump;
+    // Set while a fault is expected, any other one is a real crash.
+    volatile bool   faulting;
+
+    // Of the last capture, backtrace_depth_max of them.
+    uintptr_t*      addresses;
+    size_t          address_count;
+    bool            valid;
+
+    size_t          iteration;
+    uint64_t*       latencies_ns;
+    size_t*         frame_counts;
+    size_t          valid_count;
+    size_t          complete_count;
+};
+typedef struct StressThread StressThread;
+
+// Written before the threads of a run are started.
+struct StressRun {
+    const StressMethod*     method;
+    StressScenario          scenario;
+    size_t                  iterations;
+    size_t                  thread_count;
+    StressThread            threads[stress_thread_count_max];
+};
+typedef struct StressRun StressRun;
+
+static StressRun stress_run;
+static _Atomic size_t stress_ready_count;
+static _Atomic bool stress_started;
+static __thread StressThread* stress_thread;
+
+// Loaded copies of stress_module.c, and the calls through them:
+// one per copy, then StressModuleFault().
+static size_t stress_module_count;
+static StressModuleCall stress_module_calls[stress_module_count_max + 1];
+static uint32_t stress_module_ids[stress_module_count_max];
+
+// Never written to, the faults are stores through it.
+static int* volatile stress_fault_address;
+
+
+static uint64_t NowNs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+#if FRAME_POINTER_METHOD
+// FramePointerWithRegisters() returns whether the chain looked valid,
+// BacktraceState_Validate() checks it again for all the methods.
+static void FramePointerMethod(BacktraceState* state) {
+    FramePointerWithRegisters(state);
+}
+#endif
+
+static void FallbackMethod(BacktraceState* state) {
+    BacktraceWithFallback(state);
+}
+
+static const StressMethod stress_methods[] = {
+#if FRAME_POINTER_METHOD
+    {"FRAME_POINTER_METHOD",                    FramePointerMethod},
+#endif
+#if LIBUNWIND_WITH_REGISTERS_METHOD
+    {"LIBUNWIND_WITH_REGISTERS_METHOD",         LibunwindWithRegisters},
+#endif
+#if UNWIND_BACKTRACE_WITH_REGISTERS_METHOD
+    {"UNWIND_BACKTRACE_WITH_REGISTERS_METHOD",  UnwindBacktraceWithRegisters},
+#endif
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+    {"UNWIND_BACKTRACE_WITH_SKIPPING_METHOD",   UnwindBacktraceWithSkipping},
+#endif
+    {"BacktraceWithFallback()",                 FallbackMethod},
+};
+static const size_t stress_method_count =
+        sizeof(stress_methods) / sizeof(stress_methods[0]);
+
+static const char* const stress_scenario_names[] = {
+    [STRESS_SCENARIO_CONCURRENT]    = "concurrent",
+    [STRESS_SCENARIO_DEEP]          = "deep",
+    [STRESS_SCENARIO_MODULES]       = "modules",
+};
+
+
+static void FaultHandler(int sig, siginfo_t* info, void* ucontext) {
+    StressThread* thread = stress_thread;
+    if (!thread || !thread->faulting) {
+        // A real crash: the default action, when the instruction
+        // is restarted.
+        signal(sig, SIG_DFL);
+        return;
+    }
+    thread->faulting = false;
+
+    BacktraceState state;
+    BacktraceState_Init(&state, (const ucontext_t*)ucontext,
+            thread->addresses, backtrace_depth_max);
+
+    uint64_t start = NowNs();
+    stress_run.method->capture(&state);
+    uint64_t end = NowNs();
+
+    thread->latencies_ns[thread->iteration] = end - start;
+    thread->frame_counts[thread->iteration] = state.address_count;
+    thread->address_count = state.address_count;
+    thread->valid = BacktraceState_Validate(&state);
+
+    siglongjmp(thread->fault_jump, 1);
+}
+
+
+// Not optimized, so that every level keeps its frame,
+// see ChainFunc1() in benchmark.c.
+#if __clang__
+#define STRESS_NOINLINE __attribute__((optnone, noinline))
+#elif __GNUC__
+#define STRESS_NOINLINE __attribute__((optimize("O0"), noinline))
+#endif
+
+void StressNothing() STRESS_NOINLINE;
+void StressFault() STRESS_NOINLINE;
+void StressChain1(size_t depth) STRESS_NOINLINE;
+void StressChain2(size_t depth) STRESS_NOINLINE;
+void StressChain3(size_t depth) STRESS_NOINLINE;
+void StressModuleFault(const StressModuleCall* calls, size_t index) STRESS_NOINLINE;
+
+void StressNothing() {
+}
+
+// Calls a function after the store, so that it is not a leaf
+// and has a frame record like the others.
+void StressFault() {
+    *stress_fault_address = 0;
+    StressNothing();
+}
+
+void StressChain1(size_t depth) {
+    if (depth == 0)
+        StressFault();
+    else
+        StressChain2(depth - 1);
+}
+
+void StressChain2(size_t depth) {
+    if (depth == 0)
+        StressFault();
+    else
+        StressChain3(depth - 1);
+}
+
+void StressChain3(size_t depth) {
+    if (depth == 0)
+        StressFault();
+    else
+        StressChain1(depth - 1);
+}
+
+void StressModuleFault(const StressModuleCall* calls, size_t index) {
+    StressFault();
+}
+
+
+static const char* FrameSymbol(uintptr_t address, const Module** module) {
+    *module = ModuleMap_FindModule(address);
+    return *module ? Module_FindSymbol(*module, address) : NULL;
+}
+
+static bool IsSymbol(uintptr_t address, const char* name) {
+    const Module* module = NULL;
+    const char* symbol = FrameSymbol(address, &module);
+    return symbol && strcmp(symbol, name) == 0;
+}
+
+static bool IsChainFrame(uintptr_t address) {
+    const Module* module = NULL;
+    const char* symbol = FrameSymbol(address, &module);
+    return symbol && strncmp(symbol, "StressChain", strlen("StressChain")) == 0;
+}
+
+// Whether "addresses" has the faulting frame, then the whole chain
+// in order, up to the end of the capture if it was cut at the capacity.
+static bool IsComplete(const uintptr_t* addresses, size_t address_count) {
+    size_t fault = 0;
+    while (fault < address_count && fault < stress_fault_search_max
+            && !IsSymbol(addresses[fault], "StressFault"))
+        ++fault;
+    if (fault == address_count || fault == stress_fault_search_max)
+        return false;
+
+    size_t chain_count = 0;
+    if (stress_run.scenario == STRESS_SCENARIO_MODULES)
+        chain_count = stress_module_count + 1;
+    else if (stress_run.scenario == STRESS_SCENARIO_DEEP)
+        chain_count = stress_deep_depth + 1;
+    else
+        chain_count = stress_chain_depth + 1;
+
+    size_t i = fault + 1;
+    for (size_t k = 0; k < chain_count && i < address_count; ++k, ++i) {
+        bool expected = false;
+        if (stress_run.scenario != STRESS_SCENARIO_MODULES) {
+            expected = IsChainFrame(addresses[i]);
+        } else if (k == 0) {
+            expected = IsSymbol(addresses[i], "StressModuleFault");
+        } else {
+            // The copies, from the last one called to the first.
+            const Module* module = ModuleMap_FindModule(addresses[i]);
+            expected = module
+                    && module->id == stress_module_ids[stress_module_count - k];
+        }
+        if (!expected)
+            return false;
+    }
+    return i < address_count || address_count == backtrace_depth_max;
+}
+
+static void FaultOnce(StressThread* thread) {
+    if (sigsetjmp(thread->fault_jump, 1) == 0) {
+        thread->faulting = true;
+        switch (stress_run.scenario) {
+        case STRESS_SCENARIO_CONCURRENT:
+            StressChain1(stress_chain_depth);
+            break;
+        case STRESS_SCENARIO_DEEP:
+            StressChain1(stress_deep_depth);
+            break;
+        case STRESS_SCENARIO_MODULES:
+            stress_module_calls[0].function(stress_module_calls, 0);
+            break;
+        }
+        // Not reached, the handler jumps back.
+        thread->faulting = false;
+        return;
+    }
+
+    thread->valid_count += thread->valid;
+    thread->complete_count += IsComplete(thread->addresses, thread->address_count);
+}
+
+static void* FaultThread(void* thread_voidp) {
+    StressThread* thread = (StressThread*)thread_voidp;
+    stress_thread = thread;
+
+    bool registered = AltStackPool_RegisterThread();
+    assert(registered);
+#if FRAME_POINTER_METHOD
+    FramePointer_RegisterThread();
+#endif
+
+    // All the threads fault at the same time from the first iteration on.
+    atomic_fetch_add(&stress_ready_count, 1);
+    while (!atomic_load(&stress_started))
+        sched_yield();
+
+    for (size_t i = 0; i < stress_run.iterations; ++i) {
+        thread->iteration = i;
+        FaultOnce(thread);
+    }
+
+    AltStackPool_UnregisterThread();
+    stress_thread = NULL;
+    return NULL;
+}
+
+static int CompareLatencies(const void* a_voidp, const void* b_voidp) {
+    uint64_t a = *(const uint64_t*)a_voidp;
+    uint64_t b = *(const uint64_t*)b_voidp;
+    return (a > b) - (a < b);
+}
+
+static void RunScenario(
+        const StressMethod* method, StressScenario scenario,
+        uint64_t* all_latencies_ns) {
+    stress_run.method = method;
+    stress_run.scenario = scenario;
+    atomic_store(&stress_ready_count, 0);
+    atomic_store(&stress_started, false);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, stress_thread_stack_size);
+
+    size_t thread_count = stress_run.thread_count;
+    for (size_t i = 0; i < thread_count; ++i) {
+        StressThread* thread = &stress_run.threads[i];
+        thread->valid_count = 0;
+        thread->complete_count = 0;
+        int error = pthread_create(&thread->thread, &attributes, FaultThread, thread);
+        assert(error == 0);
+    }
+    pthread_attr_destroy(&attributes);
+
+    while (atomic_load(&stress_ready_count) != thread_count)
+        sched_yield();
+    atomic_store(&stress_started, true);
+
+    size_t valid_count = 0;
+    size_t complete_count = 0;
+    size_t min_frames = SIZE_MAX;
+    size_t max_frames = 0;
+    size_t iterations = stress_run.iterations;
+    for (size_t i = 0; i < thread_count; ++i) {
+        StressThread* thread = &stress_run.threads[i];
+        pthread_join(thread->thread, NULL);
+        valid_count += thread->valid_count;
+        complete_count += thread->complete_count;
+        for (size_t j = 0; j < iterations; ++j) {
+            size_t frames = thread->frame_counts[j];
+            if (frames < min_frames)
+                min_frames = frames;
+            if (frames > max_frames)
+                max_frames = frames;
+        }
+        memcpy(&all_latencies_ns[i * iterations], thread->latencies_ns,
+                iterations * sizeof(uint64_t));
+    }
+
+    size_t count = thread_count * iterations;
+    qsort(all_latencies_ns, count, sizeof(uint64_t), CompareLatencies);
+    printf("%-40s %-10s %9zu %5zu-%-5zu %9llu %9llu %9llu %9llu %6.1f%% %6.1f%%\n",
+            method->name, stress_scenario_names[scenario], count,
+            min_frames, max_frames,
+            (unsigned long long)all_latencies_ns[count / 2],
+            (unsigned long long)all_latencies_ns[count * 90 / 100],
+            (unsigned long long)all_latencies_ns[count * 99 / 100],
+            (unsigned long long)all_latencies_ns[count - 1],
+            100.0 * (double)valid_count / (double)count,
+            100.0 * (double)complete_count / (double)count);
+}
+
+
+// Copies the library to "directory" "count" times and loads the copies:
+// for the linker, a path already loaded is the same library.
+static size_t LoadModules(const char* library_path, const char* directory, size_t count) {
+    int fd = open(library_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    struct stat library_stat = {};
+    fstat(fd, &library_stat);
+    size_t size = (size_t)library_stat.st_size;
+    char* contents = (char*)malloc(size);
+    bool read_all = contents && read(fd, contents, size) == (ssize_t)size;
+    close(fd);
+    if (!read_all) {
+        free(contents);
+        return 0;
+    }
+
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) {
+        free(contents);
+        return 0;
+    }
+
+    size_t loaded_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // A different file name for each, older linkers compare them.
+        char path[PATH_MAX];
+        int path_size = snprintf(path, sizeof(path), "%s/libstress-module-%04zu.so",
+                directory, i);
+        if (path_size < 0 || path_size >= (int)sizeof(path))
+            break;
+        int copy_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+        if (copy_fd < 0)
+            break;
+        bool written = write(copy_fd, contents, size) == (ssize_t)size;
+        close(copy_fd);
+
+        void* handle = written ? dlopen(path, RTLD_NOW | RTLD_LOCAL) : NULL;
+        // Stays mapped, dladdr() still reports the path.
+        unlink(path);
+        if (!handle) {
+            printf("Could not load %s: %s\n", path, dlerror());
+            break;
+        }
+
+        StressModuleFunction function =
+                (StressModuleFunction)dlsym(handle, "StressModule_Call");
+        if (!function)
+            break;
+        stress_module_calls[loaded_count].function = function;
+        ++loaded_count;
+    }
+    rmdir(directory);
+    free(contents);
+    return loaded_count;
+}
+
+static void CountModule(const Module* module, void* count_voidp) {
+    ++*(size_t*)count_voidp;
+}
+
+// Times the index of the modules with the copies loaded, and
+// the symbolization of the last captured stack through them.
+static void SetUpModules(const char* library_path, const char* directory, size_t count) {
+    uint64_t start = NowNs();
+    stress_module_count = LoadModules(library_path, directory, count);
+    uint64_t load_ns = NowNs() - start;
+    if (stress_module_count == 0) {
+        printf("Could not load %s, the modules scenario is skipped.\n", library_path);
+        return;
+    }
+
+    start = NowNs();
+    ModuleMap_Refresh();
+    uint64_t refresh_ns = NowNs() - start;
+
+    for (size_t i = 0; i < stress_module_count; ++i) {
+        const Module* module = ModuleMap_FindModule(
+                (uintptr_t)stress_module_calls[i].function);
+        assert(module);
+        stress_module_ids[i] = module->id;
+    }
+    stress_module_calls[stress_module_count].function = StressModuleFault;
+
+    size_t module_count = 0;
+    ModuleMap_ForEach(CountModule, &module_count);
+    printf("Loaded %zu copies of %s in %.1f ms, %zu modules indexed in %.1f ms.\n",
+            stress_module_count, library_path, (double)load_ns / 1e6,
+            module_count, (double)refresh_ns / 1e6);
+}
+
+static uint64_t SymbolizeWithModuleMap(
+        const uintptr_t* addresses, size_t address_count, size_t* resolved_count) {
+    *resolved_count = 0;
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < address_count; ++i) {
+        const Module* module = ModuleMap_FindModule(addresses[i]);
+        if (module && Module_FindSymbol(module, addresses[i]))
+            ++*resolved_count;
+    }
+    return NowNs() - start;
+}
+
+// The first pass also builds the symbol index of every module
+// it has not looked up yet, one per frame of the modules scenario.
+static void RunModuleSymbolization(const uintptr_t* addresses, size_t address_count) {
+    if (address_count == 0)
+        return;
+
+    size_t resolved_count = 0;
+    uint64_t first_ns = SymbolizeWithModuleMap(addresses, address_count, &resolved_count);
+    uint64_t module_map_ns = SymbolizeWithModuleMap(addresses, address_count, &resolved_count);
+
+    uint64_t start = NowNs();
+    for (size_t i = 0; i < address_count; ++i) {
+        Dl_info info = {};
+        dladdr((const void*)addresses[i], &info);
+    }
+    uint64_t dladdr_ns = NowNs() - start;
+
+    printf("Symbolization of %zu frames across the modules: module map %.1f ns/frame"
+            " (%.1f the first time, %zu resolved), dladdr %.1f ns/frame\n",
+            address_count, (double)module_map_ns / (double)address_count,
+            (double)first_ns / (double)address_count,
+            resolved_count, (double)dladdr_ns / (double)address_count);
+}
+
+
+struct StressSampling {
+    _Atomic size_t  ready_count;
+    _Atomic bool    stopping;
+    _Atomic bool    started;
+    // Of all the threads.
+    _Atomic uint64_t cpu_time_ns;
+    // Only touched by the drain thread.
+    size_t          sample_count;
+    size_t          spinning_count;
+};
+typedef struct StressSampling StressSampling;
+
+static StressSampling stress_sampling;
+
+void StressSpin1(size_t depth) STRESS_NOINLINE;
+void StressSpin2(size_t depth) STRESS_NOINLINE;
+void StressSpin3(size_t depth) STRESS_NOINLINE;
+
+static void Spin() {
+    while (!atomic_load_explicit(&stress_sampling.stopping, memory_order_relaxed)) {
+    }
+}
+
+void StressSpin1(size_t depth) {
+    if (depth == 0)
+        Spin();
+    else
+        StressSpin2(depth - 1);
+}
+
+void StressSpin2(size_t depth) {
+    if (depth == 0)
+        Spin();
+    else
+        StressSpin3(depth - 1);
+}
+
+void StressSpin3(size_t depth) {
+    if (depth == 0)
+        Spin();
+    else
+        StressSpin1(depth - 1);
+}
+
+static void CheckSample(
+        pid_t tid, const uintptr_t* addresses, size_t address_count,
+        void* sampling_voidp) {
+    StressSampling* sampling = (StressSampling*)sampling_voidp;
+    ++sampling->sample_count;
+    for (size_t i = 0; i < address_count; ++i) {
+        const Module* module = NULL;
+        const char* symbol = FrameSymbol(addresses[i], &module);
+        if (symbol && strncmp(symbol, "StressSpin", strlen("StressSpin")) == 0) {
+            ++sampling->spinning_count;
+            break;
+        }
+    }
+}
+
+static uint64_t ThreadCpuTimeNs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void* SpinThread(void* sampling_voidp) {
+    StressSampling* sampling = (StressSampling*)sampling_voidp;
+    FramePointer_RegisterThread();
+    bool registered = SamplingProfiler_RegisterThread();
+
+    atomic_fetch_add(&sampling->ready_count, 1);
+    while (!atomic_load(&sampling->started))
+        sched_yield();
+
+    uint64_t start = ThreadCpuTimeNs();
+    StressSpin1(stress_sampling_spin_depth);
+    atomic_fetch_add(&sampling->cpu_time_ns, ThreadCpuTimeNs() - start);
+
+    if (registered)
+        SamplingProfiler_UnregisterThread();
+    return NULL;
+}
+
+static void RunSampling(size_t thread_count) {
+    SamplingProfilerConfig config = {};
+    config.frequency_hz = stress_sampling_hz;
+    config.depth = stress_sampling_depth;
+    // Twice what a thread can take between two drains.
+    config.drain_interval_ms = 10;
+    config.ring_size = 2 * stress_sampling_hz / 1000 * config.drain_interval_ms;
+    config.callback = CheckSample;
+    config.callback_context = &stress_sampling;
+
+    if (!SamplingProfiler_Start(&config)) {
+        printf("Could not start the sampling profiler.\n");
+        return;
+    }
+
+    CaptureCountersSnapshot before = {};
+    CaptureCounters_Snapshot(&before);
+
+    pthread_t threads[stress_thread_count_max];
+    for (size_t i = 0; i < thread_count; ++i) {
+        int error = pthread_create(&threads[i], NULL, SpinThread, &stress_sampling);
+        assert(error == 0);
+    }
+    while (atomic_load(&stress_sampling.ready_count) != thread_count)
+        sched_yield();
+    atomic_store(&stress_sampling.started, true);
+
+    struct timespec interval = {
+        stress_sampling_ms / 1000, (long)(stress_sampling_ms % 1000) * 1000000L};
+    nanosleep(&interval, NULL);
+    atomic_store(&stress_sampling.stopping, true);
+    for (size_t i = 0; i < thread_count; ++i)
+        pthread_join(threads[i], NULL);
+    SamplingProfiler_Stop();
+
+    CaptureCountersSnapshot after = {};
+    CaptureCounters_Snapshot(&after);
+    uint64_t capture_count = after.values[CAPTURE_COUNTER_CAPTURE_COUNT]
+            - before.values[CAPTURE_COUNTER_CAPTURE_COUNT];
+    uint64_t unwind_ns = after.values[CAPTURE_COUNTER_UNWIND_TIME]
+            - before.values[CAPTURE_COUNTER_UNWIND_TIME];
+
+    SamplingProfilerStats stats = {};
+    SamplingProfiler_GetStats(&stats);
+    double expected = (double)atomic_load(&stress_sampling.cpu_time_ns)
+            * stress_sampling_hz / 1e9;
+    printf("Sampling at %u Hz on %zu threads for %u ms: %llu samples,"
+            " %.1f%% of the CPU time, %llu dropped, %zu of %zu in the spinning frames",
+            stress_sampling_hz, thread_count, stress_sampling_ms,
+            (unsigned long long)stats.sample_count,
+            expected > 0 ? 100.0 * (double)stats.sample_count / expected : 0.0,
+            (unsigned long long)stats.dropped_count,
+            stress_sampling.spinning_count, stress_sampling.sample_count);
+    if (capture_count > 0)
+        printf(", %.1f ns per capture", (double)unwind_ns / (double)capture_count);
+    printf(".\n");
+}
+
+
+static bool ParseSize(const char* text, size_t min, size_t max, size_t* value) {
+    char* end = NULL;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || parsed < min || parsed > max)
+        return false;
+    *value = parsed;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    size_t thread_count = stress_thread_count_default;
+    size_t module_count = stress_module_count_default;
+    size_t iterations = stress_iterations_default;
+    if ((argc > 1 && !ParseSize(argv[1], 1, stress_thread_count_max, &thread_count))
+            || (argc > 2 && !ParseSize(argv[2], 0, stress_module_count_max, &module_count))
+            || (argc > 3 && !ParseSize(argv[3], 1, 1000000, &iterations))
+            || argc > 4) {
+        printf("Usage: %s [threads, up to %d] [modules, up to %d] [iterations]\n",
+                argv[0], stress_thread_count_max, stress_module_count_max);
+        return 1;
+    }
+
+    // lib<executable>-module.so next to the executable, copied to
+    // <executable>-modules/.
+    char executable_path[PATH_MAX] = {};
+    ssize_t size = readlink("/proc/self/exe", executable_path, sizeof(executable_path) - 1);
+    if (size <= 0) {
+        printf("Could not find the executable.\n");
+        return 1;
+    }
+    const char* slash = strrchr(executable_path, '/');
+    const char* name = slash ? slash + 1 : executable_path;
+    char library_path[PATH_MAX];
+    char modules_directory[PATH_MAX];
+    int library_size = snprintf(library_path, sizeof(library_path), "%.*slib%s-module.so",
+            (int)(name - executable_path), executable_path, name);
+    int directory_size = snprintf(modules_directory, sizeof(modules_directory),
+            "%s-modules", executable_path);
+    if (library_size >= (int)sizeof(library_path)
+            || directory_size >= (int)sizeof(modules_directory)) {
+        printf("The path of the executable is too long.\n");
+        return 1;
+    }
+
+    bool initialized = AltStackPool_Init(stress_thread_count_max, 0);
+    assert(initialized);
+    ModuleMap_Init();
+#if UNWIND_CACHE_ENABLED
+    UnwindCache_Init();
+#endif
+#if UNWIND_BACKTRACE_WITH_SKIPPING_METHOD
+    UnwindBacktraceWithSkipping_Calibrate();
+#endif
+    if (module_count > 0)
+        SetUpModules(library_path, modules_directory, module_count);
+
+    stress_run.thread_count = thread_count;
+    stress_run.iterations = iterations;
+    for (size_t i = 0; i < thread_count; ++i) {
+        StressThread* thread = &stress_run.threads[i];
+        thread->addresses = (uintptr_t*)calloc(backtrace_depth_max, sizeof(uintptr_t));
+        thread->latencies_ns = (uint64_t*)calloc(iterations, sizeof(uint64_t));
+        thread->frame_counts = (size_t*)calloc(iterations, sizeof(size_t));
+        assert(thread->addresses && thread->latencies_ns && thread->frame_counts);
+    }
+    uint64_t* all_latencies_ns = (uint64_t*)calloc(
+            thread_count * iterations, sizeof(uint64_t));
+    assert(all_latencies_ns);
+
+    struct sigaction action = {};
+    action.sa_sigaction = FaultHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigaction(SIGSEGV, &action, NULL);
+
+    printf("%zu threads, %zu faults each per method and scenario, latencies in ns.\n",
+            thread_count, iterations);
+    printf("%-40s %-10s %9s %11s %9s %9s %9s %9s %7s %7s\n",
+            "Method", "Scenario", "Captures", "Frames",
+            "p50", "p90", "p99", "max", "Valid", "Whole");
+
+    StressScenario scenarios[] = {
+        STRESS_SCENARIO_CONCURRENT, STRESS_SCENARIO_DEEP, STRESS_SCENARIO_MODULES};
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) {
+        if (scenarios[i] == STRESS_SCENARIO_MODULES && stress_module_count == 0)
+            continue;
+        for (size_t j = 0; j < stress_method_count; ++j)
+            RunScenario(&stress_methods[j], scenarios[i], all_latencies_ns);
+    }
+
+    // The last stack of the modules scenario.
+    if (stress_module_count > 0) {
+        RunModuleSymbolization(stress_run.threads[0].addresses,
+                stress_run.threads[0].address_count);
+    }
+
+    signal(SIGSEGV, SIG_DFL);
+    RunSampling(thread_count);
+
+    CaptureCountersSnapshot counters = {};
+    CaptureCounters_Snapshot(&counters);
+    CaptureCounters_Print(&counters);
+
+    for (size_t i = 0; i < thread_count; ++i) {
+        free(stress_run.threads[i].addresses);
+        free(stress_run.threads[i].latencies_ns);
+        free(stress_run.threads[i].frame_counts);
+    }
+    free(all_latencies_ns);
+    return 0;
+}
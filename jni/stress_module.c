@@ -0,0 +1,16 @@
+// Each copy of this library is a separate module for the linker, dladdr()
+// and the ModuleMap, with only one function: stress.c dlopens hundreds
+// of copies and chains the calls through all of them.
+
+#include "stress_module.h"
+
+// Not optimized, so that the call keeps its frame
+// and is not turned into a tail call.
+#if __clang__
+__attribute__((optnone, noinline))
+#elif __GNUC__
+__attribute__((optimize("O0"), noinline))
+#endif
+void StressModule_Call(const StressModuleCall* calls, size_t index) {
+    calls[index + 1].function(calls, index + 1);
+}
@@ -0,0 +1,24 @@
+#ifndef STRESS_MODULE_H
+#define STRESS_MODULE_H
+
+// The library stress.c loads in hundreds of copies, see stress_module.c.
+
+#include <stddef.h>
+
+
+struct StressModuleCall;
+
+typedef void (*StressModuleFunction)(
+        const struct StressModuleCall* calls, size_t index);
+
+// One per loaded copy, the last one is where the chain ends.
+struct StressModuleCall {
+    StressModuleFunction    function;
+};
+typedef struct StressModuleCall StressModuleCall;
+
+// Calls calls[index + 1], so that a chain started at calls[0]
+// has a frame in every copy, in order.
+void StressModule_Call(const StressModuleCall* calls, size_t index);
+
+#endif // STRESS_MODULE_H
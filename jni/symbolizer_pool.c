@@ -0,0 +1,511 @@
+#include "symbolizer_pool.h"
+#include "backtrace.h"
+#include "capture_counters.h"
+#include "demangle_cache.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+enum SymbolizerPhase {
+    SYMBOLIZER_PHASE_RESOLVE    = 0,
+    SYMBOLIZER_PHASE_FORMAT     = 1,
+    SYMBOLIZER_PHASE_EXIT       = 2,
+};
+
+struct SymbolizedAddress {
+    unsigned long   relative_address;
+    // Never NULL, "" if not found.
+    const char*     name;
+};
+typedef struct SymbolizedAddress SymbolizedAddress;
+
+// Chunks [next, end) of the current phase. The owner takes them
+// from the front, thieves split them off the back.
+struct SymbolizerQueue {
+    pthread_mutex_t mutex;
+    size_t          next;
+    size_t          end;
+};
+typedef struct SymbolizerQueue SymbolizerQueue;
+
+struct SymbolizerWorker {
+    SymbolizerPool*     pool;
+    size_t              index;
+    pthread_t           thread;
+    SymbolizerQueue     queue;
+
+    // The names resolved by this worker live here until
+    // SymbolizerPool_Destroy().
+    DemangleCache       demangle_cache;
+
+    // Text of the stack being formatted.
+    char*               scratch;
+    size_t              scratch_size;
+
+    size_t              steal_count;
+    bool                failed;
+};
+typedef struct SymbolizerWorker SymbolizerWorker;
+
+struct SymbolizerPool {
+    SymbolizerWorker*   workers;
+    size_t              worker_capacity;
+    // The calling thread and the threads which started.
+    size_t              worker_count;
+
+    pthread_mutex_t     mutex;
+    pthread_cond_t      start_cond;
+    pthread_cond_t      done_cond;
+    uint32_t            generation;
+    uint32_t            phase;
+    size_t              item_count;
+    // Worker threads still in the current phase.
+    size_t              busy_count;
+
+    // The current batch.
+    const SymbolizerStack*  stacks;
+    char**                  texts;
+    uintptr_t*              unique_addresses;
+    SymbolizedAddress*      symbolized;
+    // Per frame of all the stacks, the index of its unique address.
+    uint32_t*               frame_unique_indices;
+    // Per stack, its first frame in frame_unique_indices.
+    size_t*                 stack_offsets;
+
+    SymbolizerPoolStats     stats;
+};
+
+// Items per chunk: enough for the queue lock to cost nothing per item,
+// few enough to leave chunks to steal.
+static const size_t symbolizer_chunk_size = 64;
+static const size_t symbolizer_scratch_size_initial = 4096;
+
+
+static size_t RoundUpToPowerOfTwo(size_t value) {
+    size_t result = 1;
+    while (result < value)
+        result *= 2;
+    return result;
+}
+
+static size_t HashAddress(uintptr_t address) {
+    uint64_t hash = (uint64_t)address * 0x9e3779b97f4a7c15ull;
+    return (size_t)(hash >> 32);
+}
+
+static void ResolveAddress(SymbolizerWorker* worker, size_t index) {
+    SymbolizerPool* pool = worker->pool;
+    uintptr_t address = pool->unique_addresses[index];
+
+    const char* name = NULL;
+    unsigned long relative_address = address;
+
+    const Module* module = ModuleMap_FindModule(address);
+    if (module) {
+        relative_address = address - module->base;
+        name = Module_FindSymbol(module, address);
+    } else {
+        // Not a module known to dl_iterate_phdr(), let dladdr() try.
+        Dl_info info = {};
+        uint64_t start_ticks = CAPTURE_COUNTERS_TICKS();
+        int found = dladdr((void*)address, &info);
+        CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DLADDR_TIME,
+                CAPTURE_COUNTERS_TICKS() - start_ticks);
+        CAPTURE_COUNTERS_ADD(CAPTURE_COUNTER_DLADDR_COUNT, 1);
+        if (found) {
+            relative_address = (char*)address - (char*)info.dli_fbase;
+            name = info.dli_sname;
+        }
+    }
+
+#if ENABLE_DEMANGLING
+    if (name) {
+        const char* demangled = DemangleCache_Demangle(&worker->demangle_cache, name);
+        if (demangled)
+            name = demangled;
+    }
+#endif
+
+    pool->symbolized[index].relative_address = relative_address;
+    pool->symbolized[index].name = name ? name : "";
+}
+
+static bool GrowScratch(SymbolizerWorker* worker, size_t size_min) {
+    size_t size = worker->scratch_size * 2;
+    if (size < size_min)
+        size = size_min;
+    char* scratch = (char*)realloc(worker->scratch, size);
+    if (!scratch)
+        return false;
+    worker->scratch = scratch;
+    worker->scratch_size = size;
+    return true;
+}
+
+static void FormatStack(SymbolizerWorker* worker, size_t stack_index) {
+    SymbolizerPool* pool = worker->pool;
+    const SymbolizerStack* stack = &pool->stacks[stack_index];
+    const uint32_t* unique_indices =
+            pool->frame_unique_indices + pool->stack_offsets[stack_index];
+
+    size_t length = 0;
+    for (size_t frame_index = 0; frame_index < stack->address_count; ++frame_index) {
+        const SymbolizedAddress* symbolized =
+                &pool->symbolized[unique_indices[frame_index]];
+        for (;;) {
+            int written = snprintf(
+                    worker->scratch + length, worker->scratch_size - length,
+                    "  #%02zu:  0x%lx  %s\n",
+                    frame_index, symbolized->relative_address, symbolized->name);
+            if (written < 0) {
+                worker->failed = true;
+                return;
+            }
+            if (length + (size_t)written < worker->scratch_size) {
+                length += (size_t)written;
+                break;
+            }
+            if (!GrowScratch(worker, length + (size_t)written + 1)) {
+                worker->failed = true;
+                return;
+            }
+        }
+    }
+
+    char* text = (char*)malloc(length + 1);
+    if (!text) {
+        worker->failed = true;
+        return;
+    }
+    memcpy(text, worker->scratch, length);
+    text[length] = '\0';
+    pool->texts[stack_index] = text;
+}
+
+static void ProcessChunk(SymbolizerWorker* worker, size_t chunk_index) {
+    SymbolizerPool* pool = worker->pool;
+    size_t begin = chunk_index * symbolizer_chunk_size;
+    size_t end = begin + symbolizer_chunk_size;
+    if (end > pool->item_count)
+        end = pool->item_count;
+
+    for (size_t i = begin; i < end; ++i) {
+        if (pool->phase == SYMBOLIZER_PHASE_RESOLVE)
+            ResolveAddress(worker, i);
+        else
+            FormatStack(worker, i);
+    }
+}
+
+static bool TakeChunk(SymbolizerQueue* queue, size_t* chunk_index) {
+    pthread_mutex_lock(&queue->mutex);
+    bool taken = queue->next < queue->end;
+    if (taken)
+        *chunk_index = queue->next++;
+    pthread_mutex_unlock(&queue->mutex);
+    return taken;
+}
+
+// Moves the back half of the chunks left to another worker, at least
+// one, into the thief's own queue, which is empty.
+static bool StealChunks(SymbolizerWorker* thief) {
+    SymbolizerPool* pool = thief->pool;
+
+    for (size_t offset = 1; offset < pool->worker_count; ++offset) {
+        SymbolizerWorker* victim =
+                &pool->workers[(thief->index + offset) % pool->worker_count];
+
+        pthread_mutex_lock(&victim->queue.mutex);
+        size_t left = victim->queue.end - victim->queue.next;
+        size_t stolen_begin = victim->queue.end - (left + 1) / 2;
+        size_t stolen_end = victim->queue.end;
+        victim->queue.end = stolen_begin;
+        pthread_mutex_unlock(&victim->queue.mutex);
+
+        if (left == 0)
+            continue;
+
+        pthread_mutex_lock(&thief->queue.mutex);
+        thief->queue.next = stolen_begin;
+        thief->queue.end = stolen_end;
+        pthread_mutex_unlock(&thief->queue.mutex);
+        ++thief->steal_count;
+        return true;
+    }
+    return false;
+}
+
+// Returns when there is nothing left to take or to steal. The chunks
+// still being processed by the others are finished by them.
+static void RunWorkerPhase(SymbolizerWorker* worker) {
+    for (;;) {
+        size_t chunk_index = 0;
+        if (TakeChunk(&worker->queue, &chunk_index))
+            ProcessChunk(worker, chunk_index);
+        else if (!StealChunks(worker))
+            break;
+    }
+}
+
+static void* WorkerThread(void* worker_voidp) {
+    SymbolizerWorker* worker = (SymbolizerWorker*)worker_voidp;
+    SymbolizerPool* pool = worker->pool;
+    uint32_t seen_generation = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (pool->generation == seen_generation)
+            pthread_cond_wait(&pool->start_cond, &pool->mutex);
+        seen_generation = pool->generation;
+        if (pool->phase == SYMBOLIZER_PHASE_EXIT)
+            break;
+        pthread_mutex_unlock(&pool->mutex);
+
+        RunWorkerPhase(worker);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->busy_count == 0)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Deals the chunks out, wakes the threads up and works along.
+static void RunPhase(SymbolizerPool* pool, uint32_t phase, size_t item_count) {
+    size_t chunk_count =
+            (item_count + symbolizer_chunk_size - 1) / symbolizer_chunk_size;
+    size_t worker_count = pool->worker_count;
+
+    // The threads are waiting, the pool mutex publishes the queues.
+    for (size_t i = 0; i < worker_count; ++i) {
+        pool->workers[i].queue.next = chunk_count * i / worker_count;
+        pool->workers[i].queue.end = chunk_count * (i + 1) / worker_count;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->phase = phase;
+    pool->item_count = item_count;
+    pool->busy_count = worker_count - 1;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    RunWorkerPhase(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->busy_count > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void FreeBatch(SymbolizerPool* pool) {
+    free(pool->unique_addresses);
+    free(pool->symbolized);
+    free(pool->frame_unique_indices);
+    free(pool->stack_offsets);
+    pool->unique_addresses = NULL;
+    pool->symbolized = NULL;
+    pool->frame_unique_indices = NULL;
+    pool->stack_offsets = NULL;
+    pool->stacks = NULL;
+    pool->texts = NULL;
+}
+
+static bool Deduplicate(
+        SymbolizerPool* pool, const SymbolizerStack* stacks, size_t stack_count) {
+    size_t address_count = 0;
+    for (size_t i = 0; i < stack_count; ++i)
+        address_count += stacks[i].address_count;
+    assert(address_count <= UINT32_MAX);
+
+    // 1 for the empty batch, malloc(0) may return NULL.
+    size_t array_size = address_count ? address_count : 1;
+    pool->stack_offsets = (size_t*)malloc(
+            (stack_count ? stack_count : 1) * sizeof(size_t));
+    pool->unique_addresses = (uintptr_t*)malloc(array_size * sizeof(uintptr_t));
+    pool->frame_unique_indices = (uint32_t*)malloc(array_size * sizeof(uint32_t));
+
+    // Unique index + 1, 0 for an empty slot. At most half full.
+    size_t slot_count = RoundUpToPowerOfTwo(address_count * 2 + 16);
+    uint32_t* slots = (uint32_t*)calloc(slot_count, sizeof(uint32_t));
+
+    if (!pool->stack_offsets || !pool->unique_addresses
+            || !pool->frame_unique_indices || !slots) {
+        free(slots);
+        return false;
+    }
+
+    bool refreshed = false;
+    size_t unique_count = 0;
+    size_t frame_count = 0;
+    for (size_t i = 0; i < stack_count; ++i) {
+        pool->stack_offsets[i] = frame_count;
+
+        for (size_t j = 0; j < stacks[i].address_count; ++j) {
+            uintptr_t address = stacks[i].addresses[j];
+
+            size_t slot = HashAddress(address) & (slot_count - 1);
+            while (slots[slot] != 0
+                    && pool->unique_addresses[slots[slot] - 1] != address)
+                slot = (slot + 1) & (slot_count - 1);
+
+            if (slots[slot] == 0) {
+                // Libraries may have been dlopen'ed since the last refresh.
+                // Not thread-safe, so done here rather than by the workers.
+                if (!refreshed && !ModuleMap_FindModule(address)) {
+                    ModuleMap_Refresh();
+                    refreshed = true;
+                }
+                pool->unique_addresses[unique_count++] = address;
+                slots[slot] = (uint32_t)unique_count;
+            }
+            pool->frame_unique_indices[frame_count++] = slots[slot] - 1;
+        }
+    }
+    free(slots);
+
+    pool->stats.address_count = address_count;
+    pool->stats.unique_address_count = unique_count;
+
+    pool->symbolized = (SymbolizedAddress*)malloc(
+            (unique_count ? unique_count : 1) * sizeof(SymbolizedAddress));
+    return pool->symbolized != NULL;
+}
+
+
+SymbolizerPool* SymbolizerPool_Create(size_t thread_count) {
+    if (thread_count == 0) {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpu_count > 0 ? (size_t)cpu_count : 1;
+    }
+
+    SymbolizerPool* pool = (SymbolizerPool*)calloc(1, sizeof(SymbolizerPool));
+    if (!pool)
+        return NULL;
+    pool->workers = (SymbolizerWorker*)calloc(thread_count, sizeof(SymbolizerWorker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->worker_capacity = thread_count;
+
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    bool initialized = true;
+    for (size_t i = 0; i < thread_count; ++i) {
+        SymbolizerWorker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        pthread_mutex_init(&worker->queue.mutex, NULL);
+        DemangleCache_Init(&worker->demangle_cache);
+        worker->scratch = (char*)malloc(symbolizer_scratch_size_initial);
+        worker->scratch_size = worker->scratch ? symbolizer_scratch_size_initial : 0;
+        initialized = initialized && worker->scratch;
+    }
+
+    // The calling thread is worker 0. With fewer threads than asked for,
+    // the pool still works, with the ones which started.
+    pool->worker_count = 1;
+    for (size_t i = 1; initialized && i < thread_count; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL,
+                WorkerThread, &pool->workers[i]) != 0)
+            break;
+        ++pool->worker_count;
+    }
+
+    if (!initialized) {
+        SymbolizerPool_Destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void SymbolizerPool_Destroy(SymbolizerPool* pool) {
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->phase = SYMBOLIZER_PHASE_EXIT;
+    ++pool->generation;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (size_t i = 1; i < pool->worker_count; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (size_t i = 0; i < pool->worker_capacity; ++i) {
+        SymbolizerWorker* worker = &pool->workers[i];
+        pthread_mutex_destroy(&worker->queue.mutex);
+        DemangleCache_Destroy(&worker->demangle_cache);
+        free(worker->scratch);
+    }
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->workers);
+    free(pool);
+}
+
+size_t SymbolizerPool_ThreadCount(const SymbolizerPool* pool) {
+    assert(pool);
+    return pool->worker_count;
+}
+
+bool SymbolizerPool_Symbolize(
+        SymbolizerPool* pool, const SymbolizerStack* stacks, size_t stack_count,
+        char** texts) {
+    assert(pool);
+    assert(stacks || stack_count == 0);
+    assert(texts || stack_count == 0);
+
+    memset(&pool->stats, 0, sizeof(pool->stats));
+    for (size_t i = 0; i < stack_count; ++i)
+        texts[i] = NULL;
+
+    pool->stacks = stacks;
+    pool->texts = texts;
+    if (!Deduplicate(pool, stacks, stack_count)) {
+        FreeBatch(pool);
+        return false;
+    }
+
+    RunPhase(pool, SYMBOLIZER_PHASE_RESOLVE, pool->stats.unique_address_count);
+    RunPhase(pool, SYMBOLIZER_PHASE_FORMAT, stack_count);
+
+    bool failed = false;
+    for (size_t i = 0; i < pool->worker_count; ++i) {
+        SymbolizerWorker* worker = &pool->workers[i];
+        failed = failed || worker->failed;
+        pool->stats.steal_count += worker->steal_count;
+        worker->failed = false;
+        worker->steal_count = 0;
+    }
+    FreeBatch(pool);
+
+    if (failed) {
+        for (size_t i = 0; i < stack_count; ++i) {
+            free(texts[i]);
+            texts[i] = NULL;
+        }
+        return false;
+    }
+    return true;
+}
+
+void SymbolizerPool_GetStats(
+        const SymbolizerPool* pool, SymbolizerPoolStats* stats) {
+    assert(pool);
+    assert(stats);
+    *stats = pool->stats;
+}
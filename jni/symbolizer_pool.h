@@ -0,0 +1,64 @@
+#ifndef SYMBOLIZER_POOL_H
+#define SYMBOLIZER_POOL_H
+
+// Parallel symbolization of batches of backtraces.
+//
+// PrintAddresses() looks up and demangles every frame of every stack,
+// on one core, although the same few hundred addresses make up most
+// of a batch. A batch is symbolized in three phases instead:
+// - the addresses of all the stacks are deduplicated (on the calling
+//   thread, a hash table insert per frame),
+// - every unique address is resolved once, with the module index and
+//   a DemangleCache per worker (dladdr() for addresses outside of it),
+// - the stacks are formatted, one text per stack, in the PrintFrame()
+//   format.
+// The parallel phases deal their items out in chunks, evenly, to the
+// workers. A worker which runs out of chunks steals half of the chunks
+// left to another one, so one slow chunk (the first symbol lookup in
+// a module builds its symbol index) does not hold the whole phase back.
+// The calling thread is one of the workers.
+//
+// One batch at a time per pool. Not async-signal-safe.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct SymbolizerPool;
+typedef struct SymbolizerPool SymbolizerPool;
+
+struct SymbolizerStack {
+    const uintptr_t*    addresses;
+    size_t              address_count;
+};
+typedef struct SymbolizerStack SymbolizerStack;
+
+// Of the last batch.
+struct SymbolizerPoolStats {
+    size_t      address_count;
+    size_t      unique_address_count;
+    // Chunks taken from another worker's queue.
+    size_t      steal_count;
+};
+typedef struct SymbolizerPoolStats SymbolizerPoolStats;
+
+
+// Starts thread_count - 1 threads, 0 means one worker per online CPU.
+// ModuleMap_Init() must have been called.
+SymbolizerPool* SymbolizerPool_Create(size_t thread_count);
+void SymbolizerPool_Destroy(SymbolizerPool* pool);
+
+size_t SymbolizerPool_ThreadCount(const SymbolizerPool* pool);
+
+// Sets texts[i] to the symbolized frames of stacks[i], one line each,
+// allocated with malloc(), to be freed by the caller. Returns false,
+// with all the texts NULL, if out of memory.
+bool SymbolizerPool_Symbolize(
+        SymbolizerPool* pool, const SymbolizerStack* stacks, size_t stack_count,
+        char** texts);
+
+void SymbolizerPool_GetStats(
+        const SymbolizerPool* pool, SymbolizerPoolStats* stats);
+
+#endif // SYMBOLIZER_POOL_H
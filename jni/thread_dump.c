@@ -0,0 +1,246 @@
+#include "thread_dump.h"
+#include "backtrace_pool.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+enum ThreadDumpSlotState {
+    THREAD_DUMP_SLOT_IDLE       = 0,
+    // Signal sent, the thread has not started capturing yet.
+    THREAD_DUMP_SLOT_REQUESTED  = 1,
+    THREAD_DUMP_SLOT_CAPTURING  = 2,
+    THREAD_DUMP_SLOT_DONE       = 3,
+};
+
+struct ThreadDumpSlot {
+    _Atomic pid_t       tid;
+    _Atomic uint32_t    state;
+    uint32_t            method;
+    size_t              address_count;
+};
+typedef struct ThreadDumpSlot ThreadDumpSlot;
+
+// What getdents64(2) returns, not declared by libc headers.
+struct LinuxDirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+// How often the crashing thread checks if the others are done.
+static const long thread_dump_poll_interval_ns = 100 * 1000;
+
+static BacktracePool thread_dump_pool;
+static ThreadDumpSlot* thread_dump_slots;
+static size_t thread_dump_capacity;
+static int thread_dump_signal;
+static unsigned int thread_dump_timeout_ms;
+static atomic_flag thread_dump_running = ATOMIC_FLAG_INIT;
+
+// Only used by the thread holding thread_dump_running.
+static char thread_dump_dirents[4096];
+
+
+static BacktraceMethod CaptureSlot(size_t slot_index, const ucontext_t* ucontext) {
+    BacktraceState state;
+    BacktracePool_InitState(&thread_dump_pool, slot_index, &state, ucontext);
+    BacktraceMethod method = BacktraceWithFallback(&state);
+    thread_dump_slots[slot_index].address_count = state.address_count;
+    return method;
+}
+
+static void ThreadDumpHandler(int sig, siginfo_t* info, void* ucontext) {
+    int saved_errno = errno;
+    pid_t tid = gettid();
+
+    for (size_t i = 0; i < thread_dump_capacity; ++i) {
+        ThreadDumpSlot* slot = &thread_dump_slots[i];
+        if (atomic_load_explicit(&slot->tid, memory_order_acquire) != tid)
+            continue;
+
+        // The dump may have timed out and cancelled the request already.
+        uint32_t expected = THREAD_DUMP_SLOT_REQUESTED;
+        if (atomic_compare_exchange_strong(
+                    &slot->state, &expected, THREAD_DUMP_SLOT_CAPTURING)) {
+            slot->method = CaptureSlot(i, (const ucontext_t*)ucontext);
+            atomic_store_explicit(
+                    &slot->state, THREAD_DUMP_SLOT_DONE, memory_order_release);
+        }
+        break;
+    }
+
+    errno = saved_errno;
+}
+
+
+bool ThreadDump_Init(
+        size_t depth, size_t thread_capacity, int signal,
+        unsigned int timeout_ms) {
+    assert(thread_capacity > 0);
+    assert(!thread_dump_slots);
+
+    ThreadDumpSlot* slots = (ThreadDumpSlot*)calloc(
+            thread_capacity, sizeof(ThreadDumpSlot));
+    if (!slots)
+        return false;
+    if (!BacktracePool_Init(&thread_dump_pool, depth, thread_capacity)) {
+        free(slots);
+        return false;
+    }
+
+    thread_dump_slots = slots;
+    thread_dump_signal = signal;
+    thread_dump_timeout_ms = timeout_ms;
+
+    struct sigaction action = {};
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = ThreadDumpHandler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+    if (sigaction(signal, &action, NULL) != 0) {
+        BacktracePool_Destroy(&thread_dump_pool);
+        free(slots);
+        thread_dump_slots = NULL;
+        return false;
+    }
+
+    // Published last: the crash handler checks it.
+    thread_dump_capacity = thread_capacity;
+    return true;
+}
+
+static pid_t ParseTid(const char* name) {
+    pid_t tid = 0;
+    for (; *name; ++name) {
+        if (*name < '0' || *name > '9')
+            return 0;
+        tid = tid * 10 + (*name - '0');
+    }
+    return tid;
+}
+
+// Assigns slots to the other threads and signals them.
+// Returns the number of slots used.
+static size_t SignalOtherThreads(ThreadDumpStats* stats) {
+    int task_fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (task_fd < 0)
+        return 0;
+
+    pid_t pid = getpid();
+    pid_t self = gettid();
+    size_t slot_count = 0;
+    for (;;) {
+        long size = syscall(SYS_getdents64, task_fd,
+                thread_dump_dirents, sizeof(thread_dump_dirents));
+        if (size <= 0)
+            break;
+
+        for (long offset = 0; offset < size;) {
+            const struct LinuxDirent64* dirent =
+                    (const struct LinuxDirent64*)(thread_dump_dirents + offset);
+            offset += dirent->d_reclen;
+
+            pid_t tid = ParseTid(dirent->d_name);
+            if (tid <= 0 || tid == self)
+                continue;
+
+            ++stats->thread_count;
+            if (slot_count == thread_dump_capacity) {
+                ++stats->skipped_count;
+                continue;
+            }
+
+            ThreadDumpSlot* slot = &thread_dump_slots[slot_count];
+            atomic_store(&slot->state, THREAD_DUMP_SLOT_REQUESTED);
+            atomic_store(&slot->tid, tid);
+            if (syscall(SYS_tgkill, pid, tid, thread_dump_signal) != 0) {
+                // Exited in the meantime.
+                atomic_store(&slot->state, THREAD_DUMP_SLOT_IDLE);
+                atomic_store(&slot->tid, 0);
+                --stats->thread_count;
+                continue;
+            }
+            ++slot_count;
+        }
+    }
+
+    close(task_fd);
+    return slot_count;
+}
+
+static uint64_t NowMs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static void WaitForSlots(size_t slot_count) {
+    uint64_t deadline = NowMs() + thread_dump_timeout_ms;
+    for (;;) {
+        size_t pending_count = 0;
+        for (size_t i = 0; i < slot_count; ++i) {
+            uint32_t state = atomic_load_explicit(
+                    &thread_dump_slots[i].state, memory_order_acquire);
+            if (state == THREAD_DUMP_SLOT_REQUESTED
+                    || state == THREAD_DUMP_SLOT_CAPTURING)
+                ++pending_count;
+        }
+        if (pending_count == 0 || NowMs() >= deadline)
+            return;
+
+        struct timespec interval = {0, thread_dump_poll_interval_ns};
+        nanosleep(&interval, NULL);
+    }
+}
+
+bool ThreadDump_CaptureOtherThreads(
+        ThreadDumpCallback callback, void* context, ThreadDumpStats* stats) {
+    assert(callback);
+    if (thread_dump_capacity == 0
+            || atomic_flag_test_and_set(&thread_dump_running))
+        return false;
+
+    ThreadDumpStats local_stats = {};
+    for (size_t i = 0; i < thread_dump_capacity; ++i) {
+        atomic_store(&thread_dump_slots[i].tid, 0);
+        atomic_store(&thread_dump_slots[i].state, THREAD_DUMP_SLOT_IDLE);
+    }
+
+    size_t slot_count = SignalOtherThreads(&local_stats);
+    WaitForSlots(slot_count);
+
+    for (size_t i = 0; i < slot_count; ++i) {
+        ThreadDumpSlot* slot = &thread_dump_slots[i];
+
+        // Late threads find the request cancelled and return.
+        uint32_t state = THREAD_DUMP_SLOT_REQUESTED;
+        if (atomic_compare_exchange_strong(
+                    &slot->state, &state, THREAD_DUMP_SLOT_IDLE)
+                || state == THREAD_DUMP_SLOT_CAPTURING) {
+            ++local_stats.timed_out_count;
+            continue;
+        }
+        if (state != THREAD_DUMP_SLOT_DONE)
+            continue;
+
+        ++local_stats.captured_count;
+        callback(atomic_load(&slot->tid),
+                BacktracePool_Slot(&thread_dump_pool, i), slot->address_count,
+                (BacktraceMethod)slot->method, context);
+    }
+
+    if (stats)
+        *stats = local_stats;
+    atomic_flag_clear(&thread_dump_running);
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef THREAD_DUMP_H
+#define THREAD_DUMP_H
+
+// Backtraces of all the threads of the process, captured from
+// the crash handler.
+//
+// The crashing thread lists /proc/self/task, assigns each other thread
+// a preallocated slot and sends it a reserved real-time signal with
+// tgkill(). Every thread unwinds itself in its own handler, from the
+// registers of the interrupted code, so the threads are captured
+// in parallel. The crashing thread waits for them with a bounded timeout:
+// threads which block the signal or are stuck are reported as missing,
+// they do not hang the crash handler.
+//
+// Threads do not need to register, but only registered ones
+// (FramePointer_RegisterThread()) get the cheap FRAME_POINTER_METHOD,
+// the others fall back to the unwind table methods
+// (see BacktraceWithFallback()).
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+// Called on the crashing thread for every captured thread,
+// from the signal handler.
+typedef void (*ThreadDumpCallback)(
+        pid_t tid, const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method, void* context);
+
+struct ThreadDumpStats {
+    // Threads found in /proc/self/task, without the calling one.
+    size_t      thread_count;
+    size_t      captured_count;
+    // Threads beyond "thread_capacity".
+    size_t      skipped_count;
+    // Threads which did not answer before the timeout.
+    size_t      timed_out_count;
+};
+typedef struct ThreadDumpStats ThreadDumpStats;
+
+
+// Preallocates "thread_capacity" slots of "depth" frames and installs
+// the handler of "signal", which must not be used for anything else.
+// Not async-signal-safe, call once at start-up.
+bool ThreadDump_Init(
+        size_t depth, size_t thread_capacity, int signal,
+        unsigned int timeout_ms);
+
+// Captures all the threads but the calling one and passes the backtraces
+// to the callback, in the order the threads are listed.
+// Only one dump runs at a time: returns false without capturing,
+// if another thread is dumping already, or if ThreadDump_Init()
+// has not succeeded. Async-signal-safe.
+bool ThreadDump_CaptureOtherThreads(
+        ThreadDumpCallback callback, void* context, ThreadDumpStats* stats);
+
+#endif // THREAD_DUMP_H
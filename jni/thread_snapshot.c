@@ -0,0 +1,153 @@
+#include "thread_snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+
+enum ThreadSnapshotState {
+    THREAD_SNAPSHOT_IDLE        = 0,
+    // Signal sent, the target has not started capturing yet.
+    THREAD_SNAPSHOT_REQUESTED   = 1,
+    THREAD_SNAPSHOT_CAPTURING   = 2,
+    THREAD_SNAPSHOT_DONE        = 3,
+};
+
+// The one request in flight, under thread_snapshot_mutex.
+struct ThreadSnapshotRequest {
+    // Futex word.
+    _Atomic uint32_t    state;
+    _Atomic pid_t       tid;
+    BacktraceState*     backtrace_state;
+    BacktraceMethod     method;
+};
+typedef struct ThreadSnapshotRequest ThreadSnapshotRequest;
+
+// A running thread answers within a few microseconds,
+// a descheduled one takes a time slice, not worth spinning for.
+static const uint64_t thread_snapshot_spin_ns = 20 * 1000;
+
+static ThreadSnapshotRequest thread_snapshot_request;
+static pthread_mutex_t thread_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int thread_snapshot_signal;
+
+
+static uint64_t NowNs() {
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+static void FutexWait(_Atomic uint32_t* word, uint32_t value, uint64_t timeout_ns) {
+    struct timespec timeout = {
+        (time_t)(timeout_ns / 1000000000ull), (long)(timeout_ns % 1000000000ull)};
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+static void FutexWake(_Atomic uint32_t* word) {
+    syscall(SYS_futex, (uint32_t*)word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void ThreadSnapshotHandler(int sig, siginfo_t* info, void* ucontext) {
+    int saved_errno = errno;
+    ThreadSnapshotRequest* request = &thread_snapshot_request;
+
+    // A late signal of a cancelled request finds another thread's
+    // request, or none.
+    uint32_t expected = THREAD_SNAPSHOT_REQUESTED;
+    if (atomic_load_explicit(&request->tid, memory_order_acquire) == gettid()
+            && atomic_compare_exchange_strong(
+                    &request->state, &expected, THREAD_SNAPSHOT_CAPTURING)) {
+        // Only valid while the handler runs.
+        BacktraceState* state = request->backtrace_state;
+        state->signal_ucontext = (const ucontext_t*)ucontext;
+        BacktraceState_Reset(state);
+        request->method = BacktraceWithFallback(state);
+        state->signal_ucontext = NULL;
+
+        atomic_store_explicit(
+                &request->state, THREAD_SNAPSHOT_DONE, memory_order_release);
+        FutexWake(&request->state);
+    }
+
+    errno = saved_errno;
+}
+
+
+bool ThreadSnapshot_Init(int signal) {
+    assert(thread_snapshot_signal == 0);
+
+    struct sigaction action = {};
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_sigaction = ThreadSnapshotHandler;
+    action.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+    if (sigaction(signal, &action, NULL) != 0)
+        return false;
+
+    thread_snapshot_signal = signal;
+    return true;
+}
+
+bool ThreadSnapshot_Capture(
+        pid_t tid, BacktraceState* state, unsigned int timeout_us,
+        BacktraceMethod* method) {
+    assert(state);
+    if (thread_snapshot_signal == 0 || tid <= 0)
+        return false;
+
+    pthread_mutex_lock(&thread_snapshot_mutex);
+    ThreadSnapshotRequest* request = &thread_snapshot_request;
+    request->backtrace_state = state;
+    atomic_store(&request->state, THREAD_SNAPSHOT_REQUESTED);
+    atomic_store(&request->tid, tid);
+
+    bool done = false;
+    if (syscall(SYS_tgkill, getpid(), tid, thread_snapshot_signal) == 0) {
+        uint64_t start = NowNs();
+        uint64_t deadline = start + (uint64_t)timeout_us * 1000;
+        for (;;) {
+            uint32_t request_state = atomic_load_explicit(
+                    &request->state, memory_order_acquire);
+            if (request_state == THREAD_SNAPSHOT_DONE) {
+                done = true;
+                break;
+            }
+
+            uint64_t now = NowNs();
+            if (request_state == THREAD_SNAPSHOT_REQUESTED && now >= deadline) {
+                // The handler may start meanwhile, then it is waited for.
+                uint32_t expected = THREAD_SNAPSHOT_REQUESTED;
+                if (atomic_compare_exchange_strong(
+                            &request->state, &expected, THREAD_SNAPSHOT_IDLE))
+                    break;
+                continue;
+            }
+            if (now - start < thread_snapshot_spin_ns)
+                continue;
+
+            // The handler always wakes up, once done.
+            uint64_t timeout_ns = request_state == THREAD_SNAPSHOT_CAPTURING
+                    ? 1000000 : deadline - now;
+            FutexWait(&request->state, request_state, timeout_ns);
+        }
+    }
+
+    if (done && method)
+        *method = request->method;
+    atomic_store(&request->tid, 0);
+    atomic_store(&request->state, THREAD_SNAPSHOT_IDLE);
+    request->backtrace_state = NULL;
+    pthread_mutex_unlock(&thread_snapshot_mutex);
+
+    if (!done)
+        state->address_count = 0;
+    return done;
+}
@@ -0,0 +1,41 @@
+#ifndef THREAD_SNAPSHOT_H
+#define THREAD_SNAPSHOT_H
+
+// Current backtrace of another live thread, for watchdogs and hang
+// detection, without crashing.
+//
+// The calling thread sends the target a reserved real-time signal with
+// tgkill(), and the target captures its own interrupted stack, from
+// the registers in its ucontext_t, into the caller's BacktraceState
+// (see BacktraceWithFallback()) and resumes. The caller spins for a few
+// microseconds, which is usually enough, then sleeps on a futex the
+// handler wakes up. No allocation, no /proc, no ptrace.
+//
+// Requests are serialized: one snapshot at a time in the process.
+// Like any signal, the request makes some blocking calls of the target
+// return early with EINTR (nanosleep(), epoll_wait(), ...), even with
+// SA_RESTART.
+
+#include "backtrace.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+
+// Installs the handler of "signal", which must not be used for anything
+// else. Not async-signal-safe, call once at start-up.
+bool ThreadSnapshot_Init(int signal);
+
+// Captures the stack of thread "tid" of this process into "state",
+// initialized with BacktraceState_Init() (with a NULL ucontext)
+// and, optionally, a predicate, which is then called on the target thread.
+// Returns false, if the thread does not exist, or blocks the signal,
+// or has not started capturing within "timeout_us". Once it has started,
+// the capture is waited for, since it writes into "state".
+// "method", if not NULL, is set to the method of the backtrace.
+// Not async-signal-safe.
+bool ThreadSnapshot_Capture(
+        pid_t tid, BacktraceState* state, unsigned int timeout_us,
+        BacktraceMethod* method);
+
+#endif // THREAD_SNAPSHOT_H
@@ -0,0 +1,252 @@
+#include "trace_file.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+
+// Longest LEB128 encoding of a 64-bit value.
+enum { varint_size_max = 10 };
+
+static size_t PutVarint(uint8_t* out, uint64_t value) {
+    size_t size = 0;
+    while (value >= 0x80) {
+        out[size++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[size++] = (uint8_t)value;
+    return size;
+}
+
+static uint64_t ZigZag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static bool WriteAll(int fd, const uint8_t* bytes, size_t size) {
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+bool TraceWriter_Flush(TraceWriter* writer) {
+    assert(writer);
+    if (writer->fd < 0 || writer->failed)
+        return false;
+
+    if (writer->buffer_used > 0) {
+        if (!WriteAll(writer->fd, writer->buffer, writer->buffer_used)) {
+            writer->failed = true;
+            return false;
+        }
+        writer->bytes_written += writer->buffer_used;
+        writer->buffer_used = 0;
+    }
+    return true;
+}
+
+// Makes room for "size" more bytes in the buffer.
+static bool Reserve(TraceWriter* writer, size_t size) {
+    if (writer->fd < 0 || writer->failed || size > writer->buffer_size)
+        return false;
+    if (writer->buffer_used + size > writer->buffer_size)
+        return TraceWriter_Flush(writer);
+    return true;
+}
+
+static void PutBytes(TraceWriter* writer, const void* data, size_t size) {
+    memcpy(writer->buffer + writer->buffer_used, data, size);
+    writer->buffer_used += size;
+}
+
+static void Put(TraceWriter* writer, uint64_t value) {
+    writer->buffer_used += PutVarint(
+            writer->buffer + writer->buffer_used, value);
+}
+
+static bool IsModuleWritten(const TraceWriter* writer, uint32_t id) {
+    return (writer->written_modules[id / 32] >> (id % 32)) & 1;
+}
+
+static void WriteModule(const Module* module, void* writer_voidp) {
+    TraceWriter* writer = (TraceWriter*)writer_voidp;
+    if (module->id >= trace_file_module_id_max
+            || IsModuleWritten(writer, module->id))
+        return;
+
+    size_t path_length = strlen(module->path);
+    if (!Reserve(writer, 1 + 5 * varint_size_max
+                + module->build_id_size + path_length))
+        return;
+
+    Put(writer, TRACE_FILE_RECORD_MODULE);
+    Put(writer, module->id);
+    Put(writer, module->base);
+    Put(writer, module->end - module->base);
+    Put(writer, module->build_id_size);
+    PutBytes(writer, module->build_id, module->build_id_size);
+    Put(writer, path_length);
+    PutBytes(writer, module->path, path_length);
+
+    writer->written_modules[module->id / 32] |= 1u << (module->id % 32);
+}
+
+bool TraceWriter_Open(
+        TraceWriter* writer, const char* path, size_t buffer_size) {
+    assert(writer);
+    assert(path);
+    assert(buffer_size >= 4096);
+
+    memset(writer, 0, sizeof(*writer));
+    writer->fd = -1;
+
+    void* buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        return false;
+    writer->buffer = (uint8_t*)buffer;
+    writer->buffer_size = buffer_size;
+
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer->fd < 0) {
+        TraceWriter_Close(writer);
+        return false;
+    }
+
+    PutBytes(writer, &trace_file_magic, sizeof(trace_file_magic));
+    PutBytes(writer, &trace_file_version, sizeof(trace_file_version));
+    uint8_t pointer_size = sizeof(uintptr_t);
+    PutBytes(writer, &pointer_size, sizeof(pointer_size));
+
+    ModuleMap_ForEach(WriteModule, writer);
+    return !writer->failed;
+}
+
+bool TraceWriter_WriteStack(
+        TraceWriter* writer, const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method, uint32_t count) {
+    assert(writer);
+    assert(addresses || address_count == 0);
+
+    // Module records first, a module is looked up again below
+    // instead of keeping a second array of them on the signal stack.
+    for (size_t i = 0; i < address_count; ++i) {
+        const Module* module = ModuleMap_FindModule(addresses[i]);
+        if (module)
+            WriteModule(module, writer);
+    }
+
+    if (!Reserve(writer, 1 + 3 * varint_size_max
+                + address_count * 2 * varint_size_max))
+        return false;
+
+    Put(writer, TRACE_FILE_RECORD_STACK);
+    Put(writer, (uint64_t)method);
+    Put(writer, count);
+    Put(writer, address_count);
+
+    uintptr_t previous = 0;
+    for (size_t i = 0; i < address_count; ++i) {
+        const Module* module = ModuleMap_FindModule(addresses[i]);
+        if (!module || module->id >= trace_file_module_id_max
+                || !IsModuleWritten(writer, module->id)) {
+            Put(writer, 0);
+            Put(writer, addresses[i]);
+            continue;
+        }
+
+        uintptr_t relative_address = addresses[i] - module->base;
+        Put(writer, (uint64_t)module->id + 1);
+        Put(writer, ZigZag((int64_t)relative_address - (int64_t)previous));
+        previous = relative_address;
+    }
+
+    ++writer->stack_count;
+    return true;
+}
+
+bool TraceWriter_Close(TraceWriter* writer) {
+    assert(writer);
+    bool ok = TraceWriter_Flush(writer);
+
+    if (writer->fd >= 0) {
+        if (close(writer->fd) != 0)
+            ok = false;
+        writer->fd = -1;
+    }
+    if (writer->buffer) {
+        munmap(writer->buffer, writer->buffer_size);
+        writer->buffer = NULL;
+    }
+    return ok;
+}
+
+
+// Same module in this process, most probably
+// at a different address because of ASLR.
+struct TracePrinter {
+    const Module*   modules[trace_file_module_id_max];
+};
+typedef struct TracePrinter TracePrinter;
+
+static void MatchModule(const TraceFileModule* module, void* printer_voidp) {
+    TracePrinter* printer = (TracePrinter*)printer_voidp;
+    const Module* current = ModuleMap_FindModuleByBuildId(
+            module->build_id, module->build_id_size);
+    if (!current && module->build_id_size == 0) {
+        char* path = strndup(module->path, module->path_length);
+        if (path)
+            current = ModuleMap_FindModuleByPath(path);
+        free(path);
+    }
+    printer->modules[module->id] = current;
+}
+
+static void PrintStack(const TraceFileStack* stack, void* printer_voidp) {
+    const TracePrinter* printer = (const TracePrinter*)printer_voidp;
+    printf("Backtrace captured using %s, count %u:\n",
+            BacktraceMethod_Name((BacktraceMethod)stack->method), stack->count);
+
+    for (size_t frame_index = 0; frame_index < stack->frame_count; ++frame_index) {
+        const TraceFileFrame* frame = &stack->frames[frame_index];
+        const char* symbol_name = "";
+        const Module* current = frame->module_id != trace_file_no_module
+                ? printer->modules[frame->module_id] : NULL;
+        if (current) {
+            const char* name = Module_FindSymbol(
+                    current, current->base + (uintptr_t)frame->address);
+            if (name)
+                symbol_name = name;
+        }
+        PrintFrame(frame_index, (unsigned long)frame->address, symbol_name);
+    }
+}
+
+bool TraceFile_Print(const char* path) {
+    assert(path);
+
+    TracePrinter* printer = (TracePrinter*)calloc(1, sizeof(TracePrinter));
+    if (!printer)
+        return false;
+
+    TraceFileCallbacks callbacks = {};
+    callbacks.module = MatchModule;
+    callbacks.stack = PrintStack;
+    bool ok = TraceFile_Read(path, &callbacks, printer);
+
+    free(printer);
+    return ok;
+}
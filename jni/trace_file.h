@@ -0,0 +1,67 @@
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+// Compact binary trace of many backtraces.
+//
+// Printing every frame with printf() and dladdr() is fine for one crash,
+// but far too slow and too big for bulk collection. A trace stores
+// each stack as module-relative addresses, and each module once,
+// see trace_format.h for the layout.
+//
+// Records are encoded into a large buffer preallocated by
+// TraceWriter_Open(), which is written with one write(2) when full.
+// Text output is a formatter applied afterwards, by TraceFile_Print(),
+// either in another process or on the host.
+
+#include "backtrace.h"
+#include "trace_format.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+struct TraceWriter {
+    int         fd;
+    uint8_t*    buffer;
+    size_t      buffer_size;
+    size_t      buffer_used;
+    uint64_t    bytes_written;
+    uint64_t    stack_count;
+    bool        failed;
+
+    // Bit per module id, set once the module record is written.
+    uint32_t    written_modules[trace_file_module_id_max / 32];
+};
+typedef struct TraceWriter TraceWriter;
+
+
+// Creates (and truncates) the trace file, maps the buffer and writes
+// the header and the modules currently in the ModuleMap.
+// Not async-signal-safe.
+bool TraceWriter_Open(
+        TraceWriter* writer, const char* path, size_t buffer_size);
+
+// Encodes one stack, with the records of its modules not written yet.
+// Writes the buffer out first, if the stack may not fit.
+// Returns false, if the stack does not fit into an empty buffer
+// or writing fails. Async-signal-safe.
+bool TraceWriter_WriteStack(
+        TraceWriter* writer, const uintptr_t* addresses, size_t address_count,
+        BacktraceMethod method, uint32_t count);
+
+// Async-signal-safe.
+bool TraceWriter_Flush(TraceWriter* writer);
+
+// Flushes, closes the file and unmaps the buffer.
+// Returns false, if anything written since TraceWriter_Open() failed.
+bool TraceWriter_Close(TraceWriter* writer);
+
+// Reads the trace, symbolizes and prints the stacks.
+// Modules are matched by build id, or by path if they have none,
+// against the modules loaded in the current process.
+// Returns false, if the file is missing or malformed.
+// Not async-signal-safe.
+bool TraceFile_Print(const char* path);
+
+#endif // TRACE_FILE_H
@@ -0,0 +1,187 @@
+#include "trace_format.h"
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+struct TraceDecoder {
+    const uint8_t*  data;
+    const uint8_t*  end;
+    bool            failed;
+};
+typedef struct TraceDecoder TraceDecoder;
+
+static uint64_t GetVarint(TraceDecoder* decoder) {
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < 64; shift += 7) {
+        if (decoder->data >= decoder->end)
+            break;
+        uint8_t byte = *decoder->data++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return value;
+    }
+    decoder->failed = true;
+    return 0;
+}
+
+static const uint8_t* GetBytes(TraceDecoder* decoder, uint64_t size) {
+    if (decoder->failed || size > (uint64_t)(decoder->end - decoder->data)) {
+        decoder->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = decoder->data;
+    decoder->data += size;
+    return bytes;
+}
+
+static int64_t UnZigZag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static bool DecodeModule(
+        TraceDecoder* decoder, bool* known_modules,
+        const TraceFileCallbacks* callbacks, void* context) {
+    TraceFileModule module = {};
+    uint64_t id = GetVarint(decoder);
+    module.base = GetVarint(decoder);
+    module.size = GetVarint(decoder);
+    module.build_id_size = (size_t)GetVarint(decoder);
+    module.build_id = GetBytes(decoder, module.build_id_size);
+    module.path_length = (size_t)GetVarint(decoder);
+    module.path = (const char*)GetBytes(decoder, module.path_length);
+    if (decoder->failed || id >= trace_file_module_id_max)
+        return false;
+
+    module.id = (uint32_t)id;
+    known_modules[id] = true;
+    if (callbacks->module)
+        callbacks->module(&module, context);
+    return true;
+}
+
+static bool DecodeStack(
+        TraceDecoder* decoder, const bool* known_modules,
+        TraceFileFrame** frames, size_t* frame_capacity,
+        const TraceFileCallbacks* callbacks, void* context) {
+    TraceFileStack stack = {};
+    stack.method = (uint32_t)GetVarint(decoder);
+    stack.count = (uint32_t)GetVarint(decoder);
+    uint64_t frame_count = GetVarint(decoder);
+    // Every frame takes at least two bytes.
+    if (decoder->failed
+            || frame_count > (uint64_t)(decoder->end - decoder->data) / 2)
+        return false;
+
+    if (frame_count > *frame_capacity) {
+        TraceFileFrame* grown = (TraceFileFrame*)realloc(
+                *frames, (size_t)frame_count * sizeof(TraceFileFrame));
+        if (!grown)
+            return false;
+        *frames = grown;
+        *frame_capacity = (size_t)frame_count;
+    }
+
+    uint64_t previous = 0;
+    for (size_t i = 0; i < frame_count; ++i) {
+        TraceFileFrame* frame = &(*frames)[i];
+        uint64_t module_id = GetVarint(decoder);
+        uint64_t value = GetVarint(decoder);
+        if (decoder->failed)
+            return false;
+
+        if (module_id == 0) {
+            frame->module_id = trace_file_no_module;
+            frame->address = value;
+            continue;
+        }
+
+        --module_id;
+        if (module_id >= trace_file_module_id_max || !known_modules[module_id])
+            return false;
+        frame->module_id = (uint32_t)module_id;
+        frame->address = previous + (uint64_t)UnZigZag(value);
+        previous = frame->address;
+    }
+
+    stack.frames = *frames;
+    stack.frame_count = (size_t)frame_count;
+    if (callbacks->stack)
+        callbacks->stack(&stack, context);
+    return true;
+}
+
+bool TraceFile_Decode(
+        const void* data, size_t size,
+        const TraceFileCallbacks* callbacks, void* context) {
+    assert(data || size == 0);
+    assert(callbacks);
+
+    TraceDecoder decoder = {};
+    decoder.data = (const uint8_t*)data;
+    decoder.end = decoder.data + size;
+
+    const uint8_t* header = GetBytes(&decoder, sizeof(trace_file_magic) + 2);
+    if (!header)
+        return false;
+    uint32_t magic = 0;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != trace_file_magic
+            || header[sizeof(magic)] != trace_file_version
+            || header[sizeof(magic) + 1] > sizeof(uint64_t))
+        return false;
+
+    bool* known_modules = (bool*)calloc(trace_file_module_id_max, sizeof(bool));
+    if (!known_modules)
+        return false;
+    TraceFileFrame* frames = NULL;
+    size_t frame_capacity = 0;
+
+    bool ok = true;
+    while (ok && decoder.data < decoder.end) {
+        switch (GetVarint(&decoder)) {
+        case TRACE_FILE_RECORD_MODULE:
+            ok = DecodeModule(&decoder, known_modules, callbacks, context);
+            break;
+        case TRACE_FILE_RECORD_STACK:
+            ok = DecodeStack(&decoder, known_modules,
+                    &frames, &frame_capacity, callbacks, context);
+            break;
+        default:
+            ok = false;
+            break;
+        }
+    }
+
+    free(frames);
+    free(known_modules);
+    return ok;
+}
+
+bool TraceFile_Read(
+        const char* path, const TraceFileCallbacks* callbacks, void* context) {
+    assert(path);
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st = {};
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    void* mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return false;
+
+    bool ok = TraceFile_Decode(mapping, size, callbacks, context);
+    munmap(mapping, size);
+    return ok;
+}
@@ -0,0 +1,91 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+// Layout of the binary trace written by TraceWriter (trace_file.h),
+// and its decoder.
+//
+//     header:  magic "BTTR", version, sizeof(uintptr_t)
+//     module:  TRACE_FILE_RECORD_MODULE, id, base, size,
+//              build id length and bytes, path length and bytes
+//     stack:   TRACE_FILE_RECORD_STACK, method, count, frame count,
+//              then for every frame the module id + 1 (0 if the address
+//              belongs to no module) and the zigzag-encoded delta
+//              of the relative address from the previous frame
+//              (absolute addresses for frames of no module)
+//
+// All the integers are LEB128 varints. Neighbouring return addresses are
+// usually close to each other, so a frame takes 3-5 bytes instead of 8.
+// Modules are written before the first stack referencing them,
+// so a trace can be read front to back.
+//
+// The decoder only depends on libc, so that the host symbolizer
+// (host/symbolize.c) is built from the same source.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+static const uint32_t trace_file_magic = 0x52545442; // "BTTR"
+static const uint8_t trace_file_version = 1;
+
+enum TraceFileRecordType {
+    TRACE_FILE_RECORD_MODULE    = 1,
+    TRACE_FILE_RECORD_STACK     = 2,
+};
+typedef enum TraceFileRecordType TraceFileRecordType;
+
+// Frames of modules with larger ids are written as absolute addresses.
+enum { trace_file_module_id_max = 4096 };
+
+// Module id of frames which belong to no module.
+static const uint32_t trace_file_no_module = UINT32_MAX;
+
+struct TraceFileModule {
+    uint32_t        id;
+    uint64_t        base;
+    uint64_t        size;
+    const uint8_t*  build_id;
+    size_t          build_id_size;
+    // Not NUL-terminated.
+    const char*     path;
+    size_t          path_length;
+};
+typedef struct TraceFileModule TraceFileModule;
+
+struct TraceFileFrame {
+    uint32_t        module_id;
+    // Relative to the module base, or absolute for trace_file_no_module.
+    uint64_t        address;
+};
+typedef struct TraceFileFrame TraceFileFrame;
+
+struct TraceFileStack {
+    // BacktraceMethod used to capture the stack.
+    uint32_t                method;
+    uint32_t                count;
+    const TraceFileFrame*   frames;
+    size_t                  frame_count;
+};
+typedef struct TraceFileStack TraceFileStack;
+
+// Pointers passed to the callbacks are only valid during the call.
+struct TraceFileCallbacks {
+    void    (*module)(const TraceFileModule* module, void* context);
+    void    (*stack)(const TraceFileStack* stack, void* context);
+};
+typedef struct TraceFileCallbacks TraceFileCallbacks;
+
+
+// Decodes the trace from memory. Each module is reported before the first
+// stack referencing it. Returns false, if the trace is malformed,
+// after reporting the records before the malformed one.
+bool TraceFile_Decode(
+        const void* data, size_t size,
+        const TraceFileCallbacks* callbacks, void* context);
+
+// Maps the file and decodes it.
+bool TraceFile_Read(
+        const char* path, const TraceFileCallbacks* callbacks, void* context);
+
+#endif // TRACE_FORMAT_H
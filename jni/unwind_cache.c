@@ -0,0 +1,146 @@
+#include "unwind_cache.h"
+
+#if UNWIND_CACHE_ENABLED
+
+#include "jit_ranges.h"
+#include "module_map.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+
+// Power of two. 16 KiB of pointers.
+enum { unwind_cache_slot_count = 4096 };
+
+struct ExidxEntry {
+    // prel31 offset of the function start.
+    uint32_t    function;
+    uint32_t    data;
+};
+typedef struct ExidxEntry ExidxEntry;
+
+typedef _Unwind_Ptr (*FindExidxFunction)(_Unwind_Ptr pc, int* entry_count);
+
+static _Atomic(const ExidxEntry*) unwind_cache_slots[unwind_cache_slot_count];
+static _Atomic(FindExidxFunction) unwind_cache_fallback;
+
+static _Atomic uint32_t unwind_cache_hit_count;
+static _Atomic uint32_t unwind_cache_miss_count;
+static _Atomic uint32_t unwind_cache_fallback_count;
+
+
+static uintptr_t FunctionAddress(const ExidxEntry* entry) {
+    // Sign-extend the 31-bit offset.
+    int32_t offset = (int32_t)(entry->function << 1) >> 1;
+    return (uintptr_t)&entry->function + offset;
+}
+
+static bool EntryCovers(
+        const ExidxEntry* entry, const ExidxEntry* table_end, uintptr_t pc) {
+    if (pc < FunctionAddress(entry))
+        return false;
+    return entry + 1 == table_end || pc < FunctionAddress(entry + 1);
+}
+
+// Returns the last entry starting at or below the PC.
+static const ExidxEntry* SearchExidx(
+        const ExidxEntry* table, size_t entry_count, uintptr_t pc) {
+    size_t low = 0;
+    size_t high = entry_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (FunctionAddress(&table[middle]) <= pc)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low > 0 ? &table[low - 1] : NULL;
+}
+
+static FindExidxFunction Fallback() {
+    FindExidxFunction fallback = atomic_load_explicit(
+            &unwind_cache_fallback, memory_order_relaxed);
+    if (!fallback) {
+        fallback = (FindExidxFunction)dlsym(RTLD_NEXT, "dl_unwind_find_exidx");
+        atomic_store_explicit(&unwind_cache_fallback, fallback,
+                memory_order_relaxed);
+    }
+    return fallback;
+}
+
+void UnwindCache_Init() {
+    Fallback();
+}
+
+uintptr_t UnwindCache_FindExidx(uintptr_t pc, int* entry_count) {
+    assert(entry_count);
+
+    const Module* module = ModuleMap_FindModule(pc);
+    JitRange range;
+    if (!module && JitRanges_Count() > 0 && JitRanges_Find(pc, &range)) {
+        // JIT code has no index, the search of all the libraries
+        // for it would fail anyway.
+        *entry_count = 0;
+        return 0;
+    }
+    if (!module || module->exidx_count == 0) {
+        atomic_fetch_add_explicit(
+                &unwind_cache_fallback_count, 1, memory_order_relaxed);
+        FindExidxFunction fallback = Fallback();
+        if (fallback)
+            return fallback(pc, entry_count);
+        *entry_count = 0;
+        return 0;
+    }
+
+    const ExidxEntry* table = (const ExidxEntry*)module->exidx_start;
+    const ExidxEntry* table_end = table + module->exidx_count;
+
+    _Atomic(const ExidxEntry*)* slot =
+            &unwind_cache_slots[(pc >> 1) & (unwind_cache_slot_count - 1)];
+    const ExidxEntry* entry = atomic_load_explicit(slot, memory_order_relaxed);
+
+    // The slot may hold an entry of another module, which may be unloaded.
+    // Only entries within the index of this module are dereferenced.
+    if (entry >= table && entry < table_end && EntryCovers(entry, table_end, pc)) {
+        atomic_fetch_add_explicit(&unwind_cache_hit_count, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&unwind_cache_miss_count, 1, memory_order_relaxed);
+        entry = SearchExidx(table, module->exidx_count, pc);
+        if (!entry) {
+            // Below the first function, let the unwinder report it.
+            *entry_count = (int)module->exidx_count;
+            return (uintptr_t)table;
+        }
+        atomic_store_explicit(slot, entry, memory_order_relaxed);
+    }
+
+    *entry_count = entry + 1 < table_end ? 2 : 1;
+    return (uintptr_t)entry;
+}
+
+void UnwindCache_GetStats(UnwindCacheStats* stats) {
+    assert(stats);
+    stats->hit_count = atomic_load_explicit(
+            &unwind_cache_hit_count, memory_order_relaxed);
+    stats->miss_count = atomic_load_explicit(
+            &unwind_cache_miss_count, memory_order_relaxed);
+    stats->fallback_count = atomic_load_explicit(
+            &unwind_cache_fallback_count, memory_order_relaxed);
+}
+
+
+// Used by libunwind.
+_Unwind_Ptr dl_unwind_find_exidx(_Unwind_Ptr pc, int* entry_count) {
+    return UnwindCache_FindExidx(pc, entry_count);
+}
+
+// Used by libgcc, an alias of the above in libdl.
+_Unwind_Ptr __gnu_Unwind_Find_exidx(_Unwind_Ptr pc, int* entry_count) {
+    return UnwindCache_FindExidx(pc, entry_count);
+}
+
+#endif // UNWIND_CACHE_ENABLED
@@ -0,0 +1,61 @@
+#ifndef UNWIND_CACHE_H
+#define UNWIND_CACHE_H
+
+// Cache of unwind index lookups, PC -> EHABI index entry.
+//
+// On 32-bit ARM both libunwind and the _Unwind_Backtrace() of libgcc find
+// the unwind index of every frame with dl_unwind_find_exidx()
+// (__gnu_Unwind_Find_exidx() in libgcc), which walks all the loaded
+// libraries under the linker lock, and then binary-search the whole index
+// of the module. Under sampling, the same few thousand return addresses
+// are looked up over and over.
+//
+// Both functions are defined here, so the unwinders linked into
+// the executable call them instead of the ones of libdl. The module is
+// found in the ModuleMap without locks, and the index entry of the PC
+// in a fixed-size direct-mapped cache. Each cache slot is one pointer
+// to the entry, so it is written and read atomically, and an entry is
+// checked to cover the PC before it is used. A slot which another thread
+// has overwritten is a miss, never a wrong entry. On a hit the unwinder
+// gets a slice of the index of just that entry and the next one,
+// so its own binary search is over two entries.
+//
+// Modules which are not in the ModuleMap are looked up with the libdl
+// function, as before.
+//
+// Other ABIs unwind with DWARF .eh_frame_hdr, which libgcc looks up
+// through dl_iterate_phdr() and its own cache, with no interposable
+// function in between, so the cache is only built on 32-bit ARM.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if __arm__ && __ANDROID__
+#define UNWIND_CACHE_ENABLED 1
+#endif
+
+#if UNWIND_CACHE_ENABLED
+
+struct UnwindCacheStats {
+    uint32_t    hit_count;
+    uint32_t    miss_count;
+    // Lookups of PCs outside of the known modules.
+    uint32_t    fallback_count;
+};
+typedef struct UnwindCacheStats UnwindCacheStats;
+
+// Resolves the libdl function used for modules not in the ModuleMap.
+// Optional: otherwise it is resolved on the first lookup which needs it,
+// which is not async-signal-safe. Call after ModuleMap_Init().
+void UnwindCache_Init();
+
+// Same contract as dl_unwind_find_exidx(): returns the start of an index
+// slice covering the PC and stores the number of its entries,
+// or returns 0. Async-signal-safe, lock-free, after UnwindCache_Init().
+uintptr_t UnwindCache_FindExidx(uintptr_t pc, int* entry_count);
+
+void UnwindCache_GetStats(UnwindCacheStats* stats);
+
+#endif // UNWIND_CACHE_ENABLED
+
+#endif // UNWIND_CACHE_H